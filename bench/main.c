@@ -0,0 +1,658 @@
+
+#if defined(_WIN32) && !defined(_CRT_SECURE_NO_WARNINGS)
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifdef _MSC_VER
+#if !defined(__clang__)
+#pragma warning(disable : 5105)
+#endif
+#endif
+#if defined(__clang__)
+#pragma clang diagnostic ignored "-Wnonportable-system-include-path"
+#if __has_warning("-Wunsafe-buffer-usage")
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#endif
+#endif
+
+#include <rpmalloc.h>
+#include <rpmalloc_inline.h>
+#include <thread.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+//! Maximum number of benchmark threads
+#define BENCH_THREAD_MAX 64
+//! Number of block slots in each thread for the slot based benchmarks
+#define BENCH_SLOT_COUNT 16384
+//! Number of blocks handed over in each cross thread batch
+#define BENCH_BATCH_SIZE 64
+//! Every n:th operation is individually timed for the latency percentiles
+#define BENCH_LATENCY_SAMPLE_RATE 16
+//! Number of latency histogram buckets, eight for each power of two of nanoseconds
+#define BENCH_LATENCY_BUCKET_COUNT (40 * 8)
+//! Number of blocks allocated before all are freed in the sized and inline benchmarks
+#define BENCH_PAIR_BLOCK_COUNT 64
+//! Size of the blocks in the sized and inline benchmarks, a compile time constant for the inline fast path
+#define BENCH_PAIR_BLOCK_SIZE 64
+
+typedef struct bench_batch_t bench_batch_t;
+typedef struct bench_thread_t bench_thread_t;
+typedef struct bench_t bench_t;
+
+//! A batch of blocks allocated in one thread and freed in another thread
+struct bench_batch_t {
+	//! Next batch in mailbox
+	bench_batch_t* next;
+	//! Blocks in batch
+	void* block[BENCH_BATCH_SIZE];
+};
+
+//! Per thread benchmark state
+struct bench_thread_t {
+	//! Thread index
+	unsigned int index;
+	//! Random number generator state
+	uint64_t random;
+	//! Number of operations to perform
+	size_t op_count;
+	//! Number of operations performed
+	size_t op_total;
+	//! Counter for selecting operations to time
+	unsigned int op_sample;
+	//! Currently requested number of bytes in live blocks, not tracked in cross thread and thread churn benchmarks
+	size_t requested;
+	//! Peak requested number of bytes in live blocks
+	size_t requested_peak;
+	//! Block slots
+	void** slot;
+	//! Size of the block in each slot
+	size_t* slot_size;
+	//! Mailbox of batches of blocks to free, pushed by the previous thread
+	_Atomic(bench_batch_t*) mailbox;
+	//! Latency histogram of timed operations
+	uint64_t latency[BENCH_LATENCY_BUCKET_COUNT];
+	//! Thread handle
+	uintptr_t handle;
+	//! Thread argument
+	thread_arg arg;
+	//! Benchmark being run
+	const bench_t* bench;
+};
+
+//! A benchmark
+struct bench_t {
+	//! Name used for selection and reporting
+	const char* name;
+	//! Description
+	const char* description;
+	//! Benchmark thread function
+	void (*fn)(bench_thread_t*);
+	//! Default number of operations in each thread
+	size_t op_count;
+};
+
+//! Benchmark result
+typedef struct bench_result_t {
+	const bench_t* bench;
+	unsigned int thread_count;
+	size_t op_total;
+	double seconds;
+	uint64_t latency[BENCH_LATENCY_BUCKET_COUNT];
+	size_t requested_peak;
+	size_t rss;
+	size_t rss_peak;
+} bench_result_t;
+
+static bench_thread_t bench_thread[BENCH_THREAD_MAX];
+static unsigned int bench_thread_count;
+//! Number of threads done with the operations and waiting for the memory usage to be sampled
+static atomic_uint bench_thread_done;
+//! Flag set when the threads can start, and when the threads can release all memory and exit
+static atomic_int bench_start;
+static atomic_int bench_release;
+
+static uint64_t
+timer_ns(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * (1000000000.0 / (double)frequency.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+//! Get the resident set size of the process, or zero if not available
+static size_t
+process_rss(void) {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.WorkingSetSize;
+	return 0;
+#elif defined(__linux__)
+	size_t rss = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file) {
+		unsigned long size = 0;
+		unsigned long resident = 0;
+		if (fscanf(file, "%lu %lu", &size, &resident) == 2)
+			rss = (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+		fclose(file);
+	}
+	return rss;
+#else
+	return 0;
+#endif
+}
+
+static unsigned int
+hardware_thread_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	return (unsigned int)system_info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? (unsigned int)count : 1;
+#endif
+}
+
+//! Random number generator, xorshift64*
+static uint32_t
+bench_random(bench_thread_t* thread) {
+	uint64_t x = thread->random;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	thread->random = x;
+	return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+//! Random size in [16, 8192] with an exponential falloff, the upper limit evenly distributed over powers of two
+static size_t
+bench_random_size(bench_thread_t* thread) {
+	uint32_t random = bench_random(thread);
+	size_t size_range = ((size_t)16 << (random % 10)) - 15;
+	return 16 + ((random >> 4) % size_range);
+}
+
+static unsigned int
+latency_bucket(uint64_t ns) {
+	if (ns < 8)
+		return (unsigned int)ns;
+	unsigned int most_significant_bit = 3;
+	while (ns >> (most_significant_bit + 1))
+		++most_significant_bit;
+	unsigned int bucket = ((most_significant_bit - 2) << 3) + (unsigned int)((ns >> (most_significant_bit - 3)) & 7);
+	return (bucket < BENCH_LATENCY_BUCKET_COUNT) ? bucket : (BENCH_LATENCY_BUCKET_COUNT - 1);
+}
+
+//! Upper bound in nanoseconds of the given latency histogram bucket
+static uint64_t
+latency_bucket_limit(unsigned int bucket) {
+	if (bucket < 8)
+		return bucket;
+	unsigned int most_significant_bit = (bucket >> 3) + 2;
+	return ((uint64_t)(8 + (bucket & 7) + 1) << (most_significant_bit - 3)) - 1;
+}
+
+//! Start an operation, returns the timestamp if the operation is to be timed or zero if not
+static inline uint64_t
+bench_op_begin(bench_thread_t* thread) {
+	if (++thread->op_sample < BENCH_LATENCY_SAMPLE_RATE)
+		return 0;
+	thread->op_sample = 0;
+	return timer_ns();
+}
+
+static inline void
+bench_op_end(bench_thread_t* thread, uint64_t start) {
+	++thread->op_total;
+	if (start)
+		++thread->latency[latency_bucket(timer_ns() - start)];
+}
+
+static inline void
+bench_requested_add(bench_thread_t* thread, size_t size) {
+	thread->requested += size;
+	if (thread->requested > thread->requested_peak)
+		thread->requested_peak = thread->requested;
+}
+
+//! Wait until all threads are done and the memory usage has been sampled
+static void
+bench_thread_finish(void) {
+	atomic_fetch_add_explicit(&bench_thread_done, 1, memory_order_release);
+	while (!atomic_load_explicit(&bench_release, memory_order_acquire))
+		thread_yield();
+}
+
+//! Slot based benchmark where each operation allocates a block in a random free slot or frees the block in a
+//  random used slot, with the given size and alignment functions
+static void
+bench_slots(bench_thread_t* thread, size_t (*size_fn)(bench_thread_t*), size_t (*align_fn)(bench_thread_t*)) {
+	for (size_t iop = 0; iop < thread->op_count; ++iop) {
+		uint32_t islot = bench_random(thread) % BENCH_SLOT_COUNT;
+		if (thread->slot[islot]) {
+			uint64_t start = bench_op_begin(thread);
+			rpfree(thread->slot[islot]);
+			bench_op_end(thread, start);
+			thread->requested -= thread->slot_size[islot];
+			thread->slot[islot] = 0;
+		} else {
+			size_t size = size_fn(thread);
+			size_t alignment = align_fn ? align_fn(thread) : 0;
+			uint64_t start = bench_op_begin(thread);
+			void* block = alignment ? rpaligned_alloc(alignment, size) : rpmalloc(size);
+			bench_op_end(thread, start);
+			*(volatile char*)block = 1;
+			thread->slot[islot] = block;
+			thread->slot_size[islot] = size;
+			bench_requested_add(thread, size);
+		}
+	}
+	bench_thread_finish();
+	for (uint32_t islot = 0; islot < BENCH_SLOT_COUNT; ++islot) {
+		rpfree(thread->slot[islot]);
+		thread->slot[islot] = 0;
+	}
+}
+
+static size_t
+bench_fixed_size(bench_thread_t* thread) {
+	(void)sizeof(thread);
+	return 64;
+}
+
+static void
+bench_fixed(bench_thread_t* thread) {
+	bench_slots(thread, bench_fixed_size, 0);
+}
+
+static void
+bench_random_sizes(bench_thread_t* thread) {
+	bench_slots(thread, bench_random_size, 0);
+}
+
+static size_t
+bench_random_alignment(bench_thread_t* thread) {
+	// Half of the allocations unaligned, the rest aligned to a power of two in [32, 4096]
+	uint32_t random = bench_random(thread);
+	return (random & 1) ? ((size_t)32 << ((random >> 1) % 8)) : 0;
+}
+
+static void
+bench_aligned(bench_thread_t* thread) {
+	bench_slots(thread, bench_random_size, bench_random_alignment);
+}
+
+//! Producer and consumer benchmark, each thread allocates batches of blocks handed over to the next thread which
+//  frees them, and frees the batches handed over from the previous thread
+static void
+bench_crossthread(bench_thread_t* thread) {
+	bench_thread_t* next = bench_thread + ((thread->index + 1) % bench_thread_count);
+	size_t batch_count = thread->op_count / (2 * BENCH_BATCH_SIZE);
+	size_t batch_received = 0;
+	for (size_t ibatch = 0; (ibatch < batch_count) || (batch_received < batch_count);) {
+		if (ibatch < batch_count) {
+			bench_batch_t* batch = rpmalloc(sizeof(bench_batch_t));
+			for (size_t iblock = 0; iblock < BENCH_BATCH_SIZE; ++iblock) {
+				size_t size = bench_random_size(thread);
+				uint64_t start = bench_op_begin(thread);
+				batch->block[iblock] = rpmalloc(size);
+				bench_op_end(thread, start);
+				*(volatile char*)batch->block[iblock] = 1;
+			}
+			batch->next = atomic_load_explicit(&next->mailbox, memory_order_relaxed);
+			while (!atomic_compare_exchange_weak_explicit(&next->mailbox, &batch->next, batch, memory_order_release,
+			                                              memory_order_relaxed)) {
+			}
+			++ibatch;
+		}
+		bench_batch_t* received = atomic_exchange_explicit(&thread->mailbox, 0, memory_order_acquire);
+		if (!received && (ibatch >= batch_count))
+			thread_yield();
+		while (received) {
+			bench_batch_t* next_batch = received->next;
+			for (size_t iblock = 0; iblock < BENCH_BATCH_SIZE; ++iblock) {
+				uint64_t start = bench_op_begin(thread);
+				rpfree(received->block[iblock]);
+				bench_op_end(thread, start);
+			}
+			rpfree(received);
+			received = next_batch;
+			++batch_received;
+		}
+	}
+	bench_thread_finish();
+}
+
+static void
+bench_churn_thread(void* argp) {
+	bench_thread_t* thread = argp;
+	rpmalloc_thread_initialize();
+	// Allocate blocks, free the first half and leave the rest to be freed by the spawning thread after exit
+	for (uint32_t islot = 0; islot < 256; ++islot) {
+		size_t size = bench_random_size(thread);
+		uint64_t start = bench_op_begin(thread);
+		thread->slot[islot] = rpmalloc(size);
+		bench_op_end(thread, start);
+		*(volatile char*)thread->slot[islot] = 1;
+	}
+	for (uint32_t islot = 0; islot < 128; ++islot) {
+		uint64_t start = bench_op_begin(thread);
+		rpfree(thread->slot[islot]);
+		bench_op_end(thread, start);
+		thread->slot[islot] = 0;
+	}
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+//! Thread churn benchmark, repeatedly starting short lived threads allocating blocks that outlive the thread
+static void
+bench_churn(bench_thread_t* thread) {
+	thread_arg arg;
+	arg.fn = bench_churn_thread;
+	arg.arg = thread;
+	while (thread->op_total < thread->op_count) {
+		uintptr_t handle = thread_run(&arg);
+		if (!handle || thread_join(handle))
+			break;
+		for (uint32_t islot = 128; islot < 256; ++islot) {
+			uint64_t start = bench_op_begin(thread);
+			rpfree(thread->slot[islot]);
+			bench_op_end(thread, start);
+			thread->slot[islot] = 0;
+		}
+	}
+	bench_thread_finish();
+}
+
+//! Huge block growth benchmark, repeatedly growing a block from 1MiB to 256MiB in steps of an eighth of the size
+static void
+bench_huge_realloc(bench_thread_t* thread) {
+	while (thread->op_total < thread->op_count) {
+		void* block = 0;
+		for (size_t size = 1024 * 1024; size <= 256 * 1024 * 1024; size += (size >> 3)) {
+			uint64_t start = bench_op_begin(thread);
+			block = rprealloc(block, size);
+			bench_op_end(thread, start);
+			((volatile char*)block)[size - 1] = 1;
+			thread->requested = 0;
+			bench_requested_add(thread, size);
+		}
+		rpfree(block);
+	}
+	thread->requested = 0;
+	bench_thread_finish();
+}
+
+// The sized and inline benchmarks allocate a run of fixed size blocks and free them again with the size, either
+// through the exported functions or the inline fast path of rpmalloc_inline.h. The inline fast path is only taken
+// if the library and the benchmark are built with RPMALLOC_INLINE_ABI=1. Operations are too short to be timed
+// individually, the latency percentiles are of entire runs of allocations and frees
+#define BENCH_PAIRS(thread, alloc_fn, free_fn)                                       \
+	do {                                                                             \
+		void* block[BENCH_PAIR_BLOCK_COUNT];                                         \
+		while ((thread)->op_total < (thread)->op_count) {                            \
+			uint64_t start = bench_op_begin(thread);                                 \
+			for (size_t iblock = 0; iblock < BENCH_PAIR_BLOCK_COUNT; ++iblock) {     \
+				block[iblock] = alloc_fn(BENCH_PAIR_BLOCK_SIZE);                     \
+				*(volatile char*)block[iblock] = 1;                                  \
+			}                                                                        \
+			for (size_t iblock = 0; iblock < BENCH_PAIR_BLOCK_COUNT; ++iblock)       \
+				free_fn(block[iblock], BENCH_PAIR_BLOCK_SIZE);                       \
+			(thread)->op_total += (2 * BENCH_PAIR_BLOCK_COUNT) - 1;                  \
+			bench_op_end(thread, start);                                             \
+		}                                                                            \
+		bench_requested_add(thread, BENCH_PAIR_BLOCK_COUNT * BENCH_PAIR_BLOCK_SIZE); \
+		(thread)->requested = 0;                                                     \
+		bench_thread_finish();                                                       \
+	} while (0)
+
+static void
+bench_sized(bench_thread_t* thread) {
+	BENCH_PAIRS(thread, rpmalloc, rpfree_sized);
+}
+
+static void
+bench_inline(bench_thread_t* thread) {
+	BENCH_PAIRS(thread, rpmalloc_inline, rpfree_sized_inline);
+}
+
+static const bench_t bench_list[] = {
+    {"fixed", "Fixed 64 byte blocks in random slots", bench_fixed, 20000000},
+    {"random", "Random sizes in [16, 8192] with exponential falloff in random slots", bench_random_sizes, 20000000},
+    {"crossthread", "Batches of random sizes allocated in one thread and freed in the next", bench_crossthread,
+     20000000},
+    {"churn", "Short lived threads with blocks freed by the spawning thread", bench_churn, 500000},
+    {"aligned", "Random sizes with half of the blocks aligned to [32, 4096]", bench_aligned, 20000000},
+    {"hugerealloc", "Huge block growth from 1MiB to 256MiB", bench_huge_realloc, 2000},
+    {"sized", "Fixed 64 byte blocks allocated and freed with the size through the exported functions",
+     bench_sized, 100000000},
+    {"inline", "Fixed 64 byte blocks allocated and freed with the size through the inline fast path",
+     bench_inline, 100000000},
+};
+
+static void
+bench_thread_entry(void* argp) {
+	bench_thread_t* thread = argp;
+	rpmalloc_thread_initialize();
+	while (!atomic_load_explicit(&bench_start, memory_order_acquire))
+		thread_yield();
+	thread->bench->fn(thread);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+bench_run(const bench_t* bench, unsigned int thread_count, size_t op_count, bench_result_t* result) {
+	rpmalloc_initialize(0);
+
+	bench_thread_count = thread_count;
+	atomic_store_explicit(&bench_thread_done, 0, memory_order_relaxed);
+	atomic_store_explicit(&bench_start, 0, memory_order_relaxed);
+	atomic_store_explicit(&bench_release, 0, memory_order_relaxed);
+	for (unsigned int ithread = 0; ithread < thread_count; ++ithread) {
+		bench_thread_t* thread = bench_thread + ithread;
+		memset(thread, 0, sizeof(bench_thread_t));
+		thread->index = ithread;
+		thread->random = 0x9E3779B97F4A7C15ULL * (ithread + 1);
+		thread->op_count = op_count ? op_count : bench->op_count;
+		thread->slot = rpcalloc(BENCH_SLOT_COUNT, sizeof(void*));
+		thread->slot_size = rpcalloc(BENCH_SLOT_COUNT, sizeof(size_t));
+		thread->bench = bench;
+		thread->arg.fn = bench_thread_entry;
+		thread->arg.arg = thread;
+		thread->handle = thread_run(&thread->arg);
+		if (!thread->handle) {
+			fprintf(stderr, "Failed to start benchmark thread\n");
+			return -1;
+		}
+	}
+
+	// Sample the resident set size while running, the memory used by the allocator is measured above the baseline
+	size_t rss_baseline = process_rss();
+	size_t rss_peak = rss_baseline;
+	uint64_t start = timer_ns();
+	atomic_store_explicit(&bench_start, 1, memory_order_release);
+	while (atomic_load_explicit(&bench_thread_done, memory_order_acquire) < thread_count) {
+		size_t rss = process_rss();
+		if (rss > rss_peak)
+			rss_peak = rss;
+		thread_sleep(1);
+	}
+	uint64_t end = timer_ns();
+
+	// Sample memory use while all blocks are still live
+	size_t rss = process_rss();
+	if (rss > rss_peak)
+		rss_peak = rss;
+	memset(result, 0, sizeof(bench_result_t));
+	result->bench = bench;
+	result->thread_count = thread_count;
+	result->seconds = (double)(end - start) / 1000000000.0;
+	result->rss = (rss > rss_baseline) ? (rss - rss_baseline) : 0;
+	result->rss_peak = rss_peak - rss_baseline;
+
+	atomic_store_explicit(&bench_release, 1, memory_order_release);
+	for (unsigned int ithread = 0; ithread < thread_count; ++ithread) {
+		bench_thread_t* thread = bench_thread + ithread;
+		thread_join(thread->handle);
+		result->op_total += thread->op_total;
+		result->requested_peak += thread->requested_peak;
+		for (unsigned int ibucket = 0; ibucket < BENCH_LATENCY_BUCKET_COUNT; ++ibucket)
+			result->latency[ibucket] += thread->latency[ibucket];
+		rpfree(thread->slot);
+		rpfree(thread->slot_size);
+	}
+
+	rpmalloc_finalize();
+	return 0;
+}
+
+//! Get the latency in nanoseconds of the given percentile of timed operations, as the upper bound of the bucket
+static uint64_t
+bench_latency_percentile(const bench_result_t* result, double percentile) {
+	uint64_t total = 0;
+	for (unsigned int ibucket = 0; ibucket < BENCH_LATENCY_BUCKET_COUNT; ++ibucket)
+		total += result->latency[ibucket];
+	uint64_t threshold = (uint64_t)((double)total * percentile);
+	uint64_t count = 0;
+	for (unsigned int ibucket = 0; ibucket < BENCH_LATENCY_BUCKET_COUNT; ++ibucket) {
+		count += result->latency[ibucket];
+		if (count > threshold)
+			return latency_bucket_limit(ibucket);
+	}
+	return 0;
+}
+
+static double
+bench_ops_per_sec(const bench_result_t* result) {
+	return (result->seconds > 0) ? ((double)result->op_total / result->seconds) : 0;
+}
+
+static void
+bench_print(const bench_result_t* result) {
+	double mib = 1024.0 * 1024.0;
+	printf("%-12s %3u threads %12.0f ops/s  p50 %6llu ns  p99 %6llu ns  p999 %7llu ns  requested %8.1f MiB  "
+	       "rss %8.1f MiB  rss peak %8.1f MiB\n",
+	       result->bench->name, result->thread_count, bench_ops_per_sec(result),
+	       (unsigned long long)bench_latency_percentile(result, 0.5),
+	       (unsigned long long)bench_latency_percentile(result, 0.99),
+	       (unsigned long long)bench_latency_percentile(result, 0.999), (double)result->requested_peak / mib,
+	       (double)result->rss / mib, (double)result->rss_peak / mib);
+	fflush(stdout);
+}
+
+static void
+bench_write_json(FILE* file, const bench_result_t* result, size_t result_count) {
+	fprintf(file, "{\n  \"allocator\": \"rpmalloc\",\n  \"latency_sample_rate\": %u,\n  \"benchmarks\": [\n",
+	        BENCH_LATENCY_SAMPLE_RATE);
+	for (size_t iresult = 0; iresult < result_count; ++iresult) {
+		const bench_result_t* res = result + iresult;
+		fprintf(file,
+		        "    {\"name\": \"%s\", \"threads\": %u, \"operations\": %llu, \"seconds\": %.6f, "
+		        "\"ops_per_sec\": %.0f,\n     \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu},\n"
+		        "     \"memory\": {\"requested_peak\": %llu, \"rss\": %llu, \"rss_peak\": %llu}}%s\n",
+		        res->bench->name, res->thread_count, (unsigned long long)res->op_total, res->seconds,
+		        bench_ops_per_sec(res), (unsigned long long)bench_latency_percentile(res, 0.5),
+		        (unsigned long long)bench_latency_percentile(res, 0.99),
+		        (unsigned long long)bench_latency_percentile(res, 0.999), (unsigned long long)res->requested_peak,
+		        (unsigned long long)res->rss, (unsigned long long)res->rss_peak,
+		        (iresult + 1 < result_count) ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+}
+
+static void
+bench_usage(void) {
+	printf("Usage: rpmalloc-bench [--threads <count>] [--ops <count>] [--json <file>] [benchmark ...]\n\n");
+	printf("  --threads <count>  Number of threads, default number of hardware threads (max %d)\n",
+	       BENCH_THREAD_MAX);
+	printf("  --ops <count>      Number of operations in each thread, default depends on benchmark\n");
+	printf("  --json <file>      Write results as JSON to the given file, - for stdout\n\n");
+	printf("Benchmarks (default all):\n");
+	for (size_t ibench = 0; ibench < sizeof(bench_list) / sizeof(bench_list[0]); ++ibench)
+		printf("  %-12s %s\n", bench_list[ibench].name, bench_list[ibench].description);
+}
+
+int
+main(int argc, char** argv) {
+	unsigned int thread_count = hardware_thread_count();
+	size_t op_count = 0;
+	const char* json_path = 0;
+	const bench_t* selected[sizeof(bench_list) / sizeof(bench_list[0])];
+	size_t selected_count = 0;
+
+	for (int iarg = 1; iarg < argc; ++iarg) {
+		if (!strcmp(argv[iarg], "--threads") && (iarg + 1 < argc)) {
+			thread_count = (unsigned int)strtoul(argv[++iarg], 0, 10);
+		} else if (!strcmp(argv[iarg], "--ops") && (iarg + 1 < argc)) {
+			op_count = (size_t)strtoull(argv[++iarg], 0, 10);
+		} else if (!strcmp(argv[iarg], "--json") && (iarg + 1 < argc)) {
+			json_path = argv[++iarg];
+		} else if (!strcmp(argv[iarg], "--help") || !strcmp(argv[iarg], "-h")) {
+			bench_usage();
+			return 0;
+		} else {
+			size_t ibench = 0;
+			size_t bench_count = sizeof(bench_list) / sizeof(bench_list[0]);
+			while ((ibench < bench_count) && strcmp(bench_list[ibench].name, argv[iarg]))
+				++ibench;
+			if (ibench == bench_count) {
+				fprintf(stderr, "Unknown benchmark or argument: %s\n", argv[iarg]);
+				bench_usage();
+				return -1;
+			}
+			if (selected_count < sizeof(selected) / sizeof(selected[0]))
+				selected[selected_count++] = bench_list + ibench;
+		}
+	}
+	if (!selected_count) {
+		for (size_t ibench = 0; ibench < sizeof(bench_list) / sizeof(bench_list[0]); ++ibench)
+			selected[selected_count++] = bench_list + ibench;
+	}
+	if (thread_count < 1)
+		thread_count = 1;
+	if (thread_count > BENCH_THREAD_MAX)
+		thread_count = BENCH_THREAD_MAX;
+
+	static bench_result_t result[sizeof(bench_list) / sizeof(bench_list[0])];
+	for (size_t ibench = 0; ibench < selected_count; ++ibench) {
+		if (bench_run(selected[ibench], thread_count, op_count, result + ibench))
+			return -1;
+		bench_print(result + ibench);
+	}
+
+	if (json_path) {
+		FILE* file = strcmp(json_path, "-") ? fopen(json_path, "w") : stdout;
+		if (!file) {
+			fprintf(stderr, "Failed to open JSON output file: %s\n", json_path);
+			return -1;
+		}
+		bench_write_json(file, result, selected_count);
+		if (file != stdout)
+			fclose(file);
+	}
+	return 0;
+}
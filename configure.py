@@ -12,9 +12,22 @@ import generator
 generator = generator.Generator(project = 'rpmalloc', variables = [('bundleidentifier', 'com.maniccoder.rpmalloc.$(binname)')])
 
 rpmalloc_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc', sources = ['rpmalloc.c'])
-rpmalloc_test_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-test', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=1', 'ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+rpmalloc_test_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-test', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=1', 'ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'ENABLE_SAMPLING=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1', 'ENABLE_TRACE=1']})
+rpmalloc_test_percpu_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-test-percpu', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=1', 'ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'ENABLE_SAMPLING=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1', 'ENABLE_TRACE=1', 'ENABLE_PER_CPU_HEAPS=1']})
+rpmalloc_test_inline_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-test-inline', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=1', 'ENABLE_ASSERTS=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1', 'RPMALLOC_INLINE_ABI=1']})
+rpmalloc_bench_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-bench', sources = ['rpmalloc.c'], variables = {'defines': ['RPMALLOC_INLINE_ABI=1']})
+rpmalloc_replay_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-replay', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=0', 'ENABLE_STATISTICS=1']})
 
 if not generator.target.is_android() and not generator.target.is_ios():
 	rpmalloc_so = generator.sharedlib(module = 'rpmalloc', libname = 'rpmalloc', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_DYNAMIC_LINK=1']})
 
-	generator.bin(module = 'test', sources = ['thread.c', 'main.c', 'main-override.cc'], binname = 'rpmalloc-test', implicit_deps = [rpmalloc_test_lib], libs = ['rpmalloc-test'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+	generator.bin(module = 'test', sources = ['thread.c', 'main.c', 'main-override.cc'], binname = 'rpmalloc-test', implicit_deps = [rpmalloc_test_lib], libs = ['rpmalloc-test'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'ENABLE_SAMPLING=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+
+	generator.bin(module = 'test', sources = ['thread.c', 'main.c', 'main-override.cc'], binname = 'rpmalloc-test-inline', implicit_deps = [rpmalloc_test_inline_lib], libs = ['rpmalloc-test-inline'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['ENABLE_ASSERTS=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1', 'RPMALLOC_INLINE_ABI=1']})
+
+	if generator.target.is_linux():
+		generator.bin(module = 'test', sources = ['thread.c', 'main.c', 'main-override.cc'], binname = 'rpmalloc-test-percpu', implicit_deps = [rpmalloc_test_percpu_lib], libs = ['rpmalloc-test-percpu'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'ENABLE_SAMPLING=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1', 'ENABLE_PER_CPU_HEAPS=1']})
+
+	generator.bin(module = 'bench', sources = ['main.c', os.path.join('..', 'test', 'thread.c')], binname = 'rpmalloc-bench', implicit_deps = [rpmalloc_bench_lib], libs = ['rpmalloc-bench'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['RPMALLOC_INLINE_ABI=1']})
+
+	generator.bin(module = 'replay', sources = ['main.c', os.path.join('..', 'test', 'thread.c')], binname = 'rpmalloc-replay', implicit_deps = [rpmalloc_replay_lib], libs = ['rpmalloc-replay'], includepaths = ['rpmalloc', 'test'])
@@ -0,0 +1,586 @@
+
+#if defined(_WIN32) && !defined(_CRT_SECURE_NO_WARNINGS)
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifdef _MSC_VER
+#if !defined(__clang__)
+#pragma warning(disable : 5105)
+#endif
+#endif
+#if defined(__clang__)
+#pragma clang diagnostic ignored "-Wnonportable-system-include-path"
+#if __has_warning("-Wunsafe-buffer-usage")
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#endif
+#endif
+
+#include <rpmalloc.h>
+#include <thread.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#include <malloc.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+//! Maximum number of replayed threads
+#define REPLAY_THREAD_MAX 1024
+//! Block identifier of operations without a block
+#define REPLAY_NONE UINT32_MAX
+//! Mask of the requested size in the record info
+#define REPLAY_SIZE_MASK ((1ULL << 48) - 1)
+
+//! A replayed operation, with the blocks identified by the order they were allocated in the trace
+typedef struct replay_op_t {
+	//! Operation (RPMALLOC_TRACE_*)
+	uint32_t op;
+	//! Log2 of the requested alignment, zero if not aligned
+	uint32_t alignment_shift;
+	//! Identifier of the allocated block, or REPLAY_NONE
+	uint32_t block;
+	//! Identifier of the freed or reallocated block, or REPLAY_NONE
+	uint32_t previous;
+	//! Requested size
+	size_t size;
+} replay_op_t;
+
+//! Per thread replay state
+typedef struct replay_thread_t {
+	//! Records loaded from the trace file of the thread
+	rpmalloc_trace_record_t* record;
+	//! Number of records
+	size_t record_count;
+	//! Operations to replay, in the order performed by the traced thread
+	replay_op_t* op;
+	//! Number of operations
+	size_t op_count;
+	//! Thread handle
+	uintptr_t handle;
+	//! Thread argument
+	thread_arg arg;
+} replay_thread_t;
+
+//! Allocator to replay the trace against
+typedef struct replay_allocator_t {
+	//! Name used for reporting
+	const char* name;
+	void* (*allocate)(size_t alignment, size_t size, int zero);
+	void* (*reallocate)(void* block, size_t alignment, size_t size);
+	void (*deallocate)(void* block);
+} replay_allocator_t;
+
+//! Map from block address to identifier of the live blocks while resolving the trace, open addressing with linear
+//  probing and backward shift deletion
+typedef struct replay_map_t {
+	uint64_t* address;
+	uint32_t* block;
+	size_t capacity;
+	size_t count;
+} replay_map_t;
+
+static replay_thread_t replay_thread[REPLAY_THREAD_MAX];
+static unsigned int replay_thread_count;
+//! Allocated block for each block identifier
+static void** replay_block;
+//! Flag set for each block identifier when the block has been allocated
+static atomic_uchar* replay_ready;
+//! Number of block identifiers
+static uint32_t replay_block_count;
+//! Requested size of each block identifier, used to track the live bytes while resolving the trace
+static size_t* replay_block_size;
+//! Peak number of requested bytes in live blocks in the trace
+static size_t replay_live_peak;
+//! Allocator replayed against
+static const replay_allocator_t* replay_allocator;
+//! Flag set when the threads can start
+static atomic_int replay_start;
+//! Number of threads done with the operations
+static atomic_uint replay_thread_done;
+
+static uint64_t
+timer_ns(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * (1000000000.0 / (double)frequency.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+//! Get the resident set size of the process, or zero if not available
+static size_t
+process_rss(void) {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.WorkingSetSize;
+	return 0;
+#elif defined(__linux__)
+	size_t rss = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file) {
+		unsigned long size = 0;
+		unsigned long resident = 0;
+		if (fscanf(file, "%lu %lu", &size, &resident) == 2)
+			rss = (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+		fclose(file);
+	}
+	return rss;
+#else
+	return 0;
+#endif
+}
+
+static void*
+rpmalloc_allocate(size_t alignment, size_t size, int zero) {
+	if (alignment)
+		return zero ? rpaligned_zalloc(alignment, size) : rpaligned_alloc(alignment, size);
+	return zero ? rpzalloc(size) : rpmalloc(size);
+}
+
+static void*
+rpmalloc_reallocate(void* block, size_t alignment, size_t size) {
+	if (alignment)
+		return rpaligned_realloc(block, alignment, size, 0, 0);
+	return rprealloc(block, size);
+}
+
+static void
+rpmalloc_deallocate(void* block) {
+	rpfree(block);
+}
+
+#ifdef _WIN32
+
+// Blocks must be freed with the function matching the allocation, use the aligned functions for all blocks
+static void*
+libc_allocate(size_t alignment, size_t size, int zero) {
+	void* block = _aligned_malloc(size ? size : 1, (alignment > 16) ? alignment : 16);
+	if (block && zero)
+		memset(block, 0, size);
+	return block;
+}
+
+static void*
+libc_reallocate(void* block, size_t alignment, size_t size) {
+	return _aligned_realloc(block, size ? size : 1, (alignment > 16) ? alignment : 16);
+}
+
+static void
+libc_deallocate(void* block) {
+	_aligned_free(block);
+}
+
+#else
+
+static void*
+libc_allocate(size_t alignment, size_t size, int zero) {
+	if (!alignment)
+		return zero ? calloc(1, size) : malloc(size);
+	void* block = 0;
+	if (alignment < sizeof(void*))
+		alignment = sizeof(void*);
+	if (posix_memalign(&block, alignment, size))
+		return 0;
+	if (zero)
+		memset(block, 0, size);
+	return block;
+}
+
+// The alignment is not preserved by the standard library realloc, which only matters for the block addresses
+static void*
+libc_reallocate(void* block, size_t alignment, size_t size) {
+	(void)sizeof(alignment);
+	return realloc(block, size);
+}
+
+static void
+libc_deallocate(void* block) {
+	free(block);
+}
+
+#endif
+
+static const replay_allocator_t replay_allocator_rpmalloc = {"rpmalloc", rpmalloc_allocate, rpmalloc_reallocate,
+                                                             rpmalloc_deallocate};
+static const replay_allocator_t replay_allocator_libc = {"libc", libc_allocate, libc_reallocate, libc_deallocate};
+
+static size_t
+replay_map_slot(const replay_map_t* map, uint64_t address) {
+	return (size_t)((address * 0x9E3779B97F4A7C15ULL) >> 20) & (map->capacity - 1);
+}
+
+static int
+replay_map_insert(replay_map_t* map, uint64_t address, uint32_t block);
+
+static int
+replay_map_grow(replay_map_t* map) {
+	replay_map_t grown;
+	grown.capacity = map->capacity ? (map->capacity << 1) : 4096;
+	grown.count = 0;
+	grown.address = calloc(grown.capacity, sizeof(uint64_t));
+	grown.block = calloc(grown.capacity, sizeof(uint32_t));
+	if (!grown.address || !grown.block) {
+		free(grown.address);
+		free(grown.block);
+		return -1;
+	}
+	for (size_t islot = 0; islot < map->capacity; ++islot) {
+		if (map->address[islot])
+			replay_map_insert(&grown, map->address[islot], map->block[islot]);
+	}
+	free(map->address);
+	free(map->block);
+	*map = grown;
+	return 0;
+}
+
+//! Insert the block at the given address, replacing a block at the same address missing a traced free
+static int
+replay_map_insert(replay_map_t* map, uint64_t address, uint32_t block) {
+	if (((map->count + 1) * 2 > map->capacity) && replay_map_grow(map))
+		return -1;
+	size_t islot = replay_map_slot(map, address);
+	while (map->address[islot] && (map->address[islot] != address))
+		islot = (islot + 1) & (map->capacity - 1);
+	if (!map->address[islot])
+		++map->count;
+	map->address[islot] = address;
+	map->block[islot] = block;
+	return 0;
+}
+
+//! Remove the block at the given address, returns the block identifier or REPLAY_NONE if not a live block
+static uint32_t
+replay_map_remove(replay_map_t* map, uint64_t address) {
+	if (!map->count || !address)
+		return REPLAY_NONE;
+	size_t islot = replay_map_slot(map, address);
+	while (map->address[islot] && (map->address[islot] != address))
+		islot = (islot + 1) & (map->capacity - 1);
+	if (!map->address[islot])
+		return REPLAY_NONE;
+	uint32_t block = map->block[islot];
+	--map->count;
+	// Shift following entries of the probe sequence back into the hole
+	size_t hole = islot;
+	size_t inext = (islot + 1) & (map->capacity - 1);
+	while (map->address[inext]) {
+		size_t home = replay_map_slot(map, map->address[inext]);
+		if (((inext - home) & (map->capacity - 1)) >= ((inext - hole) & (map->capacity - 1))) {
+			map->address[hole] = map->address[inext];
+			map->block[hole] = map->block[inext];
+			hole = inext;
+		}
+		inext = (inext + 1) & (map->capacity - 1);
+	}
+	map->address[hole] = 0;
+	return block;
+}
+
+//! Assign the next block identifier to the block allocated at the given address
+static uint32_t
+replay_block_allocate(replay_map_t* map, uint64_t address, size_t size, size_t* live) {
+	static size_t capacity;
+	if (replay_block_count == capacity) {
+		capacity = capacity ? (capacity << 1) : 65536;
+		size_t* block_size = realloc(replay_block_size, capacity * sizeof(size_t));
+		if (!block_size)
+			return REPLAY_NONE;
+		replay_block_size = block_size;
+	}
+	uint32_t block = replay_block_count;
+	if (replay_map_insert(map, address, block))
+		return REPLAY_NONE;
+	++replay_block_count;
+	replay_block_size[block] = size;
+	*live += size;
+	if (*live > replay_live_peak)
+		replay_live_peak = *live;
+	return block;
+}
+
+//! Load the records of the trace file, returns non-zero if the file does not exist or is not a valid trace
+static int
+replay_load(const char* path, replay_thread_t* thread) {
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return -1;
+	rpmalloc_trace_header_t header;
+	if ((fread(&header, sizeof(header), 1, file) != 1) || (header.magic != RPMALLOC_TRACE_MAGIC) ||
+	    (header.version != RPMALLOC_TRACE_VERSION) || (header.record_size != sizeof(rpmalloc_trace_record_t))) {
+		fprintf(stderr, "Invalid trace file: %s\n", path);
+		fclose(file);
+		return -1;
+	}
+	size_t capacity = 65536;
+	thread->record = malloc(capacity * sizeof(rpmalloc_trace_record_t));
+	thread->record_count = 0;
+	while (thread->record) {
+		size_t read = fread(thread->record + thread->record_count, sizeof(rpmalloc_trace_record_t),
+		                    capacity - thread->record_count, file);
+		thread->record_count += read;
+		if (thread->record_count < capacity)
+			break;
+		capacity <<= 1;
+		rpmalloc_trace_record_t* record = realloc(thread->record, capacity * sizeof(rpmalloc_trace_record_t));
+		if (!record) {
+			free(thread->record);
+			thread->record = 0;
+		}
+		thread->record = record;
+	}
+	fclose(file);
+	if (!thread->record) {
+		fprintf(stderr, "Out of memory loading trace file: %s\n", path);
+		return -1;
+	}
+	// The trace of a thread not finalized before the process terminated ends with zero records
+	for (size_t irecord = 0; irecord < thread->record_count; ++irecord) {
+		if (!(thread->record[irecord].info >> 56)) {
+			thread->record_count = irecord;
+			break;
+		}
+	}
+	thread->op = malloc((thread->record_count ? thread->record_count : 1) * sizeof(replay_op_t));
+	thread->op_count = 0;
+	return thread->op ? 0 : -1;
+}
+
+//! Merge the records of all threads by timestamp and identify the blocks by the order they were allocated, so
+//  blocks freed or reallocated by another thread can be waited for during the replay
+static int
+replay_resolve(void) {
+	replay_map_t map;
+	memset(&map, 0, sizeof(map));
+	size_t next[REPLAY_THREAD_MAX];
+	memset(next, 0, sizeof(next));
+	size_t live = 0;
+	while (1) {
+		unsigned int ithread = REPLAY_THREAD_MAX;
+		uint64_t timestamp = 0;
+		for (unsigned int icheck = 0; icheck < replay_thread_count; ++icheck) {
+			replay_thread_t* thread = replay_thread + icheck;
+			if ((next[icheck] < thread->record_count) &&
+			    ((ithread == REPLAY_THREAD_MAX) || (thread->record[next[icheck]].timestamp < timestamp))) {
+				ithread = icheck;
+				timestamp = thread->record[next[icheck]].timestamp;
+			}
+		}
+		if (ithread == REPLAY_THREAD_MAX)
+			break;
+
+		replay_thread_t* thread = replay_thread + ithread;
+		const rpmalloc_trace_record_t* record = thread->record + next[ithread]++;
+		replay_op_t op;
+		op.op = (uint32_t)(record->info >> 56);
+		op.alignment_shift = (uint32_t)((record->info >> 48) & 0xFF);
+		op.size = (size_t)(record->info & REPLAY_SIZE_MASK);
+		op.block = REPLAY_NONE;
+		op.previous = REPLAY_NONE;
+		if ((op.op == RPMALLOC_TRACE_FREE) || (op.op == RPMALLOC_TRACE_REALLOC)) {
+			op.previous = replay_map_remove(&map, (op.op == RPMALLOC_TRACE_FREE) ? record->block : record->previous);
+			if (op.previous != REPLAY_NONE)
+				live -= replay_block_size[op.previous];
+		}
+		if (op.op == RPMALLOC_TRACE_REALLOC) {
+			if (!record->block && op.size && (op.previous != REPLAY_NONE)) {
+				// Failed reallocation, the block is still live
+				replay_map_insert(&map, record->previous, op.previous);
+				live += replay_block_size[op.previous];
+				continue;
+			}
+			if (!record->block)
+				op.op = RPMALLOC_TRACE_FREE;
+		}
+		if ((op.op != RPMALLOC_TRACE_FREE) && record->block) {
+			op.block = replay_block_allocate(&map, record->block, op.size, &live);
+			if (op.block == REPLAY_NONE) {
+				fprintf(stderr, "Out of memory resolving trace\n");
+				return -1;
+			}
+		}
+		// Skip failed allocations and frees of blocks allocated before the trace started
+		if ((op.block == REPLAY_NONE) && (op.previous == REPLAY_NONE))
+			continue;
+		thread->op[thread->op_count++] = op;
+	}
+	free(map.address);
+	free(map.block);
+	for (unsigned int ithread = 0; ithread < replay_thread_count; ++ithread) {
+		free(replay_thread[ithread].record);
+		replay_thread[ithread].record = 0;
+	}
+
+	replay_block = calloc(replay_block_count ? replay_block_count : 1, sizeof(void*));
+	replay_ready = calloc(replay_block_count ? replay_block_count : 1, sizeof(atomic_uchar));
+	if (!replay_block || !replay_ready) {
+		fprintf(stderr, "Out of memory resolving trace\n");
+		return -1;
+	}
+	// Fault in the bookkeeping memory before the baseline resident set size is sampled
+	memset(replay_block, 0, replay_block_count * sizeof(void*));
+	memset((void*)replay_ready, 0, replay_block_count * sizeof(atomic_uchar));
+	return 0;
+}
+
+//! Wait until the block has been allocated by the thread performing the allocation
+static void*
+replay_wait(uint32_t block) {
+	while (!atomic_load_explicit(replay_ready + block, memory_order_acquire))
+		thread_yield();
+	return replay_block[block];
+}
+
+static void
+replay_publish(uint32_t block, void* pointer) {
+	replay_block[block] = pointer;
+	atomic_store_explicit(replay_ready + block, 1, memory_order_release);
+}
+
+static void
+replay_thread_entry(void* argp) {
+	replay_thread_t* thread = argp;
+	const replay_allocator_t* allocator = replay_allocator;
+	rpmalloc_thread_initialize();
+	while (!atomic_load_explicit(&replay_start, memory_order_acquire))
+		thread_yield();
+	for (size_t iop = 0; iop < thread->op_count; ++iop) {
+		const replay_op_t* op = thread->op + iop;
+		size_t alignment = op->alignment_shift ? ((size_t)1 << op->alignment_shift) : 0;
+		void* previous = (op->previous != REPLAY_NONE) ? replay_wait(op->previous) : 0;
+		switch (op->op) {
+			case RPMALLOC_TRACE_ALLOC:
+			case RPMALLOC_TRACE_ZALLOC:
+				replay_publish(op->block, allocator->allocate(alignment, op->size, op->op == RPMALLOC_TRACE_ZALLOC));
+				break;
+			case RPMALLOC_TRACE_REALLOC:
+				if (op->previous == REPLAY_NONE)
+					replay_publish(op->block, allocator->allocate(alignment, op->size, 0));
+				else
+					replay_publish(op->block, allocator->reallocate(previous, alignment, op->size));
+				break;
+			case RPMALLOC_TRACE_FREE:
+				allocator->deallocate(previous);
+				break;
+			default:
+				break;
+		}
+	}
+	atomic_fetch_add_explicit(&replay_thread_done, 1, memory_order_release);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static void
+replay_usage(void) {
+	printf("Usage: rpmalloc-replay [--libc] <trace path>.<process id>\n\n");
+	printf("  --libc  Replay against the standard library allocator instead of rpmalloc\n\n");
+	printf("Replays the allocation trace files <trace path>.<process id>.0, <trace path>.<process id>.1, ...\n");
+	printf("recorded by rpmalloc built with ENABLE_TRACE=1, one thread for each traced thread of the process\n");
+}
+
+int
+main(int argc, char** argv) {
+	const char* trace_path = 0;
+	replay_allocator = &replay_allocator_rpmalloc;
+	for (int iarg = 1; iarg < argc; ++iarg) {
+		if (!strcmp(argv[iarg], "--libc")) {
+			replay_allocator = &replay_allocator_libc;
+		} else if (!strcmp(argv[iarg], "--help") || !strcmp(argv[iarg], "-h")) {
+			replay_usage();
+			return 0;
+		} else {
+			trace_path = argv[iarg];
+		}
+	}
+	if (!trace_path) {
+		replay_usage();
+		return -1;
+	}
+
+	char path[1024];
+	while (replay_thread_count < REPLAY_THREAD_MAX) {
+		snprintf(path, sizeof(path), "%s.%u", trace_path, replay_thread_count);
+		if (replay_load(path, replay_thread + replay_thread_count))
+			break;
+		++replay_thread_count;
+	}
+	if (!replay_thread_count) {
+		fprintf(stderr, "No trace files found: %s.0\n", trace_path);
+		return -1;
+	}
+	if (replay_resolve())
+		return -1;
+
+	rpmalloc_initialize(0);
+
+	size_t op_total = 0;
+	for (unsigned int ithread = 0; ithread < replay_thread_count; ++ithread) {
+		replay_thread_t* thread = replay_thread + ithread;
+		op_total += thread->op_count;
+		thread->arg.fn = replay_thread_entry;
+		thread->arg.arg = thread;
+		thread->handle = thread_run(&thread->arg);
+		if (!thread->handle) {
+			fprintf(stderr, "Failed to start replay thread\n");
+			return -1;
+		}
+	}
+
+	// Sample the resident set size while replaying, the peak above the baseline is the memory used by the allocator
+	size_t rss_baseline = process_rss();
+	size_t rss_peak = rss_baseline;
+	uint64_t start = timer_ns();
+	atomic_store_explicit(&replay_start, 1, memory_order_release);
+	while (atomic_load_explicit(&replay_thread_done, memory_order_acquire) < replay_thread_count) {
+		size_t rss = process_rss();
+		if (rss > rss_peak)
+			rss_peak = rss;
+		thread_sleep(1);
+	}
+	uint64_t end = timer_ns();
+	for (unsigned int ithread = 0; ithread < replay_thread_count; ++ithread) {
+		thread_join(replay_thread[ithread].handle);
+		free(replay_thread[ithread].op);
+	}
+
+	rpmalloc_global_statistics_t stats;
+	rpmalloc_global_statistics(&stats);
+	rpmalloc_finalize();
+
+	double mib = 1024.0 * 1024.0;
+	double seconds = (double)(end - start) / 1000000000.0;
+	size_t rss_used = rss_peak - rss_baseline;
+	double fragmentation = (rss_used > replay_live_peak) ? (100.0 * (double)(rss_used - replay_live_peak) /
+	                                                        (double)rss_used)
+	                                                     : 0;
+	printf("%-8s %3u threads %10llu ops %8.3f s %12.0f ops/s  live peak %8.1f MiB  rss peak %8.1f MiB  "
+	       "fragmentation %5.1f%%",
+	       replay_allocator->name, replay_thread_count, (unsigned long long)op_total, seconds,
+	       (seconds > 0) ? ((double)op_total / seconds) : 0, (double)replay_live_peak / mib, (double)rss_used / mib,
+	       fragmentation);
+	if (replay_allocator == &replay_allocator_rpmalloc)
+		printf("  mapped peak %8.1f MiB", (double)stats.mapped_peak / mib);
+	printf("\n");
+
+	free(replay_block);
+	free((void*)replay_ready);
+	free(replay_block_size);
+	return 0;
+}
@@ -59,7 +59,9 @@ static DWORD fls_key;
 #endif
 #if PLATFORM_POSIX
 #include <sys/mman.h>
+#include <fcntl.h>
 #include <sched.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 static pthread_key_t pthread_key;
@@ -83,10 +85,27 @@ madvise(caddr_t, size_t, int);
 
 #if defined(__linux__) || defined(__ANDROID__)
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 #if !defined(PR_SET_VMA)
 #define PR_SET_VMA 0x53564d41
 #define PR_SET_VMA_ANON_NAME 0
 #endif
+#if !defined(MPOL_PREFERRED)
+#define MPOL_PREFERRED 1
+#endif
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 35)))
+#include <sys/rseq.h>
+#define PLATFORM_HAS_RSEQ 1
+#endif
+#endif
+#ifndef PLATFORM_HAS_RSEQ
+#define PLATFORM_HAS_RSEQ 0
+#endif
+#if PLATFORM_POSIX && (defined(__GLIBC__) || defined(__APPLE__))
+#include <execinfo.h>
+#define PLATFORM_HAS_BACKTRACE 1
+#else
+#define PLATFORM_HAS_BACKTRACE 0
 #endif
 #if defined(__APPLE__)
 #include <TargetConditionals.h>
@@ -146,6 +165,45 @@ madvise(caddr_t, size_t, int);
 //! Enable statistics
 #define ENABLE_STATISTICS 0
 #endif
+#ifndef ENABLE_HUGE_CACHE
+//! Enable cache of freed huge spans for reuse in later huge allocations
+#define ENABLE_HUGE_CACHE 1
+#endif
+#ifndef ENABLE_SAMPLING
+//! Enable sampling of allocations with stack capture for heap profiling
+#define ENABLE_SAMPLING 0
+#endif
+#ifndef ENABLE_PER_CPU_HEAPS
+//! Enable experimental lock based heaps per CPU core instead of per thread (Linux only, other platforms use per
+//  thread heaps)
+#define ENABLE_PER_CPU_HEAPS 0
+#endif
+#if ENABLE_PER_CPU_HEAPS && !defined(__linux__)
+#undef ENABLE_PER_CPU_HEAPS
+#define ENABLE_PER_CPU_HEAPS 0
+#endif
+#ifndef ENABLE_TRACE
+//! Enable recording allocation traces to files for replay (POSIX only)
+#define ENABLE_TRACE 0
+#endif
+#if ENABLE_TRACE && !PLATFORM_POSIX
+#undef ENABLE_TRACE
+#define ENABLE_TRACE 0
+#endif
+#ifndef RPMALLOC_INLINE_ABI
+//! Export the thread heap for the inlined allocation fast path of rpmalloc_inline.h
+#define RPMALLOC_INLINE_ABI 0
+#endif
+#if RPMALLOC_INLINE_ABI && (ENABLE_STATISTICS || ENABLE_SAMPLING || ENABLE_TRACE || ENABLE_PER_CPU_HEAPS)
+// The inlined fast path bypasses statistics, sampling and tracing and requires per thread heaps, code using it will
+// fail to link instead
+#undef RPMALLOC_INLINE_ABI
+#define RPMALLOC_INLINE_ABI 0
+#endif
+#if RPMALLOC_INLINE_ABI
+#define RPMALLOC_INLINE_IMPLEMENTATION
+#include "rpmalloc_inline.h"
+#endif
 
 ////////////
 ///
@@ -153,8 +211,13 @@ madvise(caddr_t, size_t, int);
 ///
 //////
 
-#define PAGE_HEADER_SIZE 128
+#define PAGE_HEADER_SIZE_SHIFT 7
+#define PAGE_HEADER_SIZE (1 << PAGE_HEADER_SIZE_SHIFT)
 #define SPAN_HEADER_SIZE PAGE_HEADER_SIZE
+//! Medium and large pages track free blocks in a bitmap following the page header instead of linking the free blocks
+#define PAGE_BITMAP_HEADER_SIZE_SHIFT (PAGE_HEADER_SIZE_SHIFT + 1)
+#define PAGE_BITMAP_HEADER_SIZE (1 << PAGE_BITMAP_HEADER_SIZE_SHIFT)
+#define PAGE_BITMAP_WORD_COUNT ((PAGE_BITMAP_HEADER_SIZE - PAGE_HEADER_SIZE) / 8)
 
 #define SMALL_GRANULARITY 16
 
@@ -166,6 +229,12 @@ madvise(caddr_t, size_t, int);
 #define MEDIUM_SIZE_CLASS_COUNT 24
 #define LARGE_SIZE_CLASS_COUNT 20
 #define SIZE_CLASS_COUNT (SMALL_SIZE_CLASS_COUNT + MEDIUM_SIZE_CLASS_COUNT + LARGE_SIZE_CLASS_COUNT)
+//! Number of size classes of tiny blocks up to 64 times the granularity (i.e 1024 bytes), which are fixed
+#define TINY_SIZE_CLASS_COUNT 65
+//! Number of size class lookup buckets for blocks larger than tiny blocks, eight for each power of two
+#define SIZE_CLASS_BUCKET_COUNT 104
+//! Maximum offset from the start of the page to the first block as a power of two, used to naturally align blocks
+#define BLOCK_OFFSET_MAX_SHIFT 16
 
 #define SMALL_PAGE_SIZE_SHIFT 16
 #define SMALL_PAGE_SIZE (1 << SMALL_PAGE_SIZE_SHIFT)
@@ -180,6 +249,44 @@ madvise(caddr_t, size_t, int);
 #define SPAN_SIZE (256 * 1024 * 1024)
 #define SPAN_MASK (~((uintptr_t)(SPAN_SIZE - 1)))
 
+//! Granularity of incremental memory commit in pages, or the memory page size if larger
+#define PAGE_COMMIT_CHUNK_SIZE (64 * 1024)
+
+//! Minimum size of a reused huge block to zero by decommitting and committing the memory pages instead of memset
+#define HUGE_ZERO_DECOMMIT_SIZE (1024 * 1024)
+
+//! Default maximum number of bytes in the huge span cache
+#define HUGE_CACHE_DEFAULT_LIMIT (256 * 1024 * 1024)
+//! Default maximum age in milliseconds of spans in the huge span cache
+#define HUGE_CACHE_DEFAULT_MAX_AGE 1000
+//! Default decay time in milliseconds of free pages if the purge thread is enabled
+#define PURGE_DEFAULT_DECAY_TIME 1000
+//! Minimum interval in milliseconds between purges in the purge thread
+#define PURGE_MIN_INTERVAL 10
+//! Number of size buckets in the huge span cache, each a power of two range
+#define HUGE_CACHE_BUCKET_COUNT 32
+//! Size shift of the first huge span cache bucket
+#define HUGE_CACHE_BUCKET_SHIFT 23
+
+//! Maximum number of NUMA nodes supported
+#define NUMA_NODE_MAX 64
+
+//! Number of slots in the per heap buffer of blocks freed to pages owned by other heaps
+#define REMOTE_FREE_SLOT_COUNT 16
+
+//! Low water mark of committed memory, as a shift of the soft limit subtracted from it. Memory pressure releases
+//  not getting below the mark are held off until the committed memory drops by the same amount
+#define MEMORY_PRESSURE_LOW_WATER_SHIFT 3
+//! Minimum interval in milliseconds between memory pressure releases while held off
+#define MEMORY_PRESSURE_HOLD_TIME 1000
+
+//! Maximum number of CPU heaps, CPUs above this limit share heaps
+#define CPU_HEAP_MAX 1024
+//! Owner thread value of a CPU heap not currently held by any thread, and of a released heap
+#define CPU_HEAP_UNOWNED ((uintptr_t)1)
+//! Number of rounds over all CPU heaps spinning on held heaps before yielding the thread between rounds
+#define CPU_HEAP_SPIN_ROUNDS 16
+
 ////////////
 ///
 /// Utility macros
@@ -236,12 +343,137 @@ typedef struct rpmalloc_statistics_t {
 	atomic_size_t page_active;
 	atomic_size_t page_active_peak;
 	atomic_size_t heap_count;
+	atomic_size_t huge_alloc;
+	atomic_size_t huge_alloc_peak;
+	atomic_size_t mapped_total;
+	atomic_size_t unmapped_total;
+	atomic_size_t pool_size;
 } rpmalloc_statistics_t;
 
 static rpmalloc_statistics_t global_statistics;
 
+//! Per size class statistics for a heap, only modified by the owning thread
+typedef struct heap_size_class_statistics_t {
+	//! Current number of allocations, frees from other threads are counted once processed by the owning heap
+	size_t alloc_current;
+	//! Peak number of allocations
+	size_t alloc_peak;
+	//! Total number of allocations
+	size_t alloc_total;
+	//! Total number of frees
+	size_t free_total;
+	//! Number of pages transitioned to free state
+	size_t page_to_free;
+	//! Number of free pages taken into use
+	size_t page_from_free;
+	//! Number of new pages initialized from spans
+	size_t page_initialized;
+	//! Number of pages transitioned to full state
+	size_t page_to_full;
+	//! Number of spans mapped to initialize a new page
+	size_t span_map;
+} heap_size_class_statistics_t;
+
+//! Per page type statistics for a heap, only modified by the owning thread
+typedef struct heap_page_type_statistics_t {
+	//! Current number of pages in use
+	size_t page_current;
+	//! Peak number of pages in use
+	size_t page_peak;
+	//! Number of pages donated to the global pool
+	size_t page_to_pool;
+	//! Number of pages adopted from the global pool
+	size_t page_from_pool;
+	//! Number of pages transitioned to free state
+	size_t page_to_free;
+	//! Number of free pages taken into use
+	size_t page_from_free;
+	//! Number of pages decommitted
+	size_t page_decommit;
+	//! Number of pages recommitted
+	size_t page_commit;
+	//! Number of spans mapped
+	size_t span_map;
+} heap_page_type_statistics_t;
+
+typedef struct heap_statistics_t {
+	heap_size_class_statistics_t size_class[SIZE_CLASS_COUNT];
+	heap_page_type_statistics_t page_type[3];
+} heap_statistics_t;
+
+#define heap_stat_inc(heap, counter) ++(heap)->statistics.counter
+#define heap_stat_add(heap, counter, value) (heap)->statistics.counter += (value)
+#define heap_stat_inc_alloc(heap, class_idx)                                                        \
+	do {                                                                                            \
+		heap_size_class_statistics_t* class_stat = (heap)->statistics.size_class + (class_idx);     \
+		++class_stat->alloc_total;                                                                  \
+		if (++class_stat->alloc_current > class_stat->alloc_peak)                                   \
+			class_stat->alloc_peak = class_stat->alloc_current;                                     \
+	} while (0)
+#define heap_stat_add_free(heap, class_idx, count)                                                  \
+	do {                                                                                            \
+		heap_size_class_statistics_t* class_stat = (heap)->statistics.size_class + (class_idx);     \
+		class_stat->free_total += (count);                                                          \
+		class_stat->alloc_current -= (count);                                                       \
+	} while (0)
+#define heap_stat_inc_page(heap, type_idx)                                                          \
+	do {                                                                                            \
+		heap_page_type_statistics_t* type_stat = (heap)->statistics.page_type + (type_idx);         \
+		if (++type_stat->page_current > type_stat->page_peak)                                       \
+			type_stat->page_peak = type_stat->page_current;                                         \
+	} while (0)
+#define heap_stat_dec_page(heap, type_idx) --(heap)->statistics.page_type[type_idx].page_current
+
+static inline void
+rpmalloc_stat_add_with_peak(atomic_size_t* counter, atomic_size_t* peak, size_t value) {
+	size_t current = atomic_fetch_add_explicit(counter, value, memory_order_relaxed) + value;
+	size_t last_peak = atomic_load_explicit(peak, memory_order_relaxed);
+	while (current > last_peak) {
+		if (atomic_compare_exchange_weak_explicit(peak, &last_peak, current, memory_order_relaxed,
+		                                          memory_order_relaxed))
+			break;
+	}
+}
+
+#define rpmalloc_stat_add(counter, value) \
+	atomic_fetch_add_explicit(&global_statistics.counter, (value), memory_order_relaxed)
+#define rpmalloc_stat_sub(counter, value) \
+	atomic_fetch_sub_explicit(&global_statistics.counter, (value), memory_order_relaxed)
+#define rpmalloc_stat_add_peak(counter, value) \
+	rpmalloc_stat_add_with_peak(&global_statistics.counter, &global_statistics.counter##_peak, (value))
+
 #else
 
+#define heap_stat_inc(heap, counter) \
+	do {                             \
+	} while (0)
+#define heap_stat_add(heap, counter, value) \
+	do {                                    \
+		(void)sizeof(value);                \
+	} while (0)
+#define heap_stat_inc_alloc(heap, class_idx) \
+	do {                                     \
+	} while (0)
+#define heap_stat_add_free(heap, class_idx, count) \
+	do {                                           \
+	} while (0)
+#define heap_stat_inc_page(heap, type_idx) \
+	do {                                   \
+	} while (0)
+#define heap_stat_dec_page(heap, type_idx) \
+	do {                                   \
+	} while (0)
+#define rpmalloc_stat_add(counter, value) \
+	do {                                  \
+		(void)sizeof(value);              \
+	} while (0)
+#define rpmalloc_stat_sub(counter, value) \
+	do {                                  \
+	} while (0)
+#define rpmalloc_stat_add_peak(counter, value) \
+	do {                                       \
+	} while (0)
+
 #endif
 
 ////////////
@@ -267,6 +499,20 @@ rpmalloc_clz(uintptr_t x) {
 #endif
 }
 
+static inline uint32_t
+rpmalloc_ctz64(uint64_t x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+#if ARCH_64BIT
+	return (uint32_t)_tzcnt_u64(x);
+#else
+	uint32_t low = (uint32_t)x;
+	return low ? (uint32_t)_tzcnt_u32(low) : 32 + (uint32_t)_tzcnt_u32((uint32_t)(x >> 32));
+#endif
+#else
+	return (uint32_t)__builtin_ctzll(x);
+#endif
+}
+
 static inline void
 wait_spin(void) {
 #if defined(_MSC_VER)
@@ -347,6 +593,10 @@ typedef struct page_t page_t;
 typedef struct block_t block_t;
 //! Size class for a memory block
 typedef struct size_class_t size_class_t;
+//! Buffered chain of blocks freed to a page owned by another heap
+typedef struct remote_free_t remote_free_t;
+//! Sampled allocation
+typedef struct sample_t sample_t;
 
 //! Memory page type
 typedef enum page_type_t {
@@ -362,6 +612,8 @@ struct size_class_t {
 	uint32_t block_size;
 	//! Number of blocks in each chunk
 	uint32_t block_count;
+	//! Offset from the start of the page to the first block, as a power of two
+	uint32_t block_offset_shift;
 };
 
 //! A memory block
@@ -370,6 +622,18 @@ struct block_t {
 	block_t* next;
 };
 
+//! Chain of blocks freed to a page owned by another heap, not yet published to the page
+struct remote_free_t {
+	//! Page owning the blocks
+	page_t* page;
+	//! First block in chain
+	block_t* first;
+	//! Last block in chain
+	block_t* last;
+	//! Number of blocks in chain
+	uint32_t count;
+};
+
 //! A page contains blocks of a given size
 struct page_t {
 	//! Size class of blocks
@@ -394,8 +658,14 @@ struct page_t {
 	uint32_t is_decommitted : 1;
 	//! Flag set if containing aligned blocks
 	uint32_t has_aligned_block : 1;
-	//! Fast combination flag for either huge, fully allocated or has aligned blocks
+	//! Flag set if containing sampled blocks
+	uint32_t has_sampled_block : 1;
+	//! Fast combination flag for either huge, fully allocated, has aligned blocks or has sampled blocks
 	uint32_t generic_free : 1;
+	//! Number of committed chunks from the start of the page, zero if only the first memory page is committed
+	uint32_t commit_chunks : 16;
+	//! Offset from the start of the page to the first block, as a power of two
+	uint32_t block_offset_shift : 5;
 	//! Local free list count
 	uint32_t local_free_count;
 	//! Local free list
@@ -404,8 +674,12 @@ struct page_t {
 	heap_t* heap;
 	//! Next page in list
 	page_t* next;
-	//! Previous page in list
-	page_t* prev;
+	union {
+		//! Previous page in list of available pages
+		page_t* prev;
+		//! Timestamp in milliseconds when the page was freed, if decay based decommit is enabled
+		uint32_t free_time;
+	};
 	//! Multithreaded free list, block index is in low 32 bit, list count is high 32 bit
 	atomic_ullong thread_free;
 };
@@ -428,6 +702,14 @@ struct span_t {
 	page_type_t page_type;
 	//! Offset to start of mapped memory region
 	uint32_t offset;
+	// The span header is full on 64-bit platforms, the release time is only used by huge spans and the NUMA node
+	// only by spans of small, medium or large pages. The page type of a span never changes once mapped
+	union {
+		//! Timestamp in milliseconds when huge span was released to the huge span cache
+		uint32_t release_time;
+		//! Preferred NUMA node of the memory mapping of a span of small, medium or large pages
+		uint32_t numa_node;
+	};
 	//! Mapped size
 	uint64_t mapped_size;
 	//! Next span in list
@@ -436,39 +718,111 @@ struct span_t {
 
 // Control structure for a heap, either a thread heap or a first class heap if enabled
 struct heap_t {
-	//! Owning thread ID
-	uintptr_t owner_thread;
+	//! Owning thread ID, only stored by the owning thread (or while the heap is claimed) but read by any thread
+	atomic_uintptr_t owner_thread;
+#if ENABLE_PER_CPU_HEAPS
+	//! Thread currently holding a CPU heap, zero if not held
+	atomic_uintptr_t cpu_lock;
+	//! Number of nested acquisitions of a CPU heap by the holding thread
+	uint32_t cpu_lock_depth;
+#endif
 	//! Heap local free list for small size classes
 	block_t* local_free[SIZE_CLASS_COUNT];
+	//! Bitmask of size classes where the heap local free list only holds blocks not used since zero initialized
+	uint32_t local_free_zero[(SIZE_CLASS_COUNT + 31) / 32];
 	//! Available non-full pages for each size class
 	page_t* page_available[SIZE_CLASS_COUNT];
 	//! Free pages for each page type
 	page_t* page_free[3];
 	//! Free but still committed page count for each page tyoe
 	uint32_t page_free_commit_count[3];
+	//! Number of prewarmed pages for each page type, the number of free pages always kept committed
+	uint32_t page_free_prewarm_count[3];
 	//! Multithreaded free list
 	atomic_uintptr_t thread_free[3];
 	//! Available partially initialized spans for each page type
 	span_t* span_partial[3];
 	//! Spans in full use for each page type
 	span_t* span_used[4];
+	//! Buffered blocks freed to pages owned by other heaps
+	remote_free_t remote_free[REMOTE_FREE_SLOT_COUNT];
 	//! Next heap in queue
 	heap_t* next;
-	//! Previous heap in queue
-	heap_t* prev;
+	//! Queue state, non-zero while released to the queue of available heaps
+	atomic_uint queue_state;
+	//! Next heap in list of all heaps
+	heap_t* next_heap;
 	//! Heap ID
 	uint32_t id;
 	//! Finalization state flag
 	uint32_t finalize;
+	//! Flag set if first class heap
+	uint32_t is_first_class;
+	//! Flag set if shared first class heap, allocating through a heap for each calling thread
+	uint32_t is_shared;
+	//! Heaps of the threads using a shared first class heap, in a push only list
+	atomic_uintptr_t shared_list;
+	//! Next heap in list of heaps of the threads using a shared first class heap
+	heap_t* shared_next;
+	//! Shared first class heap owning this thread heap
+	heap_t* shared_parent;
+	//! Flag set while this thread heap of a shared first class heap is the current heap of the thread
+	uint32_t is_thread_current;
+	//! Flag set if the heap is no longer reused after the size classes changed
+	uint32_t is_abandoned;
+	//! Preferred NUMA node for memory mapped by the heap
+	uint32_t numa_node;
+	//! Timestamp in milliseconds of the next check for free pages to decommit by age
+	uint32_t decay_check_time;
 	//! Memory map region offset
 	uint32_t offset;
 	//! Memory map size
 	size_t mapped_size;
+#if ENABLE_SAMPLING
+	//! Number of bytes left to allocate before the next sampled allocation
+	size_t sample_countdown;
+	//! State of the random number generator for sample intervals
+	uint64_t sample_random;
+#endif
+#if ENABLE_STATISTICS
+	//! Heap statistics
+	heap_statistics_t statistics;
+#endif
 };
 
 _Static_assert(sizeof(page_t) <= PAGE_HEADER_SIZE, "Invalid page header size");
 _Static_assert(sizeof(span_t) <= SPAN_HEADER_SIZE, "Invalid span header size");
+_Static_assert((offsetof(span_t, release_time) == offsetof(span_t, numa_node)) &&
+                   (sizeof(((span_t*)0)->release_time) == sizeof(((span_t*)0)->numa_node)),
+               "Span release time must alias the NUMA node, see span_t");
+_Static_assert((MEDIUM_PAGE_SIZE - PAGE_BITMAP_HEADER_SIZE) / (SMALL_BLOCK_SIZE_LIMIT + SMALL_GRANULARITY) <=
+                   PAGE_BITMAP_WORD_COUNT * 64,
+               "Invalid page free bitmap size");
+#if !ENABLE_STATISTICS
 _Static_assert(sizeof(heap_t) <= 4096, "Invalid heap size");
+#endif
+#if RPMALLOC_INLINE_ABI
+_Static_assert(offsetof(heap_t, local_free) == offsetof(rpmalloc_inline_heap_t, local_free),
+               "Inline heap layout mismatch");
+_Static_assert(offsetof(page_t, block_size) == offsetof(rpmalloc_inline_page_t, block_size) &&
+                   offsetof(page_t, block_count) == offsetof(rpmalloc_inline_page_t, block_count) &&
+                   offsetof(page_t, block_used) == offsetof(rpmalloc_inline_page_t, block_used) &&
+                   offsetof(page_t, local_free_count) == offsetof(rpmalloc_inline_page_t, local_free_count) &&
+                   offsetof(page_t, local_free) == offsetof(rpmalloc_inline_page_t, local_free) &&
+                   offsetof(page_t, heap) == offsetof(rpmalloc_inline_page_t, heap),
+               "Inline page layout mismatch");
+_Static_assert(offsetof(block_t, next) == 0, "Inline block layout mismatch");
+_Static_assert((sizeof(page_t) == sizeof(rpmalloc_inline_page_t)) &&
+                   (offsetof(span_t, page_address_mask) == offsetof(rpmalloc_inline_span_t, page_address_mask)) &&
+                   (SPAN_SIZE == RPMALLOC_INLINE_SPAN_SIZE),
+               "Inline span layout mismatch");
+_Static_assert((SMALL_GRANULARITY == RPMALLOC_INLINE_GRANULARITY) &&
+                   (SMALL_GRANULARITY * 64 == RPMALLOC_INLINE_SIZE_LIMIT) &&
+                   (TINY_SIZE_CLASS_COUNT == RPMALLOC_INLINE_SIZE_CLASS_COUNT) &&
+                   (SMALL_PAGE_SIZE == RPMALLOC_INLINE_PAGE_SIZE) &&
+                   (RPMALLOC_INLINE_SIZE_LIMIT <= SMALL_BLOCK_SIZE_LIMIT),
+               "Inline size class mismatch");
+#endif
 
 ////////////
 ///
@@ -480,16 +834,31 @@ _Static_assert(sizeof(heap_t) <= 4096, "Invalid heap size");
 static RPMALLOC_CACHE_ALIGNED heap_t global_heap_fallback;
 //! Default heap
 static heap_t* global_heap_default = &global_heap_fallback;
-//! Available heaps
-static heap_t* global_heap_queue;
-//! In use heaps
-static heap_t* global_heap_used;
-//! Lock for heap queue
-static atomic_uintptr_t global_heap_lock;
+//! Available heaps for each NUMA node, tagged list head
+static atomic_uintptr_t global_heap_queue[NUMA_NODE_MAX];
+//! All heaps, both in use and available, in a push only list
+static atomic_uintptr_t global_heap_list;
+//! Flag set when a block is freed to a page of a released heap, cleared when the released heaps are collected
+static atomic_int global_heap_queue_freed;
 //! Heap ID counter
 static atomic_uint global_heap_id = 1;
+//! Free pages for each NUMA node and page type donated from released heaps, tagged list head
+static atomic_uintptr_t global_page_pool[NUMA_NODE_MAX][3];
+//! Partially initialized spans for each NUMA node and page type donated from released heaps, tagged list head
+static atomic_uintptr_t global_span_pool[NUMA_NODE_MAX][3];
+//! Number of NUMA nodes in use, 1 if NUMA awareness is not enabled
+static uint32_t global_numa_node_count = 1;
 //! Initialized flag
 static int global_rpmalloc_initialized;
+//! Number of bytes of memory committed by the allocator
+static atomic_size_t global_memory_committed;
+//! Flag set while memory is released due to the committed memory exceeding the soft limit
+static atomic_int global_memory_pressure;
+//! Timestamp of the last memory pressure release if it did not bring the committed memory below the low water mark,
+//  zero if not held off
+static atomic_uint global_memory_pressure_hold;
+//! Committed memory below which memory pressure releases held off are resumed
+static atomic_size_t global_memory_pressure_resume;
 //! Memory interface
 static rpmalloc_interface_t* global_memory_interface;
 //! Default memory interface
@@ -498,15 +867,35 @@ static rpmalloc_interface_t global_memory_interface_default;
 static rpmalloc_config_t global_config = {0};
 //! Main thread ID
 static uintptr_t global_main_thread_id;
+#if PLATFORM_POSIX
+//! Flag set in a forked child process until the purge thread of the parent is restarted
+static atomic_int global_purge_thread_restart;
+#endif
+#if ENABLE_PER_CPU_HEAPS
+//! Heaps for each CPU, lazily allocated
+static atomic_uintptr_t global_cpu_heap[CPU_HEAP_MAX];
+//! Number of CPU heaps
+static uint32_t global_cpu_heap_count;
+#endif
+#if ENABLE_HUGE_CACHE
+//! Cached huge spans for each size bucket, newest first
+static span_t* global_huge_cache[HUGE_CACHE_BUCKET_COUNT];
+//! Number of bytes in cached huge spans
+static atomic_size_t global_huge_cache_size;
+//! Lock for huge span cache
+static atomic_uint global_huge_cache_lock;
+#endif
 
 //! Size classes
 #define SCLASS(n) \
-	{ (n * SMALL_GRANULARITY), (SMALL_PAGE_SIZE - PAGE_HEADER_SIZE) / (n * SMALL_GRANULARITY) }
-#define MCLASS(n) \
-	{ (n * SMALL_GRANULARITY), (MEDIUM_PAGE_SIZE - PAGE_HEADER_SIZE) / (n * SMALL_GRANULARITY) }
-#define LCLASS(n) \
-	{ (n * SMALL_GRANULARITY), (LARGE_PAGE_SIZE - PAGE_HEADER_SIZE) / (n * SMALL_GRANULARITY) }
-static const size_class_t global_size_class[SIZE_CLASS_COUNT] = {
+	{ (n * SMALL_GRANULARITY), (SMALL_PAGE_SIZE - PAGE_HEADER_SIZE) / (n * SMALL_GRANULARITY), PAGE_HEADER_SIZE_SHIFT }
+#define MCLASS(n)                                                                                  \
+	{ (n * SMALL_GRANULARITY), (MEDIUM_PAGE_SIZE - PAGE_BITMAP_HEADER_SIZE) / (n * SMALL_GRANULARITY), \
+	  PAGE_BITMAP_HEADER_SIZE_SHIFT }
+#define LCLASS(n)                                                                                 \
+	{ (n * SMALL_GRANULARITY), (LARGE_PAGE_SIZE - PAGE_BITMAP_HEADER_SIZE) / (n * SMALL_GRANULARITY), \
+	  PAGE_BITMAP_HEADER_SIZE_SHIFT }
+static size_class_t global_size_class[SIZE_CLASS_COUNT] = {
     SCLASS(1),      SCLASS(1),      SCLASS(2),      SCLASS(3),      SCLASS(4),      SCLASS(5),      SCLASS(6),
     SCLASS(7),      SCLASS(8),      SCLASS(9),      SCLASS(10),     SCLASS(11),     SCLASS(12),     SCLASS(13),
     SCLASS(14),     SCLASS(15),     SCLASS(16),     SCLASS(17),     SCLASS(18),     SCLASS(19),     SCLASS(20),
@@ -525,6 +914,14 @@ static const size_class_t global_size_class[SIZE_CLASS_COUNT] = {
     LCLASS(81920),  LCLASS(98304),  LCLASS(114688), LCLASS(131072), LCLASS(163840), LCLASS(196608), LCLASS(229376),
     LCLASS(262144), LCLASS(327680), LCLASS(393216), LCLASS(458752), LCLASS(524288)};
 
+//! First size class of each lookup bucket for blocks larger than tiny blocks
+#define SCLASS_BUCKET(n) \
+	(65 + 4 * n), (65 + 4 * n), (66 + 4 * n), (66 + 4 * n), (67 + 4 * n), (67 + 4 * n), (68 + 4 * n), (68 + 4 * n)
+static uint8_t global_size_class_bucket[SIZE_CLASS_BUCKET_COUNT] = {
+    SCLASS_BUCKET(0), SCLASS_BUCKET(1), SCLASS_BUCKET(2),  SCLASS_BUCKET(3),  SCLASS_BUCKET(4),
+    SCLASS_BUCKET(5), SCLASS_BUCKET(6), SCLASS_BUCKET(7),  SCLASS_BUCKET(8),  SCLASS_BUCKET(9),
+    SCLASS_BUCKET(10), SCLASS_BUCKET(11), SCLASS_BUCKET(12)};
+
 //! Threshold number of pages for when free pages are decommitted
 static uint32_t global_page_free_overflow[4] = {16, 8, 2, 0};
 
@@ -533,10 +930,24 @@ static uint32_t global_page_free_retain[4] = {4, 2, 1, 0};
 
 //! OS huge page support
 static int os_huge_pages;
+//! Transparent huge page mode, mapped spans are advised as huge page candidates and decommits keep partially
+//  covered huge pages resident
+static int os_thp;
 //! OS memory map granularity
 static size_t os_map_granularity;
 //! OS memory page size
 static size_t os_page_size;
+#if PLATFORM_WINDOWS && defined(MEM_EXTENDED_PARAMETER_TYPE_BITS)
+typedef PVOID(WINAPI* virtual_alloc2_fn)(HANDLE, PVOID, SIZE_T, ULONG, ULONG, MEM_EXTENDED_PARAMETER*, ULONG);
+//! VirtualAlloc2 entry point if available (Windows 10 version 1803 and later)
+static virtual_alloc2_fn os_virtual_alloc2;
+#endif
+#if PLATFORM_POSIX
+//! Next unused address in the address space reserved on initialization
+static atomic_uintptr_t os_reserve_current;
+//! End of the address space reserved on initialization
+static uintptr_t os_reserve_end;
+#endif
 
 ////////////
 ///
@@ -558,13 +969,37 @@ static size_t os_page_size;
 #define TLS_MODEL __attribute__((tls_model("initial-exec")))
 //#define TLS_MODEL
 #endif
+#if RPMALLOC_INLINE_ABI
+// Exported under a public name, the local free lists and page headers are accessed by the inline fast path
+#define global_thread_heap rpmalloc_thread_heap
+extern RPMALLOC_EXPORT _Thread_local heap_t* global_thread_heap TLS_MODEL;
+_Thread_local heap_t* global_thread_heap TLS_MODEL = &global_heap_fallback;
+#else
 static _Thread_local heap_t* global_thread_heap TLS_MODEL = &global_heap_fallback;
+#endif
+#if RPMALLOC_FIRST_CLASS_HEAPS
+//! Heap of the current thread for the last used shared first class heap
+static _Thread_local heap_t* global_thread_shared_heap TLS_MODEL;
+#endif
+#if ENABLE_PER_CPU_HEAPS
+//! Flag if the calling thread is initialized, CPU heaps are not tied to threads and only held during a call
+static _Thread_local int global_thread_initialized TLS_MODEL;
+#endif
 
 static heap_t*
 heap_allocate(int first_class);
 
+static size_t
+heap_page_free_decommit(heap_t* heap, uint32_t page_type, uint32_t page_retain_count, size_t byte_limit);
+
+static size_t
+heap_page_free_decay(heap_t* heap, uint32_t timestamp, uint32_t decay_time);
+
+static void
+heap_collect_thread_free(heap_t* heap);
+
 static void
-heap_page_free_decommit(heap_t* heap, uint32_t page_type, uint32_t page_retain_count);
+heap_donate_to_pool(heap_t* heap);
 
 //! Fast thread ID
 static inline uintptr_t
@@ -605,13 +1040,25 @@ get_thread_id(void) {
 	*/
 }
 
+//! Get the owning thread ID of the heap, a relaxed load as only the owner itself acts on a match
+static inline uintptr_t
+heap_owner_thread(const heap_t* heap) {
+	return atomic_load_explicit(&heap->owner_thread, memory_order_relaxed);
+}
+
+//! Set the owning thread ID of the heap
+static inline void
+heap_set_owner_thread(heap_t* heap, uintptr_t thread_id) {
+	atomic_store_explicit(&heap->owner_thread, thread_id, memory_order_relaxed);
+}
+
 //! Set the current thread heap
 static void
 set_thread_heap(heap_t* heap) {
 	global_thread_heap = heap;
 	if (heap && (heap->id != 0)) {
 		rpmalloc_assert(heap->id != 0, "Default heap being used");
-		heap->owner_thread = get_thread_id();
+		heap_set_owner_thread(heap, get_thread_id());
 	}
 #if PLATFORM_WINDOWS
 	FlsSetValue(fls_key, heap);
@@ -657,10 +1104,16 @@ get_size_class(size_t size) {
 #else
 	const uint32_t most_significant_bit = (uint32_t)(31 - (int)rpmalloc_clz(minblock_count));
 #endif
-	// Class sizes are of the bit format [..]000xxx000[..] where we already have the position of the most significant
-	// bit, now calculate the subclass from the remaining two bits
-	const uint32_t subclass_bits = (minblock_count >> (most_significant_bit - 2)) & 0x03;
-	const uint32_t class_idx = (uint32_t)((most_significant_bit << 2) + subclass_bits) + 41;
+	// The lookup bucket is given by the position of the most significant bit and the following three bits
+	const uint32_t subclass_bits = (minblock_count >> (most_significant_bit - 3)) & 0x07;
+	const uint32_t bucket = ((most_significant_bit - 6) << 3) + (uint32_t)subclass_bits;
+	if (bucket >= SIZE_CLASS_BUCKET_COUNT)
+		return SIZE_CLASS_COUNT;
+	// The bucket holds the first size class fitting the smallest size in the bucket, a configured size class
+	// table can have more than one size class in a bucket
+	uint32_t class_idx = global_size_class_bucket[bucket];
+	while ((class_idx < SIZE_CLASS_COUNT) && (global_size_class[class_idx].block_size < size))
+		++class_idx;
 	rpmalloc_assert((class_idx >= SIZE_CLASS_COUNT) || (global_size_class[class_idx].block_size >= size),
 	                "Size class misconfiguration");
 	rpmalloc_assert((class_idx >= SIZE_CLASS_COUNT) || (global_size_class[class_idx - 1].block_size < size),
@@ -668,6 +1121,23 @@ get_size_class(size_t size) {
 	return class_idx;
 }
 
+//! Get the first size class where all blocks are aligned to the given alignment and the block size fits the
+//  given size, without exceeding the size plus the alignment. Returns SIZE_CLASS_COUNT if there is no such class
+static inline uint32_t
+get_size_class_aligned(size_t size, size_t alignment) {
+	// The block size of an aligned size class is a multiple of the alignment
+	size_t limit = size + alignment;
+	if (size < alignment)
+		size = alignment;
+	uint32_t class_idx = (size <= (SMALL_GRANULARITY * 64)) ? get_size_class_tiny(size) : get_size_class(size);
+	for (; (class_idx < SIZE_CLASS_COUNT) && (global_size_class[class_idx].block_size <= limit); ++class_idx) {
+		size_t block_offset = (size_t)1 << global_size_class[class_idx].block_offset_shift;
+		if (!((global_size_class[class_idx].block_size | block_offset) & (alignment - 1)))
+			return class_idx;
+	}
+	return SIZE_CLASS_COUNT;
+}
+
 static inline page_type_t
 get_page_type(uint32_t size_class) {
 	if (size_class < SMALL_SIZE_CLASS_COUNT)
@@ -679,6 +1149,16 @@ get_page_type(uint32_t size_class) {
 	return PAGE_HUGE;
 }
 
+//! Get the size of pages of the given page type, excluding huge pages
+static inline size_t
+get_page_type_size(page_type_t page_type) {
+	if (page_type == PAGE_SMALL)
+		return SMALL_PAGE_SIZE;
+	else if (page_type == PAGE_MEDIUM)
+		return MEDIUM_PAGE_SIZE;
+	return LARGE_PAGE_SIZE;
+}
+
 static inline size_t
 get_page_aligned_size(size_t size) {
 	size_t unalign = size % global_config.page_size;
@@ -708,8 +1188,217 @@ os_set_page_name(void* address, size_t size) {
 #endif
 }
 
+//! Get a coarse monotonic timestamp in milliseconds, wrapping around
+static uint32_t
+os_time_ms(void) {
+#if PLATFORM_WINDOWS
+	return (uint32_t)GetTickCount64();
+#else
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL));
+#endif
+}
+
+//! Get a monotonic timestamp in nanoseconds
+static uint64_t
+os_time_ns(void) {
+#if PLATFORM_WINDOWS
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)(((double)counter.QuadPart * 1000000000.0) / (double)frequency.QuadPart);
+#else
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+//! Get the number of NUMA nodes in the system, 1 if not supported
+static uint32_t
+os_numa_node_count(void) {
+	uint32_t node_count = 1;
+#if PLATFORM_WINDOWS
+	ULONG highest_node = 0;
+	if (GetNumaHighestNodeNumber(&highest_node))
+		node_count = (uint32_t)highest_node + 1;
+#elif defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+	// Read with plain system calls into a stack buffer, stdio allocates and would recurse into the allocator
+	// during initialization if malloc is overridden
+	int node_file = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+	if (node_file >= 0) {
+		// List of node ranges like "0-3" or "0,2-3", the highest node is the last number
+		char line[128];
+		ssize_t line_size = read(node_file, line, sizeof(line) - 1);
+		close(node_file);
+		if (line_size > 0) {
+			line[line_size] = 0;
+			uint32_t node = 0;
+			for (const char* digit = line; *digit; ++digit) {
+				if ((*digit >= '0') && (*digit <= '9')) {
+					node = (node * 10) + (uint32_t)(*digit - '0');
+				} else {
+					if (node >= node_count)
+						node_count = node + 1;
+					node = 0;
+				}
+			}
+		}
+	}
+#endif
+	return (node_count < NUMA_NODE_MAX) ? node_count : NUMA_NODE_MAX;
+}
+
+//! Get the NUMA node of the processor executing the calling thread
+static uint32_t
+os_numa_current_node(void) {
+	uint32_t node = 0;
+#if PLATFORM_WINDOWS
+	PROCESSOR_NUMBER processor;
+	USHORT processor_node = 0;
+	GetCurrentProcessorNumberEx(&processor);
+	if (GetNumaProcessorNodeEx(&processor, &processor_node))
+		node = processor_node;
+#elif defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+	unsigned int cpu = 0;
+	unsigned int cpu_node = 0;
+	if (syscall(SYS_getcpu, &cpu, &cpu_node, 0) == 0)
+		node = cpu_node;
+#endif
+	return (node < global_numa_node_count) ? node : 0;
+}
+
+#if ENABLE_PER_CPU_HEAPS
+
+//! Get the index of the CPU executing the calling thread, read from the restartable sequence area registered by
+//  the C library if available
+static inline uint32_t
+os_current_cpu(void) {
+#if PLATFORM_HAS_RSEQ
+	if (EXPECTED(__rseq_size != 0)) {
+		const volatile struct rseq* rseq_area = pointer_offset(__builtin_thread_pointer(), __rseq_offset);
+		int32_t cpu_id = (int32_t)rseq_area->cpu_id;
+		if (EXPECTED(cpu_id >= 0))
+			return (uint32_t)cpu_id;
+	}
+#endif
+	unsigned int cpu = 0;
+	(void)syscall(SYS_getcpu, &cpu, 0, 0);
+	return cpu;
+}
+
+#endif
+
+//! Set the preferred NUMA node for the physical pages backing the given address range
+static void
+os_numa_bind(void* address, size_t size, uint32_t node) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+	// Use preferred rather than strict binding to fall back to other nodes when the node is out of memory
+	unsigned long node_mask[NUMA_NODE_MAX / (8 * sizeof(unsigned long))] = {0};
+	node_mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+	(void)syscall(SYS_mbind, address, size, MPOL_PREFERRED, node_mask, (unsigned long)NUMA_NODE_MAX + 1, 0);
+#else
+	(void)sizeof(address);
+	(void)sizeof(size);
+	(void)sizeof(node);
+#endif
+}
+
+//! Update mapping statistics for a newly mapped region
+static void
+os_mmap_statistics(size_t map_size) {
+#if ENABLE_STATISTICS
+	rpmalloc_stat_add(mapped_total, map_size);
+	size_t page_count = map_size / global_config.page_size;
+	size_t page_mapped_current =
+	    atomic_fetch_add_explicit(&global_statistics.page_mapped, page_count, memory_order_relaxed) + page_count;
+	size_t page_mapped_peak = atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed);
+	while (page_mapped_current > page_mapped_peak) {
+		if (atomic_compare_exchange_weak_explicit(&global_statistics.page_mapped_peak, &page_mapped_peak,
+		                                          page_mapped_current, memory_order_relaxed, memory_order_relaxed))
+			break;
+	}
+#if ENABLE_DECOMMIT
+	size_t page_active_current =
+	    atomic_fetch_add_explicit(&global_statistics.page_active, page_count, memory_order_relaxed) + page_count;
+	size_t page_active_peak = atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed);
+	while (page_active_current > page_active_peak) {
+		if (atomic_compare_exchange_weak_explicit(&global_statistics.page_active_peak, &page_active_peak,
+		                                          page_active_current, memory_order_relaxed, memory_order_relaxed))
+			break;
+	}
+#endif
+#else
+	(void)sizeof(map_size);
+#endif
+}
+
+#if PLATFORM_POSIX
+
+//! Reserve the given number of bytes of span aligned address space to carve spans from. The reservation is
+//  mapped without reserving swap space, carved regions are returned without any system call
+static void
+os_reserve_initialize(size_t size) {
+	size = (size + (SPAN_SIZE - 1)) & SPAN_MASK;
+	size_t map_size = size + SPAN_SIZE;
+	void* ptr = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return;
+	os_set_page_name(ptr, map_size);
+	size_t padding = ((uintptr_t)ptr & (uintptr_t)(SPAN_SIZE - 1));
+	if (padding)
+		padding = SPAN_SIZE - padding;
+	if (padding)
+		munmap(ptr, padding);
+	if (SPAN_SIZE - padding)
+		munmap(pointer_offset(ptr, padding + size), SPAN_SIZE - padding);
+	ptr = pointer_offset(ptr, padding);
+	os_reserve_end = (uintptr_t)ptr + size;
+	atomic_store_explicit(&os_reserve_current, (uintptr_t)ptr, memory_order_release);
+}
+
+//! Release the unused part of the reserved address space
+static void
+os_reserve_finalize(void) {
+	uintptr_t current = atomic_exchange_explicit(&os_reserve_current, 0, memory_order_acquire);
+	if (current && (current < os_reserve_end))
+		munmap((void*)current, os_reserve_end - current);
+	os_reserve_end = 0;
+}
+
+//! Carve a region from the reserved address space, returns null if there is no reservation or it is exhausted
+static void*
+os_reserve_carve(size_t size) {
+	uintptr_t current = atomic_load_explicit(&os_reserve_current, memory_order_relaxed);
+	do {
+		if (!current || (size > (os_reserve_end - current)))
+			return 0;
+	} while (!atomic_compare_exchange_weak_explicit(&os_reserve_current, &current, current + size,
+	                                                memory_order_relaxed, memory_order_relaxed));
+	return (void*)current;
+}
+
+//! Size of a transparent huge page
+#define THP_SIZE (2 * 1024 * 1024)
+
+//! Advise the kernel to back the mapped range with transparent huge pages
+static void
+os_thp_advise(void* address, size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	// Transparent huge pages might be disabled system wide, the range is then backed by normal pages
+	(void)madvise(address, size, MADV_HUGEPAGE);
+#else
+	(void)sizeof(address);
+	(void)sizeof(size);
+#endif
+}
+
+#endif
+
+//! Map memory pages, preferring physical pages from the given NUMA node unless the node is negative
 static void*
-os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+os_mmap_node(size_t size, size_t alignment, size_t* offset, size_t* mapped_size, int numa_node) {
 	size_t map_size = size + alignment;
 #if PLATFORM_WINDOWS
 	// Ok to MEM_COMMIT - according to MSDN, "actual physical pages are not allocated unless/until the virtual addresses
@@ -720,9 +1409,47 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 #else
 	DWORD do_commit = MEM_COMMIT;
 #endif
-	void* ptr =
-	    VirtualAlloc(0, map_size, (os_huge_pages ? MEM_LARGE_PAGES : 0) | MEM_RESERVE | do_commit, PAGE_READWRITE);
+	DWORD alloc_type = (os_huge_pages ? MEM_LARGE_PAGES : 0) | MEM_RESERVE | do_commit;
+	void* ptr = 0;
+#if defined(MEM_EXTENDED_PARAMETER_TYPE_BITS)
+	if (alignment && os_virtual_alloc2) {
+		// Let the OS place the reservation at the requested alignment, no padding needed
+		MEM_ADDRESS_REQUIREMENTS requirements;
+		memset(&requirements, 0, sizeof(requirements));
+		requirements.Alignment = alignment;
+		MEM_EXTENDED_PARAMETER parameter[2];
+		memset(parameter, 0, sizeof(parameter));
+		parameter[0].Type = MemExtendedParameterAddressRequirements;
+		parameter[0].Pointer = &requirements;
+		ULONG parameter_count = 1;
+		if (numa_node >= 0) {
+			parameter[1].Type = MemExtendedParameterNumaNode;
+			parameter[1].ULong = (DWORD)numa_node;
+			++parameter_count;
+		}
+		ptr = os_virtual_alloc2(GetCurrentProcess(), 0, size, alloc_type, PAGE_READWRITE, parameter, parameter_count);
+		if (ptr)
+			map_size = size;
+	}
+	if (!ptr)
+#endif
+		ptr = (numa_node >= 0) ? VirtualAllocExNuma(GetCurrentProcess(), 0, map_size, alloc_type, PAGE_READWRITE,
+		                                            (DWORD)numa_node) :
+		                         VirtualAlloc(0, map_size, alloc_type, PAGE_READWRITE);
 #else
+	if (alignment && !(size & (alignment - 1))) {
+		void* reserved = os_reserve_carve(size);
+		if (reserved) {
+			if (numa_node >= 0)
+				os_numa_bind(reserved, size, (uint32_t)numa_node);
+			if (os_thp)
+				os_thp_advise(reserved, size);
+			*offset = 0;
+			*mapped_size = size;
+			os_mmap_statistics(size);
+			return reserved;
+		}
+	}
 	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_UNINITIALIZED;
 #if defined(__APPLE__) && !TARGET_OS_IPHONE && !TARGET_OS_SIMULATOR
 	int fd = (int)VM_MAKE_TAG(240U);
@@ -756,11 +1483,15 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 #endif
 	if (ptr == MAP_FAILED)
 		ptr = 0;
+	if (ptr && (numa_node >= 0))
+		os_numa_bind(ptr, map_size, (uint32_t)numa_node);
+	if (ptr && os_thp)
+		os_thp_advise(ptr, map_size);
 #endif
 	if (!ptr) {
 		if (global_memory_interface->map_fail_callback) {
 			if (global_memory_interface->map_fail_callback(map_size))
-				return os_mmap(size, alignment, offset, mapped_size);
+				return os_mmap_node(size, alignment, offset, mapped_size, numa_node);
 		} else {
 			rpmalloc_assert(ptr != 0, "Failed to map more virtual memory");
 		}
@@ -773,33 +1504,30 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 		rpmalloc_assert(padding <= alignment, "Internal failure in padding");
 		rpmalloc_assert(!(padding % 8), "Internal failure in padding");
 		ptr = pointer_offset(ptr, padding);
+#if PLATFORM_POSIX
+		// Release the leading and trailing padding, keeping only the aligned region mapped
+		size_t trailing = map_size - (padding + size);
+		if (!(padding % os_map_granularity) && !(trailing % os_map_granularity)) {
+			if (padding)
+				munmap(pointer_offset(ptr, -(int32_t)padding), padding);
+			if (trailing)
+				munmap(pointer_offset(ptr, size), trailing);
+			map_size = size;
+			padding = 0;
+		}
+#endif
 		*offset = padding;
 	}
 	*mapped_size = map_size;
-#if ENABLE_STATISTICS
-	size_t page_count = map_size / global_config.page_size;
-	size_t page_mapped_current =
-	    atomic_fetch_add_explicit(&global_statistics.page_mapped, page_count, memory_order_relaxed) + page_count;
-	size_t page_mapped_peak = atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed);
-	while (page_mapped_current > page_mapped_peak) {
-		if (atomic_compare_exchange_weak_explicit(&global_statistics.page_mapped_peak, &page_mapped_peak,
-		                                          page_mapped_current, memory_order_relaxed, memory_order_relaxed))
-			break;
-	}
-#if ENABLE_DECOMMIT
-	size_t page_active_current =
-	    atomic_fetch_add_explicit(&global_statistics.page_active, page_count, memory_order_relaxed) + page_count;
-	size_t page_active_peak = atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed);
-	while (page_active_current > page_active_peak) {
-		if (atomic_compare_exchange_weak_explicit(&global_statistics.page_active_peak, &page_active_peak,
-		                                          page_active_current, memory_order_relaxed, memory_order_relaxed))
-			break;
-	}
-#endif
-#endif
+	os_mmap_statistics(map_size);
 	return ptr;
 }
 
+static void*
+os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	return os_mmap_node(size, alignment, offset, mapped_size, -1);
+}
+
 static void
 os_mcommit(void* address, size_t size) {
 #if ENABLE_DECOMMIT
@@ -833,6 +1561,29 @@ os_mcommit(void* address, size_t size) {
 	(void)sizeof(size);
 }
 
+//! Flag set if memory decommitted by the OS reads back as zero when committed again
+#if PLATFORM_WINDOWS || (defined(MADV_DONTNEED) && !defined(__APPLE__))
+#define DECOMMIT_IS_ZERO 1
+#else
+#define DECOMMIT_IS_ZERO 0
+#endif
+
+#if PLATFORM_POSIX && defined(MADV_DONTNEED)
+//! Shrink a range to decommit to the transparent huge pages it fully covers. Releasing part of a huge page
+//  splits it into normal pages, so partially covered huge pages are kept resident. Returns the size of the
+//  range to release, which is zero if the range does not cover any full huge page
+static size_t
+os_thp_decommit_range(void** address, size_t size) {
+	uintptr_t start = (uintptr_t)*address;
+	uintptr_t thp_start = (start + (THP_SIZE - 1)) & ~(uintptr_t)(THP_SIZE - 1);
+	uintptr_t thp_end = (start + size) & ~(uintptr_t)(THP_SIZE - 1);
+	if (thp_start >= thp_end)
+		return 0;
+	*address = (void*)thp_start;
+	return thp_end - thp_start;
+}
+#endif
+
 static void
 os_mdecommit(void* address, size_t size) {
 #if ENABLE_DECOMMIT
@@ -849,7 +1600,9 @@ os_mdecommit(void* address, size_t size) {
 		}
 		*/
 #if defined(MADV_DONTNEED)
-	if (madvise(address, size, MADV_DONTNEED)) {
+	void* release = address;
+	size_t release_size = os_thp ? os_thp_decommit_range(&release, size) : size;
+	if (release_size && madvise(release, release_size, MADV_DONTNEED)) {
 #elif defined(MADV_FREE_REUSABLE)
 	int ret;
 	while ((ret = madvise(address, size, MADV_FREE_REUSABLE)) == -1 && (errno == EAGAIN))
@@ -879,6 +1632,37 @@ os_mdecommit(void* address, size_t size) {
 #endif
 }
 
+//! Fault in the physical pages of a committed range ahead of use, optionally locking them in memory
+static void
+os_mprefault(void* address, size_t size, int lock) {
+#if PLATFORM_WINDOWS
+	if (lock)
+		(void)VirtualLock(address, size);
+#else
+	// Locking the range also faults in the pages, if it fails with the lock limit the pages are just faulted in
+	if (lock && !mlock(address, size))
+		return;
+#if defined(MADV_POPULATE_WRITE)
+	if (!madvise(address, size, MADV_POPULATE_WRITE))
+		return;
+#endif
+#endif
+	// Write to each memory page without modifying the content
+	volatile char* page = address;
+	for (size_t offset = 0; offset < size; offset += os_page_size)
+		page[offset] = page[offset];
+}
+
+//! Unlock a range of memory locked by os_mprefault, pages in the range that are not locked are left as is
+static void
+os_munlock(void* address, size_t size) {
+#if PLATFORM_WINDOWS
+	(void)VirtualUnlock(address, size);
+#else
+	(void)munlock(address, size);
+#endif
+}
+
 static void
 os_munmap(void* address, size_t offset, size_t mapped_size) {
 	(void)sizeof(mapped_size);
@@ -893,6 +1677,7 @@ os_munmap(void* address, size_t offset, size_t mapped_size) {
 		rpmalloc_assert(0, "Failed to unmap virtual memory block");
 #endif
 #if ENABLE_STATISTICS
+	rpmalloc_stat_add(unmapped_total, mapped_size);
 	size_t page_count = mapped_size / global_config.page_size;
 	atomic_fetch_sub_explicit(&global_statistics.page_mapped, page_count, memory_order_relaxed);
 	atomic_fetch_sub_explicit(&global_statistics.page_active, page_count, memory_order_relaxed);
@@ -900,46 +1685,212 @@ os_munmap(void* address, size_t offset, size_t mapped_size) {
 #endif
 }
 
-////////////
-///
-/// Page interface
-///
-//////
-
-static inline span_t*
-page_get_span(page_t* page) {
-	return (span_t*)((uintptr_t)page & SPAN_MASK);
-}
-
-static inline size_t
-page_get_size(page_t* page) {
-	if (page->page_type == PAGE_SMALL)
-		return SMALL_PAGE_SIZE;
-	else if (page->page_type == PAGE_MEDIUM)
-		return MEDIUM_PAGE_SIZE;
-	else if (page->page_type == PAGE_LARGE)
-		return LARGE_PAGE_SIZE;
-	else
-		return page_get_span(page)->page_size;
+//! Update mapping statistics for a region that was resized by remapping
+static void
+os_mremap_statistics(size_t mapped_size, size_t unmapped_size) {
+#if ENABLE_STATISTICS
+	rpmalloc_stat_add(mapped_total, mapped_size);
+	rpmalloc_stat_add(unmapped_total, unmapped_size);
+	size_t mapped_count = mapped_size / global_config.page_size;
+	size_t unmapped_count = unmapped_size / global_config.page_size;
+	rpmalloc_stat_add_peak(page_mapped, mapped_count);
+	rpmalloc_stat_sub(page_mapped, unmapped_count);
+#if ENABLE_DECOMMIT
+	rpmalloc_stat_add_peak(page_active, mapped_count);
+#endif
+	rpmalloc_stat_sub(page_active, unmapped_count);
+#else
+	(void)sizeof(mapped_size);
+	(void)sizeof(unmapped_size);
+#endif
+}
+
+static void*
+os_mremap(void* address, size_t size, size_t new_size, size_t* offset, size_t* mapped_size, unsigned int flags) {
+	size_t map_offset = *offset;
+	size_t map_size = *mapped_size;
+	size_t avail_size = map_size - map_offset;
+	// The mapping is over-allocated to fulfill the alignment, use the trailing padding first
+	if (new_size <= avail_size) {
+		if (new_size > size)
+			os_mcommit(pointer_offset(address, size), new_size - size);
+		else if (new_size < size)
+			os_mdecommit(pointer_offset(address, new_size), size - new_size);
+		return address;
+	}
+#if PLATFORM_POSIX && defined(__linux__) && defined(MREMAP_MAYMOVE) && defined(MREMAP_FIXED)
+	// Try extending the aligned part of the mapping in place
+	void* ptr = mremap(address, avail_size, new_size, 0);
+	if (ptr != MAP_FAILED) {
+		*mapped_size = map_offset + new_size;
+		os_mremap_statistics(new_size - avail_size, 0);
+		return address;
+	}
+	if (!!(flags & RPMALLOC_GROW_OR_FAIL) || os_huge_pages)
+		return 0;
+	// Reserve a new region large enough to guarantee span alignment and move the pages into the aligned
+	// position, the kernel moves the page table entries without copying the memory content
+	size_t reserve_size = new_size + SPAN_SIZE;
+	void* reserve = mmap(0, reserve_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserve == MAP_FAILED)
+		return 0;
+	os_set_page_name(reserve, reserve_size);
+	size_t padding = ((uintptr_t)reserve & (uintptr_t)(SPAN_SIZE - 1));
+	if (padding)
+		padding = SPAN_SIZE - padding;
+	void* target = pointer_offset(reserve, padding);
+	ptr = mremap(address, avail_size, new_size, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+	if (ptr == MAP_FAILED) {
+		munmap(reserve, reserve_size);
+		return 0;
+	}
+	// Release the old alignment padding and the unused parts of the reservation, keeping the
+	// moved pages as the tail of a single mapping to allow further remapping
+	if (map_offset)
+		munmap(pointer_offset(address, -(int32_t)map_offset), map_offset);
+	if (padding)
+		munmap(reserve, padding);
+	if (reserve_size > padding + new_size)
+		munmap(pointer_offset(target, new_size), reserve_size - (padding + new_size));
+	*offset = 0;
+	*mapped_size = new_size;
+	os_mremap_statistics(new_size, map_size);
+	return target;
+#elif PLATFORM_POSIX
+	// Try mapping the adjacent address range to extend the mapping in place
+	if (os_huge_pages)
+		return 0;
+	size_t extend_size = new_size - avail_size;
+	void* map_end = pointer_offset(address, avail_size);
+	void* ptr = mmap(map_end, extend_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return 0;
+	if (ptr != map_end) {
+		munmap(ptr, extend_size);
+		return 0;
+	}
+	*mapped_size = map_size + extend_size;
+	os_mremap_statistics(extend_size, 0);
+	(void)sizeof(flags);
+	return address;
+#else
+	// Windows reservations cannot be extended and must be released as a whole
+	(void)sizeof(flags);
+	return 0;
+#endif
+}
+
+//! Map memory pages for a heap with the given preferred NUMA node
+static void*
+numa_memory_map(uint32_t numa_node, size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	if (global_config.enable_numa && (global_memory_interface->memory_map == os_mmap))
+		return os_mmap_node(size, alignment, offset, mapped_size, (int)numa_node);
+	return global_memory_interface->memory_map(size, alignment, offset, mapped_size);
+}
+
+//! Track memory committed by the allocator, at span and page commit granularity
+static inline void
+memory_committed_add(size_t size) {
+	atomic_fetch_add_explicit(&global_memory_committed, size, memory_order_relaxed);
+}
+
+//! Get the committed memory low water mark a memory pressure release must get below to not hold off releases
+static inline size_t
+memory_pressure_low_water(void) {
+	return global_config.soft_limit - (global_config.soft_limit >> MEMORY_PRESSURE_LOW_WATER_SHIFT);
+}
+
+static inline void
+memory_committed_sub(size_t size) {
+	size_t committed = atomic_fetch_sub_explicit(&global_memory_committed, size, memory_order_relaxed) - size;
+	if (UNEXPECTED(atomic_load_explicit(&global_memory_pressure_hold, memory_order_relaxed) != 0) &&
+	    (committed < atomic_load_explicit(&global_memory_pressure_resume, memory_order_relaxed)))
+		atomic_store_explicit(&global_memory_pressure_hold, 0, memory_order_relaxed);
+}
+
+//! Commit a range of memory pages and track the committed size. Without decommit support, memory is
+//  committed and tracked when mapped
+static inline void
+memory_commit(void* address, size_t size) {
+	global_memory_interface->memory_commit(address, size);
+#if ENABLE_DECOMMIT
+	memory_committed_add(size);
+#endif
+}
+
+//! Decommit a range of memory pages and track the committed size
+static inline void
+memory_decommit(void* address, size_t size) {
+	global_memory_interface->memory_decommit(address, size);
+#if ENABLE_DECOMMIT
+	memory_committed_sub(size);
+#endif
+}
+
+static void
+memory_pressure_release(heap_t* heap, size_t size);
+
+//! Check if committing the given number of bytes would exceed the soft limit, and if so release memory
+static inline void
+memory_pressure_check(heap_t* heap, size_t size) {
+	size_t soft_limit = global_config.soft_limit;
+	if (UNEXPECTED(soft_limit != 0) &&
+	    (atomic_load_explicit(&global_memory_committed, memory_order_relaxed) + size > soft_limit))
+		memory_pressure_release(heap, size);
+}
+
+////////////
+///
+/// Page interface
+///
+//////
+
+static inline span_t*
+page_get_span(page_t* page) {
+	return (span_t*)((uintptr_t)page & SPAN_MASK);
+}
+
+static inline size_t
+page_get_size(page_t* page) {
+	if (page->page_type == PAGE_SMALL)
+		return SMALL_PAGE_SIZE;
+	else if (page->page_type == PAGE_MEDIUM)
+		return MEDIUM_PAGE_SIZE;
+	else if (page->page_type == PAGE_LARGE)
+		return LARGE_PAGE_SIZE;
+	else
+		return page_get_span(page)->page_size;
 }
 
 static inline int
 page_is_thread_heap(page_t* page) {
 #if RPMALLOC_FIRST_CLASS_HEAPS
-	return (!page->heap->owner_thread || (page->heap->owner_thread == get_thread_id()));
+	uintptr_t owner_thread = heap_owner_thread(page->heap);
+	return (!owner_thread || (owner_thread == get_thread_id()));
+#else
+	return (heap_owner_thread(page->heap) == get_thread_id());
+#endif
+}
+
+//! Check if the page contains sampled blocks, always false if sampling is not enabled
+static inline int
+page_has_sampled_block(page_t* page) {
+#if ENABLE_SAMPLING
+	return page->has_sampled_block;
 #else
-	return (page->heap->owner_thread == get_thread_id());
+	(void)sizeof(page);
+	return 0;
 #endif
 }
 
 static inline block_t*
 page_block_start(page_t* page) {
-	return pointer_offset(page, PAGE_HEADER_SIZE);
+	return pointer_offset(page, (size_t)1 << page->block_offset_shift);
 }
 
 static inline block_t*
 page_block(page_t* page, uint32_t block_index) {
-	return pointer_offset(page, PAGE_HEADER_SIZE + (page->block_size * block_index));
+	return pointer_offset(page, ((size_t)1 << page->block_offset_shift) + (page->block_size * block_index));
 }
 
 static inline uint32_t
@@ -969,45 +1920,183 @@ page_block_realign(page_t* page, block_t* block) {
 	return pointer_offset(block, -(int32_t)(block_offset % page->block_size));
 }
 
+//! Get the bitmap of free blocks of a medium or large page, where a set bit marks a free block. Small pages link
+//  the free blocks in the local free list instead, as their blocks are likely to be in cache when freed
+static inline uint64_t*
+page_free_bitmap(page_t* page) {
+	return pointer_offset(page, PAGE_HEADER_SIZE);
+}
+
+//! Mark the block as free in the page free bitmap without touching the block memory
+static inline void
+page_free_bitmap_set(page_t* page, block_t* block) {
+	uint32_t block_index = page_block_index(page, block);
+	uint64_t* bitmap = page_free_bitmap(page);
+	rpmalloc_assert(!(bitmap[block_index >> 6] & (1ULL << (block_index & 63))), "Block already free in page bitmap");
+	bitmap[block_index >> 6] |= (1ULL << (block_index & 63));
+}
+
+//! Take the lowest address free block from the page free bitmap
+static inline block_t*
+page_free_bitmap_get(page_t* page) {
+	uint64_t* bitmap = page_free_bitmap(page);
+	uint32_t iword = 0;
+	while (!bitmap[iword])
+		++iword;
+	rpmalloc_assert(iword < PAGE_BITMAP_WORD_COUNT, "Page free bitmap out of sync with free count");
+	uint32_t ibit = rpmalloc_ctz64(bitmap[iword]);
+	bitmap[iword] &= ~(1ULL << ibit);
+	return page_block(page, (iword << 6) + ibit);
+}
+
+//! Mark a list of the given number of blocks freed by other threads as free in the page free bitmap
+static void
+page_free_bitmap_set_list(page_t* page, block_t* block, uint32_t count) {
+	for (uint32_t iblock = 0; iblock < count; ++iblock) {
+		block_t* next_block = block->next;
+		page_free_bitmap_set(page, block);
+		block = next_block;
+	}
+}
+
 static block_t*
 page_get_local_free_block(page_t* page) {
-	block_t* block = page->local_free;
-	page->local_free = block->next;
+	block_t* block;
+	if (page->page_type == PAGE_SMALL) {
+		block = page->local_free;
+		page->local_free = block->next;
+	} else {
+		block = page_free_bitmap_get(page);
+	}
 	--page->local_free_count;
 	++page->block_used;
 	return block;
 }
 
+//! Put a block in the page local free, linking it in the free list of small pages or marking it in the free bitmap
+//  of medium and large pages
 static inline void
-page_decommit_memory_pages(page_t* page) {
-	if (page->is_decommitted)
+page_push_local_free_block(page_t* page, block_t* block) {
+	if (EXPECTED(page->page_type == PAGE_SMALL)) {
+		block->next = page->local_free;
+		page->local_free = block;
+	} else {
+		page_free_bitmap_set(page, block);
+	}
+	++page->local_free_count;
+}
+
+//! Get the size of the memory commit chunks in pages
+static inline size_t
+page_commit_chunk_size(void) {
+	return (global_config.page_size > PAGE_COMMIT_CHUNK_SIZE) ? global_config.page_size : PAGE_COMMIT_CHUNK_SIZE;
+}
+
+//! Get the number of committed bytes from the start of the page
+static inline size_t
+page_committed_size(page_t* page) {
+	if (!page->commit_chunks)
+		return global_config.page_size;
+	size_t committed_size = (size_t)page->commit_chunks * page_commit_chunk_size();
+	size_t page_size = page_get_size(page);
+	return (committed_size < page_size) ? committed_size : page_size;
+}
+
+//! Commit memory in chunks from the start of the page up to at least the given offset, used to
+//  only commit memory for the initialized blocks of medium and large pages
+static NOINLINE void
+page_commit_to_offset(page_t* page, size_t offset) {
+	size_t chunk_size = page_commit_chunk_size();
+	uint32_t chunk_count = (uint32_t)((offset + (chunk_size - 1)) / chunk_size);
+	if (chunk_count <= page->commit_chunks)
 		return;
-	void* extra_page = pointer_offset(page, global_config.page_size);
-	size_t extra_page_size = page_get_size(page) - global_config.page_size;
-	global_memory_interface->memory_decommit(extra_page, extra_page_size);
+	size_t commit_start = page_committed_size(page);
+	size_t commit_end = (size_t)chunk_count * chunk_size;
+	size_t page_size = page_get_size(page);
+	if (commit_end > page_size)
+		commit_end = page_size;
+	if (commit_end > commit_start) {
+		memory_pressure_check(page->heap, commit_end - commit_start);
+		memory_commit(pointer_offset(page, commit_start), commit_end - commit_start);
+	}
+	page->commit_chunks = (uint16_t)chunk_count;
+}
+
+//! Make sure the memory for the given number of initialized blocks in the page is committed
+static inline void
+page_commit_blocks(page_t* page, uint32_t block_initialized) {
+	size_t offset = ((size_t)1 << page->block_offset_shift) + ((size_t)block_initialized * (size_t)page->block_size);
+	if (UNEXPECTED(offset > page_committed_size(page)))
+		page_commit_to_offset(page, offset);
+}
+
+//! Get the number of bytes released by decommitting a free page, the committed chunks beyond the first memory page
+static inline size_t
+page_decommit_size(page_t* page) {
+	size_t committed_size = page_committed_size(page);
+	return (committed_size > global_config.page_size) ? committed_size - global_config.page_size : 0;
+}
+
+//! Decommit the memory of a free page, returns the number of bytes decommitted
+static inline size_t
+page_decommit_memory(page_t* page) {
+	// Only the committed chunks need to be decommitted, always keep the first memory page with the header
+	size_t decommit_size = page_decommit_size(page);
+	if (decommit_size)
+		memory_decommit(pointer_offset(page, global_config.page_size), decommit_size);
+	page->commit_chunks = 0;
 	page->is_decommitted = 1;
+	return decommit_size;
+}
+
+static inline size_t
+page_decommit_memory_pages(page_t* page) {
+	if (page->is_decommitted)
+		return 0;
+	heap_stat_inc(page->heap, page_type[page->page_type].page_decommit);
+	return page_decommit_memory(page);
 }
 
 static inline void
 page_commit_memory_pages(page_t* page) {
 	if (!page->is_decommitted)
 		return;
-	void* extra_page = pointer_offset(page, global_config.page_size);
-	size_t extra_page_size = page_get_size(page) - global_config.page_size;
-	global_memory_interface->memory_commit(extra_page, extra_page_size);
+	// Memory beyond the first memory page is committed in chunks as blocks are initialized
 	page->is_decommitted = 0;
+	heap_stat_inc(page->heap, page_type[page->page_type].page_commit);
 #if ENABLE_DECOMMIT
-#if !defined(__APPLE__)
+#if DECOMMIT_IS_ZERO
 	// When page is recommitted, the blocks in the second memory page and forward
 	// will be zeroed out by OS - take advantage in zalloc/calloc calls and make sure
-	// blocks in first page is zeroed out
-	void* first_page = pointer_offset(page, PAGE_HEADER_SIZE);
-	memset(first_page, 0, global_config.page_size - PAGE_HEADER_SIZE);
-	page->is_zero = 1;
+	// blocks in first page is zeroed out. In transparent huge page mode parts of the
+	// page might have been kept resident and are not known to be zero, and with decommit
+	// disabled the memory was never released
+	if (!os_thp && !global_config.disable_decommit) {
+		void* first_page = pointer_offset(page, PAGE_HEADER_SIZE);
+		memset(first_page, 0, global_config.page_size - PAGE_HEADER_SIZE);
+		page->is_zero = 1;
+	}
 #endif
 #endif
 }
 
+//! Decommit free pages of the heap after the given page was freed. Pages are either decommitted by age, checked
+//  at most twice per decay time, or when the number of free committed pages reaches the overflow threshold
+static inline void
+heap_page_free_check_decommit(heap_t* heap, page_t* page) {
+	uint32_t decay_time = global_config.decay_time;
+	if (decay_time) {
+		uint32_t timestamp = os_time_ms();
+		page->free_time = timestamp;
+		if (!heap->decay_check_time || ((int32_t)(timestamp - heap->decay_check_time) >= 0)) {
+			heap->decay_check_time = timestamp + (decay_time >> 1);
+			heap_page_free_decay(heap, timestamp, decay_time);
+		}
+	} else if (heap->page_free_commit_count[page->page_type] >= global_page_free_overflow[page->page_type]) {
+		heap_page_free_decommit(heap, page->page_type, global_page_free_retain[page->page_type], SIZE_MAX);
+	}
+}
+
 static void
 page_available_to_free(page_t* page) {
 	rpmalloc_assert(page->is_full == 0, "Page full flag internal failure");
@@ -1024,8 +2113,11 @@ page_available_to_free(page_t* page) {
 	page->is_zero = 0;
 	page->next = heap->page_free[page->page_type];
 	heap->page_free[page->page_type] = page;
-	if (++heap->page_free_commit_count[page->page_type] >= global_page_free_overflow[page->page_type])
-		heap_page_free_decommit(heap, page->page_type, global_page_free_retain[page->page_type]);
+	heap_stat_inc(heap, size_class[page->size_class].page_to_free);
+	heap_stat_inc(heap, page_type[page->page_type].page_to_free);
+	heap_stat_dec_page(heap, page->page_type);
+	++heap->page_free_commit_count[page->page_type];
+	heap_page_free_check_decommit(heap, page);
 }
 
 static void
@@ -1038,7 +2130,7 @@ page_full_to_available(page_t* page) {
 		page->next->prev = page;
 	heap->page_available[page->size_class] = page;
 	page->is_full = 0;
-	if (page->has_aligned_block == 0)
+	if ((page->has_aligned_block == 0) && !page_has_sampled_block(page))
 		page->generic_free = 0;
 }
 
@@ -1053,8 +2145,8 @@ page_full_to_free_on_new_heap(page_t* page, heap_t* heap) {
 	atomic_store_explicit(&page->thread_free, 0, memory_order_relaxed);
 	page->next = heap->page_free[page->page_type];
 	heap->page_free[page->page_type] = page;
-	if (++heap->page_free_commit_count[page->page_type] >= global_page_free_overflow[page->page_type])
-		heap_page_free_decommit(heap, page->page_type, global_page_free_retain[page->page_type]);
+	++heap->page_free_commit_count[page->page_type];
+	heap_page_free_check_decommit(heap, page);
 }
 
 static void
@@ -1070,13 +2162,12 @@ page_available_to_full(page_t* page) {
 	page->is_full = 1;
 	page->is_zero = 0;
 	page->generic_free = 1;
+	heap_stat_inc(heap, size_class[page->size_class].page_to_full);
 }
 
 static inline void
 page_put_local_free_block(page_t* page, block_t* block) {
-	block->next = page->local_free;
-	page->local_free = block;
-	++page->local_free_count;
+	page_push_local_free_block(page, block);
 	if (UNEXPECTED(--page->block_used == 0)) {
 		page_available_to_free(page);
 	} else if (UNEXPECTED(page->is_full != 0)) {
@@ -1086,7 +2177,7 @@ page_put_local_free_block(page_t* page, block_t* block) {
 
 static NOINLINE void
 page_adopt_thread_free_block_list(page_t* page) {
-	if (page->local_free)
+	if (page->local_free_count)
 		return;
 	unsigned long long thread_free = atomic_load_explicit(&page->thread_free, memory_order_relaxed);
 	if (thread_free != 0) {
@@ -1094,45 +2185,132 @@ page_adopt_thread_free_block_list(page_t* page) {
 		while (!atomic_compare_exchange_weak_explicit(&page->thread_free, &thread_free, 0, memory_order_relaxed,
 		                                              memory_order_relaxed))
 			wait_spin();
-		page->local_free_count = page_block_from_thread_free_list(page, thread_free, &page->local_free);
+		if (page->page_type == PAGE_SMALL) {
+			page->local_free_count = page_block_from_thread_free_list(page, thread_free, &page->local_free);
+		} else {
+			block_t* block = 0;
+			page->local_free_count = page_block_from_thread_free_list(page, thread_free, &block);
+			page_free_bitmap_set_list(page, block, page->local_free_count);
+		}
 		rpmalloc_assert(page->local_free_count <= page->block_used, "Page thread free list count internal failure");
 		page->block_used -= page->local_free_count;
+		heap_stat_add_free(page->heap, page->size_class, page->local_free_count);
+	}
+}
+
+//! Adopt the thread free list of the page and merge it with the page local free list
+static void
+page_collect_thread_free_block_list(page_t* page) {
+	if (atomic_load_explicit(&page->thread_free, memory_order_relaxed) == 0)
+		return;
+	unsigned long long thread_free = atomic_exchange_explicit(&page->thread_free, 0, memory_order_acquire);
+	block_t* block = 0;
+	uint32_t list_count = page_block_from_thread_free_list(page, thread_free, &block);
+	if (!list_count)
+		return;
+	if (page->page_type == PAGE_SMALL) {
+		block_t* last_block = block;
+		for (uint32_t iblock = 1; iblock < list_count; ++iblock)
+			last_block = last_block->next;
+		last_block->next = page->local_free;
+		page->local_free = block;
+	} else {
+		page_free_bitmap_set_list(page, block, list_count);
 	}
+	page->local_free_count += list_count;
+	rpmalloc_assert(list_count <= page->block_used, "Page thread free list count internal failure");
+	page->block_used -= list_count;
+	heap_stat_add_free(page->heap, page->size_class, list_count);
 }
 
+//! Push a list of blocks in the page, linked from first to last, to the page thread free list with a single
+//  atomic operation
 static NOINLINE void
-page_put_thread_free_block(page_t* page, block_t* block) {
+page_put_thread_free_block_list(page_t* page, block_t* first, block_t* last, uint32_t count) {
 	atomic_thread_fence(memory_order_acquire);
+	// Let the next thread running out of free pages collect the released heap, the flag is only written on change
+	// to keep the cache line shared
+	if (UNEXPECTED(atomic_load_explicit(&page->heap->queue_state, memory_order_relaxed) != 0) &&
+	    !atomic_load_explicit(&global_heap_queue_freed, memory_order_relaxed))
+		atomic_store_explicit(&global_heap_queue_freed, 1, memory_order_relaxed);
 	if (page->is_full) {
-		// Page is full, put the block in the heap thread free list instead, otherwise
+		// Page is full, put the blocks in the heap thread free list instead, otherwise
 		// the heap will not pick up the free blocks until a thread local free happens
 		heap_t* heap = page->heap;
 		uintptr_t prev_head = atomic_load_explicit(&heap->thread_free[page->page_type], memory_order_relaxed);
-		block->next = (void*)prev_head;
-		while (!atomic_compare_exchange_weak_explicit(&heap->thread_free[page->page_type], &prev_head, (uintptr_t)block,
+		last->next = (void*)prev_head;
+		while (!atomic_compare_exchange_weak_explicit(&heap->thread_free[page->page_type], &prev_head, (uintptr_t)first,
 		                                              memory_order_relaxed, memory_order_relaxed)) {
-			block->next = (void*)prev_head;
+			last->next = (void*)prev_head;
 			wait_spin();
 		}
 	} else {
 		unsigned long long prev_thread_free = atomic_load_explicit(&page->thread_free, memory_order_relaxed);
-		uint32_t block_index = page_block_index(page, block);
-		rpmalloc_assert(page_block(page, block_index) == block, "Block pointer is not aligned to start of block");
-		uint32_t list_size = page_block_from_thread_free_list(page, prev_thread_free, &block->next) + 1;
+		uint32_t block_index = page_block_index(page, first);
+		rpmalloc_assert(page_block(page, block_index) == first, "Block pointer is not aligned to start of block");
+		uint32_t list_size = page_block_from_thread_free_list(page, prev_thread_free, &last->next) + count;
 		uint64_t thread_free = page_block_to_thread_free_list(page, block_index, list_size);
 		while (!atomic_compare_exchange_weak_explicit(&page->thread_free, &prev_thread_free, thread_free,
 		                                              memory_order_relaxed, memory_order_relaxed)) {
-			list_size = page_block_from_thread_free_list(page, prev_thread_free, &block->next) + 1;
+			list_size = page_block_from_thread_free_list(page, prev_thread_free, &last->next) + count;
 			thread_free = page_block_to_thread_free_list(page, block_index, list_size);
 			wait_spin();
 		}
 	}
 }
 
+static inline void
+page_put_thread_free_block(page_t* page, block_t* block) {
+	page_put_thread_free_block_list(page, block, block, 1);
+}
+
+//! Publish the buffered chain of remote freed blocks in the slot to the owning page
+static inline void
+remote_free_publish(remote_free_t* remote) {
+	page_put_thread_free_block_list(remote->page, remote->first, remote->last, remote->count);
+	remote->page = 0;
+}
+
+//! Buffer a block freed to a page owned by another heap. The chain of blocks for the page is published with a
+//  single atomic operation when reaching the configured batch size or when the slot is needed for another page
+static NOINLINE void
+heap_put_remote_free_block(heap_t* heap, page_t* page, block_t* block) {
+	uint32_t slot = (uint32_t)(((uint64_t)(uintptr_t)page * 0x9E3779B97F4A7C15ULL) >> 60);
+	remote_free_t* remote = heap->remote_free + (slot % REMOTE_FREE_SLOT_COUNT);
+	if (remote->page != page) {
+		if (remote->page)
+			remote_free_publish(remote);
+		remote->page = page;
+		remote->last = block;
+		remote->count = 0;
+	} else {
+		block->next = remote->first;
+	}
+	remote->first = block;
+	if (++remote->count >= global_config.remote_free_batch)
+		remote_free_publish(remote);
+}
+
+//! Publish all buffered chains of remote freed blocks of the heap
+static void
+heap_flush_remote_free(heap_t* heap) {
+	for (uint32_t islot = 0; islot < REMOTE_FREE_SLOT_COUNT; ++islot) {
+		if (heap->remote_free[islot].page)
+			remote_free_publish(heap->remote_free + islot);
+	}
+}
+
 static void
-page_push_local_free_to_heap(page_t* page) {
-	// Push the page free list as the fast track list of free blocks for heap
-	page->heap->local_free[page->size_class] = page->local_free;
+page_push_local_free_to_heap(page_t* page, unsigned int is_zero) {
+	// Push the page free list as the fast track list of free blocks for heap, keeping track of whether the
+	// list only holds newly initialized blocks of a zero initialized page
+	heap_t* heap = page->heap;
+	uint32_t size_class = page->size_class;
+	heap->local_free[size_class] = page->local_free;
+	if (is_zero)
+		heap->local_free_zero[size_class >> 5] |= (1U << (size_class & 31));
+	else
+		heap->local_free_zero[size_class >> 5] &= ~(1U << (size_class & 31));
 	page->block_used += page->local_free_count;
 	page->local_free = 0;
 	page->local_free_count = 0;
@@ -1167,6 +2345,7 @@ page_initialize_blocks(page_t* page) {
 			page->local_free_count = list_count;
 		}
 	}
+	page_commit_blocks(page, page->block_initialized);
 
 	return block;
 }
@@ -1174,11 +2353,11 @@ page_initialize_blocks(page_t* page) {
 static inline RPMALLOC_ALLOCATOR void*
 page_allocate_block(page_t* page, unsigned int zero) {
 	unsigned int is_zero = 0;
-	block_t* block = (page->local_free != 0) ? page_get_local_free_block(page) : 0;
+	block_t* block = (page->local_free_count != 0) ? page_get_local_free_block(page) : 0;
 	if (UNEXPECTED(block == 0)) {
 		if (atomic_load_explicit(&page->thread_free, memory_order_relaxed) != 0) {
 			page_adopt_thread_free_block_list(page);
-			block = (page->local_free != 0) ? page_get_local_free_block(page) : 0;
+			block = (page->local_free_count != 0) ? page_get_local_free_block(page) : 0;
 		}
 		if (block == 0) {
 			block = page_initialize_blocks(page);
@@ -1187,8 +2366,9 @@ page_allocate_block(page_t* page, unsigned int zero) {
 	}
 
 	rpmalloc_assert(page->block_used <= page->block_count, "Page block use counter out of sync");
+	heap_stat_inc_alloc(page->heap, page->size_class);
 	if (page->local_free && !page->heap->local_free[page->size_class])
-		page_push_local_free_to_heap(page);
+		page_push_local_free_to_heap(page, is_zero);
 
 	// The page might be full when free list has been pushed to heap local free list,
 	// check if there is a thread free list to adopt
@@ -1211,87 +2391,794 @@ page_allocate_block(page_t* page, unsigned int zero) {
 	return block;
 }
 
+//! Allocate up to the given number of blocks from the page, returns the number of blocks allocated
+static size_t
+page_allocate_block_batch(page_t* page, size_t count, void** blocks) {
+	size_t allocated = 0;
+	while (allocated < count) {
+		if (!page->local_free_count && (atomic_load_explicit(&page->thread_free, memory_order_relaxed) != 0))
+			page_adopt_thread_free_block_list(page);
+		if (page->local_free_count && (page->page_type != PAGE_SMALL)) {
+			while (page->local_free_count && (allocated < count))
+				blocks[allocated++] = page_get_local_free_block(page);
+		} else if (page->local_free) {
+			block_t* block = page->local_free;
+			uint32_t block_count = 0;
+			while (block && (allocated < count)) {
+				blocks[allocated++] = block;
+				block = block->next;
+				++block_count;
+			}
+			page->local_free = block;
+			page->local_free_count -= block_count;
+			page->block_used += block_count;
+		} else if (page->block_initialized < page->block_count) {
+			// Hand out a run of uninitialized blocks directly instead of linking them in a free list
+			uint32_t block_count = page->block_count - page->block_initialized;
+			if (block_count > count - allocated)
+				block_count = (uint32_t)(count - allocated);
+			// Mark the blocks as used before committing, the memory pressure callback may free blocks in the page
+			uint32_t block_first = page->block_initialized;
+			page->block_initialized += block_count;
+			page->block_used += block_count;
+			page_commit_blocks(page, page->block_initialized);
+			for (uint32_t iblock = 0; iblock < block_count; ++iblock)
+				blocks[allocated++] = page_block(page, block_first + iblock);
+		} else {
+			break;
+		}
+	}
+
+	rpmalloc_assert(page->block_used <= page->block_count, "Page block use counter out of sync");
+	for (size_t iblock = 0; iblock < allocated; ++iblock)
+		heap_stat_inc_alloc(page->heap, page->size_class);
+
+	if (page->block_used == page->block_count) {
+		page_adopt_thread_free_block_list(page);
+		if (page->block_used == page->block_count) {
+			rpmalloc_assert(!page->is_full, "Page block use counter out of sync with full flag");
+			page_available_to_full(page);
+		}
+	}
+	return allocated;
+}
+
 ////////////
 ///
-/// Span interface
+/// Huge span cache interface
 ///
 //////
 
-static inline int
-span_is_thread_heap(span_t* span) {
-#if RPMALLOC_FIRST_CLASS_HEAPS
-	return (!span->heap->owner_thread || (span->heap->owner_thread == get_thread_id()));
-#else
-	return (span->heap->owner_thread == get_thread_id());
-#endif
-}
+#if ENABLE_HUGE_CACHE
 
-static inline page_t*
-span_get_page_from_block(span_t* span, void* block) {
-	return (page_t*)((uintptr_t)block & span->page_address_mask);
-}
+static void
+span_unmap(span_t* span);
 
-//! Find or allocate a page from the given span
-static inline page_t*
-span_allocate_page(span_t* span) {
-	// Allocate path, initialize a new chunk of memory for a page in the given span
-	rpmalloc_assert(span->page_initialized < span->page_count, "Page initialization internal failure");
-	heap_t* heap = span->heap;
-	page_t* page = pointer_offset(span, span->page_size * span->page_initialized);
+static inline size_t
+huge_span_size(span_t* span) {
+	return (size_t)span->page_size * (size_t)span->page_count;
+}
 
-#if ENABLE_DECOMMIT
-	// The first page is always committed on initial span map of memory
-	if (span->page_initialized)
-		global_memory_interface->memory_commit(page, span->page_size);
-#endif
-	++span->page_initialized;
+static inline uint32_t
+huge_cache_bucket(size_t size) {
+	uint32_t most_significant_bit = (uint32_t)((sizeof(uintptr_t) * 8) - 1 - rpmalloc_clz(size));
+	if (most_significant_bit < HUGE_CACHE_BUCKET_SHIFT)
+		return 0;
+	uint32_t bucket = most_significant_bit - HUGE_CACHE_BUCKET_SHIFT;
+	return (bucket < HUGE_CACHE_BUCKET_COUNT) ? bucket : (HUGE_CACHE_BUCKET_COUNT - 1);
+}
 
-	page->page_type = span->page_type;
-	page->is_zero = 1;
-	page->heap = heap;
-	rpmalloc_assert(page_is_thread_heap(page), "Page owner thread mismatch");
+static inline void
+huge_cache_lock_acquire(void) {
+	unsigned int lock = 0;
+	while (!atomic_compare_exchange_weak_explicit(&global_huge_cache_lock, &lock, 1, memory_order_acquire,
+	                                              memory_order_relaxed)) {
+		lock = 0;
+		wait_spin();
+	}
+}
 
-	if (span->page_initialized == span->page_count) {
-		// Span fully utilized
-		rpmalloc_assert(span == heap->span_partial[span->page_type], "Span partial tracking out of sync");
-		heap->span_partial[span->page_type] = 0;
+static inline void
+huge_cache_lock_release(void) {
+	atomic_store_explicit(&global_huge_cache_lock, 0, memory_order_release);
+}
 
-		span->next = heap->span_used[span->page_type];
-		heap->span_used[span->page_type] = span;
+//! Unlink cached spans older than the max age and then the oldest spans until the cache is within the given
+//  size limit. Returns the list of unlinked spans, must be called with the cache lock held
+static span_t*
+huge_cache_evict(uint32_t timestamp, uint32_t max_age, size_t size_limit) {
+	span_t* release = 0;
+	size_t cache_size = atomic_load_explicit(&global_huge_cache_size, memory_order_relaxed);
+	for (uint32_t ibucket = 0; ibucket < HUGE_CACHE_BUCKET_COUNT; ++ibucket) {
+		span_t** prev = global_huge_cache + ibucket;
+		while (*prev) {
+			span_t* span = *prev;
+			if ((uint32_t)(timestamp - span->release_time) >= max_age) {
+				*prev = span->next;
+				span->next = release;
+				release = span;
+				cache_size -= huge_span_size(span);
+			} else {
+				prev = &span->next;
+			}
+		}
+	}
+	while (cache_size > size_limit) {
+		span_t** oldest = 0;
+		uint32_t oldest_age = 0;
+		for (uint32_t ibucket = 0; ibucket < HUGE_CACHE_BUCKET_COUNT; ++ibucket) {
+			for (span_t** prev = global_huge_cache + ibucket; *prev; prev = &(*prev)->next) {
+				uint32_t age = (uint32_t)(timestamp - (*prev)->release_time);
+				if (!oldest || (age >= oldest_age)) {
+					oldest = prev;
+					oldest_age = age;
+				}
+			}
+		}
+		if (!oldest)
+			break;
+		span_t* span = *oldest;
+		*oldest = span->next;
+		span->next = release;
+		release = span;
+		cache_size -= huge_span_size(span);
 	}
+	atomic_store_explicit(&global_huge_cache_size, cache_size, memory_order_relaxed);
+	return release;
+}
 
-	return page;
+static void
+huge_cache_unmap(span_t* span) {
+	while (span) {
+		span_t* next_span = span->next;
+		span_unmap(span);
+		span = next_span;
+	}
 }
 
-static NOINLINE void
-span_deallocate_block(span_t* span, page_t* page, void* block) {
-	if (UNEXPECTED(page->page_type == PAGE_HUGE)) {
-		global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
+//! Unmap cached huge spans older than the given max age, and then the oldest spans until within the size limit
+static void
+huge_cache_release(uint32_t max_age, size_t size_limit) {
+	if (!atomic_load_explicit(&global_huge_cache_size, memory_order_relaxed))
 		return;
-	}
+	huge_cache_lock_acquire();
+	span_t* release = huge_cache_evict(os_time_ms(), max_age, size_limit);
+	huge_cache_lock_release();
+	huge_cache_unmap(release);
+}
 
-	if (page->has_aligned_block) {
-		// Realign pointer to block start
-		block = page_block_realign(page, block);
-	}
+//! Put a free huge span in the cache, returns zero if the span was not cached
+static int
+huge_cache_insert(span_t* span) {
+	size_t span_size = huge_span_size(span);
+	if (global_config.disable_huge_cache || (span_size > global_config.huge_cache_limit))
+		return 0;
+	uint32_t timestamp = os_time_ms();
+	span->page.is_zero = 0;
+	rpmalloc_assert(span->page_type == PAGE_HUGE, "Release time set on span not huge");
+	huge_cache_lock_acquire();
+	span->release_time = timestamp;
+	span_t** bucket = global_huge_cache + huge_cache_bucket(span_size);
+	span->next = *bucket;
+	*bucket = span;
+	atomic_fetch_add_explicit(&global_huge_cache_size, span_size, memory_order_relaxed);
+	span_t* release = huge_cache_evict(timestamp, global_config.huge_cache_max_age, global_config.huge_cache_limit);
+	huge_cache_lock_release();
+	huge_cache_unmap(release);
+	return 1;
+}
 
-	int is_thread_local = page_is_thread_heap(page);
-	if (EXPECTED(is_thread_local != 0)) {
-		page_put_local_free_block(page, block);
-	} else {
-		// Multithreaded deallocation, push to deferred deallocation list.
-		page_put_thread_free_block(page, block);
+//! Find the smallest cached huge span fitting the given size, without wasting more than a quarter of the size
+static span_t*
+huge_cache_extract(size_t size) {
+	if (!atomic_load_explicit(&global_huge_cache_size, memory_order_relaxed))
+		return 0;
+	size_t max_size = size + (size >> 2);
+	span_t** best = 0;
+	size_t best_size = 0;
+	huge_cache_lock_acquire();
+	for (uint32_t ibucket = huge_cache_bucket(size); ibucket <= huge_cache_bucket(max_size); ++ibucket) {
+		for (span_t** prev = global_huge_cache + ibucket; *prev; prev = &(*prev)->next) {
+			size_t span_size = huge_span_size(*prev);
+			if ((span_size >= size) && (span_size <= max_size) && (!best || (span_size < best_size))) {
+				best = prev;
+				best_size = span_size;
+			}
+		}
+	}
+	span_t* span = 0;
+	if (best) {
+		span = *best;
+		*best = span->next;
+		span->next = 0;
+		atomic_fetch_sub_explicit(&global_huge_cache_size, best_size, memory_order_relaxed);
 	}
+	huge_cache_lock_release();
+	return span;
 }
 
+#endif
+
 ////////////
 ///
-/// Block interface
+/// Allocation sampling
 ///
 //////
 
-static inline span_t*
-block_get_span(block_t* block) {
+#if ENABLE_SAMPLING
+
+//! Maximum number of stack frames captured for a sampled allocation
+#define SAMPLE_STACK_DEPTH 32
+//! Number of stack frames inside the allocator skipped when capturing the stack of a sampled allocation
+#define SAMPLE_SKIP_FRAMES 2
+//! Number of hash buckets of sampled allocations as a power of two
+#define SAMPLE_BUCKET_SHIFT 10
+#define SAMPLE_BUCKET_COUNT (1 << SAMPLE_BUCKET_SHIFT)
+//! Size of memory chunks mapped to hold sampled allocations
+#define SAMPLE_CHUNK_SIZE (256 * 1024)
+//! Number of sampled allocations copied out of a bucket at a time while dumping
+#define SAMPLE_DUMP_BATCH 8
+
+//! A sampled allocation
+struct sample_t {
+	//! Next sample in bucket or free list
+	sample_t* next;
+	//! Start of the sampled block
+	void* block;
+	//! Requested size
+	size_t size;
+	//! Number of captured stack frames
+	uint32_t depth;
+	//! Return addresses of the captured stack frames, innermost first
+	void* stack[SAMPLE_STACK_DEPTH];
+};
+
+//! Hash bucket of sampled allocations
+typedef struct sample_bucket_t {
+	//! Lock for the bucket
+	atomic_uint lock;
+	//! Sampled allocations in the bucket
+	sample_t* head;
+} sample_bucket_t;
+
+//! Memory chunk holding sampled allocations, stored in the first sample slot of the chunk
+typedef struct sample_chunk_t sample_chunk_t;
+struct sample_chunk_t {
+	//! Next chunk in list
+	sample_chunk_t* next;
+	//! Offset to start of mapped memory region
+	size_t offset;
+	//! Mapped size
+	size_t mapped_size;
+};
+
+_Static_assert(sizeof(sample_chunk_t) <= sizeof(sample_t), "Invalid sample chunk header size");
+
+//! Sampled allocations for each hash bucket, keyed by block address
+static sample_bucket_t global_sample_bucket[SAMPLE_BUCKET_COUNT];
+//! Free sampled allocation records
+static sample_t* global_sample_free;
+//! Mapped chunks of sampled allocation records
+static sample_chunk_t* global_sample_chunk;
+//! Lock for free sampled allocation records and mapped chunks
+static atomic_uint global_sample_lock;
+//! Estimated number of bytes allocated since initialization, extrapolated from the sampled allocations
+static atomic_size_t global_sample_alloc_size;
+//! Estimated number of allocations since initialization, extrapolated from the sampled allocations
+static atomic_size_t global_sample_alloc_count;
+
+static inline void
+sample_lock_acquire(atomic_uint* lock) {
+	unsigned int unlocked = 0;
+	while (!atomic_compare_exchange_weak_explicit(lock, &unlocked, 1, memory_order_acquire, memory_order_relaxed)) {
+		unlocked = 0;
+		wait_spin();
+	}
+}
+
+static inline void
+sample_lock_release(atomic_uint* lock) {
+	atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+static inline sample_bucket_t*
+sample_bucket(void* block) {
+	uint64_t key = (uint64_t)(uintptr_t)block >> 4;
+	return global_sample_bucket + ((key * 0x9E3779B97F4A7C15ULL) >> (64 - SAMPLE_BUCKET_SHIFT));
+}
+
+//! Get the number of bytes to allocate before the next sampled allocation, drawn from an exponential distribution
+//  with the configured sample interval as mean. The logarithm is approximated by the most significant bit and a
+//  linear mantissa in 16.16 fixed point, which is accurate enough for a sampling interval
+static size_t
+sample_next_interval(heap_t* heap) {
+	size_t interval = global_config.sample_interval;
+	if (!interval)
+		return SIZE_MAX;
+	uint64_t state = heap->sample_random;
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	heap->sample_random = state;
+	// Uniform value in [1, 2^24]
+	uint32_t value = (uint32_t)((state * 0x2545F4914F6CDD1DULL) >> 40) + 1;
+	uint32_t msb = (uint32_t)((sizeof(uintptr_t) * 8) - 1 - rpmalloc_clz((uintptr_t)value));
+	uint64_t log2_value = ((uint64_t)msb << 16) + ((((uint64_t)value - (1ULL << msb)) << 16) >> msb);
+	// -ln(value / 2^24) = (24 - log2(value)) * ln(2), with ln(2) as 45426 / 2^16
+	uint64_t neg_log = (((24ULL << 16) - log2_value) * 45426ULL) >> 16;
+	return (size_t)(((uint64_t)interval * neg_log) >> 16);
+}
+
+//! Get the estimated number of allocated bytes represented by a sampled allocation of the given size. An allocation
+//  is sampled with probability 1 - exp(-size / interval), approximated by the larger of interval + size / 2 and size
+static size_t
+sample_weight(size_t size) {
+	size_t weight = global_config.sample_interval + (size >> 1);
+	return (weight > size) ? weight : size;
+}
+
+//! Map a new chunk of sampled allocation records, must be called with the free list lock held
+static sample_t*
+sample_map_chunk(void) {
+	size_t offset = 0;
+	size_t mapped_size = 0;
+	sample_chunk_t* chunk = numa_memory_map(0, SAMPLE_CHUNK_SIZE, 0, &offset, &mapped_size);
+	if (!chunk)
+		return 0;
+#if ENABLE_DECOMMIT
+	memory_commit(chunk, SAMPLE_CHUNK_SIZE);
+#else
+	memory_committed_add(SAMPLE_CHUNK_SIZE);
+#endif
+	chunk->next = global_sample_chunk;
+	chunk->offset = offset;
+	chunk->mapped_size = mapped_size;
+	global_sample_chunk = chunk;
+	sample_t* sample = pointer_offset(chunk, sizeof(sample_t));
+	size_t sample_count = (SAMPLE_CHUNK_SIZE / sizeof(sample_t)) - 1;
+	for (size_t isample = 0; isample < sample_count - 1; ++isample)
+		sample[isample].next = sample + isample + 1;
+	sample[sample_count - 1].next = 0;
+	return sample;
+}
+
+static sample_t*
+sample_allocate(void) {
+	sample_lock_acquire(&global_sample_lock);
+	sample_t* sample = global_sample_free;
+	if (!sample)
+		sample = sample_map_chunk();
+	if (sample)
+		global_sample_free = sample->next;
+	sample_lock_release(&global_sample_lock);
+	return sample;
+}
+
+static void
+sample_release_list(sample_t* first, sample_t* last) {
+	sample_lock_acquire(&global_sample_lock);
+	last->next = global_sample_free;
+	global_sample_free = first;
+	sample_lock_release(&global_sample_lock);
+}
+
+//! Insert a sampled allocation, replacing any stale sample of the same block
+static void
+sample_insert(sample_t* sample) {
+	sample_bucket_t* bucket = sample_bucket(sample->block);
+	sample_lock_acquire(&bucket->lock);
+	sample_t** prev = &bucket->head;
+	while (*prev && ((*prev)->block != sample->block))
+		prev = &(*prev)->next;
+	sample_t* stale = *prev;
+	sample->next = stale ? stale->next : bucket->head;
+	if (stale)
+		*prev = sample;
+	else
+		bucket->head = sample;
+	sample_lock_release(&bucket->lock);
+	if (stale)
+		sample_release_list(stale, stale);
+}
+
+//! Unlink the sampled allocation of the given block start, returns null if the block was not sampled
+static sample_t*
+sample_unlink(void* block) {
+	sample_bucket_t* bucket = sample_bucket(block);
+	sample_lock_acquire(&bucket->lock);
+	sample_t** prev = &bucket->head;
+	while (*prev && ((*prev)->block != block))
+		prev = &(*prev)->next;
+	sample_t* sample = *prev;
+	if (sample)
+		*prev = sample->next;
+	sample_lock_release(&bucket->lock);
+	return sample;
+}
+
+//! Remove the sampled allocation of the given block start when the block is freed
+static void
+sample_remove(void* block) {
+	sample_t* sample = sample_unlink(block);
+	if (sample)
+		sample_release_list(sample, sample);
+}
+
+//! Move the sampled allocation of a huge block which was remapped to a new address
+static void
+sample_move(void* block, void* new_block) {
+	sample_t* sample = sample_unlink(block);
+	if (sample) {
+		sample->block = new_block;
+		sample_insert(sample);
+	}
+}
+
+//! Remove all sampled allocations of blocks in pages owned by the given heap, the pages must still be mapped
+static void
+sample_remove_heap(heap_t* heap) {
+	for (uint32_t ibucket = 0; ibucket < SAMPLE_BUCKET_COUNT; ++ibucket) {
+		sample_bucket_t* bucket = global_sample_bucket + ibucket;
+		sample_t* first = 0;
+		sample_t* last = 0;
+		sample_lock_acquire(&bucket->lock);
+		sample_t** prev = &bucket->head;
+		while (*prev) {
+			sample_t* sample = *prev;
+			span_t* span = (span_t*)((uintptr_t)sample->block & SPAN_MASK);
+			page_t* page = (page_t*)((uintptr_t)sample->block & span->page_address_mask);
+			if (page->heap == heap) {
+				*prev = sample->next;
+				sample->next = first;
+				first = sample;
+				if (!last)
+					last = sample;
+			} else {
+				prev = &sample->next;
+			}
+		}
+		sample_lock_release(&bucket->lock);
+		if (first)
+			sample_release_list(first, last);
+	}
+}
+
+//! Capture the return addresses of the calling stack frames, innermost first, returns the number of frames
+static inline uint32_t
+sample_capture_stack(void** stack) {
+#if PLATFORM_WINDOWS
+	return (uint32_t)RtlCaptureStackBackTrace(SAMPLE_SKIP_FRAMES, SAMPLE_STACK_DEPTH, stack, 0);
+#elif PLATFORM_HAS_BACKTRACE
+	void* frames[SAMPLE_SKIP_FRAMES + SAMPLE_STACK_DEPTH];
+	int depth = backtrace(frames, SAMPLE_SKIP_FRAMES + SAMPLE_STACK_DEPTH);
+	if (depth <= SAMPLE_SKIP_FRAMES)
+		return 0;
+	memcpy(stack, frames + SAMPLE_SKIP_FRAMES, sizeof(void*) * (size_t)(depth - SAMPLE_SKIP_FRAMES));
+	return (uint32_t)(depth - SAMPLE_SKIP_FRAMES);
+#else
+	(void)sizeof(stack);
+	return 0;
+#endif
+}
+
+//! Record a sampled allocation of the given block start in the given page. Frees of blocks in the page are
+//  forced to the generic free path, which unlinks the sample
+static NOINLINE void
+sample_record(page_t* page, void* block, size_t size) {
+	sample_t* sample = sample_allocate();
+	if (!sample)
+		return;
+	sample->block = block;
+	sample->size = size;
+	sample->depth = sample_capture_stack(sample->stack);
+	page->has_sampled_block = 1;
+	page->generic_free = 1;
+	sample_insert(sample);
+	size_t weight = sample_weight(size);
+	atomic_fetch_add_explicit(&global_sample_alloc_size, weight, memory_order_relaxed);
+	atomic_fetch_add_explicit(&global_sample_alloc_count, size ? (weight / size) : 1, memory_order_relaxed);
+}
+
+//! Release all sampled allocations and the mapped memory holding them
+static void
+sample_finalize(void) {
+	sample_chunk_t* chunk = global_sample_chunk;
+	while (chunk) {
+		sample_chunk_t* next = chunk->next;
+		memory_committed_sub(SAMPLE_CHUNK_SIZE);
+		global_memory_interface->memory_unmap(chunk, chunk->offset, chunk->mapped_size);
+		chunk = next;
+	}
+	global_sample_chunk = 0;
+	global_sample_free = 0;
+	memset(global_sample_bucket, 0, sizeof(global_sample_bucket));
+	atomic_store_explicit(&global_sample_alloc_size, 0, memory_order_relaxed);
+	atomic_store_explicit(&global_sample_alloc_count, 0, memory_order_relaxed);
+}
+
+//! Buffered output of a sample dump
+typedef struct sample_writer_t {
+	//! Output function
+	void (*write)(void* context, const char* buffer, size_t size);
+	//! Output function context
+	void* context;
+	//! Number of bytes used in buffer
+	size_t used;
+	//! Output buffer
+	char buffer[1024];
+} sample_writer_t;
+
+static void
+sample_write_flush(sample_writer_t* writer) {
+	if (writer->used)
+		writer->write(writer->context, writer->buffer, writer->used);
+	writer->used = 0;
+}
+
+static void
+sample_write(sample_writer_t* writer, const char* data, size_t size) {
+	while (size) {
+		if (writer->used == sizeof(writer->buffer))
+			sample_write_flush(writer);
+		size_t count = sizeof(writer->buffer) - writer->used;
+		if (count > size)
+			count = size;
+		memcpy(writer->buffer + writer->used, data, count);
+		writer->used += count;
+		data += count;
+		size -= count;
+	}
+}
+
+static void
+sample_write_string(sample_writer_t* writer, const char* string) {
+	sample_write(writer, string, strlen(string));
+}
+
+static void
+sample_write_uint(sample_writer_t* writer, unsigned long long value) {
+	char digits[32];
+	int length = snprintf(digits, sizeof(digits), "%llu", value);
+	sample_write(writer, digits, (size_t)length);
+}
+
+static void
+sample_write_address(sample_writer_t* writer, void* address) {
+	char digits[32];
+	int length = snprintf(digits, sizeof(digits), "0x%llx", (unsigned long long)(uintptr_t)address);
+	sample_write(writer, digits, (size_t)length);
+}
+
+//! Write in use and allocated counts and bytes in the heap profile format of pprof
+static void
+sample_write_pprof_counts(sample_writer_t* writer, size_t count, size_t size) {
+	sample_write_uint(writer, count);
+	sample_write_string(writer, ": ");
+	sample_write_uint(writer, size);
+	sample_write_string(writer, " [");
+	sample_write_uint(writer, count);
+	sample_write_string(writer, ": ");
+	sample_write_uint(writer, size);
+	sample_write_string(writer, "]");
+}
+
+static void
+sample_write_sample(sample_writer_t* writer, const sample_t* sample, int format) {
+	if (format == RPMALLOC_SAMPLE_FORMAT_FOLDED) {
+		// Outermost frame first, weighted by the estimated bytes the sample represents
+		if (!sample->depth)
+			sample_write_string(writer, "[unknown]");
+		for (uint32_t iframe = sample->depth; iframe > 0; --iframe) {
+			sample_write_address(writer, sample->stack[iframe - 1]);
+			if (iframe > 1)
+				sample_write_string(writer, ";");
+		}
+		sample_write_string(writer, " ");
+		sample_write_uint(writer, sample_weight(sample->size));
+	} else {
+		// Raw sampled counts and bytes, pprof scales them by the sample interval given in the header
+		sample_write_pprof_counts(writer, 1, sample->size);
+		sample_write_string(writer, " @");
+		for (uint32_t iframe = 0; iframe < sample->depth; ++iframe) {
+			sample_write_string(writer, " ");
+			sample_write_address(writer, sample->stack[iframe]);
+		}
+	}
+	sample_write_string(writer, "\n");
+}
+
+//! Write the memory mappings of the process used by pprof to symbolize the addresses
+static void
+sample_write_mapped_libraries(sample_writer_t* writer) {
+#if defined(__linux__) || defined(__ANDROID__)
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (!maps)
+		return;
+	sample_write_string(writer, "\nMAPPED_LIBRARIES:\n");
+	while (1) {
+		if (writer->used == sizeof(writer->buffer))
+			sample_write_flush(writer);
+		size_t read = fread(writer->buffer + writer->used, 1, sizeof(writer->buffer) - writer->used, maps);
+		if (!read)
+			break;
+		writer->used += read;
+	}
+	fclose(maps);
+#else
+	(void)sizeof(writer);
+#endif
+}
+
+//! Copy up to the given number of sampled allocations from a bucket, skipping the given number of samples
+static uint32_t
+sample_bucket_copy(sample_bucket_t* bucket, size_t skip, sample_t* samples, uint32_t max_count) {
+	uint32_t count = 0;
+	sample_lock_acquire(&bucket->lock);
+	sample_t* sample = bucket->head;
+	while (sample && skip) {
+		sample = sample->next;
+		--skip;
+	}
+	while (sample && (count < max_count)) {
+		samples[count++] = *sample;
+		sample = sample->next;
+	}
+	sample_lock_release(&bucket->lock);
+	return count;
+}
+
+#endif
+
+////////////
+///
+/// Span interface
+///
+//////
+
+static inline int
+span_is_thread_heap(span_t* span) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	uintptr_t owner_thread = heap_owner_thread(span->heap);
+	return (!owner_thread || (owner_thread == get_thread_id()));
+#else
+	return (heap_owner_thread(span->heap) == get_thread_id());
+#endif
+}
+
+static inline page_t*
+span_get_page_from_block(span_t* span, void* block) {
+	return (page_t*)((uintptr_t)block & span->page_address_mask);
+}
+
+//! Get the number of committed bytes in the span from the commit state of the initialized pages
+static size_t
+span_committed_size(span_t* span) {
+	if (span->page_type == PAGE_HUGE)
+		return (size_t)span->page_size * (size_t)span->page_count;
+#if ENABLE_DECOMMIT
+	if (!span->page_initialized) {
+		size_t commit_size = page_commit_chunk_size();
+		return (commit_size < span->page_size) ? commit_size : span->page_size;
+	}
+	size_t committed_size = 0;
+	for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage)
+		committed_size += page_committed_size(pointer_offset(span, (size_t)span->page_size * ipage));
+	return committed_size;
+#else
+	return SPAN_SIZE;
+#endif
+}
+
+static void
+span_unmap(span_t* span) {
+	memory_committed_sub(span_committed_size(span));
+	global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
+}
+
+//! Find or allocate a page from the given span
+static inline page_t*
+span_allocate_page(span_t* span) {
+	// Allocate path, initialize a new chunk of memory for a page in the given span
+	rpmalloc_assert(span->page_initialized < span->page_count, "Page initialization internal failure");
+	heap_t* heap = span->heap;
+	page_t* page = pointer_offset(span, span->page_size * span->page_initialized);
+
+#if ENABLE_DECOMMIT
+	// The first chunk of the first page is always committed on initial span map of memory, the rest of
+	// the page is committed as blocks are initialized
+	size_t commit_size = page_commit_chunk_size();
+	if (commit_size > span->page_size)
+		commit_size = span->page_size;
+	if (span->page_initialized) {
+		memory_pressure_check(heap, commit_size);
+		memory_commit(page, commit_size);
+	}
+	page->commit_chunks = 1;
+#else
+	// Memory is committed when mapped
+	page->commit_chunks = (uint16_t)((span->page_size + (page_commit_chunk_size() - 1)) / page_commit_chunk_size());
+#endif
+	++span->page_initialized;
+
+	page->page_type = span->page_type;
+	page->is_zero = 1;
+	page->heap = heap;
+	rpmalloc_assert(page_is_thread_heap(page), "Page owner thread mismatch");
+
+	if (span->page_initialized == span->page_count) {
+		// Span fully utilized
+		rpmalloc_assert(span == heap->span_partial[span->page_type], "Span partial tracking out of sync");
+		heap->span_partial[span->page_type] = 0;
+
+		span->next = heap->span_used[span->page_type];
+		heap->span_used[span->page_type] = span;
+	}
+
+	return page;
+}
+
+//! Replace a huge span tracked by a first class heap with the given span, or stop tracking it if replacement is null.
+//  The replacement must already be linked to the next span in the list
+static void
+span_huge_replace_tracked(heap_t* heap, span_t* span, span_t* replacement) {
+	span_t** prev = heap->span_used + PAGE_HUGE;
+	while (*prev && (*prev != span))
+		prev = &(*prev)->next;
+	if (*prev)
+		*prev = replacement ? replacement : span->next;
+}
+
+static NOINLINE void
+span_deallocate_block(span_t* span, page_t* page, void* block) {
+	if (UNEXPECTED(page->page_type == PAGE_HUGE)) {
+#if ENABLE_SAMPLING
+		if (span->page.has_sampled_block)
+			sample_remove(pointer_offset(span, SPAN_HEADER_SIZE));
+#endif
+		rpmalloc_stat_sub(huge_alloc, (size_t)span->page_size * (size_t)span->page_count);
+		// Stop tracking span in first class heap
+		if (span->heap->is_first_class)
+			span_huge_replace_tracked(span->heap, span, 0);
+#if ENABLE_HUGE_CACHE
+		if (huge_cache_insert(span))
+			return;
+#endif
+		span_unmap(span);
+		return;
+	}
+
+	if (page->has_aligned_block) {
+		// Realign pointer to block start
+		block = page_block_realign(page, block);
+	}
+#if ENABLE_SAMPLING
+	if (page->has_sampled_block)
+		sample_remove(block);
+#endif
+
+	int is_thread_local = page_is_thread_heap(page);
+	if (EXPECTED(is_thread_local != 0)) {
+		heap_stat_add_free(page->heap, page->size_class, 1);
+		page_put_local_free_block(page, block);
+	} else if ((global_config.remote_free_batch > 1) && !page->heap->is_first_class &&
+	           (get_thread_heap()->id != 0)) {
+		// Multithreaded deallocation, buffer in the freeing heap. Pages of first class heaps are published
+		// immediately as the heap memory can be released with rpmalloc_heap_free_all at any time
+		heap_put_remote_free_block(get_thread_heap(), page, block);
+	} else {
+		// Multithreaded deallocation, push to deferred deallocation list.
+		page_put_thread_free_block(page, block);
+	}
+}
+
+////////////
+///
+/// Block interface
+///
+//////
+
+static inline span_t*
+block_get_span(block_t* block) {
 	return (span_t*)((uintptr_t)block & SPAN_MASK);
 }
 
@@ -1306,9 +3193,8 @@ block_deallocate(block_t* block) {
 	if (EXPECTED(is_thread_local != 0)) {
 		if (EXPECTED(page->generic_free == 0)) {
 			// Page is not huge, not full and has no aligned block - fast path
-			block->next = page->local_free;
-			page->local_free = block;
-			++page->local_free_count;
+			heap_stat_add_free(page->heap, page->size_class, 1);
+			page_push_local_free_block(page, block);
 			if (UNEXPECTED(--page->block_used == 0))
 				page_available_to_free(page);
 		} else {
@@ -1319,12 +3205,70 @@ block_deallocate(block_t* block) {
 	}
 }
 
+//! Deallocate a block of the given size. The page is found from the span as for an unsized free, which needs no size
+//  class lookup, so the size is only used to check in assert builds that it does not exceed the block size
+static inline void
+block_deallocate_sized(block_t* block, size_t size) {
+#if ENABLE_ASSERTS
+	page_t* page = span_get_page_from_block(block_get_span(block), block);
+	rpmalloc_assert((page->page_type == PAGE_HUGE) || (size <= page->block_size),
+	                "Sized free size exceeds block size");
+#endif
+	(void)sizeof(size);
+	block_deallocate(block);
+}
+
+//! Deallocate a batch of blocks, grouping runs of consecutive blocks in the same page to only check the
+//  owning thread once and push remote frees as one list
+static void
+block_deallocate_batch(void** blocks, size_t count) {
+	size_t iblock = 0;
+	while (iblock < count) {
+		block_t* block = blocks[iblock++];
+		if (!block)
+			continue;
+		span_t* span = block_get_span(block);
+		page_t* page = span_get_page_from_block(span, block);
+		if (UNEXPECTED((page->page_type == PAGE_HUGE) || page_has_sampled_block(page))) {
+			span_deallocate_block(span, page, block);
+			continue;
+		}
+		if (page->has_aligned_block)
+			block = page_block_realign(page, block);
+		if (page_is_thread_heap(page)) {
+			heap_stat_add_free(page->heap, page->size_class, 1);
+			page_put_local_free_block(page, block);
+			while ((iblock < count) && blocks[iblock] &&
+			       ((page_t*)((uintptr_t)blocks[iblock] & span->page_address_mask) == page)) {
+				block = blocks[iblock++];
+				if (page->has_aligned_block)
+					block = page_block_realign(page, block);
+				heap_stat_add_free(page->heap, page->size_class, 1);
+				page_put_local_free_block(page, block);
+			}
+		} else {
+			block_t* last = block;
+			uint32_t list_count = 1;
+			while ((iblock < count) && blocks[iblock] &&
+			       ((page_t*)((uintptr_t)blocks[iblock] & span->page_address_mask) == page)) {
+				block_t* next = blocks[iblock++];
+				if (page->has_aligned_block)
+					next = page_block_realign(page, next);
+				last->next = next;
+				last = next;
+				++list_count;
+			}
+			page_put_thread_free_block_list(page, block, last, list_count);
+		}
+	}
+}
+
 static inline size_t
 block_usable_size(block_t* block) {
 	span_t* span = (span_t*)((uintptr_t)block & SPAN_MASK);
 	if (EXPECTED(span->page_type <= PAGE_LARGE)) {
 		page_t* page = span_get_page_from_block(span, block);
-		void* blocks_start = pointer_offset(page, PAGE_HEADER_SIZE);
+		void* blocks_start = page_block_start(page);
 		return page->block_size - ((size_t)pointer_diff(block, blocks_start) % page->block_size);
 	} else {
 		return ((size_t)span->page_size * (size_t)span->page_count) - (size_t)pointer_diff(block, span);
@@ -1333,25 +3277,235 @@ block_usable_size(block_t* block) {
 
 ////////////
 ///
-/// Heap interface
+/// Global pool interface
 ///
 //////
 
+// The pools are lock free stacks where the low bits of the list head hold a modification tag to
+// avoid ABA problems. Pages and spans are always aligned to at least the small page size, and
+// memory for pooled pages and spans is never unmapped until finalization, so the next pointer
+// of a popped entry is always safe to read even if the entry is concurrently popped by another thread
+
+#define POOL_TAG_MASK ((uintptr_t)SMALL_PAGE_SIZE - 1)
+
+// While a free page is in the global pool its thread free list is unused and holds the pool state instead. Thread
+// free lists are either zero or have a non-zero list count in the high 32 bits, the pool state only uses the low
+// 32 bits for a flag set while pooled, a flag set while claimed by a decay of the pool and the number of the last
+// decay pass that visited the page. Pages are decayed in place, a page popped from the pool while claimed is only
+// reused once the decay of the page is done
+
+#define POOL_PAGE_POOLED 1ULL
+#define POOL_PAGE_CLAIMED 2ULL
+#define POOL_PAGE_PASS_SHIFT 2
+#define POOL_PAGE_PASS_MASK 0x3FFFFFFFU
+
+static inline void*
+pool_pointer(uintptr_t head) {
+	return (void*)(head & ~POOL_TAG_MASK);
+}
+
+static inline uintptr_t
+pool_head(void* pointer, uintptr_t prev_head) {
+	return (uintptr_t)pointer | ((prev_head + 1) & POOL_TAG_MASK);
+}
+
+//! Push a list of free pages from spans local to the given NUMA node to the global pool
+static void
+pool_push_page_list(uint32_t numa_node, page_type_t page_type, page_t* first, page_t* last) {
+	for (page_t* page = first; page != last; page = page->next)
+		atomic_store_explicit(&page->thread_free, POOL_PAGE_POOLED, memory_order_relaxed);
+	atomic_store_explicit(&last->thread_free, POOL_PAGE_POOLED, memory_order_relaxed);
+	atomic_uintptr_t* pool = &global_page_pool[numa_node][page_type];
+	uintptr_t head = atomic_load_explicit(pool, memory_order_relaxed);
+	do {
+		last->next = pool_pointer(head);
+	} while (!atomic_compare_exchange_weak_explicit(pool, &head, pool_head(first, head), memory_order_release,
+	                                                memory_order_relaxed));
+}
+
+//! Number of the last decay pass of the global pool
+static atomic_uint global_pool_decay_pass;
+
+//! Claim a page in the global pool for the given decay pass, fails if the page was popped from the pool, is claimed
+//  by a concurrent decay or was already visited by the pass
+static inline int
+pool_page_claim(page_t* page, unsigned long long pass) {
+	unsigned long long state = atomic_load_explicit(&page->thread_free, memory_order_acquire);
+	if (((state & ~((unsigned long long)POOL_PAGE_PASS_MASK << POOL_PAGE_PASS_SHIFT)) != POOL_PAGE_POOLED) ||
+	    ((state >> POOL_PAGE_PASS_SHIFT) == pass))
+		return 0;
+	return atomic_compare_exchange_strong_explicit(&page->thread_free, &state, state | POOL_PAGE_CLAIMED,
+	                                               memory_order_acquire, memory_order_relaxed);
+}
+
+//! Release a page in the global pool claimed by the given decay pass
 static inline void
-heap_lock_acquire(void) {
-	uintptr_t lock = 0;
-	uintptr_t this_lock = get_thread_id();
-	while (!atomic_compare_exchange_strong(&global_heap_lock, &lock, this_lock)) {
-		lock = 0;
+pool_page_unclaim(page_t* page, unsigned long long pass) {
+	atomic_store_explicit(&page->thread_free, (pass << POOL_PAGE_PASS_SHIFT) | POOL_PAGE_POOLED, memory_order_release);
+}
+
+//! Take ownership of a page popped from the global pool, waiting for a concurrent decay of the page to finish
+static inline void
+pool_page_take(page_t* page) {
+	unsigned long long state = atomic_load_explicit(&page->thread_free, memory_order_acquire);
+	while ((state & POOL_PAGE_CLAIMED) || !atomic_compare_exchange_weak_explicit(&page->thread_free, &state, 0,
+	                                                                             memory_order_acquire,
+	                                                                             memory_order_acquire)) {
 		wait_spin();
+		state = atomic_load_explicit(&page->thread_free, memory_order_acquire);
 	}
 }
 
-static inline void
-heap_lock_release(void) {
-	rpmalloc_assert((uintptr_t)atomic_load_explicit(&global_heap_lock, memory_order_relaxed) == get_thread_id(),
-	                "Bad heap lock");
-	atomic_store_explicit(&global_heap_lock, 0, memory_order_release);
+//! Decommit pages in the global pool that have been free for at least the given decay time. The pool lists are
+//  walked in place with each page claimed while processed, stopping at pages popped from the pool during the walk.
+//  If the deadline is non-zero, pages are only processed until the deadline in nanoseconds has passed. Returns the
+//  number of bytes decommitted
+static size_t
+pool_page_decay(uint32_t timestamp, uint32_t decay_time, uint64_t deadline) {
+	unsigned long long pass =
+	    (atomic_fetch_add_explicit(&global_pool_decay_pass, 1, memory_order_relaxed) + 1) & POOL_PAGE_PASS_MASK;
+	if (!pass)
+		pass = 1;
+	size_t decommit_size = 0;
+	for (uint32_t inode = 0; inode < global_numa_node_count; ++inode) {
+		for (uint32_t itype = 0; itype < 3; ++itype) {
+			atomic_uintptr_t* pool = &global_page_pool[inode][itype];
+			page_t* page = pool_pointer(atomic_load_explicit(pool, memory_order_acquire));
+			// The next page is stable while the page is claimed, it is only changed once the page is taken
+			while (page && pool_page_claim(page, pass)) {
+				if (deadline && (os_time_ns() >= deadline)) {
+					pool_page_unclaim(page, pass);
+					return decommit_size;
+				}
+				// Pages donated after the given timestamp, by a decay of the released heaps, are kept
+				if (!page->is_decommitted &&
+				    (!decay_time || ((int32_t)(timestamp - page->free_time) >= (int32_t)decay_time)))
+					decommit_size += page_decommit_memory(page);
+				page_t* next = page->next;
+				pool_page_unclaim(page, pass);
+				page = next;
+			}
+		}
+	}
+	return decommit_size;
+}
+
+//! Pop a free page from the global pool, preferring pages local to the given NUMA node
+static page_t*
+pool_pop_page(uint32_t numa_node, page_type_t page_type) {
+	for (uint32_t inode = 0; inode < global_numa_node_count; ++inode) {
+		atomic_uintptr_t* pool = &global_page_pool[(numa_node + inode) % global_numa_node_count][page_type];
+		uintptr_t head = atomic_load_explicit(pool, memory_order_acquire);
+		page_t* page = pool_pointer(head);
+		while (page) {
+			if (atomic_compare_exchange_weak_explicit(pool, &head, pool_head(page->next, head), memory_order_acquire,
+			                                          memory_order_acquire)) {
+				pool_page_take(page);
+				return page;
+			}
+			page = pool_pointer(head);
+		}
+	}
+	return 0;
+}
+
+//! Push a partially initialized span to the global pool of the NUMA node of the span
+static void
+pool_push_span(page_type_t page_type, span_t* span) {
+	rpmalloc_assert(span->page_type <= PAGE_LARGE, "NUMA node read from huge span");
+	atomic_uintptr_t* pool = &global_span_pool[span->numa_node][page_type];
+	uintptr_t head = atomic_load_explicit(pool, memory_order_relaxed);
+	do {
+		span->next = pool_pointer(head);
+	} while (!atomic_compare_exchange_weak_explicit(pool, &head, pool_head(span, head), memory_order_release,
+	                                                memory_order_relaxed));
+}
+
+//! Pop a partially initialized span from the global pool, preferring spans local to the given NUMA node
+static span_t*
+pool_pop_span(uint32_t numa_node, page_type_t page_type) {
+	for (uint32_t inode = 0; inode < global_numa_node_count; ++inode) {
+		atomic_uintptr_t* pool = &global_span_pool[(numa_node + inode) % global_numa_node_count][page_type];
+		uintptr_t head = atomic_load_explicit(pool, memory_order_acquire);
+		span_t* span = pool_pointer(head);
+		while (span) {
+			if (atomic_compare_exchange_weak_explicit(pool, &head, pool_head(span->next, head), memory_order_acquire,
+			                                          memory_order_acquire)) {
+				span->next = 0;
+				return span;
+			}
+			span = pool_pointer(head);
+		}
+	}
+	return 0;
+}
+
+////////////
+///
+/// Heap interface
+///
+//////
+
+// The queues of available heaps are lock free stacks with the same tagged head as the global pools. Heaps
+// are mapped as separate memory pages and never unmapped until finalization, leaving the low bits of the
+// heap address for the tag. Heaps are never removed from the list of all heaps, so it needs no tag. Released
+// heaps are decayed in place by claiming the queue state of the heap, a heap popped from the queue while
+// claimed is only reused once the decay of the heap is done.
+
+#define HEAP_QUEUE_TAG_MASK ((uintptr_t)4096 - 1)
+
+//! Queue state of a heap released to the queue of available heaps
+#define HEAP_QUEUE_RELEASED 1
+//! Queue state of a released heap claimed while its free pages are decommitted
+#define HEAP_QUEUE_CLAIMED 2
+
+//! Push a released heap to the queue of available heaps for the NUMA node of the heap
+static void
+heap_queue_push(heap_t* heap) {
+	rpmalloc_assert(!((uintptr_t)heap & HEAP_QUEUE_TAG_MASK), "Heap not aligned to memory page");
+	atomic_store_explicit(&heap->queue_state, HEAP_QUEUE_RELEASED, memory_order_relaxed);
+	atomic_uintptr_t* queue = global_heap_queue + heap->numa_node;
+	uintptr_t head = atomic_load_explicit(queue, memory_order_relaxed);
+	do {
+		heap->next = (heap_t*)(head & ~HEAP_QUEUE_TAG_MASK);
+	} while (!atomic_compare_exchange_weak_explicit(queue, &head,
+	                                                (uintptr_t)heap | ((head + 1) & HEAP_QUEUE_TAG_MASK),
+	                                                memory_order_release, memory_order_relaxed));
+}
+
+//! Pop an available heap from the queue for the given NUMA node
+static heap_t*
+heap_queue_pop(uint32_t numa_node) {
+	atomic_uintptr_t* queue = global_heap_queue + numa_node;
+	uintptr_t head = atomic_load_explicit(queue, memory_order_acquire);
+	heap_t* heap = (heap_t*)(head & ~HEAP_QUEUE_TAG_MASK);
+	while (heap) {
+		uintptr_t next_head = (uintptr_t)heap->next | ((head + 1) & HEAP_QUEUE_TAG_MASK);
+		if (atomic_compare_exchange_weak_explicit(queue, &head, next_head, memory_order_acquire,
+		                                          memory_order_acquire))
+			break;
+		heap = (heap_t*)(head & ~HEAP_QUEUE_TAG_MASK);
+	}
+	if (heap) {
+		// Wait for a concurrent decay of the heap to finish
+		unsigned int state = HEAP_QUEUE_RELEASED;
+		while (!atomic_compare_exchange_weak_explicit(&heap->queue_state, &state, 0, memory_order_acquire,
+		                                              memory_order_relaxed)) {
+			state = HEAP_QUEUE_RELEASED;
+			wait_spin();
+		}
+	}
+	return heap;
+}
+
+//! Add a new heap to the list of all heaps
+static void
+heap_list_push(heap_t* heap) {
+	uintptr_t head = atomic_load_explicit(&global_heap_list, memory_order_relaxed);
+	do {
+		heap->next_heap = (heap_t*)head;
+	} while (!atomic_compare_exchange_weak_explicit(&global_heap_list, &head, (uintptr_t)heap, memory_order_release,
+	                                                memory_order_relaxed));
 }
 
 static inline heap_t*
@@ -1363,19 +3517,23 @@ heap_initialize(void* block) {
 }
 
 static heap_t*
-heap_allocate_new(void) {
+heap_allocate_new(uint32_t numa_node) {
 	if (!global_config.page_size)
 		rpmalloc_initialize(0);
 	size_t heap_size = get_page_aligned_size(sizeof(heap_t));
 	size_t offset = 0;
 	size_t mapped_size = 0;
-	block_t* block = global_memory_interface->memory_map(heap_size, 0, &offset, &mapped_size);
+	block_t* block = numa_memory_map(numa_node, heap_size, 0, &offset, &mapped_size);
 #if ENABLE_DECOMMIT
-	global_memory_interface->memory_commit(block, heap_size);
+	memory_commit(block, heap_size);
+#else
+	memory_committed_add(heap_size);
 #endif
 	heap_t* heap = heap_initialize((void*)block);
 	heap->offset = (uint32_t)offset;
 	heap->mapped_size = mapped_size;
+	heap->numa_node = numa_node;
+	heap_list_push(heap);
 #if ENABLE_STATISTICS
 	atomic_fetch_add_explicit(&global_statistics.heap_count, 1, memory_order_relaxed);
 #endif
@@ -1384,60 +3542,281 @@ heap_allocate_new(void) {
 
 static void
 heap_unmap(heap_t* heap) {
+	memory_committed_sub(get_page_aligned_size(sizeof(heap_t)));
 	global_memory_interface->memory_unmap(heap, heap->offset, heap->mapped_size);
 }
 
 static heap_t*
 heap_allocate(int first_class) {
 	heap_t* heap = 0;
-	if (!first_class) {
-		heap_lock_acquire();
-		heap = global_heap_queue;
-		global_heap_queue = heap ? heap->next : 0;
-		heap_lock_release();
-	}
+	// Only reuse heaps from the local node, a heap from another node would keep reading remote memory
+	uint32_t numa_node = global_config.enable_numa ? os_numa_current_node() : 0;
+	if (!first_class)
+		heap = heap_queue_pop(numa_node);
 	if (!heap)
-		heap = heap_allocate_new();
+		heap = heap_allocate_new(numa_node);
 	if (heap) {
-		uintptr_t current_thread_id = get_thread_id();
-		heap_lock_acquire();
-		heap->next = global_heap_used;
-		heap->prev = 0;
-		if (global_heap_used)
-			global_heap_used->prev = heap;
-		global_heap_used = heap;
-		heap_lock_release();
-		heap->owner_thread = current_thread_id;
+		heap->is_first_class = (uint32_t)first_class;
+		heap->next = 0;
+		heap_set_owner_thread(heap, get_thread_id());
+#if ENABLE_SAMPLING
+		if (!heap->sample_random)
+			heap->sample_random = ((uint64_t)(uintptr_t)heap ^ ((uint64_t)heap->id << 32) ^ os_time_ms()) | 1;
+		heap->sample_countdown = sample_next_interval(heap);
+#endif
 	}
 	return heap;
 }
 
 static inline void
 heap_release(heap_t* heap) {
-	heap_lock_acquire();
-	if (heap->prev)
-		heap->prev->next = heap->next;
-	if (heap->next)
-		heap->next->prev = heap->prev;
-	if (global_heap_used == heap)
-		global_heap_used = heap->next;
-	heap->next = global_heap_queue;
-	global_heap_queue = heap;
-	heap_lock_release();
+	// Heaps of the threads using a shared first class heap are only released with the shared heap
+	heap->is_thread_current = 0;
+	if (heap->shared_parent)
+		return;
+	heap_flush_remote_free(heap);
+	// Thread IDs are reused by new threads, which must not take the local free path to a released heap. Frees
+	// go through the thread free lists, leaving the heap to the thread claiming or popping it from the queue
+	heap_set_owner_thread(heap, CPU_HEAP_UNOWNED);
+	heap_queue_push(heap);
+}
+
+#if ENABLE_PER_CPU_HEAPS
+
+// CPU heaps are held by a thread for the duration of a single call to the public interface. The mode is lock based,
+// every call pays an atomic compare and swap to acquire the heap and a release store to release it, and the local
+// free lists are not accessed in restartable sequence critical sections. The lock is only contended if a thread is
+// preempted or migrated while holding the heap of a CPU, in which case the next heap is tried. While held the heap
+// is set as the thread heap and owned by the thread, making frees to pages of the heap take the thread local fast
+// path and all other frees go through the lock free thread free lists.
+
+//! Get the heap of the given CPU index, allocating it if needed
+static heap_t*
+cpu_heap_get(uint32_t cpu_index) {
+	heap_t* heap = (heap_t*)atomic_load_explicit(&global_cpu_heap[cpu_index], memory_order_acquire);
+	if (EXPECTED(heap != 0))
+		return heap;
+	heap = heap_allocate(0);
+	heap_set_owner_thread(heap, CPU_HEAP_UNOWNED);
+	uintptr_t current = 0;
+	if (!atomic_compare_exchange_strong_explicit(&global_cpu_heap[cpu_index], &current, (uintptr_t)heap,
+	                                             memory_order_acq_rel, memory_order_acquire)) {
+		heap_release(heap);
+		heap = (heap_t*)current;
+	}
+	return heap;
+}
+
+//! Try to acquire the given CPU heap for the calling thread, returns non-zero if acquired
+static inline int
+cpu_heap_try_acquire(heap_t* heap, uintptr_t thread_id) {
+	uintptr_t unlocked = 0;
+	if (EXPECTED(atomic_load_explicit(&heap->cpu_lock, memory_order_relaxed) == 0) &&
+	    atomic_compare_exchange_strong_explicit(&heap->cpu_lock, &unlocked, thread_id, memory_order_acquire,
+	                                            memory_order_relaxed)) {
+		heap_set_owner_thread(heap, thread_id);
+		global_thread_heap = heap;
+		return 1;
+	}
+	return 0;
+}
+
+//! Acquire the heap for the CPU executing the calling thread, falling back to the heaps of other CPUs if held
+static heap_t*
+cpu_heap_acquire(void) {
+	if (UNEXPECTED(!global_cpu_heap_count))
+		rpmalloc_initialize(0);
+	uintptr_t thread_id = get_thread_id();
+	// Calls from the memory pressure callback are made while the thread holds a heap
+	heap_t* current = global_thread_heap;
+	if (UNEXPECTED(atomic_load_explicit(&current->cpu_lock, memory_order_relaxed) == thread_id)) {
+		++current->cpu_lock_depth;
+		return current;
+	}
+	if (UNEXPECTED(!global_thread_initialized))
+		global_thread_initialized = 1;
+	uint32_t cpu_index = os_current_cpu() % global_cpu_heap_count;
+	uint32_t round = 0;
+	while (1) {
+		for (uint32_t iheap = 0; iheap < global_cpu_heap_count; ++iheap) {
+			heap_t* heap = cpu_heap_get(cpu_index);
+			if (cpu_heap_try_acquire(heap, thread_id))
+				return heap;
+			if (++cpu_index == global_cpu_heap_count)
+				cpu_index = 0;
+		}
+		// All heaps are held by threads which have been preempted while holding them, spinning only burns the
+		// time slice they need to make progress
+		if (round < CPU_HEAP_SPIN_ROUNDS) {
+			++round;
+			wait_spin();
+		} else {
+			sched_yield();
+		}
+	}
 }
 
+//! Release a CPU heap held by the calling thread
 static void
-heap_page_free_decommit(heap_t* heap, uint32_t page_type, uint32_t page_retain_count) {
+cpu_heap_release(heap_t* heap) {
+	rpmalloc_assert(atomic_load_explicit(&heap->cpu_lock, memory_order_relaxed) == get_thread_id(),
+	                "CPU heap not held by thread");
+	if (UNEXPECTED(heap->cpu_lock_depth != 0)) {
+		--heap->cpu_lock_depth;
+		return;
+	}
+	global_thread_heap = global_heap_default;
+	heap_set_owner_thread(heap, CPU_HEAP_UNOWNED);
+	atomic_store_explicit(&heap->cpu_lock, 0, memory_order_release);
+}
+
+#endif
+
+//! Acquire the heap to use in the calling thread, must be released with thread_heap_release
+static inline heap_t*
+thread_heap_acquire(void) {
+#if ENABLE_PER_CPU_HEAPS
+	return cpu_heap_acquire();
+#else
+	return get_thread_heap();
+#endif
+}
+
+//! Release the heap acquired with thread_heap_acquire
+static inline void
+thread_heap_release(heap_t* heap) {
+#if ENABLE_PER_CPU_HEAPS
+	cpu_heap_release(heap);
+#else
+	(void)sizeof(heap);
+#endif
+}
+
+//! Decommit free pages beyond the given retain count, releasing at least the given number of bytes if possible
+//  but no more pages than needed for it. Committed pages are always first in the free list, decommit the committed
+//  pages at the end of the list to maintain this order. Returns the number of bytes decommitted
+static size_t
+heap_page_free_decommit(heap_t* heap, uint32_t page_type, uint32_t page_retain_count, size_t byte_limit) {
+	// Free pages of a prewarmed heap are kept committed up to the number of prewarmed pages
+	if (page_retain_count < heap->page_free_prewarm_count[page_type])
+		page_retain_count = heap->page_free_prewarm_count[page_type];
+	if (heap->page_free_commit_count[page_type] <= page_retain_count)
+		return 0;
 	page_t* page = heap->page_free[page_type];
-	while (page && page_retain_count) {
+	for (uint32_t iskip = 0; page && (iskip < page_retain_count); ++iskip)
 		page = page->next;
-		--page_retain_count;
+	if (byte_limit != SIZE_MAX) {
+		// Keep leading pages committed as long as the trailing pages alone reach the limit
+		size_t range_size = 0;
+		for (page_t* range = page; range && !range->is_decommitted; range = range->next)
+			range_size += page_decommit_size(range);
+		while (page && !page->is_decommitted && (range_size - page_decommit_size(page) >= byte_limit)) {
+			range_size -= page_decommit_size(page);
+			page = page->next;
+		}
 	}
-	while (page && (page->is_decommitted == 0)) {
-		page_decommit_memory_pages(page);
-		--heap->page_free_commit_count[page_type];
+	size_t decommit_size = 0;
+	uint32_t page_count = 0;
+	while (page && !page->is_decommitted) {
+		decommit_size += page_decommit_memory_pages(page);
+		++page_count;
 		page = page->next;
 	}
+	heap->page_free_commit_count[page_type] -= page_count;
+	return decommit_size;
+}
+
+//! Decommit free pages that have been free for at least the given decay time. Committed free pages are ordered
+//  newest first, so all pages after the first expired one are decommitted. Pages freed after the given timestamp,
+//  by a collection during the decay, are kept unless the decay time is zero. Returns the number of bytes decommitted
+static size_t
+heap_page_free_decay(heap_t* heap, uint32_t timestamp, uint32_t decay_time) {
+	size_t decommit_size = 0;
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		uint32_t retain_count = 0;
+		page_t* page = heap->page_free[itype];
+		while (decay_time && page && !page->is_decommitted &&
+		       ((int32_t)(timestamp - page->free_time) < (int32_t)decay_time)) {
+			page = page->next;
+			++retain_count;
+		}
+		decommit_size += heap_page_free_decommit(heap, itype, retain_count, SIZE_MAX);
+	}
+	return decommit_size;
+}
+
+//! Decommit free pages that have been free for at least the given decay time in the released heaps. The heaps are
+//  left in the queue, each released heap is claimed while processed and heaps in use are skipped. Blocks freed by
+//  other threads after the heap was released are collected first, pages emptied by them are donated to the global
+//  page pool, or for first class heaps decayed from the time of the collection. If the deadline is non-zero, heaps
+//  are only processed until the deadline in nanoseconds has passed. Returns the number of bytes decommitted
+static size_t
+heap_queue_page_decay(uint32_t timestamp, uint32_t decay_time, uint64_t deadline) {
+	size_t decommit_size = 0;
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap) {
+		if (deadline && (os_time_ns() >= deadline))
+			break;
+		unsigned int state = HEAP_QUEUE_RELEASED;
+		if (!atomic_compare_exchange_strong_explicit(&heap->queue_state, &state, HEAP_QUEUE_CLAIMED,
+		                                             memory_order_acquire, memory_order_relaxed))
+			continue;
+		if (!heap->is_first_class)
+			heap_donate_to_pool(heap);
+		else
+			heap_collect_thread_free(heap);
+		decommit_size += heap_page_free_decay(heap, timestamp, decay_time);
+		atomic_store_explicit(&heap->queue_state, HEAP_QUEUE_RELEASED, memory_order_release);
+	}
+	return decommit_size;
+}
+
+//! Release as much memory as possible when the committed memory exceeds the soft limit. The memory pressure callback is
+//  called first to let the application free memory, then all free pages in the given heap, the released heaps and the
+//  global page pool are decommitted and the huge span cache is flushed. Blocks freed by other threads to the released
+//  heaps are collected first and the emptied pages donated to the pool, the given heap is in the middle of an
+//  allocation and only its free pages are decommitted. If the live data exceeds the soft limit the release cannot get
+//  below it, further releases are then held off until the committed memory drops by the low water margin below the
+//  level left by the release and the commit of the given size, or the hold time has passed, instead of releasing on
+//  every commit
+static NOINLINE void
+memory_pressure_release(heap_t* heap, size_t size) {
+	uint32_t hold = atomic_load_explicit(&global_memory_pressure_hold, memory_order_relaxed);
+	// Signed difference, the timestamp with the low bit set can be one millisecond ahead of the current time
+	if (hold && ((int32_t)(os_time_ms() - hold) < MEMORY_PRESSURE_HOLD_TIME))
+		return;
+	int pressure = 0;
+	if (!atomic_compare_exchange_strong_explicit(&global_memory_pressure, &pressure, 1, memory_order_acquire,
+	                                             memory_order_relaxed))
+		return;
+	if (global_memory_interface->memory_pressure_callback) {
+		size_t committed_size = atomic_load_explicit(&global_memory_committed, memory_order_relaxed);
+		global_memory_interface->memory_pressure_callback(committed_size, global_config.soft_limit);
+	}
+#if ENABLE_HUGE_CACHE
+	huge_cache_release(0, 0);
+#endif
+#if ENABLE_DECOMMIT
+	if (!global_config.disable_decommit) {
+		uint32_t timestamp = os_time_ms();
+		heap_page_free_decay(heap, timestamp, 0);
+		heap_queue_page_decay(timestamp, 0, 0);
+		pool_page_decay(timestamp, 0, 0);
+	}
+#else
+	(void)sizeof(heap);
+#endif
+	// Timestamp zero is reserved for not held off
+	hold = 0;
+	size_t committed = atomic_load_explicit(&global_memory_committed, memory_order_relaxed) + size;
+	if (committed >= memory_pressure_low_water()) {
+		atomic_store_explicit(&global_memory_pressure_resume,
+		                      committed - (global_config.soft_limit >> MEMORY_PRESSURE_LOW_WATER_SHIFT),
+		                      memory_order_relaxed);
+		hold = os_time_ms() | 1;
+	}
+	atomic_store_explicit(&global_memory_pressure_hold, hold, memory_order_relaxed);
+	atomic_store_explicit(&global_memory_pressure, 0, memory_order_release);
 }
 
 static inline void
@@ -1445,13 +3824,18 @@ heap_make_free_page_available(heap_t* heap, uint32_t size_class, page_t* page) {
 	page->size_class = size_class;
 	page->block_size = global_size_class[size_class].block_size;
 	page->block_count = global_size_class[size_class].block_count;
+	// Shift is at most BLOCK_OFFSET_MAX_SHIFT, mask to the width of the page bitfield
+	page->block_offset_shift = global_size_class[size_class].block_offset_shift & 0x1F;
 	page->block_used = 0;
 	page->block_initialized = 0;
 	page->local_free = 0;
 	page->local_free_count = 0;
+	if (page->page_type != PAGE_SMALL)
+		memset(page_free_bitmap(page), 0, PAGE_BITMAP_HEADER_SIZE - PAGE_HEADER_SIZE);
 	page->is_full = 0;
 	page->is_free = 0;
 	page->has_aligned_block = 0;
+	page->has_sampled_block = 0;
 	page->generic_free = 0;
 	page->heap = heap;
 	page_t* head = heap->page_available[size_class];
@@ -1461,6 +3845,7 @@ heap_make_free_page_available(heap_t* heap, uint32_t size_class, page_t* page) {
 	if (head)
 		head->prev = page;
 	heap->page_available[size_class] = page;
+	heap_stat_inc_page(heap, page->page_type);
 	if (page->is_decommitted)
 		page_commit_memory_pages(page);
 }
@@ -1472,10 +3857,20 @@ heap_get_span(heap_t* heap, page_type_t page_type) {
 	if (EXPECTED(heap->span_partial[page_type] != 0))
 		return heap->span_partial[page_type];
 
+	// Check if there is a partially initialized span donated from a released heap. First class
+	// heaps must own all their spans in order to release them in rpmalloc_heap_free_all
+	span_t* span = (!heap->is_first_class) ? pool_pop_span(heap->numa_node, page_type) : 0;
+	if (span) {
+		span->heap = heap;
+		heap->span_partial[page_type] = span;
+		return span;
+	}
+
 	// Fallback path, map more memory
+	memory_pressure_check(heap, page_commit_chunk_size());
 	size_t offset = 0;
 	size_t mapped_size = 0;
-	span_t* span = global_memory_interface->memory_map(SPAN_SIZE, SPAN_SIZE, &offset, &mapped_size);
+	span = numa_memory_map(heap->numa_node, SPAN_SIZE, SPAN_SIZE, &offset, &mapped_size);
 	if (EXPECTED(span != 0)) {
 		uint32_t page_count = 0;
 		uint32_t page_size = 0;
@@ -1494,8 +3889,12 @@ heap_get_span(heap_t* heap, page_type_t page_type) {
 			page_address_mask = LARGE_PAGE_MASK;
 		}
 #if ENABLE_DECOMMIT
-		global_memory_interface->memory_commit(span, page_size);
+		size_t commit_size = page_commit_chunk_size();
+		memory_commit(span, (commit_size < page_size) ? commit_size : page_size);
+#else
+		memory_committed_add(SPAN_SIZE);
 #endif
+		heap_stat_inc(heap, page_type[page_type].span_map);
 		span->heap = heap;
 		span->page_type = page_type;
 		span->page_count = page_count;
@@ -1503,6 +3902,7 @@ heap_get_span(heap_t* heap, page_type_t page_type) {
 		span->page_address_mask = page_address_mask;
 		span->offset = (uint32_t)offset;
 		span->mapped_size = mapped_size;
+		span->numa_node = heap->numa_node;
 
 		heap->span_partial[page_type] = span;
 	}
@@ -1513,26 +3913,38 @@ heap_get_span(heap_t* heap, page_type_t page_type) {
 static page_t*
 heap_get_page(heap_t* heap, uint32_t size_class);
 
-static void
-block_deallocate(block_t* block);
+static int
+heap_queue_donate_to_pool(void);
+
+//! Process deferred deallocations of blocks in full pages from other threads, returns non-zero if any. The blocks
+//  are already realigned and belong to pages of the heap, they are returned to the pages without checking the
+//  owner thread, the calling thread must own the heap or have claimed it from the queue of released heaps
+static int
+heap_process_thread_free(heap_t* heap, page_type_t page_type) {
+	uintptr_t block_mt = atomic_load_explicit(&heap->thread_free[page_type], memory_order_relaxed);
+	if (EXPECTED(block_mt == 0))
+		return 0;
+	while (!atomic_compare_exchange_weak_explicit(&heap->thread_free[page_type], &block_mt, 0, memory_order_relaxed,
+	                                              memory_order_relaxed)) {
+		wait_spin();
+	}
+	block_t* block = (void*)block_mt;
+	while (block) {
+		block_t* next_block = block->next;
+		page_t* page = span_get_page_from_block(block_get_span(block), block);
+		heap_stat_add_free(page->heap, page->size_class, 1);
+		page_put_local_free_block(page, block);
+		block = next_block;
+	}
+	return 1;
+}
 
 static page_t*
 heap_get_page_generic(heap_t* heap, uint32_t size_class) {
 	page_type_t page_type = get_page_type(size_class);
 
 	// Check if there is a free page from multithreaded deallocations
-	uintptr_t block_mt = atomic_load_explicit(&heap->thread_free[page_type], memory_order_relaxed);
-	if (UNEXPECTED(block_mt != 0)) {
-		while (!atomic_compare_exchange_weak_explicit(&heap->thread_free[page_type], &block_mt, 0, memory_order_relaxed,
-		                                              memory_order_relaxed)) {
-			wait_spin();
-		}
-		block_t* block = (void*)block_mt;
-		while (block) {
-			block_t* next_block = block->next;
-			block_deallocate(block);
-			block = next_block;
-		}
+	if (UNEXPECTED(heap_process_thread_free(heap, page_type) != 0)) {
 		// Retry after processing deferred thread frees
 		return heap_get_page(heap, size_class);
 	}
@@ -1545,6 +3957,8 @@ heap_get_page_generic(heap_t* heap, uint32_t size_class) {
 			rpmalloc_assert(heap->page_free_commit_count[page_type] > 0, "Free committed page count out of sync");
 			--heap->page_free_commit_count[page_type];
 		}
+		heap_stat_inc(heap, size_class[size_class].page_from_free);
+		heap_stat_inc(heap, page_type[page_type].page_from_free);
 		heap_make_free_page_available(heap, size_class, page);
 		return page;
 	}
@@ -1556,6 +3970,22 @@ heap_get_page_generic(heap_t* heap, uint32_t size_class) {
 		return heap_get_page(get_thread_heap(), size_class);
 	}
 
+	// Check if there is a free page donated from a released heap, prefer already initialized
+	// pages over mapping or initializing new memory
+	if (!heap->is_first_class) {
+		page = pool_pop_page(heap->numa_node, page_type);
+		// Collect pages emptied in released heaps by other threads before initializing or mapping new pages
+		if (!page && heap_queue_donate_to_pool())
+			page = pool_pop_page(heap->numa_node, page_type);
+		if (page) {
+			heap_stat_inc(heap, size_class[size_class].page_from_free);
+			heap_stat_inc(heap, page_type[page_type].page_from_pool);
+			rpmalloc_stat_sub(pool_size, get_page_type_size(page_type));
+			heap_make_free_page_available(heap, size_class, page);
+			return page;
+		}
+	}
+
 	// Fallback path, find or allocate span for given size class
 	// If thread was not initialized, the heap for the new span
 	// will be different from the local heap variable in this scope
@@ -1563,6 +3993,9 @@ heap_get_page_generic(heap_t* heap, uint32_t size_class) {
 	span_t* span = heap_get_span(heap, page_type);
 	if (EXPECTED(span != 0)) {
 		page = span_allocate_page(span);
+		heap_stat_inc(page->heap, size_class[size_class].page_initialized);
+		if (span->page_initialized == 1)
+			heap_stat_inc(page->heap, size_class[size_class].span_map);
 		heap_make_free_page_available(page->heap, size_class, page);
 	}
 
@@ -1579,60 +4012,175 @@ heap_get_page(heap_t* heap, uint32_t size_class) {
 	return heap_get_page_generic(heap, size_class);
 }
 
+//! Initialize free small and medium pages in the heap for the given number of bytes, split evenly between the
+//  page types. The pages are fully committed and faulted in, and locked in memory if configured. The heap keeps
+//  the same number of free pages committed until donated to the pool
+static void
+heap_prewarm(heap_t* heap, size_t size) {
+	int prefault = (global_memory_interface->memory_commit == os_mcommit);
+	uint32_t timestamp = os_time_ms();
+	for (int itype = PAGE_SMALL; itype <= PAGE_MEDIUM; ++itype) {
+		size_t page_size = get_page_type_size((page_type_t)itype);
+		size_t page_count = ((size >> 1) + (page_size - 1)) / page_size;
+		for (size_t ipage = 0; ipage < page_count; ++ipage) {
+			span_t* span = heap_get_span(heap, (page_type_t)itype);
+			if (!span)
+				return;
+			page_t* page = span_allocate_page(span);
+			page_commit_to_offset(page, page_size);
+			if (prefault)
+				os_mprefault(page, page_size, global_config.prewarm_lock);
+			page->is_free = 1;
+			page->free_time = timestamp;
+			page->next = heap->page_free[itype];
+			heap->page_free[itype] = page;
+			++heap->page_free_commit_count[itype];
+			++heap->page_free_prewarm_count[itype];
+		}
+	}
+}
+
+//! Unlock the small and medium page spans that might hold locked prewarmed pages, allowing the memory to be
+//  decommitted after a later initialization. All pages are contained in spans owned by heaps or the span pool
+static void
+heap_prewarm_unlock(void) {
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap) {
+		for (int itype = PAGE_SMALL; itype <= PAGE_MEDIUM; ++itype) {
+			for (int ilist = 0; ilist < 2; ++ilist) {
+				span_t* span = ilist ? heap->span_used[itype] : heap->span_partial[itype];
+				for (; span; span = span->next)
+					os_munlock(span, (size_t)span->page_size * span->page_initialized);
+			}
+		}
+	}
+	for (uint32_t inode = 0; inode < global_numa_node_count; ++inode) {
+		for (int itype = PAGE_SMALL; itype <= PAGE_MEDIUM; ++itype) {
+			uintptr_t head = atomic_load_explicit(&global_span_pool[inode][itype], memory_order_acquire);
+			for (span_t* span = pool_pointer(head); span; span = span->next)
+				os_munlock(span, (size_t)span->page_size * span->page_initialized);
+		}
+	}
+}
+
 //! Pop a block from the heap local free list
 static inline RPMALLOC_ALLOCATOR void*
 heap_pop_local_free(heap_t* heap, uint32_t size_class) {
 	block_t** free_list = heap->local_free + size_class;
 	block_t* block = *free_list;
-	if (EXPECTED(block != 0))
+	if (EXPECTED(block != 0)) {
 		*free_list = block->next;
+		heap_stat_inc_alloc(heap, size_class);
+	}
 	return block;
 }
 
+//! Zero a block popped from the heap local free list, where only the free list link needs to be cleared if the
+//  list holds blocks not used since the page was zero initialized
+static inline void
+heap_zero_local_free_block(heap_t* heap, uint32_t size_class, block_t* block) {
+	if (heap->local_free_zero[size_class >> 5] & (1U << (size_class & 31)))
+		block->next = 0;
+	else
+		memset(block, 0, global_size_class[size_class].block_size);
+}
+
+#if PLATFORM_POSIX
+static NOINLINE void
+purge_thread_restart(void);
+#endif
+
+//! Restart the purge thread in a forked child process. Done in the allocation slow paths before the heap is
+//  modified, as creating the thread can allocate memory from the heap of the calling thread
+static inline void
+purge_thread_restart_check(void) {
+#if PLATFORM_POSIX
+	if (UNEXPECTED(atomic_load_explicit(&global_purge_thread_restart, memory_order_relaxed) != 0))
+		purge_thread_restart();
+#endif
+}
+
 //! Generic allocation path from heap pages, spans or new mapping
 static NOINLINE RPMALLOC_ALLOCATOR void*
 heap_allocate_block_small_to_large(heap_t* heap, uint32_t size_class, unsigned int zero) {
+	purge_thread_restart_check();
 	page_t* page = heap_get_page(heap, size_class);
 	if (EXPECTED(page != 0))
 		return page_allocate_block(page, zero);
 	return 0;
 }
 
+//! Zero the given number of bytes of the block in a reused huge span. If decommitted memory is known to read back
+//  as zero, the pages of a large block are decommitted and committed again instead of touching all the memory
+static void
+span_zero_huge_block(span_t* span, size_t size) {
+	void* block = pointer_offset(span, SPAN_HEADER_SIZE);
+#if ENABLE_DECOMMIT && DECOMMIT_IS_ZERO
+	if ((size >= HUGE_ZERO_DECOMMIT_SIZE) && !global_config.disable_decommit && !os_thp &&
+	    (global_memory_interface->memory_decommit == os_mdecommit)) {
+		size_t page_size = global_config.page_size;
+		size_t zero_start = get_page_aligned_size(SPAN_HEADER_SIZE);
+		size_t zero_end = (SPAN_HEADER_SIZE + size) & ~(page_size - 1);
+		memset(block, 0, zero_start - SPAN_HEADER_SIZE);
+		memory_decommit(pointer_offset(span, zero_start), zero_end - zero_start);
+		memory_commit(pointer_offset(span, zero_start), zero_end - zero_start);
+		memset(pointer_offset(span, zero_end), 0, (SPAN_HEADER_SIZE + size) - zero_end);
+		return;
+	}
+#endif
+	memset(block, 0, size);
+}
+
 //! Generic allocation path from heap pages, spans or new mapping
 static NOINLINE RPMALLOC_ALLOCATOR void*
 heap_allocate_block_huge(heap_t* heap, size_t size, unsigned int zero) {
-	(void)sizeof(heap);
+	purge_thread_restart_check();
 	size_t alloc_size = get_page_aligned_size(size + SPAN_HEADER_SIZE);
-	size_t offset = 0;
-	size_t mapped_size = 0;
-	void* block = global_memory_interface->memory_map(alloc_size, SPAN_SIZE, &offset, &mapped_size);
-	if (block) {
-		span_t* span = block;
+	span_t* span = 0;
+#if ENABLE_HUGE_CACHE
+	span = huge_cache_extract(alloc_size);
+	if (span) {
+		span->page.has_aligned_block = 0;
+		span->page.has_sampled_block = 0;
+	}
+#endif
+	if (!span) {
+		memory_pressure_check(heap, alloc_size);
+		size_t offset = 0;
+		size_t mapped_size = 0;
+		span = numa_memory_map(heap->numa_node, alloc_size, SPAN_SIZE, &offset, &mapped_size);
+		if (!span)
+			return 0;
 #if ENABLE_DECOMMIT
-		global_memory_interface->memory_commit(span, alloc_size);
+		memory_commit(span, alloc_size);
+#else
+		memory_committed_add(alloc_size);
 #endif
-		span->heap = heap;
 		span->page_type = PAGE_HUGE;
 		span->page_size = (uint32_t)global_config.page_size;
 		span->page_count = (uint32_t)(alloc_size / global_config.page_size);
 		span->page_address_mask = LARGE_PAGE_MASK;
 		span->offset = (uint32_t)offset;
 		span->mapped_size = mapped_size;
-		span->page.heap = heap;
 		span->page.is_full = 1;
+		span->page.is_zero = 1;
 		span->page.generic_free = 1;
 		span->page.page_type = PAGE_HUGE;
-		// Keep track of span if first class heap
-		if (!heap->owner_thread) {
-			span->next = heap->span_used[PAGE_HUGE];
-			heap->span_used[PAGE_HUGE] = span;
-		}
-		void* ptr = pointer_offset(block, SPAN_HEADER_SIZE);
-		if (zero)
-			memset(ptr, 0, size);
-		return ptr;
 	}
-	return 0;
+	span->heap = heap;
+	span->page.heap = heap;
+	rpmalloc_stat_add_peak(huge_alloc, (size_t)span->page_size * (size_t)span->page_count);
+	// Keep track of span if first class heap
+	if (heap->is_first_class) {
+		span->next = heap->span_used[PAGE_HUGE];
+		heap->span_used[PAGE_HUGE] = span;
+	}
+	void* ptr = pointer_offset(span, SPAN_HEADER_SIZE);
+	// Newly mapped memory is already zero
+	if (zero && !span->page.is_zero)
+		span_zero_huge_block(span, size);
+	span->page.is_zero = 0;
+	return ptr;
 }
 
 static RPMALLOC_ALLOCATOR NOINLINE void*
@@ -1643,7 +4191,7 @@ heap_allocate_block_generic(heap_t* heap, size_t size, unsigned int zero) {
 		if (EXPECTED(block != 0)) {
 			// Fast track with small block available in heap level local free list
 			if (zero)
-				memset(block, 0, global_size_class[size_class].block_size);
+				heap_zero_local_free_block(heap, size_class, block);
 			return block;
 		}
 
@@ -1653,22 +4201,106 @@ heap_allocate_block_generic(heap_t* heap, size_t size, unsigned int zero) {
 	return heap_allocate_block_huge(heap, size, zero);
 }
 
+#if ENABLE_SAMPLING
+
+//! Sample an allocated block and draw the next sample interval. The fallback heap of uninitialized threads has a
+//  zero countdown to always take the sampled path, but allocations through it are not sampled
+static NOINLINE void
+heap_sample_block(heap_t* heap, void* block, size_t size) {
+	if (!heap->id)
+		return;
+	// Allocations made while capturing the stack must not be sampled
+	heap->sample_countdown = SIZE_MAX;
+	if (block && global_config.sample_interval)
+		sample_record(span_get_page_from_block(block_get_span(block), block), block, size);
+	heap->sample_countdown = sample_next_interval(heap);
+}
+
+static NOINLINE RPMALLOC_ALLOCATOR void*
+heap_allocate_block_sampled(heap_t* heap, size_t size, unsigned int zero) {
+	void* block = heap_allocate_block_generic(heap, size, zero);
+	heap_sample_block(heap, block, size);
+	return block;
+}
+
+//! Count each block of an allocated batch against the sample interval, as individual allocations
+static inline void
+heap_sample_block_batch(heap_t* heap, size_t size, size_t count, void** blocks) {
+	for (size_t iblock = 0; iblock < count; ++iblock) {
+		if (UNEXPECTED(size >= heap->sample_countdown))
+			heap_sample_block(heap, blocks[iblock], size);
+		else
+			heap->sample_countdown -= size;
+	}
+}
+
+#endif
+
 //! Find or allocate a block of the given size
 static inline RPMALLOC_ALLOCATOR void*
 heap_allocate_block(heap_t* heap, size_t size, unsigned int zero) {
+#if ENABLE_SAMPLING
+	if (UNEXPECTED(size >= heap->sample_countdown))
+		return heap_allocate_block_sampled(heap, size, zero);
+	heap->sample_countdown -= size;
+#endif
 	if (size <= (SMALL_GRANULARITY * 64)) {
 		uint32_t size_class = get_size_class_tiny(size);
 		block_t* block = heap_pop_local_free(heap, size_class);
 		if (EXPECTED(block != 0)) {
 			// Fast track with small block available in heap level local free list
 			if (zero)
-				memset(block, 0, global_size_class[size_class].block_size);
+				heap_zero_local_free_block(heap, size_class, block);
 			return block;
 		}
 	}
 	return heap_allocate_block_generic(heap, size, zero);
 }
 
+//! Allocate a batch of blocks of the given size, returns the number of blocks allocated
+static size_t
+heap_allocate_block_batch(heap_t* heap, size_t size, size_t count, void** blocks) {
+	uint32_t size_class = get_size_class(size);
+	size_t allocated = 0;
+	if (UNEXPECTED(size_class >= SIZE_CLASS_COUNT)) {
+		while ((allocated < count) && ((blocks[allocated] = heap_allocate_block_huge(heap, size, 0)) != 0))
+			++allocated;
+#if ENABLE_SAMPLING
+		heap_sample_block_batch(heap, size, allocated, blocks);
+#endif
+		return allocated;
+	}
+	if (UNEXPECTED(heap->id == 0)) {
+		// Thread has not yet initialized, assign heap
+		rpmalloc_initialize(0);
+		heap = get_thread_heap();
+	}
+	while (allocated < count) {
+		// Drain the heap local free list before taking runs of blocks from pages
+		block_t* block = heap->local_free[size_class];
+		while (block && (allocated < count)) {
+			blocks[allocated++] = block;
+			block = block->next;
+			heap_stat_inc_alloc(heap, size_class);
+		}
+		heap->local_free[size_class] = block;
+		if (allocated == count)
+			break;
+		page_t* page = heap_get_page(heap, size_class);
+		if (!page)
+			break;
+		size_t page_allocated = page_allocate_block_batch(page, count - allocated, blocks + allocated);
+		rpmalloc_assert(page_allocated != 0, "Available page has no free blocks");
+		if (!page_allocated)
+			break;
+		allocated += page_allocated;
+	}
+#if ENABLE_SAMPLING
+	heap_sample_block_batch(heap, size, allocated, blocks);
+#endif
+	return allocated;
+}
+
 static RPMALLOC_ALLOCATOR void*
 heap_allocate_block_aligned(heap_t* heap, size_t alignment, size_t size, unsigned int zero) {
 	if (alignment <= SMALL_GRANULARITY)
@@ -1689,6 +4321,26 @@ heap_allocate_block_aligned(heap_t* heap, size_t alignment, size_t size, unsigne
 		return 0;
 	}
 
+	// Use the first size class where all blocks are naturally aligned, if not larger than the block that
+	// would be used by over-allocating for the alignment. This keeps the pages on the fast free path
+	uint32_t size_class = get_size_class_aligned(size, alignment);
+	if (size_class < SIZE_CLASS_COUNT) {
+		block_t* block = heap_pop_local_free(heap, size_class);
+		if (EXPECTED(block != 0)) {
+			if (zero)
+				heap_zero_local_free_block(heap, size_class, block);
+		} else {
+			block = heap_allocate_block_small_to_large(heap, size_class, zero);
+		}
+#if ENABLE_SAMPLING
+		if (UNEXPECTED(size >= heap->sample_countdown))
+			heap_sample_block(heap, block, size);
+		else
+			heap->sample_countdown -= size;
+#endif
+		return block;
+	}
+
 	size_t align_mask = alignment - 1;
 	block_t* block = heap_allocate_block(heap, size + alignment, zero);
 	if ((uintptr_t)block & align_mask) {
@@ -1702,6 +4354,46 @@ heap_allocate_block_aligned(heap_t* heap, size_t alignment, size_t size, unsigne
 	return block;
 }
 
+//! Resize a huge block by resizing the memory mapping of the span, return null if not possible
+static void*
+span_reallocate_huge(span_t* span, size_t size, unsigned int flags) {
+	if (!global_memory_interface->memory_remap)
+		return 0;
+	size_t current_size = (size_t)span->page_size * (size_t)span->page_count;
+	size_t new_size = get_page_aligned_size(size + SPAN_HEADER_SIZE);
+	if ((new_size > current_size) && !(flags & RPMALLOC_GROW_OR_FAIL)) {
+		// Use the same hysteresis as the copying reallocation to avoid remapping for each small growth
+		size_t lower_bound = current_size + (current_size >> 2) + (current_size >> 3);
+		if (new_size < lower_bound)
+			new_size = get_page_aligned_size(lower_bound);
+	}
+	heap_t* heap = span->heap;
+	size_t offset = span->offset;
+	size_t mapped_size = span->mapped_size;
+	span_t* new_span = global_memory_interface->memory_remap(span, current_size, new_size, &offset, &mapped_size,
+	                                                         flags & RPMALLOC_GROW_OR_FAIL);
+	if (!new_span)
+		return 0;
+	rpmalloc_assert(!((uintptr_t)new_span & ~SPAN_MASK), "Remapped huge span not span aligned");
+	new_span->offset = (uint32_t)offset;
+	new_span->mapped_size = mapped_size;
+	new_span->page_count = (uint32_t)(new_size / new_span->page_size);
+	if (new_size > current_size) {
+		memory_committed_add(new_size - current_size);
+		rpmalloc_stat_add_peak(huge_alloc, new_size - current_size);
+	} else {
+		memory_committed_sub(current_size - new_size);
+		rpmalloc_stat_sub(huge_alloc, current_size - new_size);
+	}
+	if ((new_span != span) && heap->is_first_class)
+		span_huge_replace_tracked(heap, span, new_span);
+#if ENABLE_SAMPLING
+	if ((new_span != span) && new_span->page.has_sampled_block)
+		sample_move(pointer_offset(span, SPAN_HEADER_SIZE), pointer_offset(new_span, SPAN_HEADER_SIZE));
+#endif
+	return pointer_offset(new_span, SPAN_HEADER_SIZE);
+}
+
 static void*
 heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, unsigned int flags) {
 	if (block) {
@@ -1710,7 +4402,7 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 		if (EXPECTED(span->page_type <= PAGE_LARGE)) {
 			// Normal sized block
 			page_t* page = span_get_page_from_block(span, block);
-			void* blocks_start = pointer_offset(page, PAGE_HEADER_SIZE);
+			void* blocks_start = page_block_start(page);
 			uint32_t block_offset = (uint32_t)pointer_diff(block, blocks_start);
 			uint32_t block_idx = block_offset / page->block_size;
 			void* block_origin = pointer_offset(blocks_start, (size_t)block_idx * page->block_size);
@@ -1728,12 +4420,23 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 			if (!old_size)
 				old_size = ((size_t)span->page_size * (size_t)span->page_count) - SPAN_HEADER_SIZE;
 			if ((size < old_size) && (size > LARGE_BLOCK_SIZE_LIMIT)) {
-				// Still fits in block and still huge, never mind trying to save memory,
+				// Still fits in block and still huge, release the tail pages if shrinking to less than half,
 				// but preserve data if alignment changed
+				if ((block_start == block) && (size < (old_size >> 1))) {
+					void* remapped = span_reallocate_huge(span, size, RPMALLOC_GROW_OR_FAIL);
+					if (remapped)
+						return remapped;
+				}
 				if ((block_start != block) && !(flags & RPMALLOC_NO_PRESERVE))
 					memmove(block_start, block, old_size);
 				return block_start;
 			}
+			if ((block_start == block) && (size > LARGE_BLOCK_SIZE_LIMIT)) {
+				// Grow the mapping in place, or move it without copying the content
+				void* remapped = span_reallocate_huge(span, size, flags);
+				if (remapped)
+					return remapped;
+			}
 		}
 	} else {
 		old_size = 0;
@@ -1753,44 +4456,168 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 			memcpy(block, old_block, old_size < new_size ? old_size : new_size);
 		block_deallocate(old_block);
 	}
-
-	return block;
+
+	return block;
+}
+
+static void*
+heap_reallocate_block_aligned(heap_t* heap, void* block, size_t alignment, size_t size, size_t old_size,
+                              unsigned int flags) {
+	if (alignment <= SMALL_GRANULARITY)
+		return heap_reallocate_block(heap, block, size, old_size, flags);
+
+	int no_alloc = !!(flags & RPMALLOC_GROW_OR_FAIL);
+	size_t usable_size = (block ? block_usable_size(block) : 0);
+	if ((usable_size >= size) && !((uintptr_t)block & (alignment - 1))) {
+		if (no_alloc || (size >= (usable_size / 2)))
+			return block;
+	}
+	// Aligned alloc marks span as having aligned blocks
+	void* old_block = block;
+	block = (!no_alloc ? heap_allocate_block_aligned(heap, alignment, size, 0) : 0);
+	if (EXPECTED(block != 0)) {
+		if (!(flags & RPMALLOC_NO_PRESERVE) && old_block) {
+			if (!old_size)
+				old_size = usable_size;
+			memcpy(block, old_block, old_size < size ? old_size : size);
+		}
+		if (EXPECTED(old_block != 0))
+			block_deallocate(old_block);
+	}
+	return block;
+}
+
+//! Return all blocks in the heap local free lists to the owning pages
+static void
+heap_flush_local_free(heap_t* heap) {
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		block_t* block = heap->local_free[iclass];
+		heap->local_free[iclass] = 0;
+		while (block) {
+			block_t* next_block = block->next;
+			page_t* page = span_get_page_from_block(block_get_span(block), block);
+			if (page->is_full)
+				page_full_to_available(page);
+			page_put_local_free_block(page, block);
+			block = next_block;
+		}
+	}
+}
+
+//! Process all deferred deallocations of the heap, moving pages emptied by them to the free list of the heap
+static void
+heap_collect_thread_free(heap_t* heap) {
+	heap_flush_remote_free(heap);
+	for (int itype = 0; itype < 3; ++itype)
+		heap_process_thread_free(heap, (page_type_t)itype);
+	heap_flush_local_free(heap);
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		page_t* page = heap->page_available[iclass];
+		while (page) {
+			page_t* next_page = page->next;
+			page_collect_thread_free_block_list(page);
+			if (page->block_used == 0)
+				page_available_to_free(page);
+			page = next_page;
+		}
+	}
+}
+
+//! Process all deferred deallocations and decommit free pages beyond the given retain count for each page type,
+//  at most the given number of bytes if non-zero. Returns the number of bytes decommitted
+static size_t
+heap_collect(heap_t* heap, const uint32_t* page_retain_count, size_t byte_budget) {
+	if (heap->id == 0)
+		return 0;
+	heap_collect_thread_free(heap);
+
+	size_t decommit_size = 0;
+#if ENABLE_DECOMMIT
+	if (global_config.disable_decommit)
+		return 0;
+	// Decommit larger pages first to release as much memory as possible within the budget in few calls
+	for (int itype = PAGE_LARGE; itype >= PAGE_SMALL; --itype) {
+		size_t byte_limit = SIZE_MAX;
+		if (byte_budget) {
+			if (decommit_size >= byte_budget)
+				break;
+			byte_limit = byte_budget - decommit_size;
+		}
+		decommit_size += heap_page_free_decommit(heap, (uint32_t)itype, page_retain_count[itype], byte_limit);
+	}
+#else
+	(void)sizeof(page_retain_count);
+	(void)sizeof(byte_budget);
+#endif
+	return decommit_size;
+}
+
+//! Donate all free pages and partially initialized spans of a released thread heap to the global pools, including
+//  pages emptied by deferred deallocations from other threads
+static void
+heap_donate_to_pool(heap_t* heap) {
+	heap_collect_thread_free(heap);
+	for (int itype = 0; itype < 3; ++itype) {
+		// Push runs of pages from spans on the same NUMA node
+		page_t* page = heap->page_free[itype];
+		while (page) {
+			uint32_t numa_node = page_get_span(page)->numa_node;
+			size_t page_count = 1;
+			page_t* last = page;
+			while (last->next && (page_get_span(last->next)->numa_node == numa_node)) {
+				last = last->next;
+				++page_count;
+			}
+			page_t* next = last->next;
+			heap_stat_add(heap, page_type[itype].page_to_pool, page_count);
+			rpmalloc_stat_add(pool_size, page_count * get_page_type_size((page_type_t)itype));
+			pool_push_page_list(numa_node, (page_type_t)itype, page, last);
+			page = next;
+		}
+		heap->page_free[itype] = 0;
+		heap->page_free_commit_count[itype] = 0;
+		// The pages are no longer kept committed once the thread adopting the prewarmed heap has exited
+		heap->page_free_prewarm_count[itype] = 0;
+		span_t* span = heap->span_partial[itype];
+		if (span) {
+			pool_push_span((page_type_t)itype, span);
+			heap->span_partial[itype] = 0;
+		}
+	}
 }
 
-static void*
-heap_reallocate_block_aligned(heap_t* heap, void* block, size_t alignment, size_t size, size_t old_size,
-                              unsigned int flags) {
-	if (alignment <= SMALL_GRANULARITY)
-		return heap_reallocate_block(heap, block, size, old_size, flags);
-
-	int no_alloc = !!(flags & RPMALLOC_GROW_OR_FAIL);
-	size_t usable_size = (block ? block_usable_size(block) : 0);
-	if ((usable_size >= size) && !((uintptr_t)block & (alignment - 1))) {
-		if (no_alloc || (size >= (usable_size / 2)))
-			return block;
-	}
-	// Aligned alloc marks span as having aligned blocks
-	void* old_block = block;
-	block = (!no_alloc ? heap_allocate_block_aligned(heap, alignment, size, 0) : 0);
-	if (EXPECTED(block != 0)) {
-		if (!(flags & RPMALLOC_NO_PRESERVE) && old_block) {
-			if (!old_size)
-				old_size = usable_size;
-			memcpy(block, old_block, old_size < size ? old_size : size);
-		}
-		if (EXPECTED(old_block != 0))
-			block_deallocate(old_block);
+//! Donate the pages emptied by blocks freed from other threads in the released heaps to the global pools, if any
+//  blocks were freed to released heaps since the last collection. Each released heap is claimed while processed
+//  and heaps in use are skipped. Returns non-zero if the released heaps were collected
+static int
+heap_queue_donate_to_pool(void) {
+	if (!atomic_load_explicit(&global_heap_queue_freed, memory_order_relaxed) ||
+	    !atomic_exchange_explicit(&global_heap_queue_freed, 0, memory_order_relaxed))
+		return 0;
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap) {
+		unsigned int state = HEAP_QUEUE_RELEASED;
+		if (heap->is_first_class ||
+		    !atomic_compare_exchange_strong_explicit(&heap->queue_state, &state, HEAP_QUEUE_CLAIMED,
+		                                             memory_order_acquire, memory_order_relaxed))
+			continue;
+		heap_donate_to_pool(heap);
+		atomic_store_explicit(&heap->queue_state, HEAP_QUEUE_RELEASED, memory_order_release);
 	}
-	return block;
+	return 1;
 }
 
 static void
 heap_free_all(heap_t* heap) {
+	heap_flush_remote_free(heap);
+#if ENABLE_SAMPLING
+	sample_remove_heap(heap);
+#endif
 	for (int itype = 0; itype < 3; ++itype) {
 		span_t* span = heap->span_partial[itype];
 		while (span) {
 			span_t* span_next = span->next;
-			global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
+			span_unmap(span);
 			span = span_next;
 		}
 		heap->span_partial[itype] = 0;
@@ -1802,7 +4629,7 @@ heap_free_all(heap_t* heap) {
 		span_t* span = heap->span_used[itype];
 		while (span) {
 			span_t* span_next = span->next;
-			global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
+			span_unmap(span);
 			span = span_next;
 		}
 		heap->span_used[itype] = 0;
@@ -1811,10 +4638,337 @@ heap_free_all(heap_t* heap) {
 	memset(heap->page_available, 0, sizeof(heap->page_available));
 
 #if ENABLE_STATISTICS
-	// TODO: Fix
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass)
+		heap->statistics.size_class[iclass].alloc_current = 0;
+	for (int itype = 0; itype < 3; ++itype)
+		heap->statistics.page_type[itype].page_current = 0;
+#endif
+}
+
+//! Reset an initialized page of a heap being reset to the free state, keeping the memory committed
+static inline void
+heap_reset_page(page_t* page, uint32_t timestamp) {
+	page->block_used = 0;
+	page->block_initialized = 0;
+	page->local_free = 0;
+	page->local_free_count = 0;
+	page->is_full = 0;
+	page->is_free = 1;
+	page->is_zero = 0;
+	page->has_aligned_block = 0;
+	page->has_sampled_block = 0;
+	page->generic_free = 0;
+	page->free_time = timestamp;
+	atomic_store_explicit(&page->thread_free, 0, memory_order_relaxed);
+}
+
+//! Discard all blocks allocated by the heap but keep the spans of small, medium and large pages mapped. All
+//  initialized pages become free pages, kept committed up to the given number of bytes and decommitted beyond
+//  that. Huge blocks are released to the huge span cache or unmapped
+static void
+heap_reset(heap_t* heap, size_t retain_size) {
+	heap_flush_remote_free(heap);
+#if ENABLE_SAMPLING
+	sample_remove_heap(heap);
+#endif
+	span_t* span = heap->span_used[PAGE_HUGE];
+	while (span) {
+		span_t* span_next = span->next;
+		span->next = 0;
+		rpmalloc_stat_sub(huge_alloc, (size_t)span->page_size * (size_t)span->page_count);
+#if ENABLE_HUGE_CACHE
+		if (!huge_cache_insert(span))
+			span_unmap(span);
+#else
+		span_unmap(span);
+#endif
+		span = span_next;
+	}
+	heap->span_used[PAGE_HUGE] = 0;
+
+	uint32_t timestamp = os_time_ms();
+	size_t retained_size = 0;
+	for (int itype = 0; itype < 3; ++itype) {
+		// Committed pages must be first in the free list
+		page_t* commit_first = 0;
+		page_t* commit_last = 0;
+		page_t* decommit_first = 0;
+		uint32_t commit_count = 0;
+		for (int ilist = 0; ilist < 2; ++ilist) {
+			span = ilist ? heap->span_used[itype] : heap->span_partial[itype];
+			for (; span; span = span->next) {
+				for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage) {
+					page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+					heap_reset_page(page, timestamp);
+					if (!page->is_decommitted) {
+						size_t committed_size = page_committed_size(page);
+						if (retained_size + committed_size > retain_size)
+							page_decommit_memory_pages(page);
+						else
+							retained_size += committed_size;
+					}
+					if (page->is_decommitted) {
+						page->next = decommit_first;
+						decommit_first = page;
+					} else {
+						page->next = commit_first;
+						commit_first = page;
+						if (!commit_last)
+							commit_last = page;
+						++commit_count;
+					}
+				}
+			}
+		}
+		if (commit_last)
+			commit_last->next = decommit_first;
+		heap->page_free[itype] = commit_first ? commit_first : decommit_first;
+		heap->page_free_commit_count[itype] = commit_count;
+		atomic_store_explicit(&heap->thread_free[itype], 0, memory_order_relaxed);
+	}
+	memset(heap->local_free, 0, sizeof(heap->local_free));
+	memset(heap->page_available, 0, sizeof(heap->page_available));
+
+#if ENABLE_STATISTICS
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass)
+		heap->statistics.size_class[iclass].alloc_current = 0;
+	for (int itype = 0; itype < 3; ++itype)
+		heap->statistics.page_type[itype].page_current = 0;
 #endif
 }
 
+////////////
+///
+/// Allocation tracing
+///
+//////
+
+#if ENABLE_TRACE
+
+//! Size of the window of a trace file mapped by a thread at a time
+#define TRACE_WINDOW_SIZE (1024 * 1024)
+#define TRACE_WINDOW_RECORD_COUNT (TRACE_WINDOW_SIZE / sizeof(rpmalloc_trace_record_t))
+//! Maximum length of the trace file path prefix
+#define TRACE_PATH_MAX 256
+
+_Static_assert(sizeof(rpmalloc_trace_record_t) == 32, "Invalid trace record size");
+_Static_assert(sizeof(rpmalloc_trace_header_t) == sizeof(rpmalloc_trace_record_t), "Invalid trace header size");
+
+//! Per thread allocation trace, records are written directly to a shared mapping of a window of the trace file
+typedef struct trace_thread_t {
+	//! Mapped window of the trace file, null if the trace file is not open
+	rpmalloc_trace_record_t* window;
+	//! Number of records written to the window
+	size_t used;
+	//! Offset of the window in the trace file
+	size_t offset;
+	//! Trace file descriptor
+	int fd;
+	//! Trace generation of the trace file
+	unsigned int generation;
+} trace_thread_t;
+
+//! Trace file path prefix, copied from the configuration
+static char global_trace_path[TRACE_PATH_MAX];
+//! Flag set while allocations are traced
+static int global_trace_enabled;
+//! Trace generation, incremented when tracing starts so threads open new trace files
+static atomic_uint global_trace_generation;
+//! Index of the next thread to open a trace file
+static atomic_uint global_trace_thread_index;
+//! Allocation trace of the current thread
+static _Thread_local trace_thread_t global_thread_trace TLS_MODEL;
+
+//! Drop the trace file inherited from the parent process by the forking thread in the child process, threads of the
+//  child process open new trace files with the process ID of the child
+static void
+trace_fork_child(void) {
+	trace_thread_t* trace = &global_thread_trace;
+	if (trace->window) {
+		munmap(trace->window, TRACE_WINDOW_SIZE);
+		close(trace->fd);
+		trace->window = 0;
+	}
+	trace->generation = 0;
+	atomic_store_explicit(&global_trace_thread_index, 0, memory_order_relaxed);
+}
+
+//! Start tracing to the configured path prefix, or the path prefix in the environment variable
+static void
+trace_initialize(void) {
+	const char* path = global_config.trace_path ? global_config.trace_path : getenv("RPMALLOC_TRACE");
+	size_t length = path ? strlen(path) : 0;
+	if (!length || (length >= TRACE_PATH_MAX)) {
+		global_config.trace_path = 0;
+		return;
+	}
+	memcpy(global_trace_path, path, length + 1);
+	global_config.trace_path = global_trace_path;
+	atomic_store_explicit(&global_trace_thread_index, 0, memory_order_relaxed);
+	atomic_fetch_add_explicit(&global_trace_generation, 1, memory_order_release);
+	global_trace_enabled = 1;
+}
+
+//! Append the decimal representation of the value to the path
+static size_t
+trace_path_append(char* path, size_t length, unsigned int value) {
+	char digits[16];
+	size_t digit_count = 0;
+	path[length++] = '.';
+	do {
+		digits[digit_count++] = (char)('0' + (value % 10));
+		value /= 10;
+	} while (value);
+	while (digit_count)
+		path[length++] = digits[--digit_count];
+	path[length] = 0;
+	return length;
+}
+
+//! Open the trace file <path>.<process id>.<thread index> of the calling thread with the next thread index and map
+//  the first window, the first record slot holds the file header. Done without allocating memory, tracing is
+//  silently disabled for the thread on failure. The header is stamped with the timestamp of the first record, which
+//  can be taken before the file is opened
+static void
+trace_thread_open(trace_thread_t* trace, uint64_t timestamp) {
+	char path[TRACE_PATH_MAX + 32];
+	size_t length = strlen(global_trace_path);
+	memcpy(path, global_trace_path, length);
+	unsigned int process_id = (unsigned int)getpid();
+	unsigned int thread_index = atomic_fetch_add_explicit(&global_trace_thread_index, 1, memory_order_relaxed);
+	length = trace_path_append(path, length, process_id);
+	trace_path_append(path, length, thread_index);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	void* window = MAP_FAILED;
+	if (!ftruncate(fd, TRACE_WINDOW_SIZE))
+		window = mmap(0, TRACE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (window == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	rpmalloc_trace_header_t* header = window;
+	header->magic = RPMALLOC_TRACE_MAGIC;
+	header->version = RPMALLOC_TRACE_VERSION;
+	header->record_size = sizeof(rpmalloc_trace_record_t);
+	header->thread_index = thread_index;
+	header->process_id = process_id;
+	header->timestamp = timestamp;
+	trace->window = window;
+	trace->used = 1;
+	trace->offset = 0;
+	trace->fd = fd;
+}
+
+//! Close the trace file of the calling thread, truncating it to the records written
+static void
+trace_thread_close(trace_thread_t* trace) {
+	if (!trace->window)
+		return;
+	munmap(trace->window, TRACE_WINDOW_SIZE);
+	trace->window = 0;
+	if (ftruncate(trace->fd, (off_t)(trace->offset + (trace->used * sizeof(rpmalloc_trace_record_t)))))
+		trace->used = 0;
+	close(trace->fd);
+}
+
+//! Map the next window of the trace file when the current window is full, returns zero and closes the file if
+//  the file cannot be extended
+static int
+trace_thread_advance(trace_thread_t* trace) {
+	size_t offset = trace->offset + TRACE_WINDOW_SIZE;
+	void* window = MAP_FAILED;
+	if (!ftruncate(trace->fd, (off_t)(offset + TRACE_WINDOW_SIZE)))
+		window = mmap(0, TRACE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, (off_t)offset);
+	if (window == MAP_FAILED) {
+		trace_thread_close(trace);
+		return 0;
+	}
+	munmap(trace->window, TRACE_WINDOW_SIZE);
+	trace->window = window;
+	trace->used = 0;
+	trace->offset = offset;
+	return 1;
+}
+
+//! Write a trace record with the given timestamp for the calling thread, opening the trace file on the first record
+//  of the thread in the current trace generation. Records after the thread has been finalized are dropped
+static NOINLINE void
+trace_write(uint64_t timestamp, uint32_t op, void* block, void* previous, size_t size, size_t alignment) {
+	trace_thread_t* trace = &global_thread_trace;
+	unsigned int generation = atomic_load_explicit(&global_trace_generation, memory_order_acquire);
+	if (UNEXPECTED(trace->generation != generation)) {
+		trace_thread_close(trace);
+		trace->generation = generation;
+		trace_thread_open(trace, timestamp);
+	}
+	if (!trace->window)
+		return;
+	if ((trace->used == TRACE_WINDOW_RECORD_COUNT) && !trace_thread_advance(trace))
+		return;
+	uint64_t alignment_shift =
+	    (alignment > 1) ? (uint64_t)((sizeof(uintptr_t) * 8) - 1 - rpmalloc_clz((uintptr_t)alignment)) : 0;
+	rpmalloc_trace_record_t* record = trace->window + trace->used++;
+	record->timestamp = timestamp;
+	record->block = (uint64_t)(uintptr_t)block;
+	record->previous = (uint64_t)(uintptr_t)previous;
+	record->info = ((uint64_t)op << 56ULL) | (alignment_shift << 48ULL) | ((uint64_t)size & ((1ULL << 48ULL) - 1));
+}
+
+//! Close the trace file of the calling thread, no more records are written by the thread in this trace generation
+static void
+trace_thread_finalize(void) {
+	trace_thread_t* trace = &global_thread_trace;
+	trace_thread_close(trace);
+	trace->generation = atomic_load_explicit(&global_trace_generation, memory_order_acquire);
+}
+
+//! Stop tracing, the trace files of other threads are closed when the threads are finalized
+static void
+trace_finalize(void) {
+	global_trace_enabled = 0;
+	global_config.trace_path = 0;
+}
+
+// Frees are recorded before the block is released and reallocations are timestamped before the previous block is
+// released, as the block can be reused by another thread as soon as it is released. Allocations are recorded after
+// the block is allocated, ordering the records of each address by timestamp
+#define trace_timestamp() (UNEXPECTED(global_trace_enabled) ? os_time_ns() : 0)
+#define trace_record_at(timestamp, op, block, previous, size, alignment)   \
+	do {                                                                   \
+		if (UNEXPECTED(global_trace_enabled))                              \
+			trace_write(timestamp, op, block, previous, size, alignment); \
+	} while (0)
+#define trace_record(op, block, previous, size, alignment) \
+	trace_record_at(os_time_ns(), op, block, previous, size, alignment)
+#define trace_record_batch(op, blocks, count, size)                              \
+	do {                                                                         \
+		if (UNEXPECTED(global_trace_enabled)) {                                  \
+			for (size_t itrace = 0; itrace < (count); ++itrace) {                \
+				if ((blocks)[itrace])                                            \
+					trace_write(os_time_ns(), op, (blocks)[itrace], 0, size, 0); \
+			}                                                                    \
+		}                                                                        \
+	} while (0)
+
+#else
+
+#define trace_timestamp() ((uint64_t)0)
+#define trace_record_at(timestamp, op, block, previous, size, alignment) \
+	do {                                                                 \
+		(void)sizeof(timestamp);                                         \
+	} while (0)
+#define trace_record(op, block, previous, size, alignment) \
+	do {                                                   \
+	} while (0)
+#define trace_record_batch(op, blocks, count, size) \
+	do {                                            \
+	} while (0)
+
+#endif
+
 ////////////
 ///
 /// Extern interface
@@ -1823,7 +4977,29 @@ heap_free_all(heap_t* heap) {
 
 int
 rpmalloc_is_thread_initialized(void) {
+#if ENABLE_PER_CPU_HEAPS
+	return (global_rpmalloc_initialized && global_thread_initialized) ? 1 : 0;
+#else
 	return (get_thread_heap() != global_heap_default) ? 1 : 0;
+#endif
+}
+
+extern unsigned int
+rpmalloc_thread_numa_node(void) {
+	return get_thread_heap()->numa_node;
+}
+
+extern int
+rpmalloc_thread_set_numa_node(unsigned int node) {
+	if (!global_config.enable_numa || (node >= global_numa_node_count) || ENABLE_PER_CPU_HEAPS)
+		return -1;
+	heap_t* heap = get_thread_heap();
+	if (heap->id == 0)
+		heap = get_thread_heap_allocate();
+	if (!heap)
+		return -1;
+	heap->numa_node = node;
+	return 0;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -1834,8 +5010,11 @@ rpmalloc(size_t size) {
 		return 0;
 	}
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block(heap, size, 0);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block(heap, size, 0);
+	thread_heap_release(heap);
+	trace_record(RPMALLOC_TRACE_ALLOC, block, 0, size, 0);
+	return block;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -1846,15 +5025,54 @@ rpzalloc(size_t size) {
 		return 0;
 	}
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block(heap, size, 1);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block(heap, size, 1);
+	thread_heap_release(heap);
+	trace_record(RPMALLOC_TRACE_ZALLOC, block, 0, size, 0);
+	return block;
 }
 
 extern inline void
 rpfree(void* ptr) {
 	if (UNEXPECTED(ptr == 0))
 		return;
+	trace_record(RPMALLOC_TRACE_FREE, ptr, 0, 0, 0);
+	heap_t* heap = thread_heap_acquire();
 	block_deallocate(ptr);
+	thread_heap_release(heap);
+}
+
+extern inline void
+rpfree_sized(void* ptr, size_t size) {
+	if (UNEXPECTED(ptr == 0))
+		return;
+	trace_record(RPMALLOC_TRACE_FREE, ptr, 0, size, 0);
+	heap_t* heap = thread_heap_acquire();
+	block_deallocate_sized(ptr, size);
+	thread_heap_release(heap);
+}
+
+extern size_t
+rpmalloc_alloc_batch(size_t size, size_t count, void** blocks) {
+#if ENABLE_VALIDATE_ARGS
+	if (size >= MAX_ALLOC_SIZE) {
+		errno = EINVAL;
+		return 0;
+	}
+#endif
+	heap_t* heap = thread_heap_acquire();
+	size_t allocated = heap_allocate_block_batch(heap, size, count, blocks);
+	thread_heap_release(heap);
+	trace_record_batch(RPMALLOC_TRACE_ALLOC, blocks, allocated, size);
+	return allocated;
+}
+
+extern void
+rpfree_batch(void** ptrs, size_t count) {
+	trace_record_batch(RPMALLOC_TRACE_FREE, ptrs, count, 0);
+	heap_t* heap = thread_heap_acquire();
+	block_deallocate_batch(ptrs, count);
+	thread_heap_release(heap);
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -1877,8 +5095,11 @@ rpcalloc(size_t num, size_t size) {
 #else
 	total = num * size;
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block(heap, total, 1);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block(heap, total, 1);
+	thread_heap_release(heap);
+	trace_record(RPMALLOC_TRACE_ZALLOC, block, 0, total, 0);
+	return block;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -1889,8 +5110,12 @@ rprealloc(void* ptr, size_t size) {
 		return ptr;
 	}
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_reallocate_block(heap, ptr, size, 0, 0);
+	uint64_t trace_time = trace_timestamp();
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_reallocate_block(heap, ptr, size, 0, 0);
+	thread_heap_release(heap);
+	trace_record_at(trace_time, RPMALLOC_TRACE_REALLOC, block, ptr, size, 0);
+	return block;
 }
 
 extern RPMALLOC_ALLOCATOR void*
@@ -1901,20 +5126,30 @@ rpaligned_realloc(void* ptr, size_t alignment, size_t size, size_t oldsize, unsi
 		return 0;
 	}
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_reallocate_block_aligned(heap, ptr, alignment, size, oldsize, flags);
+	uint64_t trace_time = trace_timestamp();
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_reallocate_block_aligned(heap, ptr, alignment, size, oldsize, flags);
+	thread_heap_release(heap);
+	trace_record_at(trace_time, RPMALLOC_TRACE_REALLOC, block, ptr, size, alignment);
+	return block;
 }
 
 extern RPMALLOC_ALLOCATOR void*
 rpaligned_alloc(size_t alignment, size_t size) {
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block_aligned(heap, alignment, size, 0);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block_aligned(heap, alignment, size, 0);
+	thread_heap_release(heap);
+	trace_record(RPMALLOC_TRACE_ALLOC, block, 0, size, alignment);
+	return block;
 }
 
 extern RPMALLOC_ALLOCATOR void*
 rpaligned_zalloc(size_t alignment, size_t size) {
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block_aligned(heap, alignment, size, 1);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block_aligned(heap, alignment, size, 1);
+	thread_heap_release(heap);
+	trace_record(RPMALLOC_TRACE_ZALLOC, block, 0, size, alignment);
+	return block;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -1937,23 +5172,30 @@ rpaligned_calloc(size_t alignment, size_t num, size_t size) {
 #else
 	total = num * size;
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block_aligned(heap, alignment, total, 1);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block_aligned(heap, alignment, total, 1);
+	thread_heap_release(heap);
+	trace_record(RPMALLOC_TRACE_ZALLOC, block, 0, total, alignment);
+	return block;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
 rpmemalign(size_t alignment, size_t size) {
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block_aligned(heap, alignment, size, 0);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block_aligned(heap, alignment, size, 0);
+	thread_heap_release(heap);
+	trace_record(RPMALLOC_TRACE_ALLOC, block, 0, size, alignment);
+	return block;
 }
 
 extern inline int
 rpposix_memalign(void** memptr, size_t alignment, size_t size) {
-	heap_t* heap = get_thread_heap();
-	if (memptr)
-		*memptr = heap_allocate_block_aligned(heap, alignment, size, 0);
-	else
+	if (!memptr)
 		return EINVAL;
+	heap_t* heap = thread_heap_acquire();
+	*memptr = heap_allocate_block_aligned(heap, alignment, size, 0);
+	thread_heap_release(heap);
+	trace_record(RPMALLOC_TRACE_ALLOC, *memptr, 0, size, alignment);
 	return *memptr ? 0 : ENOMEM;
 }
 
@@ -1962,11 +5204,265 @@ rpmalloc_usable_size(void* ptr) {
 	return (ptr ? block_usable_size(ptr) : 0);
 }
 
-////////////
-///
-/// Initialization and finalization
-///
-//////
+////////////
+///
+/// Initialization and finalization
+///
+//////
+
+#if PLATFORM_WINDOWS
+//! Background purge thread
+static HANDLE global_purge_thread;
+//! Event signalled to stop the purge thread
+static HANDLE global_purge_event;
+#else
+//! Background purge thread
+static pthread_t global_purge_thread;
+//! Flag set if the purge thread is running
+static int global_purge_thread_running;
+//! Flag set to stop the purge thread
+static int global_purge_thread_stop;
+//! Lock and condition signalled to stop the purge thread
+static pthread_mutex_t global_purge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t global_purge_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+//! Get the interval in milliseconds between purges in the purge thread
+static uint32_t
+purge_thread_interval(void) {
+	uint32_t interval = global_config.decay_time >> 1;
+	return (interval > PURGE_MIN_INTERVAL) ? interval : PURGE_MIN_INTERVAL;
+}
+
+#if PLATFORM_WINDOWS
+
+static DWORD WINAPI
+purge_thread_main(LPVOID arg) {
+	(void)sizeof(arg);
+	DWORD interval = (DWORD)purge_thread_interval();
+	while (WaitForSingleObject(global_purge_event, interval) == WAIT_TIMEOUT)
+		rpmalloc_purge(0);
+	return 0;
+}
+
+static void
+purge_thread_start(void) {
+	global_purge_event = CreateEventA(0, TRUE, FALSE, 0);
+	if (global_purge_event)
+		global_purge_thread = CreateThread(0, 0, purge_thread_main, 0, 0, 0);
+}
+
+static void
+purge_thread_stop(void) {
+	if (global_purge_thread) {
+		SetEvent(global_purge_event);
+		WaitForSingleObject(global_purge_thread, INFINITE);
+		CloseHandle(global_purge_thread);
+		global_purge_thread = 0;
+	}
+	if (global_purge_event) {
+		CloseHandle(global_purge_event);
+		global_purge_event = 0;
+	}
+}
+
+#else
+
+static void*
+purge_thread_main(void* arg) {
+	(void)sizeof(arg);
+	uint32_t interval = purge_thread_interval();
+	pthread_mutex_lock(&global_purge_mutex);
+	while (!global_purge_thread_stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t nsec = (uint64_t)ts.tv_nsec + ((uint64_t)interval * 1000000ULL);
+		ts.tv_sec += (time_t)(nsec / 1000000000ULL);
+		ts.tv_nsec = (long)(nsec % 1000000000ULL);
+		pthread_cond_timedwait(&global_purge_cond, &global_purge_mutex, &ts);
+		if (global_purge_thread_stop)
+			break;
+		pthread_mutex_unlock(&global_purge_mutex);
+		rpmalloc_purge(0);
+		pthread_mutex_lock(&global_purge_mutex);
+	}
+	pthread_mutex_unlock(&global_purge_mutex);
+	return 0;
+}
+
+static void
+purge_thread_start(void) {
+	global_purge_thread_stop = 0;
+	global_purge_thread_running = (pthread_create(&global_purge_thread, 0, purge_thread_main, 0) == 0);
+}
+
+//! Start the purge thread of the parent process in a forked child process, only done by the first caller
+static NOINLINE void
+purge_thread_restart(void) {
+	if (atomic_exchange_explicit(&global_purge_thread_restart, 0, memory_order_acquire))
+		purge_thread_start();
+}
+
+static void
+purge_thread_stop(void) {
+	atomic_store_explicit(&global_purge_thread_restart, 0, memory_order_relaxed);
+	if (!global_purge_thread_running)
+		return;
+	pthread_mutex_lock(&global_purge_mutex);
+	global_purge_thread_stop = 1;
+	pthread_cond_signal(&global_purge_cond);
+	pthread_mutex_unlock(&global_purge_mutex);
+	pthread_join(global_purge_thread, 0);
+	global_purge_thread_running = 0;
+}
+
+#endif
+
+#if PLATFORM_POSIX
+
+// The allocator state is lock free except for the spin locks of the huge span cache and the sampled allocations,
+// which are held across a fork to keep the copies in the child process consistent. Only the forking thread exists
+// in the child, and the heaps owned by the other threads of the parent can have been in the middle of an update.
+// These heaps are orphaned without touching their page and span lists: they are marked abandoned and are never
+// owned by a thread of the child again, so blocks freed to them go through the thread free lists. The memory of
+// the orphaned heaps is only released in finalization. The purge thread is restarted by the first allocation slow
+// path in the child, as creating a thread from the fork handler is not safe.
+
+//! Flag set once the fork handlers are registered, they cannot be unregistered
+static int global_fork_handler_registered;
+
+//! Orphan a heap of a thread of the parent process in the child process
+static void
+heap_orphan(heap_t* heap) {
+	heap_set_owner_thread(heap, CPU_HEAP_UNOWNED);
+	heap->is_abandoned = 1;
+}
+
+//! Decommit all free pages the forking thread can access and flush the huge span cache before a fork
+static void
+fork_decommit(void) {
+#if ENABLE_HUGE_CACHE
+	huge_cache_release(0, 0);
+#endif
+#if ENABLE_DECOMMIT
+	if (global_config.disable_decommit)
+		return;
+	uint32_t timestamp = os_time_ms();
+#if ENABLE_PER_CPU_HEAPS
+	// CPU heaps held by other threads are skipped
+	uintptr_t thread_id = get_thread_id();
+	for (uint32_t icpu = 0; icpu < global_cpu_heap_count; ++icpu) {
+		heap_t* heap = (heap_t*)atomic_load_explicit(&global_cpu_heap[icpu], memory_order_acquire);
+		if (heap && cpu_heap_try_acquire(heap, thread_id)) {
+			heap_page_free_decay(heap, timestamp, 0);
+			cpu_heap_release(heap);
+		}
+	}
+#else
+	heap_t* heap = get_thread_heap();
+	if (heap->id != 0)
+		heap_page_free_decay(heap, timestamp, 0);
+#endif
+	heap_queue_page_decay(timestamp, 0, 0);
+	pool_page_decay(timestamp, 0, 0);
+#endif
+}
+
+//! Acquire the allocator spin locks before a fork
+static void
+fork_prepare(void) {
+	if (!global_rpmalloc_initialized)
+		return;
+	if (global_config.decommit_on_fork)
+		fork_decommit();
+#if ENABLE_SAMPLING
+	for (uint32_t ibucket = 0; ibucket < SAMPLE_BUCKET_COUNT; ++ibucket)
+		sample_lock_acquire(&global_sample_bucket[ibucket].lock);
+	sample_lock_acquire(&global_sample_lock);
+#endif
+#if ENABLE_HUGE_CACHE
+	huge_cache_lock_acquire();
+#endif
+}
+
+//! Release the allocator spin locks acquired before the fork, in both the parent and the child process
+static void
+fork_release_locks(void) {
+#if ENABLE_HUGE_CACHE
+	huge_cache_lock_release();
+#endif
+#if ENABLE_SAMPLING
+	sample_lock_release(&global_sample_lock);
+	for (uint32_t ibucket = 0; ibucket < SAMPLE_BUCKET_COUNT; ++ibucket)
+		sample_lock_release(&global_sample_bucket[ibucket].lock);
+#endif
+}
+
+//! Release the allocator spin locks in the parent process after a fork
+static void
+fork_parent(void) {
+	if (global_rpmalloc_initialized)
+		fork_release_locks();
+}
+
+//! Reset the allocator state in the child process after a fork
+static void
+fork_child(void) {
+#if ENABLE_TRACE
+	trace_fork_child();
+#endif
+	if (!global_rpmalloc_initialized)
+		return;
+	fork_release_locks();
+	atomic_store_explicit(&global_memory_pressure, 0, memory_order_relaxed);
+	atomic_store_explicit(&global_memory_pressure_hold, 0, memory_order_relaxed);
+	global_main_thread_id = get_thread_id();
+
+	// Claims held by a decay in progress in another thread of the parent are never released
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap) {
+		if (atomic_load_explicit(&heap->queue_state, memory_order_relaxed) == HEAP_QUEUE_CLAIMED)
+			atomic_store_explicit(&heap->queue_state, HEAP_QUEUE_RELEASED, memory_order_relaxed);
+	}
+	for (uint32_t inode = 0; inode < global_numa_node_count; ++inode) {
+		for (int itype = 0; itype < 3; ++itype) {
+			page_t* page = pool_pointer(atomic_load_explicit(&global_page_pool[inode][itype], memory_order_acquire));
+			for (; page; page = page->next)
+				atomic_fetch_and_explicit(&page->thread_free, ~POOL_PAGE_CLAIMED, memory_order_relaxed);
+		}
+	}
+
+#if ENABLE_PER_CPU_HEAPS
+	// CPU heaps held by other threads are replaced by new heaps on next use, the forking thread holds none
+	for (uint32_t icpu = 0; icpu < CPU_HEAP_MAX; ++icpu) {
+		heap_t* heap = (heap_t*)atomic_load_explicit(&global_cpu_heap[icpu], memory_order_relaxed);
+		if (heap && atomic_load_explicit(&heap->cpu_lock, memory_order_relaxed)) {
+			atomic_store_explicit(&global_cpu_heap[icpu], 0, memory_order_relaxed);
+			heap_orphan(heap);
+		}
+	}
+	global_thread_heap = global_heap_default;
+#else
+	// Heaps released to the queue are consistent and reused as is
+	heap_t* thread_heap = get_thread_heap();
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap) {
+		if ((heap == thread_heap) || heap->is_first_class || heap->is_abandoned ||
+		    atomic_load_explicit(&heap->queue_state, memory_order_relaxed))
+			continue;
+		heap_orphan(heap);
+	}
+#endif
+
+	if (global_purge_thread_running) {
+		pthread_mutex_init(&global_purge_mutex, 0);
+		pthread_cond_init(&global_purge_cond, 0);
+		global_purge_thread_running = 0;
+		atomic_store_explicit(&global_purge_thread_restart, 1, memory_order_relaxed);
+	}
+}
+
+#endif
 
 static void
 rpmalloc_thread_destructor(void* value) {
@@ -1978,6 +5474,123 @@ rpmalloc_thread_destructor(void* value) {
 		rpmalloc_thread_finalize();
 }
 
+//! Stop reusing all released heaps, which have pages and free lists of the current size classes. The free pages
+//  and partially initialized spans are donated to the global pools, the remaining memory of the heaps is only
+//  released when blocks are freed or the heaps are unmapped in finalization. Returns zero if any heap is in use
+static int
+heap_abandon_released(void) {
+	// Initialization is not thread safe, the queues can be walked without detaching the heaps
+	uint32_t heap_count = 0;
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap) {
+		if (!heap->is_abandoned)
+			++heap_count;
+	}
+	for (uint32_t inode = 0; inode < NUMA_NODE_MAX; ++inode) {
+		uintptr_t head = atomic_load_explicit(&global_heap_queue[inode], memory_order_acquire);
+		for (heap_t* heap = (heap_t*)(head & ~HEAP_QUEUE_TAG_MASK); heap; heap = heap->next)
+			--heap_count;
+	}
+#if ENABLE_PER_CPU_HEAPS
+	for (uint32_t icpu = 0; icpu < CPU_HEAP_MAX; ++icpu) {
+		if (atomic_load_explicit(&global_cpu_heap[icpu], memory_order_acquire))
+			--heap_count;
+	}
+#endif
+	if (heap_count)
+		return 0;
+
+	for (uint32_t inode = 0; inode < NUMA_NODE_MAX; ++inode) {
+		heap_t* heap;
+		while ((heap = heap_queue_pop(inode)) != 0) {
+			if (!heap->is_first_class)
+				heap_donate_to_pool(heap);
+			heap->is_abandoned = 1;
+		}
+	}
+#if ENABLE_PER_CPU_HEAPS
+	for (uint32_t icpu = 0; icpu < CPU_HEAP_MAX; ++icpu) {
+		heap_t* heap = (heap_t*)atomic_exchange_explicit(&global_cpu_heap[icpu], 0, memory_order_acquire);
+		if (heap) {
+			heap_donate_to_pool(heap);
+			heap->is_abandoned = 1;
+		}
+	}
+#endif
+	return 1;
+}
+
+//! Build the size classes above the tiny size classes from the given table of block sizes, or the default size
+//  classes if the table is null. Returns zero if the table is invalid. The size classes of each page type
+//  not given by the table repeat the previous block size and are never selected by the lookup
+static int
+size_class_initialize(const unsigned int* table, unsigned int count) {
+	size_class_t size_class[SIZE_CLASS_COUNT];
+	memcpy(size_class, global_size_class, sizeof(size_class_t) * TINY_SIZE_CLASS_COUNT);
+	const uint32_t type_limit[3] = {SMALL_BLOCK_SIZE_LIMIT, MEDIUM_BLOCK_SIZE_LIMIT, LARGE_BLOCK_SIZE_LIMIT};
+	const uint32_t type_end[3] = {SMALL_SIZE_CLASS_COUNT, SMALL_SIZE_CLASS_COUNT + MEDIUM_SIZE_CLASS_COUNT,
+	                              SIZE_CLASS_COUNT};
+	const uint32_t type_page_size[3] = {SMALL_PAGE_SIZE, MEDIUM_PAGE_SIZE, LARGE_PAGE_SIZE};
+	const uint32_t type_header_size[3] = {PAGE_HEADER_SIZE, PAGE_BITMAP_HEADER_SIZE, PAGE_BITMAP_HEADER_SIZE};
+	const uint32_t type_header_shift[3] = {PAGE_HEADER_SIZE_SHIFT, PAGE_BITMAP_HEADER_SIZE_SHIFT,
+	                                       PAGE_BITMAP_HEADER_SIZE_SHIFT};
+	uint32_t iclass = TINY_SIZE_CLASS_COUNT;
+	uint32_t ientry = 0;
+	uint32_t block_size = SMALL_GRANULARITY * 64;
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		for (; iclass < type_end[itype]; ++iclass) {
+			if (!table) {
+				// Default size classes have four subclasses for each power of two
+				uint32_t idx = iclass - TINY_SIZE_CLASS_COUNT;
+				block_size = ((5 + (idx & 3)) << ((idx >> 2) + 4)) * SMALL_GRANULARITY;
+			} else if ((ientry < count) && (table[ientry] <= type_limit[itype])) {
+				if ((table[ientry] <= block_size) || (table[ientry] % SMALL_GRANULARITY))
+					return 0;
+				block_size = table[ientry++];
+			}
+			size_class[iclass].block_size = block_size;
+			size_class[iclass].block_count = (type_page_size[itype] - type_header_size[itype]) / block_size;
+			size_class[iclass].block_offset_shift = type_header_shift[itype];
+		}
+		// The largest block size of each page type must be the limit to keep the page type of a size fixed
+		if (block_size != type_limit[itype])
+			return 0;
+	}
+	if (table && (ientry < count))
+		return 0;
+
+	// Start the blocks at the offset aligned to the largest power of two dividing the block size, if it does not
+	// reduce the number of blocks in the page, to naturally align the blocks for aligned allocations
+	for (iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		page_type_t page_type = get_page_type(iclass);
+		uint32_t page_size = (uint32_t)get_page_type_size(page_type);
+		block_size = size_class[iclass].block_size;
+		uint32_t block_offset_shift = BLOCK_OFFSET_MAX_SHIFT;
+		while ((block_offset_shift > type_header_shift[page_type]) &&
+		       ((block_size & ((1U << block_offset_shift) - 1)) ||
+		        (((page_size - (1U << block_offset_shift)) / block_size) < size_class[iclass].block_count)))
+			--block_offset_shift;
+		size_class[iclass].block_offset_shift = block_offset_shift;
+	}
+
+	// Heaps kept from a previous initialization must not be reused with other size classes
+	if (memcmp(size_class, global_size_class, sizeof(size_class)) &&
+	    atomic_load_explicit(&global_heap_list, memory_order_relaxed) && !heap_abandon_released())
+		return 0;
+	memcpy(global_size_class, size_class, sizeof(size_class));
+
+	for (uint32_t ibucket = 0; ibucket < SIZE_CLASS_BUCKET_COUNT; ++ibucket) {
+		// Smallest size in the bucket, matching the bucket calculation in get_size_class
+		uint32_t most_significant_bit = 6 + (ibucket >> 3);
+		size_t min_size = ((size_t)(8 + (ibucket & 7)) << (most_significant_bit - 3)) * SMALL_GRANULARITY + 1;
+		iclass = TINY_SIZE_CLASS_COUNT;
+		while ((iclass < SIZE_CLASS_COUNT) && (global_size_class[iclass].block_size < min_size))
+			++iclass;
+		global_size_class_bucket[ibucket] = (uint8_t)iclass;
+	}
+	return 1;
+}
+
 extern int
 rpmalloc_initialize_config(rpmalloc_interface_t* memory_interface, rpmalloc_config_t* config) {
 	if (global_rpmalloc_initialized) {
@@ -1989,6 +5602,7 @@ rpmalloc_initialize_config(rpmalloc_interface_t* memory_interface, rpmalloc_conf
 
 	if (config)
 		global_config = *config;
+	atomic_store_explicit(&global_memory_pressure_hold, 0, memory_order_relaxed);
 
 	int result = rpmalloc_initialize(memory_interface);
 
@@ -2013,6 +5627,7 @@ rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 		global_memory_interface->memory_commit = os_mcommit;
 		global_memory_interface->memory_decommit = os_mdecommit;
 		global_memory_interface->memory_unmap = os_munmap;
+		global_memory_interface->memory_remap = os_mremap;
 	}
 
 #if PLATFORM_WINDOWS
@@ -2099,21 +5714,153 @@ rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 	if (global_config.enable_huge_pages || global_config.page_size > (256 * 1024))
 		global_config.disable_decommit = 1;
 
+	if (!global_config.prewarm_heap_count || !global_config.prewarm_size) {
+		global_config.prewarm_heap_count = 0;
+		global_config.prewarm_size = 0;
+		global_config.prewarm_lock = 0;
+	}
+	// Locked pages cannot be decommitted
+	if (global_config.prewarm_lock)
+		global_config.disable_decommit = 1;
+
+#if PLATFORM_WINDOWS && defined(MEM_EXTENDED_PARAMETER_TYPE_BITS)
+	HMODULE kernelbase = GetModuleHandleA("kernelbase.dll");
+	if (kernelbase)
+		os_virtual_alloc2 = (virtual_alloc2_fn)(void*)GetProcAddress(kernelbase, "VirtualAlloc2");
+#endif
+#if PLATFORM_POSIX
+	if (global_config.reserve_size && !os_huge_pages && (global_memory_interface->memory_map == os_mmap))
+		os_reserve_initialize(global_config.reserve_size);
+	else
+		global_config.reserve_size = 0;
+#else
+	global_config.reserve_size = 0;
+	global_config.decommit_on_fork = 0;
+#endif
+
+#if ENABLE_DECOMMIT
+	if (global_config.enable_purge_thread && !global_config.decay_time)
+		global_config.decay_time = PURGE_DEFAULT_DECAY_TIME;
+#else
+	global_config.enable_purge_thread = 0;
+#endif
+
+#if ENABLE_HUGE_CACHE
+	if (!global_config.huge_cache_limit)
+		global_config.huge_cache_limit = HUGE_CACHE_DEFAULT_LIMIT;
+	if (!global_config.huge_cache_max_age)
+		global_config.huge_cache_max_age = HUGE_CACHE_DEFAULT_MAX_AGE;
+#else
+	global_config.disable_huge_cache = 1;
+#endif
+
+	if (!global_config.size_class_table || !global_config.size_class_count ||
+	    !size_class_initialize(global_config.size_class_table, global_config.size_class_count)) {
+		global_config.size_class_table = 0;
+		global_config.size_class_count = 0;
+		size_class_initialize(0, 0);
+	}
+
+#if !ENABLE_SAMPLING
+	global_config.sample_interval = 0;
+#endif
+
+#if ENABLE_TRACE
+	trace_initialize();
+#else
+	global_config.trace_path = 0;
+#endif
+
+#if ENABLE_PER_CPU_HEAPS
+	long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+	global_cpu_heap_count = (cpu_count > 0) ? (uint32_t)cpu_count : 1;
+	if (global_cpu_heap_count > CPU_HEAP_MAX)
+		global_cpu_heap_count = CPU_HEAP_MAX;
+#endif
+
+	global_numa_node_count = global_config.enable_numa ? os_numa_node_count() : 1;
+	if (global_numa_node_count < 2) {
+		global_numa_node_count = 1;
+		global_config.enable_numa = 0;
+	}
+
 #if defined(__linux__) || defined(__ANDROID__)
 	if (global_config.disable_thp)
 		(void)prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0);
+#if defined(MADV_HUGEPAGE)
+	if (global_config.disable_thp || os_huge_pages || (global_memory_interface->memory_map != os_mmap))
+		global_config.enable_thp = 0;
+#else
+	global_config.enable_thp = 0;
+#endif
+	os_thp = global_config.enable_thp;
 #endif
 
 #ifdef _WIN32
 	fls_key = FlsAlloc(&rpmalloc_thread_destructor);
 #else
 	pthread_key_create(&pthread_key, rpmalloc_thread_destructor);
+	if (!global_fork_handler_registered)
+		global_fork_handler_registered = !pthread_atfork(fork_prepare, fork_parent, fork_child);
 #endif
 
 	global_main_thread_id = get_thread_id();
 
+	if (global_config.prewarm_heap_count) {
+#if ENABLE_PER_CPU_HEAPS
+		// Threads allocate from the heap of the CPU they run on, prewarm the CPU heaps instead
+		uintptr_t thread_id = get_thread_id();
+		for (uint32_t icpu = 0; (icpu < global_config.prewarm_heap_count) && (icpu < global_cpu_heap_count); ++icpu) {
+			heap_t* heap = cpu_heap_get(icpu);
+			uintptr_t unlocked = 0;
+			while (!atomic_compare_exchange_weak_explicit(&heap->cpu_lock, &unlocked, thread_id, memory_order_acquire,
+			                                              memory_order_relaxed)) {
+				unlocked = 0;
+				wait_spin();
+			}
+			heap_set_owner_thread(heap, thread_id);
+			heap_prewarm(heap, global_config.prewarm_size);
+			heap_set_owner_thread(heap, CPU_HEAP_UNOWNED);
+			atomic_store_explicit(&heap->cpu_lock, 0, memory_order_release);
+		}
+#else
+		// Hold all heaps until prewarmed to avoid prewarming the same released heap again
+		heap_t* prewarm_list = 0;
+		for (unsigned int iheap = 0; iheap < global_config.prewarm_heap_count; ++iheap) {
+			heap_t* heap = heap_allocate(0);
+			if (!heap)
+				break;
+			heap_prewarm(heap, global_config.prewarm_size);
+			heap->next = prewarm_list;
+			prewarm_list = heap;
+		}
+		while (prewarm_list) {
+			heap_t* heap = prewarm_list;
+			prewarm_list = heap->next;
+			heap_release(heap);
+		}
+#endif
+	}
+
 	rpmalloc_thread_initialize();
 
+#if ENABLE_SAMPLING
+	// Heaps kept from a previous initialization, like the CPU heaps, draw a sample interval from the new config
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap)
+		heap->sample_countdown = sample_next_interval(heap);
+#if PLATFORM_HAS_BACKTRACE
+	if (global_config.sample_interval) {
+		// The first backtrace call loads the unwinder and allocates memory, do it outside of a sampled allocation
+		void* frames[2];
+		(void)backtrace(frames, 2);
+	}
+#endif
+#endif
+
+	if (global_config.enable_purge_thread)
+		purge_thread_start();
+
 	return 0;
 }
 
@@ -2124,25 +5871,47 @@ rpmalloc_config(void) {
 
 extern void
 rpmalloc_finalize(void) {
+	purge_thread_stop();
+#if ENABLE_TRACE
+	trace_finalize();
+#endif
 	rpmalloc_thread_finalize();
 
+#if ENABLE_HUGE_CACHE
+	huge_cache_release(0, 0);
+#endif
+
+	if (global_config.prewarm_lock && (global_memory_interface->memory_commit == os_mcommit))
+		heap_prewarm_unlock();
+
 	if (global_config.unmap_on_finalize) {
-		heap_t* heap = global_heap_queue;
-		global_heap_queue = 0;
+		heap_t* heap = (heap_t*)atomic_exchange_explicit(&global_heap_list, 0, memory_order_acquire);
+		for (uint32_t inode = 0; inode < NUMA_NODE_MAX; ++inode)
+			atomic_store_explicit(&global_heap_queue[inode], 0, memory_order_relaxed);
+#if ENABLE_PER_CPU_HEAPS
+		for (uint32_t icpu = 0; icpu < CPU_HEAP_MAX; ++icpu)
+			atomic_store_explicit(&global_cpu_heap[icpu], 0, memory_order_relaxed);
+#endif
 		while (heap) {
-			heap_t* heap_next = heap->next;
+			heap_t* heap_next = heap->next_heap;
 			heap_free_all(heap);
 			heap_unmap(heap);
 			heap = heap_next;
 		}
-		heap = global_heap_used;
-		global_heap_used = 0;
-		while (heap) {
-			heap_t* heap_next = heap->next;
-			heap_free_all(heap);
-			heap_unmap(heap);
-			heap = heap_next;
+		// Pooled pages are contained in spans owned by heaps or the span pool
+		for (uint32_t inode = 0; inode < global_numa_node_count; ++inode) {
+			for (int itype = 0; itype < 3; ++itype) {
+				span_t* span = pool_pop_span(inode, (page_type_t)itype);
+				while (span) {
+					span_unmap(span);
+					span = pool_pop_span(inode, (page_type_t)itype);
+				}
+				atomic_store_explicit(&global_page_pool[inode][itype], 0, memory_order_relaxed);
+			}
 		}
+#if ENABLE_SAMPLING
+		sample_finalize();
+#endif
 #if ENABLE_STATISTICS
 		memset(&global_statistics, 0, sizeof(global_statistics));
 #endif
@@ -2154,29 +5923,516 @@ rpmalloc_finalize(void) {
 #else
 	pthread_key_delete(pthread_key);
 	pthread_key = 0;
+	os_reserve_finalize();
 #endif
 
 	global_main_thread_id = 0;
+#if ENABLE_PER_CPU_HEAPS
+	global_cpu_heap_count = 0;
+#endif
 	global_rpmalloc_initialized = 0;
 }
 
 extern void
 rpmalloc_thread_initialize(void) {
+#if ENABLE_PER_CPU_HEAPS
+	global_thread_initialized = 1;
+#else
 	if (get_thread_heap() == global_heap_default)
 		get_thread_heap_allocate();
+#endif
 }
 
 extern void
 rpmalloc_thread_finalize(void) {
 	heap_t* heap = get_thread_heap();
 	if (heap != global_heap_default) {
+		if (!heap->is_first_class)
+			heap_donate_to_pool(heap);
 		heap_release(heap);
 		set_thread_heap(global_heap_default);
 	}
+#if ENABLE_PER_CPU_HEAPS
+	global_thread_initialized = 0;
+#endif
+#if ENABLE_TRACE
+	trace_thread_finalize();
+#endif
 }
 
 extern void
 rpmalloc_thread_collect(void) {
+#if ENABLE_HUGE_CACHE
+	huge_cache_release(global_config.huge_cache_max_age, global_config.huge_cache_limit);
+#endif
+	heap_t* heap = thread_heap_acquire();
+	heap_collect(heap, global_page_free_retain, 0);
+	thread_heap_release(heap);
+}
+
+extern size_t
+rpmalloc_thread_collect_budget(unsigned int page_retain_count, size_t byte_budget) {
+#if ENABLE_HUGE_CACHE
+	huge_cache_release(global_config.huge_cache_max_age, global_config.huge_cache_limit);
+#endif
+	uint32_t retain_count[3] = {page_retain_count, page_retain_count, page_retain_count};
+	heap_t* heap = thread_heap_acquire();
+	size_t collected = heap_collect(heap, retain_count, byte_budget);
+	thread_heap_release(heap);
+	return collected;
+}
+
+extern size_t
+rpmalloc_purge(unsigned long long budget_ns) {
+#if ENABLE_HUGE_CACHE
+	huge_cache_release(global_config.huge_cache_max_age, global_config.huge_cache_limit);
+#endif
+	size_t decommit_size = 0;
+#if ENABLE_DECOMMIT
+	if (global_config.disable_decommit || !global_rpmalloc_initialized)
+		return 0;
+	uint64_t deadline = budget_ns ? os_time_ns() + budget_ns : 0;
+	uint32_t timestamp = os_time_ms();
+	uint32_t decay_time = global_config.decay_time;
+
+	heap_t* heap = thread_heap_acquire();
+	if (heap->id != 0) {
+		heap_collect_thread_free(heap);
+		decommit_size += heap_page_free_decay(heap, timestamp, decay_time);
+	}
+	thread_heap_release(heap);
+
+	// Released heaps donate pages emptied by other threads to the pool, decay them before the pool
+	decommit_size += heap_queue_page_decay(timestamp, decay_time, deadline);
+	decommit_size += pool_page_decay(timestamp, decay_time, deadline);
+#else
+	(void)sizeof(budget_ns);
+#endif
+	return decommit_size;
+}
+
+extern void
+rpmalloc_thread_statistics(rpmalloc_thread_statistics_t* stats) {
+	memset(stats, 0, sizeof(rpmalloc_thread_statistics_t));
+	heap_t* heap = thread_heap_acquire();
+	if (heap->id == 0) {
+		thread_heap_release(heap);
+		return;
+	}
+
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		size_t block_count = 0;
+		for (block_t* block = heap->local_free[iclass]; block; block = block->next)
+			++block_count;
+		stats->sizecache += block_count * global_size_class[iclass].block_size;
+	}
+	for (int itype = 0; itype < 3; ++itype)
+		stats->spancache += (size_t)heap->page_free_commit_count[itype] * get_page_type_size((page_type_t)itype);
+
+#if ENABLE_STATISTICS
+	for (int itype = 0; itype < 3; ++itype) {
+		const heap_page_type_statistics_t* type_stat = heap->statistics.page_type + itype;
+		size_t page_size = get_page_type_size((page_type_t)itype);
+		stats->thread_to_global += type_stat->page_to_pool * page_size;
+		stats->global_to_thread += type_stat->page_from_pool * page_size;
+		stats->span_use[itype].current = type_stat->page_current;
+		stats->span_use[itype].peak = type_stat->page_peak;
+		stats->span_use[itype].to_global = type_stat->page_to_pool;
+		stats->span_use[itype].from_global = type_stat->page_from_pool;
+		stats->span_use[itype].to_cache = type_stat->page_to_free;
+		stats->span_use[itype].from_cache = type_stat->page_from_free;
+		stats->span_use[itype].to_reserved = type_stat->page_decommit;
+		stats->span_use[itype].from_reserved = type_stat->page_commit;
+		stats->span_use[itype].map_calls = type_stat->span_map;
+	}
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		const heap_size_class_statistics_t* class_stat = heap->statistics.size_class + iclass;
+		stats->size_use[iclass].alloc_current = class_stat->alloc_current;
+		stats->size_use[iclass].alloc_peak = class_stat->alloc_peak;
+		stats->size_use[iclass].alloc_total = class_stat->alloc_total;
+		stats->size_use[iclass].free_total = class_stat->free_total;
+		stats->size_use[iclass].spans_to_cache = class_stat->page_to_free;
+		stats->size_use[iclass].spans_from_cache = class_stat->page_from_free;
+		stats->size_use[iclass].spans_from_reserved = class_stat->page_initialized;
+		stats->size_use[iclass].map_calls = class_stat->span_map;
+		stats->size_use[iclass].pages_to_full = class_stat->page_to_full;
+	}
+#endif
+	thread_heap_release(heap);
+}
+
+extern void
+rpmalloc_global_statistics(rpmalloc_global_statistics_t* stats) {
+	memset(stats, 0, sizeof(rpmalloc_global_statistics_t));
+#if ENABLE_STATISTICS
+	size_t page_size = global_config.page_size;
+	stats->mapped = atomic_load_explicit(&global_statistics.page_mapped, memory_order_relaxed) * page_size;
+	stats->mapped_peak = atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed) * page_size;
+	stats->cached = atomic_load_explicit(&global_statistics.pool_size, memory_order_relaxed);
+#if ENABLE_HUGE_CACHE
+	stats->cached += atomic_load_explicit(&global_huge_cache_size, memory_order_relaxed);
+#endif
+	stats->huge_alloc = atomic_load_explicit(&global_statistics.huge_alloc, memory_order_relaxed);
+	stats->huge_alloc_peak = atomic_load_explicit(&global_statistics.huge_alloc_peak, memory_order_relaxed);
+	stats->mapped_total = atomic_load_explicit(&global_statistics.mapped_total, memory_order_relaxed);
+	stats->unmapped_total = atomic_load_explicit(&global_statistics.unmapped_total, memory_order_relaxed);
+#endif
+	stats->committed = atomic_load_explicit(&global_memory_committed, memory_order_relaxed);
+#if defined(__linux__)
+	if (os_thp) {
+		FILE* smaps = fopen("/proc/self/smaps_rollup", "r");
+		if (smaps) {
+			char line[128];
+			while (fgets(line, sizeof(line) - 1, smaps)) {
+				line[sizeof(line) - 1] = 0;
+				if (strstr(line, "AnonHugePages:") == line) {
+					stats->thp_backed = (size_t)strtol(line + 14, 0, 10) * 1024;
+					break;
+				}
+			}
+			fclose(smaps);
+		}
+	}
+#endif
+#if ENABLE_SAMPLING
+	stats->sampled_alloc_total = atomic_load_explicit(&global_sample_alloc_size, memory_order_relaxed);
+	stats->sampled_alloc_count = atomic_load_explicit(&global_sample_alloc_count, memory_order_relaxed);
+#endif
+}
+
+extern int
+rpmalloc_sample_dump(int format, void (*write)(void* context, const char* buffer, size_t size), void* context) {
+#if ENABLE_SAMPLING
+	if (!global_config.sample_interval || !write)
+		return -1;
+	sample_writer_t writer;
+	writer.write = write;
+	writer.context = context;
+	writer.used = 0;
+	if (format != RPMALLOC_SAMPLE_FORMAT_FOLDED) {
+		size_t total_count = 0;
+		size_t total_size = 0;
+		for (uint32_t ibucket = 0; ibucket < SAMPLE_BUCKET_COUNT; ++ibucket) {
+			sample_bucket_t* bucket = global_sample_bucket + ibucket;
+			sample_lock_acquire(&bucket->lock);
+			for (sample_t* sample = bucket->head; sample; sample = sample->next) {
+				++total_count;
+				total_size += sample->size;
+			}
+			sample_lock_release(&bucket->lock);
+		}
+		sample_write_string(&writer, "heap profile: ");
+		sample_write_pprof_counts(&writer, total_count, total_size);
+		sample_write_string(&writer, " @ heap_v2/");
+		sample_write_uint(&writer, global_config.sample_interval);
+		sample_write_string(&writer, "\n");
+	}
+	// Samples are copied out of the bucket to not hold the lock while calling the output function
+	int sample_count = 0;
+	sample_t samples[SAMPLE_DUMP_BATCH];
+	for (uint32_t ibucket = 0; ibucket < SAMPLE_BUCKET_COUNT; ++ibucket) {
+		size_t skip = 0;
+		uint32_t count = 0;
+		do {
+			count = sample_bucket_copy(global_sample_bucket + ibucket, skip, samples, SAMPLE_DUMP_BATCH);
+			for (uint32_t isample = 0; isample < count; ++isample)
+				sample_write_sample(&writer, samples + isample, format);
+			skip += count;
+			sample_count += (int)count;
+		} while (count == SAMPLE_DUMP_BATCH);
+	}
+	if (format != RPMALLOC_SAMPLE_FORMAT_FOLDED)
+		sample_write_mapped_libraries(&writer);
+	sample_write_flush(&writer);
+	return sample_count;
+#else
+	(void)sizeof(format);
+	(void)sizeof(write);
+	(void)sizeof(context);
+	return -1;
+#endif
+}
+
+#if ENABLE_STATISTICS
+
+static void
+heap_statistics_accumulate(heap_statistics_t* total, const heap_t* heap) {
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		heap_size_class_statistics_t* total_stat = total->size_class + iclass;
+		const heap_size_class_statistics_t* class_stat = heap->statistics.size_class + iclass;
+		total_stat->alloc_current += class_stat->alloc_current;
+		total_stat->alloc_peak += class_stat->alloc_peak;
+		total_stat->alloc_total += class_stat->alloc_total;
+		total_stat->free_total += class_stat->free_total;
+		total_stat->page_to_free += class_stat->page_to_free;
+		total_stat->page_from_free += class_stat->page_from_free;
+		total_stat->page_initialized += class_stat->page_initialized;
+		total_stat->page_to_full += class_stat->page_to_full;
+		total_stat->span_map += class_stat->span_map;
+	}
+	for (int itype = 0; itype < 3; ++itype) {
+		heap_page_type_statistics_t* total_stat = total->page_type + itype;
+		const heap_page_type_statistics_t* type_stat = heap->statistics.page_type + itype;
+		total_stat->page_current += type_stat->page_current;
+		total_stat->page_peak += type_stat->page_peak;
+		total_stat->page_to_pool += type_stat->page_to_pool;
+		total_stat->page_from_pool += type_stat->page_from_pool;
+		total_stat->page_to_free += type_stat->page_to_free;
+		total_stat->page_from_free += type_stat->page_from_free;
+		total_stat->page_decommit += type_stat->page_decommit;
+		total_stat->page_commit += type_stat->page_commit;
+		total_stat->span_map += type_stat->span_map;
+	}
+}
+
+#endif
+
+////////////
+///
+/// Heap walk
+///
+//////
+
+_Static_assert(SIZE_CLASS_COUNT <= sizeof(((rpmalloc_walk_summary_t*)0)->size_class) /
+                                       sizeof(((rpmalloc_walk_summary_t*)0)->size_class[0]),
+               "Invalid walk summary size class count");
+
+//! State of a heap walk
+typedef struct heap_walk_t {
+	//! Function called for each page
+	rpmalloc_page_visit_fn visit;
+	//! Context passed to the visit function
+	void* context;
+	//! Heap of the calling thread, or null if not initialized or heaps are per CPU
+	const heap_t* thread_heap;
+	//! Heap held by the walk while its spans are walked, or null when walking pooled or abandoned spans
+	const heap_t* held;
+} heap_walk_t;
+
+//! Check if the pages of the heap are reported by the walk. Pages of heaps held by the walk and of abandoned heaps
+//  are stable, pages of released heaps and of CPU heaps not held by any thread are read without synchronization
+//  and are approximate. Pages of heaps in use by other threads are not reported
+static inline int
+heap_walk_is_visible(const heap_t* heap, const heap_walk_t* walk) {
+	if ((heap == walk->held) || (heap == walk->thread_heap) || heap->is_abandoned)
+		return 1;
+#if ENABLE_PER_CPU_HEAPS
+	if (heap_owner_thread(heap) == CPU_HEAP_UNOWNED)
+		return 1;
+#endif
+	return (atomic_load_explicit(&((heap_t*)heap)->queue_state, memory_order_relaxed) != 0);
+}
+
+//! Get the number of blocks of the page in the local free list of its heap, which are counted as used by the page.
+//  The heap local free list of a size class only holds blocks of a single page, and is only read for heaps held
+//  by the walk
+static uint32_t
+page_walk_local_free_count(page_t* page, const heap_walk_t* walk) {
+	if ((page->heap != walk->held) && (page->heap != walk->thread_heap))
+		return 0;
+	block_t* block = page->heap->local_free[page->size_class];
+	if (!block || (span_get_page_from_block(block_get_span(block), block) != page))
+		return 0;
+	uint32_t count = 0;
+	for (; block; block = block->next)
+		++count;
+	return count;
+}
+
+//! Report the initialized pages of the list of spans to the visit function, returns non-zero if the walk was
+//  stopped. Pages in the spans can have been adopted from the global page pool by other heaps, only pages owned
+//  by heaps visible to the walk are reported
+static int
+span_walk(span_t* span, page_type_t page_type, const heap_walk_t* walk) {
+	rpmalloc_page_info_t info;
+	for (; span; span = span->next) {
+		for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage) {
+			page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+			if (!page->heap || !heap_walk_is_visible(page->heap, walk))
+				continue;
+			memset(&info, 0, sizeof(info));
+			info.address = page;
+			info.page_size = span->page_size;
+			info.committed = page_committed_size(page);
+			info.heap_id = page->heap->id;
+			info.page_type = (unsigned int)page_type;
+			info.is_free = (int)page->is_free;
+			info.is_decommitted = (int)page->is_decommitted;
+			if (!page->is_free) {
+				// Blocks in the heap local free list are not in use
+				uint32_t local_free_count = page_walk_local_free_count(page, walk);
+				info.block_size = page->block_size;
+				info.size_class = page->size_class;
+				info.block_count = page->block_count;
+				info.block_used = (page->block_used > local_free_count) ? (page->block_used - local_free_count) : 0;
+				info.block_initialized = page->block_initialized;
+				info.thread_free_count =
+				    (uint32_t)(atomic_load_explicit(&page->thread_free, memory_order_relaxed) >> 32ULL);
+				info.is_full = (int)(page->is_full && !local_free_count);
+			}
+			if (walk->visit(&info, walk->context))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+//! Report the pages of the spans of the heap held by the walk to the visit function, returns non-zero if the walk
+//  was stopped
+static int
+heap_walk(heap_t* heap, heap_walk_t* walk) {
+	walk->held = heap;
+	for (int itype = PAGE_SMALL; itype <= PAGE_LARGE; ++itype) {
+		if (span_walk(heap->span_partial[itype], (page_type_t)itype, walk) ||
+		    span_walk(heap->span_used[itype], (page_type_t)itype, walk)) {
+			walk->held = 0;
+			return 1;
+		}
+	}
+	walk->held = 0;
+	rpmalloc_page_info_t info;
+	// Huge blocks are only tracked by first class heaps
+	for (span_t* span = heap->span_used[PAGE_HUGE]; span; span = span->next) {
+		memset(&info, 0, sizeof(info));
+		info.address = span;
+		info.page_size = (size_t)span->page_size * (size_t)span->page_count;
+		info.committed = info.page_size;
+		info.block_size = info.page_size - SPAN_HEADER_SIZE;
+		info.heap_id = heap->id;
+		info.page_type = PAGE_HUGE;
+		info.block_count = 1;
+		info.block_used = 1;
+		info.block_initialized = 1;
+		info.is_full = 1;
+		if (walk->visit(&info, walk->context))
+			return 1;
+	}
+	return 0;
+}
+
+//! Walk the spans of the heaps abandoned when the size classes changed or orphaned in a forked child process, which
+//  are not owned by any thread but can contain pages adopted from the global page pool by the walked heaps
+static int
+heap_walk_abandoned(const heap_walk_t* walk) {
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap) {
+		if (!heap->is_abandoned)
+			continue;
+		for (int itype = PAGE_SMALL; itype <= PAGE_LARGE; ++itype) {
+			if (span_walk(heap->span_partial[itype], (page_type_t)itype, walk) ||
+			    span_walk(heap->span_used[itype], (page_type_t)itype, walk))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+//! Walk the partially initialized spans donated to the global span pool by released heaps, which can contain
+//  pages adopted by the walked heaps. The spans are read in place and can be taken from the pool concurrently,
+//  spans in the pool are only unmapped on finalization
+static int
+pool_walk(const heap_walk_t* walk) {
+	for (int itype = PAGE_SMALL; itype <= PAGE_LARGE; ++itype) {
+		for (uint32_t inode = 0; inode < global_numa_node_count; ++inode) {
+			uintptr_t head = atomic_load_explicit(&global_span_pool[inode][itype], memory_order_acquire);
+			if (span_walk(pool_pointer(head), (page_type_t)itype, walk))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+//! Walk the calling thread heap and the released heaps, or the CPU heaps not held by other threads, including the
+//  pages they adopted in spans of the global span pool and of abandoned heaps. Heaps are walked in place, each
+//  released heap is claimed while walked and heaps in use by other threads are skipped
+static int
+global_walk(rpmalloc_page_visit_fn visit, void* context) {
+	if (!global_rpmalloc_initialized)
+		return 0;
+	heap_walk_t walk = {visit, context, 0, 0};
+#if ENABLE_PER_CPU_HEAPS
+	uintptr_t thread_id = get_thread_id();
+	for (uint32_t icpu = 0; icpu < global_cpu_heap_count; ++icpu) {
+		heap_t* heap = (heap_t*)atomic_load_explicit(&global_cpu_heap[icpu], memory_order_acquire);
+		if (heap && cpu_heap_try_acquire(heap, thread_id)) {
+			int stopped = heap_walk(heap, &walk);
+			cpu_heap_release(heap);
+			if (stopped)
+				return 1;
+		}
+	}
+#else
+	heap_t* thread_heap = get_thread_heap();
+	if (thread_heap->id != 0) {
+		walk.thread_heap = thread_heap;
+		if (heap_walk(thread_heap, &walk))
+			return 1;
+	}
+#endif
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->next_heap) {
+		unsigned int state = HEAP_QUEUE_RELEASED;
+		if (!atomic_compare_exchange_strong_explicit(&heap->queue_state, &state, HEAP_QUEUE_CLAIMED,
+		                                             memory_order_acquire, memory_order_relaxed))
+			continue;
+		int stopped = heap_walk(heap, &walk);
+		atomic_store_explicit(&heap->queue_state, HEAP_QUEUE_RELEASED, memory_order_release);
+		if (stopped)
+			return 1;
+	}
+	if (pool_walk(&walk))
+		return 1;
+	return heap_walk_abandoned(&walk);
+}
+
+//! Accumulate the page in the walk summary
+static int
+walk_summary_visit(const rpmalloc_page_info_t* page, void* context) {
+	rpmalloc_walk_summary_t* summary = context;
+	++summary->page_count;
+	summary->committed += page->committed;
+	if (page->is_free) {
+		summary->free_committed += page->committed;
+		return 0;
+	}
+	// Blocks freed by other threads are not in use even if not yet adopted by the owning heap
+	uint32_t block_used =
+	    (page->block_used > page->thread_free_count) ? (page->block_used - page->thread_free_count) : 0;
+	size_t used = (size_t)block_used * page->block_size;
+	summary->used += used;
+	if (page->page_type == PAGE_HUGE)
+		return 0;
+	summary->size_class[page->size_class].block_size = page->block_size;
+	++summary->size_class[page->size_class].page_count;
+	summary->size_class[page->size_class].block_count += page->block_count;
+	summary->size_class[page->size_class].block_used += block_used;
+	summary->size_class[page->size_class].committed += page->committed;
+	summary->size_class[page->size_class].fragmented += (page->committed > used) ? (page->committed - used) : 0;
+	return 0;
+}
+
+//! Compute the share of the fragmented bytes of each size class in the committed memory of the allocator
+static void
+walk_summary_finalize(rpmalloc_walk_summary_t* summary) {
+	size_t total_committed = atomic_load_explicit(&global_memory_committed, memory_order_relaxed);
+	if (total_committed < summary->committed)
+		total_committed = summary->committed;
+	summary->total_committed = total_committed;
+	for (uint32_t iclass = 0; (iclass < SIZE_CLASS_COUNT) && total_committed; ++iclass)
+		summary->size_class[iclass].fragmented_share =
+		    (unsigned int)(((uint64_t)summary->size_class[iclass].fragmented * 10000) / total_committed);
+}
+
+extern int
+rpmalloc_walk(rpmalloc_page_visit_fn visit, void* context) {
+	return global_walk(visit, context);
+}
+
+extern void
+rpmalloc_walk_summary(rpmalloc_walk_summary_t* summary) {
+	memset(summary, 0, sizeof(rpmalloc_walk_summary_t));
+	global_walk(walk_summary_visit, summary);
+	walk_summary_finalize(summary);
 }
 
 void
@@ -2196,6 +6452,47 @@ rpmalloc_dump_statistics(void* file) {
 	        (unsigned long long)atomic_load_explicit(&global_statistics.page_decommit, memory_order_relaxed));
 	fprintf(file, "Heaps created:       %llu\n",
 	        (unsigned long long)atomic_load_explicit(&global_statistics.heap_count, memory_order_relaxed));
+	fprintf(file, "Huge memory:         %zuMiB\n",
+	        atomic_load_explicit(&global_statistics.huge_alloc, memory_order_relaxed) / (1024 * 1024));
+	fprintf(file, "Huge memory (peak):  %zuMiB\n",
+	        atomic_load_explicit(&global_statistics.huge_alloc_peak, memory_order_relaxed) / (1024 * 1024));
+	fprintf(file, "Pooled memory:       %zuMiB\n",
+	        atomic_load_explicit(&global_statistics.pool_size, memory_order_relaxed) / (1024 * 1024));
+#if ENABLE_HUGE_CACHE
+	fprintf(file, "Huge cache memory:   %zuMiB\n",
+	        atomic_load_explicit(&global_huge_cache_size, memory_order_relaxed) / (1024 * 1024));
+#endif
+
+	// Counters are owned by each heap thread and read without synchronization, values are approximate
+	heap_statistics_t total;
+	memset(&total, 0, sizeof(total));
+	heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire);
+	for (; heap; heap = heap->next_heap)
+		heap_statistics_accumulate(&total, heap);
+
+	const char* page_type_name[3] = {"Small", "Medium", "Large"};
+	fprintf(file, "Page type  Current     Peak   ToPool FromPool   ToFree FromFree Decommit   Commit  SpanMap\n");
+	for (int itype = 0; itype < 3; ++itype) {
+		const heap_page_type_statistics_t* type_stat = total.page_type + itype;
+		fprintf(file, "%-9s %8zu %8zu %8zu %8zu %8zu %8zu %8zu %8zu %8zu\n", page_type_name[itype],
+		        type_stat->page_current, type_stat->page_peak, type_stat->page_to_pool, type_stat->page_from_pool,
+		        type_stat->page_to_free, type_stat->page_from_free, type_stat->page_decommit, type_stat->page_commit,
+		        type_stat->span_map);
+	}
+	fprintf(file, "Class    Size   Current      Peak    Allocs     Frees  CurMiB PeakMiB  ToFree FromFree NewPage  "
+	              "ToFull SpanMap\n");
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		const heap_size_class_statistics_t* class_stat = total.size_class + iclass;
+		if (!class_stat->alloc_total)
+			continue;
+		size_t block_size = global_size_class[iclass].block_size;
+		fprintf(file, "%5u %7zu %9zu %9zu %9zu %9zu %7zu %7zu %7zu %8zu %7zu %7zu %7zu\n", iclass, block_size,
+		        class_stat->alloc_current, class_stat->alloc_peak, class_stat->alloc_total, class_stat->free_total,
+		        (class_stat->alloc_current * block_size) / (1024 * 1024),
+		        (class_stat->alloc_peak * block_size) / (1024 * 1024), class_stat->page_to_free,
+		        class_stat->page_from_free, class_stat->page_initialized, class_stat->page_to_full,
+		        class_stat->span_map);
+	}
 #else
 	(void)sizeof(file);
 #endif
@@ -2203,6 +6500,42 @@ rpmalloc_dump_statistics(void* file) {
 
 #if RPMALLOC_FIRST_CLASS_HEAPS
 
+//! Get the heap of the calling thread for the given shared first class heap, allocating it on first use
+static NOINLINE heap_t*
+heap_shared_get_thread_heap(heap_t* heap) {
+	uintptr_t thread_id = get_thread_id();
+	heap_t* thread_heap = (heap_t*)atomic_load_explicit(&heap->shared_list, memory_order_acquire);
+	while (thread_heap && (heap_owner_thread(thread_heap) != thread_id))
+		thread_heap = thread_heap->shared_next;
+	if (!thread_heap) {
+		thread_heap = heap_allocate(1);
+		rpmalloc_assume(thread_heap != 0);
+		heap_set_owner_thread(thread_heap, thread_id);
+		thread_heap->numa_node = heap->numa_node;
+		thread_heap->shared_parent = heap;
+		uintptr_t head = atomic_load_explicit(&heap->shared_list, memory_order_relaxed);
+		do {
+			thread_heap->shared_next = (heap_t*)head;
+		} while (!atomic_compare_exchange_weak_explicit(&heap->shared_list, &head, (uintptr_t)thread_heap,
+		                                                memory_order_release, memory_order_relaxed));
+	}
+	global_thread_shared_heap = thread_heap;
+	return thread_heap;
+}
+
+//! Get the heap to allocate from for the given first class heap, which is the heap of the calling thread if the
+//  heap is shared
+static inline heap_t*
+heap_first_class_get(heap_t* heap) {
+	if (EXPECTED(!heap->is_shared))
+		return heap;
+	heap_t* thread_heap = global_thread_shared_heap;
+	if (EXPECTED(thread_heap != 0) && EXPECTED(thread_heap->shared_parent == heap) &&
+	    EXPECTED(heap_owner_thread(thread_heap) == get_thread_id()))
+		return thread_heap;
+	return heap_shared_get_thread_heap(heap);
+}
+
 rpmalloc_heap_t*
 rpmalloc_heap_acquire(void) {
 	// Must be a pristine heap from newly mapped memory pages, or else memory blocks
@@ -2211,14 +6544,38 @@ rpmalloc_heap_acquire(void) {
 	// pristine from the dedicated orphan list can be used.
 	heap_t* heap = heap_allocate(1);
 	rpmalloc_assume(heap != 0);
-	heap->owner_thread = 0;
+	heap_set_owner_thread(heap, 0);
+	return heap;
+}
+
+rpmalloc_heap_t*
+rpmalloc_heap_acquire_shared(void) {
+	heap_t* heap = heap_allocate(1);
+	rpmalloc_assume(heap != 0);
+	heap_set_owner_thread(heap, 0);
+	heap->is_shared = 1;
 	return heap;
 }
 
 void
 rpmalloc_heap_release(rpmalloc_heap_t* heap) {
-	if (heap)
-		heap_release(heap);
+	if (!heap)
+		return;
+	if (heap->is_shared) {
+		heap_t* thread_heap = (heap_t*)atomic_exchange_explicit(&heap->shared_list, 0, memory_order_acquire);
+		while (thread_heap) {
+			heap_t* next = thread_heap->shared_next;
+			thread_heap->shared_next = 0;
+			thread_heap->shared_parent = 0;
+			// A thread heap set as the current heap of its thread is detached and kept by the thread, and
+			// released when the thread sets another current heap or exits
+			if (!thread_heap->is_thread_current)
+				heap_release(thread_heap);
+			thread_heap = next;
+		}
+		heap->is_shared = 0;
+	}
+	heap_release(heap);
 }
 
 RPMALLOC_ALLOCATOR void*
@@ -2229,7 +6586,7 @@ rpmalloc_heap_alloc(rpmalloc_heap_t* heap, size_t size) {
 		return 0;
 	}
 #endif
-	return heap_allocate_block(heap, size, 0);
+	return heap_allocate_block(heap_first_class_get(heap), size, 0);
 }
 
 RPMALLOC_ALLOCATOR void*
@@ -2240,7 +6597,7 @@ rpmalloc_heap_aligned_alloc(rpmalloc_heap_t* heap, size_t alignment, size_t size
 		return 0;
 	}
 #endif
-	return heap_allocate_block_aligned(heap, alignment, size, 0);
+	return heap_allocate_block_aligned(heap_first_class_get(heap), alignment, size, 0);
 }
 
 RPMALLOC_ALLOCATOR void*
@@ -2263,7 +6620,7 @@ rpmalloc_heap_calloc(rpmalloc_heap_t* heap, size_t num, size_t size) {
 #else
 	total = num * size;
 #endif
-	return heap_allocate_block(heap, total, 1);
+	return heap_allocate_block(heap_first_class_get(heap), total, 1);
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -2286,7 +6643,7 @@ rpmalloc_heap_aligned_calloc(rpmalloc_heap_t* heap, size_t alignment, size_t num
 #else
 	total = num * size;
 #endif
-	return heap_allocate_block_aligned(heap, alignment, total, 1);
+	return heap_allocate_block_aligned(heap_first_class_get(heap), alignment, total, 1);
 }
 
 RPMALLOC_ALLOCATOR void*
@@ -2297,7 +6654,7 @@ rpmalloc_heap_realloc(rpmalloc_heap_t* heap, void* ptr, size_t size, unsigned in
 		return ptr;
 	}
 #endif
-	return heap_reallocate_block(heap, ptr, size, 0, flags);
+	return heap_reallocate_block(heap_first_class_get(heap), ptr, size, 0, flags);
 }
 
 RPMALLOC_ALLOCATOR void*
@@ -2308,7 +6665,7 @@ rpmalloc_heap_aligned_realloc(rpmalloc_heap_t* heap, void* ptr, size_t alignment
 		return 0;
 	}
 #endif
-	return heap_reallocate_block_aligned(heap, ptr, alignment, size, 0, flags);
+	return heap_reallocate_block_aligned(heap_first_class_get(heap), ptr, alignment, size, 0, flags);
 }
 
 void
@@ -2317,18 +6674,45 @@ rpmalloc_heap_free(rpmalloc_heap_t* heap, void* ptr) {
 	block_deallocate(ptr);
 }
 
+//! Free the given memory block of the given size from the given heap
+void
+rpmalloc_heap_free_sized(rpmalloc_heap_t* heap, void* ptr, size_t size) {
+	(void)sizeof(heap);
+	if (UNEXPECTED(ptr == 0))
+		return;
+	block_deallocate_sized(ptr, size);
+}
+
 //! Free all memory allocated by the heap
 void
 rpmalloc_heap_free_all(rpmalloc_heap_t* heap) {
+	heap_t* thread_heap = (heap_t*)atomic_load_explicit(&heap->shared_list, memory_order_acquire);
+	for (; thread_heap; thread_heap = thread_heap->shared_next)
+		heap_free_all(thread_heap);
 	heap_free_all(heap);
 }
 
+//! Free all memory allocated by the heap but keep the memory mapped for reuse by the heap
+void
+rpmalloc_heap_reset(rpmalloc_heap_t* heap, size_t retain_size) {
+	heap_t* thread_heap = (heap_t*)atomic_load_explicit(&heap->shared_list, memory_order_acquire);
+	for (; thread_heap; thread_heap = thread_heap->shared_next)
+		heap_reset(thread_heap, retain_size);
+	heap_reset(heap, retain_size);
+}
+
 extern inline void
 rpmalloc_heap_thread_set_current(rpmalloc_heap_t* heap) {
+	if (heap) {
+		heap = heap_first_class_get(heap);
+		if (heap->shared_parent)
+			heap->is_thread_current = 1;
+	}
 	heap_t* prev_heap = get_thread_heap();
 	if (prev_heap != heap) {
 		set_thread_heap(heap);
-		if (prev_heap)
+		// The fallback heap of uninitialized threads is not released
+		if (prev_heap && (prev_heap != global_heap_default))
 			heap_release(prev_heap);
 	}
 }
@@ -2337,11 +6721,40 @@ rpmalloc_heap_t*
 rpmalloc_get_heap_for_ptr(void* ptr) {
 	// Grab the span, and then the heap from the span
 	span_t* span = (span_t*)((uintptr_t)ptr & SPAN_MASK);
-	if (span)
-		return span_get_page_from_block(span, ptr)->heap;
+	if (span) {
+		heap_t* heap = span_get_page_from_block(span, ptr)->heap;
+		return heap->shared_parent ? heap->shared_parent : heap;
+	}
+	return 0;
+}
+
+extern unsigned int
+rpmalloc_heap_numa_node(rpmalloc_heap_t* heap) {
+	return heap->numa_node;
+}
+
+extern int
+rpmalloc_heap_set_numa_node(rpmalloc_heap_t* heap, unsigned int node) {
+	if (!global_config.enable_numa || (node >= global_numa_node_count))
+		return -1;
+	heap->numa_node = node;
 	return 0;
 }
 
+int
+rpmalloc_heap_walk(rpmalloc_heap_t* heap, rpmalloc_page_visit_fn visit, void* context) {
+	heap = heap_first_class_get(heap);
+	heap_walk_t walk = {visit, context, heap, 0};
+	return heap_walk(heap, &walk);
+}
+
+void
+rpmalloc_heap_walk_summary(rpmalloc_heap_t* heap, rpmalloc_walk_summary_t* summary) {
+	memset(summary, 0, sizeof(rpmalloc_walk_summary_t));
+	rpmalloc_heap_walk(heap, walk_summary_visit, summary);
+	walk_summary_finalize(summary);
+}
+
 #endif
 
 #include "malloc.c"
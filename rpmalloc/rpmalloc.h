@@ -66,57 +66,90 @@ extern "C" {
 //  a new block).
 #define RPMALLOC_GROW_OR_FAIL 2
 
+//! Format to rpmalloc_sample_dump for the legacy heap profile text format read by pprof
+#define RPMALLOC_SAMPLE_FORMAT_PPROF 0
+//! Format to rpmalloc_sample_dump for folded stacks read by flame graph tools
+#define RPMALLOC_SAMPLE_FORMAT_FOLDED 1
+
+//! Page types reported by the heap walk, huge blocks are reported as a single page of the huge type
+#define RPMALLOC_PAGE_SMALL 0
+#define RPMALLOC_PAGE_MEDIUM 1
+#define RPMALLOC_PAGE_LARGE 2
+#define RPMALLOC_PAGE_HUGE 3
+
+//! Operations in allocation trace records, allocations by the zero initializing functions are traced as zalloc
+#define RPMALLOC_TRACE_ALLOC 1
+#define RPMALLOC_TRACE_ZALLOC 2
+#define RPMALLOC_TRACE_REALLOC 3
+#define RPMALLOC_TRACE_FREE 4
+//! Magic number of allocation trace files ("RPTRACE1" in little endian byte order) and the trace format version
+#define RPMALLOC_TRACE_MAGIC 0x3145434152545052ULL
+#define RPMALLOC_TRACE_VERSION 1
+
 typedef struct rpmalloc_global_statistics_t {
 	//! Current amount of virtual memory mapped, all of which might not have been committed (only if
 	//! ENABLE_STATISTICS=1)
 	size_t mapped;
 	//! Peak amount of virtual memory mapped, all of which might not have been committed (only if ENABLE_STATISTICS=1)
 	size_t mapped_peak;
-	//! Current amount of memory in global caches for small and medium sizes (<32KiB)
+	//! Current amount of memory in global caches, free pages in the global page pool donated from released
+	//! heaps and freed spans in the huge span cache (only if ENABLE_STATISTICS=1)
 	size_t cached;
-	//! Current amount of memory allocated in huge allocations, i.e larger than LARGE_SIZE_LIMIT which is 2MiB by
-	//! default (only if ENABLE_STATISTICS=1)
+	//! Current amount of memory allocated in huge allocations, i.e larger than LARGE_BLOCK_SIZE_LIMIT which is 8MiB
+	//! by default (only if ENABLE_STATISTICS=1)
 	size_t huge_alloc;
-	//! Peak amount of memory allocated in huge allocations, i.e larger than LARGE_SIZE_LIMIT which is 2MiB by default
-	//! (only if ENABLE_STATISTICS=1)
+	//! Peak amount of memory allocated in huge allocations, i.e larger than LARGE_BLOCK_SIZE_LIMIT which is 8MiB by
+	//! default (only if ENABLE_STATISTICS=1)
 	size_t huge_alloc_peak;
 	//! Total amount of memory mapped since initialization (only if ENABLE_STATISTICS=1)
 	size_t mapped_total;
 	//! Total amount of memory unmapped since initialization  (only if ENABLE_STATISTICS=1)
 	size_t unmapped_total;
+	//! Current amount of memory committed, tracked at the granularity of span and page commits
+	size_t committed;
+	//! Current amount of anonymous memory in the process backed by transparent huge pages, as reported by the
+	//! kernel (only on Linux with enable_thp set in the configuration)
+	size_t thp_backed;
+	//! Estimated total amount of memory allocated since initialization, extrapolated from sampled allocations
+	//! (only if ENABLE_SAMPLING=1 and a sample interval is configured)
+	size_t sampled_alloc_total;
+	//! Estimated total number of allocations since initialization, extrapolated from sampled allocations
+	//! (only if ENABLE_SAMPLING=1 and a sample interval is configured)
+	size_t sampled_alloc_count;
 } rpmalloc_global_statistics_t;
 
 typedef struct rpmalloc_thread_statistics_t {
-	//! Current number of bytes available in thread size class caches for small and medium sizes (<32KiB)
+	//! Current number of bytes available in thread heap local free lists
 	size_t sizecache;
-	//! Current number of bytes available in thread span caches for small and medium sizes (<32KiB)
+	//! Current number of bytes in free but still committed pages in the thread heap
 	size_t spancache;
-	//! Total number of bytes transitioned from thread cache to global cache (only if ENABLE_STATISTICS=1)
+	//! Total number of bytes in free pages donated from the heap to the global pool (only if ENABLE_STATISTICS=1)
 	size_t thread_to_global;
-	//! Total number of bytes transitioned from global cache to thread cache (only if ENABLE_STATISTICS=1)
+	//! Total number of bytes in free pages adopted by the heap from the global pool (only if ENABLE_STATISTICS=1)
 	size_t global_to_thread;
-	//! Per span count statistics (only if ENABLE_STATISTICS=1)
+	//! Per page type statistics, indexed by page type (0 small, 1 medium, 2 large) (only if ENABLE_STATISTICS=1)
 	struct {
-		//! Currently used number of spans
+		//! Currently used number of pages
 		size_t current;
-		//! High water mark of spans used
+		//! High water mark of pages used
 		size_t peak;
-		//! Number of spans transitioned to global cache
+		//! Number of free pages donated to global pool
 		size_t to_global;
-		//! Number of spans transitioned from global cache
+		//! Number of free pages adopted from global pool
 		size_t from_global;
-		//! Number of spans transitioned to thread cache
+		//! Number of pages transitioned to heap free list
 		size_t to_cache;
-		//! Number of spans transitioned from thread cache
+		//! Number of pages taken into use from heap free list
 		size_t from_cache;
-		//! Number of spans transitioned to reserved state
+		//! Number of free pages decommitted
 		size_t to_reserved;
-		//! Number of spans transitioned from reserved state
+		//! Number of free pages recommitted
 		size_t from_reserved;
-		//! Number of raw memory map calls (not hitting the reserve spans but resulting in actual OS mmap calls)
+		//! Number of raw memory map calls for new spans of pages
 		size_t map_calls;
 	} span_use[64];
-	//! Per size class statistics (only if ENABLE_STATISTICS=1)
+	//! Per size class statistics (only if ENABLE_STATISTICS=1). Frees from other threads are counted once
+	//! processed by the owning heap
 	struct {
 		//! Current number of allocations
 		size_t alloc_current;
@@ -126,26 +159,128 @@ typedef struct rpmalloc_thread_statistics_t {
 		size_t alloc_total;
 		//! Total number of frees
 		size_t free_total;
-		//! Number of spans transitioned to cache
+		//! Number of pages transitioned to free state
 		size_t spans_to_cache;
-		//! Number of spans transitioned from cache
+		//! Number of free pages taken into use, from heap free list or global pool
 		size_t spans_from_cache;
-		//! Number of spans transitioned from reserved state
+		//! Number of new pages initialized from spans
 		size_t spans_from_reserved;
-		//! Number of raw memory map calls (not hitting the reserve spans but resulting in actual OS mmap calls)
+		//! Number of raw memory map calls for new spans of pages
 		size_t map_calls;
+		//! Number of pages transitioned to full state
+		size_t pages_to_full;
 	} size_use[128];
 } rpmalloc_thread_statistics_t;
 
+//! Page state reported by the heap walk. Values of pages in heaps not owned by the calling thread are read without
+//! synchronization and are approximate
+typedef struct rpmalloc_page_info_t {
+	//! Start of the page memory
+	void* address;
+	//! Size of the page in bytes
+	size_t page_size;
+	//! Number of committed bytes from the start of the page
+	size_t committed;
+	//! Size of the blocks of the page
+	size_t block_size;
+	//! ID of the heap owning the page
+	unsigned int heap_id;
+	//! Page type (RPMALLOC_PAGE_*)
+	unsigned int page_type;
+	//! Size class of the blocks, zero for free and huge pages
+	unsigned int size_class;
+	//! Number of blocks in the page, zero for free pages
+	unsigned int block_count;
+	//! Number of blocks in use, including blocks freed by other threads not yet adopted by the owning heap
+	unsigned int block_used;
+	//! Number of blocks initialized, i.e handed out at least once since the page was taken into use
+	unsigned int block_initialized;
+	//! Number of blocks freed by other threads not yet adopted by the owning heap
+	unsigned int thread_free_count;
+	//! Non-zero if the page is free and kept in the free page list of the heap
+	int is_free;
+	//! Non-zero if all blocks of the page are in use
+	int is_full;
+	//! Non-zero if the memory of the free page beyond the first memory page has been decommitted
+	int is_decommitted;
+} rpmalloc_page_info_t;
+
+//! Function called for each page by the heap walk, return non-zero to stop the walk. The function must not call
+//! into the allocator, the walked heaps are held by the calling thread during the walk
+typedef int (*rpmalloc_page_visit_fn)(const rpmalloc_page_info_t* page, void* context);
+
+//! Summary of the pages reported by a heap walk
+typedef struct rpmalloc_walk_summary_t {
+	//! Number of pages walked
+	size_t page_count;
+	//! Number of committed bytes in the walked pages
+	size_t committed;
+	//! Number of bytes in blocks in use in the walked pages
+	size_t used;
+	//! Number of committed bytes in free pages
+	size_t free_committed;
+	//! Total amount of memory committed by the allocator, used as the resident size share base
+	size_t total_committed;
+	//! Per size class summary of pages in use, indexed by size class
+	struct {
+		//! Size of the blocks of the size class
+		size_t block_size;
+		//! Number of pages in use
+		size_t page_count;
+		//! Number of blocks in the pages in use
+		size_t block_count;
+		//! Number of blocks in use
+		size_t block_used;
+		//! Number of committed bytes in the pages in use
+		size_t committed;
+		//! Number of committed bytes in the pages in use not holding a block in use
+		size_t fragmented;
+		//! Share of the fragmented bytes in the total memory committed by the allocator, in hundredths of a percent
+		unsigned int fragmented_share;
+	} size_class[128];
+} rpmalloc_walk_summary_t;
+
+//! Header of an allocation trace file, followed by the records of the traced thread in the order performed. The
+//! trace of a thread not finalized before the process terminated ends with zero records
+typedef struct rpmalloc_trace_header_t {
+	//! Magic number, RPMALLOC_TRACE_MAGIC
+	unsigned long long magic;
+	//! Format version, RPMALLOC_TRACE_VERSION
+	unsigned int version;
+	//! Size of a record in bytes
+	unsigned int record_size;
+	//! Index of the traced thread in the order the threads started tracing in the process
+	unsigned int thread_index;
+	//! ID of the traced process
+	unsigned int process_id;
+	//! Timestamp in nanoseconds of the start of the trace, from the same monotonic clock as the records
+	unsigned long long timestamp;
+} rpmalloc_trace_header_t;
+
+//! Allocation trace record
+typedef struct rpmalloc_trace_record_t {
+	//! Timestamp in nanoseconds from a monotonic clock
+	unsigned long long timestamp;
+	//! Address of the allocated or freed block, zero if the allocation failed. Addresses identify the blocks
+	//! between the allocation and the free, and can be reused by later allocations
+	unsigned long long block;
+	//! Address of the reallocated block for reallocations, zero otherwise
+	unsigned long long previous;
+	//! Operation (RPMALLOC_TRACE_*) in bits 56-63, log2 of the requested alignment in bits 48-55 (zero if not
+	//! aligned) and the requested size in bits 0-47
+	unsigned long long info;
+} rpmalloc_trace_record_t;
+
 typedef struct rpmalloc_interface_t {
 	//! Map memory pages for the given number of bytes. The returned address MUST be aligned to the given alignment,
-	//! which will always be either 0 or the span size. The function can store an alignment offset in the offset
-	//! variable in case it performs alignment and the returned pointer is offset from the actual start of the memory
-	//! region due to this alignment. This alignment offset will be passed to the memory unmap function. The mapped size
-	//! can be stored in the mapped_size variable, which will also be passed to the memory unmap function as the release
-	//! parameter once the entire mapped region is ready to be released. If you set a memory_map function, you must also
-	//! set a memory_unmap function or else the default implementation will be used for both. This function must be
-	//! thread safe, it can be called by multiple threads simultaneously.
+	//! which will always be either 0 or the span size, and always to the memory page size. The function can store
+	//! an alignment offset in the offset variable in case it performs alignment and the returned pointer is offset
+	//! from the actual start of the memory region due to this alignment. This alignment offset will be passed to
+	//! the memory unmap function. The mapped size can be stored in the mapped_size variable, which will also be
+	//! passed to the memory unmap function as the release parameter once the entire mapped region is ready to be
+	//! released. If you set a memory_map function, you must also set a memory_unmap function or else the default
+	//! implementation will be used for both. This function must be thread safe, it can be called by multiple
+	//! threads simultaneously.
 	void* (*memory_map)(size_t size, size_t alignment, size_t* offset, size_t* mapped_size);
 	//! Commit a range of memory pages
 	void (*memory_commit)(void* address, size_t size);
@@ -160,8 +295,27 @@ typedef struct rpmalloc_interface_t {
 	//! be retried. The argument passed is the number of bytes that was requested in the map call. Only used if the
 	//! default system memory map function is used (memory_map callback is not set).
 	int (*map_fail_callback)(size_t size);
+	//! Called when new memory is about to be committed while the committed memory exceeds the soft limit set
+	//! in the configuration, before the allocator releases its own free memory. The arguments passed are the
+	//! number of bytes currently committed and the soft limit. The callback is made from inside the allocation
+	//! call of whichever thread crossed the limit, at most one call at a time across all threads, while the
+	//! calling thread (or with ENABLE_PER_CPU_HEAPS=1, its CPU heap) is in the middle of an allocation. The
+	//! application can free memory held in its own caches with rpfree (or the heap free functions), blocks from
+	//! any heap and thread can be freed. It must not allocate memory, which would not trigger a nested release
+	//! and could exceed the limit further, and must not call the initialize, finalize, collect or purge functions.
+	//! Other threads crossing the limit during the callback continue without releasing memory.
+	void (*memory_pressure_callback)(size_t committed_size, size_t soft_limit);
 	//! Called when an assert fails, if asserts are enabled. Will use the standard assert() if this is not set.
 	void (*error_callback)(const char* message);
+	//! Resize the memory pages starting at address, previously mapped with memory_map with span size alignment and
+	//! currently committed for the given number of bytes, to span the given new size. The offset and mapped_size
+	//! variables hold the values from the memory map call and must be updated to reflect the new mapping. The returned
+	//! address MUST be aligned to the span size and the memory content must be preserved. If the flags contain
+	//! RPMALLOC_GROW_OR_FAIL the region must not be moved. Return null if the region could not be resized, the
+	//! original region must then be left untouched. Optional, if not set huge blocks are resized by allocating a new
+	//! block and copying the content. Set to the default implementation if memory_map and memory_unmap are not set.
+	void* (*memory_remap)(void* address, size_t size, size_t new_size, size_t* offset, size_t* mapped_size,
+	                      unsigned int flags);
 } rpmalloc_interface_t;
 
 typedef struct rpmalloc_config_t {
@@ -188,12 +342,107 @@ typedef struct rpmalloc_config_t {
 	//  when process exits, but if using rpmalloc in a dynamic library you might want to unmap
 	//  all pages when the dynamic library unloads to avoid process memory leaks and bloat.
 	int unmap_on_finalize;
+	//! Maximum number of bytes in freed huge spans to keep in the huge span cache for reuse in later
+	//  huge allocations. Set to 0 to use the default limit of 256MiB.
+	size_t huge_cache_limit;
+	//! Maximum age in milliseconds of spans in the huge span cache before they are unmapped. The age
+	//  is checked on huge deallocations and calls to rpmalloc_thread_collect. Set to 0 to use the
+	//  default age of 1000ms.
+	unsigned int huge_cache_max_age;
+	//! Disable the huge span cache if set to 1, unmapping huge spans immediately when freed
+	int disable_huge_cache;
+	//! Enable NUMA awareness if set to 1 and the system has more than one NUMA node. Heaps are assigned the
+	//  node of the thread acquiring them and released heaps are kept in separate queues for each node. Memory
+	//  mapped by a heap is bound to the preferred node of the heap (only with the default memory map functions
+	//  on Linux and Windows), and pages from the global pool local to the node are preferred. Will be reset
+	//  to 0 during initialization if NUMA is not supported.
+	int enable_numa;
+	//! Number of blocks freed by a thread to a page owned by another thread to buffer in the freeing thread heap
+	//  before publishing them to the page as a single list with one atomic operation. Reduces contention on the
+	//  owning page when a thread frees most blocks allocated by other threads. Buffered blocks are published
+	//  when the batch size is reached, the buffer slot is needed for another page, and in calls to
+	//  rpmalloc_thread_collect and rpmalloc_thread_finalize. Set to 0 or 1 to disable buffering (default).
+	unsigned int remote_free_batch;
+	//! Number of bytes of address space to reserve on initialization, rounded up to the span size (256MiB).
+	//  Spans are carved out of the reserved region without a system call for each span, and once exhausted
+	//  spans are mapped individually. The reservation does not reserve swap space. Only used with the default
+	//  memory map functions on POSIX systems without huge pages, reset to 0 otherwise. Set to 0 to disable
+	//  the reservation (default).
+	size_t reserve_size;
+	//! Time in milliseconds a free page is kept committed before it is decommitted. If non-zero, free pages are
+	//  decommitted by age instead of when the number of free pages reaches a fixed threshold. Set to 0 to use
+	//  the fixed thresholds (default), or the default decay time of 1000ms if the purge thread is enabled.
+	unsigned int decay_time;
+	//! Start a background thread calling rpmalloc_purge periodically, at half the decay time, if set to 1.
+	//  The thread is stopped in rpmalloc_finalize.
+	int enable_purge_thread;
+	//! Soft limit in bytes of committed memory. When committing new memory would exceed the limit, the memory
+	//  pressure callback is called and the free pages of the calling thread, of exited threads (including pages
+	//  emptied by frees from other threads) and of the global pool are decommitted and the huge span cache is
+	//  flushed. The limit is not enforced, allocations exceeding it still succeed. Committed memory is tracked at span and
+	//  page commit granularity, or as the full mapped spans if decommit is not enabled (ENABLE_DECOMMIT=0), and
+	//  is reported in the global statistics. If the release does not bring the committed memory below 7/8 of the
+	//  limit (the live data is close to or above it), further releases are held off until the committed memory
+	//  drops by 1/8 of the limit from the level left by the release, or for at most one second. Set to 0 to
+	//  disable the limit (default).
+	size_t soft_limit;
+	//! Block sizes of the size classes for blocks larger than 1024 bytes, in ascending order. Block sizes must be
+	//  multiples of 16 bytes. At most 8 block sizes up to 4KiB, 24 block sizes up to 256KiB and 20 block sizes
+	//  up to 8MiB can be given, and the table must contain 4KiB, 256KiB and 8MiB. Blocks up to 1024 bytes always
+	//  use size classes in increments of 16 bytes. The table can be generated from a histogram of allocation
+	//  sizes with tools/sizeclass.py. If the size classes differ from the previous initialization, heaps kept
+	//  from it are no longer reused and all threads must have been finalized. Set to null to use the default
+	//  size classes, will be reset to null during initialization if the table is invalid or cannot be used.
+	const unsigned int* size_class_table;
+	//! Number of block sizes in the size class table
+	unsigned int size_class_count;
+	//! Mean number of bytes allocated between sampled allocations. Each thread heap counts down a random number
+	//  of bytes drawn from an exponential distribution with this mean, and the allocation reaching zero records its
+	//  size and call stack until freed. Sampled allocations can be dumped with rpmalloc_sample_dump. Frees of blocks
+	//  in pages holding sampled blocks take a slower path. Only used if built with ENABLE_SAMPLING=1, reset to 0
+	//  otherwise. Set to 0 to disable sampling (default).
+	size_t sample_interval;
+	//! Number of heaps to create on initialization, each with prewarmed free pages, to be adopted by the calling
+	//  thread and the next threads initialized. Avoids mapping the heap and span memory and the page faults of the
+	//  first allocations of latency critical threads. Combine with reserve_size to also carve later spans without
+	//  a system call. If built with ENABLE_PER_CPU_HEAPS=1 the heaps of the first CPUs up to the given count are
+	//  prewarmed instead. Will be reset to 0 if prewarm_size is 0. Set to 0 to disable prewarming (default).
+	unsigned int prewarm_heap_count;
+	//! Number of bytes of small and medium pages, split evenly between the page types, to initialize, commit and
+	//  fault in for each prewarmed heap. The prewarmed number of free pages of each type are kept committed in the
+	//  heap, also when collecting or purging free pages and under memory pressure, until the thread using the
+	//  heap exits (CPU heaps keep them until finalized). Free pages beyond that number are subject to the same
+	//  decommit rules as in other heaps
+	size_t prewarm_size;
+	//! Lock the prewarmed pages in memory if set to 1, keeping them resident. Disables decommit of all free pages
+	//  (disable_decommit is set to 1) until the pages are unlocked in rpmalloc_finalize. The pages are still
+	//  faulted in if locking fails, for example by exceeding the locked memory limit of the process
+	int prewarm_lock;
+	//! Path prefix of allocation trace files. If set, each thread records its allocations, reallocations and
+	//  frees through the rpmalloc entry points, which the malloc and new/delete overrides use, to the file
+	//  <trace_path>.<process id>.<thread index> for replay with rpmalloc-replay. Forked child processes trace to
+	//  files with their own process ID. If null the RPMALLOC_TRACE environment variable is used. Tracing stops in
+	//  rpmalloc_finalize. Only used if built with ENABLE_TRACE=1 on POSIX systems, reset to null otherwise or if
+	//  the path is longer than 255 characters. The path is copied during initialization.
+	const char* trace_path;
+	//! Decommit free pages and flush the huge span cache before a fork if set to 1, so forked child processes do not
+	//  inherit and copy on write the memory cached by the parent. Free pages of heaps owned by other threads of the
+	//  parent are not decommitted, these heaps are orphaned in the child. Fork handlers are registered on POSIX
+	//  systems to keep the allocator usable in the child regardless of this setting, reset to 0 on other systems
+	int decommit_on_fork;
 #if defined(__linux__) || defined(__ANDROID__)
 	///! Allows to disable the Transparent Huge Page feature on Linux on a process basis,
 	///  rather than enabling/disabling system-wise (done via /sys/kernel/mm/transparent_hugepage/enabled).
 	///  It can possibly improve performance and reduced allocation overhead in some contexts, albeit
 	///  THP is usually enabled by default.
 	int disable_thp;
+	//! Enable transparent huge page mode if set to 1. Mapped spans are advised as transparent huge page candidates
+	//  and decommits only release the 2MiB huge pages fully covered by the decommitted range, keeping partially
+	//  covered huge pages resident instead of splitting them back to normal pages. Reduces TLB misses for large
+	//  working sets at the cost of more resident memory, partially released pages are still counted as
+	//  decommitted in the committed memory statistics. Only used with the default memory map functions when
+	//  explicit huge pages and disable_thp are not enabled, reset to 0 otherwise.
+	int enable_thp;
 #endif
 } rpmalloc_config_t;
 
@@ -221,14 +470,41 @@ rpmalloc_thread_initialize(void);
 RPMALLOC_EXPORT void
 rpmalloc_thread_finalize(void);
 
-//! Perform deferred deallocations pending for the calling thread heap
+//! Perform deferred deallocations pending for the calling thread heap and decommit excess free pages
 RPMALLOC_EXPORT void
 rpmalloc_thread_collect(void);
 
-//! Query if allocator is initialized for calling thread
+//! Decommit free pages that have been free for at least the configured decay time, in the calling thread heap,
+//  the global page pool and the released heaps not yet reused by other threads. Blocks freed by other threads to
+//  the calling thread heap and the released heaps are collected first, pages emptied by them are decommitted by a
+//  later purge once older than the decay time. Heaps in use by other threads are not touched, they decommit their
+//  own free pages by age when pages are freed. If the budget is non-zero, released heaps are only processed until
+//  the given number of nanoseconds has passed. Returns the number of bytes decommitted
+RPMALLOC_EXPORT size_t
+rpmalloc_purge(unsigned long long budget_ns);
+
+//! Perform deferred deallocations pending for the calling thread heap and decommit free pages beyond the
+//  given number of retained free pages for each page type. If the byte budget is non-zero, stop once at
+//  least the given number of bytes have been decommitted. Returns the number of bytes decommitted
+RPMALLOC_EXPORT size_t
+rpmalloc_thread_collect_budget(unsigned int page_retain_count, size_t byte_budget);
+
+//! Query if allocator is initialized for calling thread, that is if the thread has been initialized (explicitly or
+//  implicitly by a call to the allocation interface) and not finalized since. If built with ENABLE_PER_CPU_HEAPS=1
+//  threads do not own a heap and this only tracks the calls to rpmalloc_thread_initialize and
+//  rpmalloc_thread_finalize and the use of the interface by the thread
 RPMALLOC_EXPORT int
 rpmalloc_is_thread_initialized(void);
 
+//! Get the preferred NUMA node of the calling thread heap, always 0 if NUMA awareness is not enabled
+RPMALLOC_EXPORT unsigned int
+rpmalloc_thread_numa_node(void);
+
+//! Set the preferred NUMA node of the calling thread heap for memory mapped after this call. Returns 0 on
+//  success, or -1 if NUMA awareness is not enabled, the node is invalid or heaps are per CPU
+RPMALLOC_EXPORT int
+rpmalloc_thread_set_numa_node(unsigned int node);
+
 //! Get per-thread statistics
 RPMALLOC_EXPORT void
 rpmalloc_thread_statistics(rpmalloc_thread_statistics_t* stats);
@@ -241,6 +517,27 @@ rpmalloc_global_statistics(rpmalloc_global_statistics_t* stats);
 RPMALLOC_EXPORT void
 rpmalloc_dump_statistics(void* file);
 
+//! Dump the live sampled allocations in the given format (RPMALLOC_SAMPLE_FORMAT_*) by calling the write function
+//  with buffers of output text. The pprof format holds the raw samples and the sample interval for pprof to scale,
+//  while folded stacks are weighted by the estimated number of bytes each sample represents. Stacks are given as
+//  return addresses to be symbolized by the tools. Returns the number of sampled allocations dumped, or -1 if
+//  sampling is not enabled
+RPMALLOC_EXPORT int
+rpmalloc_sample_dump(int format, void (*write)(void* context, const char* buffer, size_t size), void* context);
+
+//! Walk the pages of the calling thread heap and the released heaps not yet reused by other threads, calling the visit
+//  function for each page. Each released heap is held by the calling thread while its pages are walked, a thread
+//  reusing it waits until done. Heaps in use by other threads are not walked and never stopped, they can be walked from
+//  their own thread. Pages of the walked heaps adopted from spans of heaps in use by other threads are not reported. If
+//  built with ENABLE_PER_CPU_HEAPS=1 all CPU heaps not held by another thread are walked. Returns non-zero if the walk
+//  was stopped by the visitor
+RPMALLOC_EXPORT int
+rpmalloc_walk(rpmalloc_page_visit_fn visit, void* context);
+
+//! Summarize the pages walked by rpmalloc_walk, reporting the fragmentation of each size class
+RPMALLOC_EXPORT void
+rpmalloc_walk_summary(rpmalloc_walk_summary_t* summary);
+
 //! Allocate a memory block of at least the given size
 RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
 rpmalloc(size_t size) RPMALLOC_ATTRIB_MALLOC RPMALLOC_ATTRIB_ALLOC_SIZE(1);
@@ -305,6 +602,23 @@ rpposix_memalign(void** memptr, size_t alignment, size_t size);
 RPMALLOC_EXPORT void
 rpfree(void* ptr);
 
+//! Free the given memory block of the given size. The size must be at most the usable size of the block, such as
+//  the size passed to the allocation function, and is checked against the block size in assert builds. Blocks from
+//  aligned allocation and reallocation functions can be freed with their size as well.
+RPMALLOC_EXPORT void
+rpfree_sized(void* ptr, size_t size);
+
+//! Allocate the given number of memory blocks of at least the given size, storing the block pointers in the
+//  given array. Returns the number of blocks allocated, which is less than the requested count only if out of
+//  memory. The blocks are freed individually or with rpfree_batch.
+RPMALLOC_EXPORT size_t
+rpmalloc_alloc_batch(size_t size, size_t count, void** blocks);
+
+//! Free the given number of memory blocks. Null pointers in the array are ignored. Blocks from the same
+//  page should be stored consecutively, as for blocks from rpmalloc_alloc_batch, for the best performance.
+RPMALLOC_EXPORT void
+rpfree_batch(void** ptrs, size_t count);
+
 //! Query the usable size of the given memory block (from given pointer to the end of block)
 RPMALLOC_EXPORT size_t
 rpmalloc_usable_size(void* ptr);
@@ -324,6 +638,19 @@ typedef struct heap_t rpmalloc_heap_t;
 RPMALLOC_EXPORT rpmalloc_heap_t*
 rpmalloc_heap_acquire(void);
 
+//! Acquire a new shared heap, which unlike other heaps can be used by multiple threads concurrently. Each thread
+//  calling an allocation function with the heap transparently gets its own heap for the shared heap, allocating
+//  from its own pages without locks. Blocks can be freed by any thread, blocks freed by a thread other than the
+//  allocating thread are returned through the lock free deferred free lists of the pages. All memory for all
+//  threads is released with rpmalloc_heap_free_all, or discarded with rpmalloc_heap_reset, which must not be called
+//  concurrently with other calls for the heap. Each thread heap is a complete heap with its own pages, the memory
+//  overhead grows with the number of threads using the shared heap. The heap of a thread is kept until the shared
+//  heap is released, even if the thread exits. If the shared heap is set as the current heap of a thread with
+//  rpmalloc_heap_thread_set_current when released, the heap of that thread is kept by the thread until it sets
+//  another current heap or exits.
+RPMALLOC_EXPORT rpmalloc_heap_t*
+rpmalloc_heap_acquire_shared(void);
+
 //! Release a heap (does NOT free the memory allocated by the heap, use rpmalloc_heap_free_all before destroying the
 //! heap).
 //  Releasing a heap will enable it to be reused by other threads. Safe to pass a null pointer.
@@ -375,12 +702,26 @@ rpmalloc_heap_aligned_realloc(rpmalloc_heap_t* heap, void* ptr, size_t alignment
 RPMALLOC_EXPORT void
 rpmalloc_heap_free(rpmalloc_heap_t* heap, void* ptr);
 
+//! Free the given memory block of the given size from the given heap. The memory block MUST be allocated by the
+//  same heap given to this function, with the same restrictions on the size as for rpfree_sized.
+RPMALLOC_EXPORT void
+rpmalloc_heap_free_sized(rpmalloc_heap_t* heap, void* ptr, size_t size);
+
 //! Free all memory allocated by the heap
 RPMALLOC_EXPORT void
 rpmalloc_heap_free_all(rpmalloc_heap_t* heap);
 
-//! Set the given heap as the current heap for the calling thread. A heap MUST only be current heap
-//  for a single thread, a heap can never be shared between multiple threads. The previous
+//! Free all memory allocated by the heap but keep the memory mapped, to reuse warm memory pages for the next
+//  allocations from the heap without mapping and faulting in memory again. Up to the given number of bytes of
+//  free pages are kept committed, the rest are decommitted. Huge blocks are released to the huge span cache or
+//  unmapped. As with rpmalloc_heap_free_all, no blocks of the heap can be in use or freed after the call
+RPMALLOC_EXPORT void
+rpmalloc_heap_reset(rpmalloc_heap_t* heap, size_t retain_size);
+
+//! Set the given heap as the current heap for the calling thread. A heap from rpmalloc_heap_acquire MUST only be
+//  current heap for a single thread. A heap from rpmalloc_heap_acquire_shared can be set as current heap by any
+//  number of threads, the heap of the calling thread in the shared heap is what becomes current, and it is kept by
+//  the thread after the shared heap is released until the thread sets another current heap or exits. The previous
 //  current heap for the calling thread is released to be reused by other threads.
 RPMALLOC_EXPORT void
 rpmalloc_heap_thread_set_current(rpmalloc_heap_t* heap);
@@ -389,6 +730,25 @@ rpmalloc_heap_thread_set_current(rpmalloc_heap_t* heap);
 RPMALLOC_EXPORT rpmalloc_heap_t*
 rpmalloc_get_heap_for_ptr(void* ptr);
 
+//! Get the preferred NUMA node of the heap, always 0 if NUMA awareness is not enabled
+RPMALLOC_EXPORT unsigned int
+rpmalloc_heap_numa_node(rpmalloc_heap_t* heap);
+
+//! Set the preferred NUMA node of the heap for memory mapped after this call. Returns 0 on success, or -1
+//  if NUMA awareness is not enabled or the node is invalid
+RPMALLOC_EXPORT int
+rpmalloc_heap_set_numa_node(rpmalloc_heap_t* heap, unsigned int node);
+
+//! Walk the pages of the heap, calling the visit function for each page. Must be called from the thread using the
+//  heap, for a shared heap only the pages allocated by the calling thread are walked. Returns non-zero if the walk
+//  was stopped by the visitor
+RPMALLOC_EXPORT int
+rpmalloc_heap_walk(rpmalloc_heap_t* heap, rpmalloc_page_visit_fn visit, void* context);
+
+//! Summarize the pages of the heap walked by rpmalloc_heap_walk, reporting the fragmentation of each size class
+RPMALLOC_EXPORT void
+rpmalloc_heap_walk_summary(rpmalloc_heap_t* heap, rpmalloc_walk_summary_t* summary);
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,287 @@
+/* rpmalloc.hpp  -  Memory allocator  -  Public Domain  -  2016-2024 Mattias Jansson
+ *
+ * This library provides a cross-platform lock free thread caching malloc
+ * implementation in C11. The latest source code is always available at
+ *
+ * https://github.com/mjansson/rpmalloc
+ *
+ * This library is put in the public domain; you can redistribute it and/or
+ * modify it without any restrictions.
+ *
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+
+#include <rpmalloc.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>) && ((__cplusplus >= 201703L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 201703L)))
+#include <memory_resource>
+#define RPMALLOC_HAS_MEMORY_RESOURCE 1
+#endif
+#endif
+#ifndef RPMALLOC_HAS_MEMORY_RESOURCE
+#define RPMALLOC_HAS_MEMORY_RESOURCE 0
+#endif
+
+namespace rp {
+
+//! Alignment of all blocks returned by the allocation functions, larger alignments must use the aligned functions
+static const std::size_t natural_alignment = 16;
+
+namespace detail {
+
+//! Report an allocation failure, throwing std::bad_alloc if exceptions are enabled
+[[noreturn]] inline void
+throw_bad_alloc() {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+	throw std::bad_alloc();
+#else
+	std::abort();
+#endif
+}
+
+//! Check that an array of the given number of elements does not overflow the size type
+template <class T>
+inline std::size_t
+array_size(std::size_t count) {
+	if (count > (SIZE_MAX / sizeof(T)))
+		throw_bad_alloc();
+	return count * sizeof(T);
+}
+
+}  // namespace detail
+
+//! Allocator for standard containers using the global rpmalloc functions. The allocator is stateless, all
+//  instances compare equal and containers using it carry no extra storage. Deallocation passes the size of the
+//  block to the sized free path
+template <class T>
+class allocator {
+   public:
+	typedef T value_type;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type is_always_equal;
+
+	template <class U>
+	struct rebind {
+		typedef allocator<U> other;
+	};
+
+	allocator() noexcept {
+	}
+
+	template <class U>
+	allocator(const allocator<U>&) noexcept {
+	}
+
+	T*
+	allocate(std::size_t count) {
+		std::size_t size = detail::array_size<T>(count);
+		void* block = (alignof(T) > natural_alignment) ? rpaligned_alloc(alignof(T), size) : rpmalloc(size);
+		if (!block)
+			detail::throw_bad_alloc();
+		return static_cast<T*>(block);
+	}
+
+	void
+	deallocate(T* ptr, std::size_t count) noexcept {
+		if (alignof(T) > natural_alignment)
+			rpfree(ptr);
+		else
+			rpfree_sized(ptr, count * sizeof(T));
+	}
+
+	std::size_t
+	max_size() const noexcept {
+		return SIZE_MAX / sizeof(T);
+	}
+};
+
+template <class T, class U>
+inline bool
+operator==(const allocator<T>&, const allocator<U>&) noexcept {
+	return true;
+}
+
+template <class T, class U>
+inline bool
+operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+	return false;
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Allocator for standard containers allocating from the given first class heap. Allocators compare equal if
+//  they use the same heap, and the heap follows the container on copy, move and swap
+template <class T>
+class heap_allocator {
+   public:
+	typedef T value_type;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+	typedef std::false_type is_always_equal;
+
+	template <class U>
+	struct rebind {
+		typedef heap_allocator<U> other;
+	};
+
+	explicit heap_allocator(rpmalloc_heap_t* heap) noexcept : heap_(heap) {
+	}
+
+	template <class U>
+	heap_allocator(const heap_allocator<U>& other) noexcept : heap_(other.heap()) {
+	}
+
+	T*
+	allocate(std::size_t count) {
+		std::size_t size = detail::array_size<T>(count);
+		void* block = (alignof(T) > natural_alignment) ? rpmalloc_heap_aligned_alloc(heap_, alignof(T), size) :
+		                                                 rpmalloc_heap_alloc(heap_, size);
+		if (!block)
+			detail::throw_bad_alloc();
+		return static_cast<T*>(block);
+	}
+
+	void
+	deallocate(T* ptr, std::size_t count) noexcept {
+		if (alignof(T) > natural_alignment)
+			rpmalloc_heap_free(heap_, ptr);
+		else
+			rpmalloc_heap_free_sized(heap_, ptr, count * sizeof(T));
+	}
+
+	std::size_t
+	max_size() const noexcept {
+		return SIZE_MAX / sizeof(T);
+	}
+
+	rpmalloc_heap_t*
+	heap() const noexcept {
+		return heap_;
+	}
+
+   private:
+	rpmalloc_heap_t* heap_;
+};
+
+template <class T, class U>
+inline bool
+operator==(const heap_allocator<T>& lhs, const heap_allocator<U>& rhs) noexcept {
+	return lhs.heap() == rhs.heap();
+}
+
+template <class T, class U>
+inline bool
+operator!=(const heap_allocator<T>& lhs, const heap_allocator<U>& rhs) noexcept {
+	return lhs.heap() != rhs.heap();
+}
+
+#if RPMALLOC_HAS_MEMORY_RESOURCE
+
+//! Polymorphic memory resource allocating from the given first class heap. The alignment is forwarded to the
+//  aligned allocation functions when larger than the natural alignment, and the size to the sized free path
+class heap_resource : public std::pmr::memory_resource {
+   public:
+	explicit heap_resource(rpmalloc_heap_t* heap) noexcept : heap_(heap) {
+	}
+
+	rpmalloc_heap_t*
+	heap() const noexcept {
+		return heap_;
+	}
+
+   protected:
+	void*
+	do_allocate(std::size_t bytes, std::size_t alignment) override {
+		void* block = (alignment > natural_alignment) ? rpmalloc_heap_aligned_alloc(heap_, alignment, bytes) :
+		                                                rpmalloc_heap_alloc(heap_, bytes);
+		if (!block)
+			detail::throw_bad_alloc();
+		return block;
+	}
+
+	void
+	do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override {
+		if (alignment > natural_alignment)
+			rpmalloc_heap_free(heap_, ptr);
+		else
+			rpmalloc_heap_free_sized(heap_, ptr, bytes);
+	}
+
+	bool
+	do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+#if defined(__cpp_rtti) || defined(__GXX_RTTI) || defined(_CPPRTTI)
+		const heap_resource* resource = dynamic_cast<const heap_resource*>(&other);
+		return resource && (resource->heap_ == heap_);
+#else
+		return (this == &other);
+#endif
+	}
+
+   private:
+	rpmalloc_heap_t* heap_;
+};
+
+#endif
+
+//! First class heap owned by a scope. All memory allocated from the heap is freed with a single call to
+//  rpmalloc_heap_free_all when the scope ends, without running any destructors of objects allocated from the
+//  heap. The heap can be reset with reset() to discard all blocks while keeping the memory pages for reuse, for
+//  example between requests handled by the same worker. Use get_allocator() for standard containers, or a
+//  heap_resource constructed with heap() for polymorphic allocators
+class scoped_heap {
+   public:
+	scoped_heap() : heap_(rpmalloc_heap_acquire()) {
+		if (!heap_)
+			detail::throw_bad_alloc();
+	}
+
+	~scoped_heap() {
+		rpmalloc_heap_free_all(heap_);
+		rpmalloc_heap_release(heap_);
+	}
+
+	scoped_heap(const scoped_heap&) = delete;
+	scoped_heap&
+	operator=(const scoped_heap&) = delete;
+
+	//! Discard all blocks allocated from the heap, keeping up to the given number of bytes of memory committed
+	void
+	reset(std::size_t retain_size = SIZE_MAX) noexcept {
+		rpmalloc_heap_reset(heap_, retain_size);
+	}
+
+	rpmalloc_heap_t*
+	heap() const noexcept {
+		return heap_;
+	}
+
+	template <class T>
+	heap_allocator<T>
+	get_allocator() const noexcept {
+		return heap_allocator<T>(heap_);
+	}
+
+   private:
+	rpmalloc_heap_t* heap_;
+};
+
+#endif
+
+}  // namespace rp
+
+#endif
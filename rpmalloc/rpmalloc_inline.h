@@ -0,0 +1,165 @@
+/* rpmalloc_inline.h  -  Memory allocator  -  Public Domain  -  2016-2024 Mattias Jansson
+ *
+ * This library provides a cross-platform lock free thread caching malloc
+ * implementation in C11. The latest source code is always available at
+ *
+ * https://github.com/mjansson/rpmalloc
+ *
+ * This library is put in the public domain; you can redistribute it and/or
+ * modify it without any restrictions.
+ *
+ */
+
+#pragma once
+
+#include "rpmalloc.h"
+
+#include <stdint.h>
+
+//! Define RPMALLOC_INLINE_ABI to 1 both when building the library and the code including this header to inline the
+//  fast path of allocations and sized frees of compile time constant sizes up to RPMALLOC_INLINE_SIZE_LIMIT bytes.
+//  The library then exports the thread heap and verifies the layout below at compile time. The library must be
+//  built without ENABLE_STATISTICS, ENABLE_SAMPLING and ENABLE_TRACE, which the inlined fast path bypasses, and
+//  without ENABLE_PER_CPU_HEAPS, and be loaded at process start as the thread heap uses the initial exec TLS model.
+//  If not defined, or if the compiler lacks __builtin_constant_p, the inline functions call the exported functions
+#ifndef RPMALLOC_INLINE_ABI
+#define RPMALLOC_INLINE_ABI 0
+#endif
+
+#if RPMALLOC_INLINE_ABI && (defined(__clang__) || defined(__GNUC__))
+#define RPMALLOC_INLINE_FAST_PATH 1
+#define RPMALLOC_INLINE_ALWAYS __attribute__((always_inline))
+#define RPMALLOC_INLINE_EXPECTED(x) __builtin_expect((x), 1)
+#else
+#define RPMALLOC_INLINE_FAST_PATH 0
+#define RPMALLOC_INLINE_ALWAYS
+#define RPMALLOC_INLINE_EXPECTED(x) (x)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Largest block size handled by the inline fast path, the limit of the tiny size classes
+#define RPMALLOC_INLINE_SIZE_LIMIT 1024
+//! Granularity of the tiny size classes, the size class of a size is the size in units of the granularity
+#define RPMALLOC_INLINE_GRANULARITY 16
+//! Number of tiny size classes, including the size class of zero sized blocks
+#define RPMALLOC_INLINE_SIZE_CLASS_COUNT ((RPMALLOC_INLINE_SIZE_LIMIT / RPMALLOC_INLINE_GRANULARITY) + 1)
+//! Size of the pages holding blocks of the tiny size classes, page headers are aligned to the page size
+#define RPMALLOC_INLINE_PAGE_SIZE 65536
+//! Size of the spans holding the pages, span headers are aligned to the span size
+#define RPMALLOC_INLINE_SPAN_SIZE (256 * 1024 * 1024)
+
+//! Leading fields of the heap control structure, only the local free lists are accessed by the inline fast path.
+//  Blocks in the lists are counted as used by their pages
+typedef struct rpmalloc_inline_heap_t {
+	//! Owning thread ID
+	uintptr_t reserved_owner;
+	//! Heap local free lists for the tiny size classes, the first pointer sized word of a free block is the link
+	void* local_free[RPMALLOC_INLINE_SIZE_CLASS_COUNT];
+} rpmalloc_inline_heap_t;
+
+//! Leading fields of the page header of pages holding blocks of the tiny size classes
+typedef struct rpmalloc_inline_page_t {
+	//! Size class of blocks
+	uint32_t size_class;
+	//! Block size
+	uint32_t block_size;
+	//! Block count
+	uint32_t block_count;
+	//! Block initialized count
+	uint32_t block_initialized;
+	//! Block used count
+	uint32_t block_used;
+	//! Page type
+	uint32_t page_type;
+	//! Page state flags
+	uint32_t reserved_flags;
+	//! Local free list count
+	uint32_t local_free_count;
+	//! Local free list
+	void* local_free;
+	//! Owning heap
+	rpmalloc_inline_heap_t* heap;
+	//! Next page in list
+	void* reserved_next;
+	//! Previous page in list
+	void* reserved_prev;
+	//! Multithreaded free list
+	unsigned long long reserved_thread_free;
+} rpmalloc_inline_page_t;
+
+//! Leading fields of the span header, the first page header of the span
+typedef struct rpmalloc_inline_span_t {
+	//! Page header
+	rpmalloc_inline_page_t page;
+	//! Owning heap
+	rpmalloc_inline_heap_t* reserved_heap;
+	//! Page address mask
+	uintptr_t page_address_mask;
+} rpmalloc_inline_span_t;
+
+// The library only includes the layout to verify it against the internal structures
+#ifndef RPMALLOC_INLINE_IMPLEMENTATION
+
+#if RPMALLOC_INLINE_FAST_PATH
+//! Heap of the calling thread, exported by the library built with RPMALLOC_INLINE_ABI=1
+extern __thread rpmalloc_inline_heap_t* rpmalloc_thread_heap __attribute__((tls_model("initial-exec")));
+#endif
+
+//! Allocate a memory block of at least the given size. If the size is a compile time constant of at most
+//  RPMALLOC_INLINE_SIZE_LIMIT bytes, a block is popped inline from the local free list of the size class in the
+//  thread heap, calling rpmalloc if the list is empty or the size is not constant
+static inline RPMALLOC_INLINE_ALWAYS RPMALLOC_ALLOCATOR void*
+rpmalloc_inline(size_t size) {
+#if RPMALLOC_INLINE_FAST_PATH
+	if (__builtin_constant_p(size) && (size <= RPMALLOC_INLINE_SIZE_LIMIT)) {
+		size_t size_class = (size + (RPMALLOC_INLINE_GRANULARITY - 1)) / RPMALLOC_INLINE_GRANULARITY;
+		void** free_list = rpmalloc_thread_heap->local_free + size_class;
+		void* block = *free_list;
+		if (RPMALLOC_INLINE_EXPECTED(block != 0)) {
+			*free_list = *(void**)block;
+			return block;
+		}
+	}
+#endif
+	return rpmalloc(size);
+}
+
+//! Free a memory block allocated with the given size by rpmalloc_inline or any of the unaligned allocation
+//  functions. If the size is a compile time constant of at most RPMALLOC_INLINE_SIZE_LIMIT bytes and the block is
+//  in a page of the thread heap which stays partially used, the block is pushed inline to the local free list of
+//  the page, otherwise rpfree_sized is called. The page is only used inline if the span holds small pages and the
+//  block size of the page matches the size, other sizes must be valid for rpfree_sized. Unlike rpfree_sized, blocks
+//  from aligned allocation functions must not be passed
+static inline RPMALLOC_INLINE_ALWAYS void
+rpfree_sized_inline(void* ptr, size_t size) {
+#if RPMALLOC_INLINE_FAST_PATH
+	if (__builtin_constant_p(size) && (size <= RPMALLOC_INLINE_SIZE_LIMIT) && RPMALLOC_INLINE_EXPECTED(ptr != 0)) {
+		uintptr_t page_mask = ~((uintptr_t)RPMALLOC_INLINE_PAGE_SIZE - 1);
+		rpmalloc_inline_span_t* span =
+		    (rpmalloc_inline_span_t*)((uintptr_t)ptr & ~((uintptr_t)RPMALLOC_INLINE_SPAN_SIZE - 1));
+		size_t size_class = (size + (RPMALLOC_INLINE_GRANULARITY - 1)) / RPMALLOC_INLINE_GRANULARITY;
+		uint32_t block_size = (uint32_t)((size_class ? size_class : 1) * RPMALLOC_INLINE_GRANULARITY);
+		rpmalloc_inline_page_t* page = (rpmalloc_inline_page_t*)((uintptr_t)ptr & page_mask);
+		// Pages transitioning from full or to free take the exported path
+		if (RPMALLOC_INLINE_EXPECTED((span->page_address_mask == page_mask) && (page->block_size == block_size) &&
+		                             (page->heap == rpmalloc_thread_heap) && (page->block_used > 1) &&
+		                             (page->block_used < page->block_count))) {
+			*(void**)ptr = page->local_free;
+			page->local_free = ptr;
+			++page->local_free_count;
+			--page->block_used;
+			return;
+		}
+	}
+#endif
+	rpfree_sized(ptr, size);
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -44,14 +44,12 @@ operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
 
 extern void __CRTDECL
 operator delete(void* p, std::size_t size) noexcept {
-	(void)sizeof(size);
-	rpfree(p);
+	rpfree_sized(p, size);
 }
 
 extern void __CRTDECL
 operator delete[](void* p, std::size_t size) noexcept {
-	(void)sizeof(size);
-	rpfree(p);
+	rpfree_sized(p, size);
 }
 
 #endif
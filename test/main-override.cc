@@ -10,6 +10,7 @@
 #endif
 
 #include <rpmalloc.h>
+#include <rpmalloc.hpp>
 #ifdef _WIN32
 #include <rpnew.h>
 #endif
@@ -25,6 +26,9 @@ extern "C" {
 #include <memory.h>
 #include <inttypes.h>
 
+#include <map>
+#include <vector>
+
 #if defined(_WIN32)
 extern "C" void*
 rpvalloc(size_t size);
@@ -56,6 +60,9 @@ test_free(int print_log);
 extern "C" int
 test_malloc_thread(void);
 
+extern "C" int
+test_cxx_allocator(void);
+
 int
 test_malloc(int print_log) {
 	const rpmalloc_config_t* config = rpmalloc_config();
@@ -176,3 +183,71 @@ test_malloc_thread(void) {
 	printf("Memory override thread tests passed\n");
 	return 0;
 }
+
+//! Over-aligned element type for allocator tests
+struct alignas(64) cxx_aligned_t {
+	char data[64];
+};
+
+int
+test_cxx_allocator(void) {
+	if (!std::is_empty<rp::allocator<int>>::value)
+		return test_fail("STL allocator is not stateless");
+
+	{
+		std::vector<int, rp::allocator<int>> values;
+		for (int ivalue = 0; ivalue < 10000; ++ivalue)
+			values.push_back(ivalue);
+		for (int ivalue = 0; ivalue < 10000; ++ivalue) {
+			if (values[static_cast<size_t>(ivalue)] != ivalue)
+				return test_fail("Data corrupted in STL allocator container");
+		}
+		if (rpmalloc_usable_size(values.data()) < values.capacity() * sizeof(int))
+			return test_fail("STL allocator block smaller than requested");
+
+		std::vector<cxx_aligned_t, rp::allocator<cxx_aligned_t>> aligned(17);
+		if (reinterpret_cast<uintptr_t>(aligned.data()) & (alignof(cxx_aligned_t) - 1))
+			return test_fail("STL allocator did not align over-aligned type");
+	}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	{
+		typedef std::pair<const int, int> value_t;
+		typedef std::map<int, int, std::less<int>, rp::heap_allocator<value_t>> map_t;
+		rp::scoped_heap heap;
+		for (int ipass = 0; ipass < 3; ++ipass) {
+			// The container is allocated in the heap and never destroyed, reset discards all nodes at once
+			void* storage = rpmalloc_heap_alloc(heap.heap(), sizeof(map_t));
+			map_t* map = new (storage) map_t(heap.get_allocator<value_t>());
+			for (int ivalue = 0; ivalue < 4096; ++ivalue)
+				(*map)[ivalue] = ivalue * 2;
+			if (map->size() != 4096)
+				return test_fail("Heap allocator container has wrong size");
+			for (const value_t& value : *map) {
+				if (value.second != value.first * 2)
+					return test_fail("Data corrupted in heap allocator container");
+			}
+			if (rpmalloc_get_heap_for_ptr(const_cast<int*>(&map->begin()->second)) != heap.heap())
+				return test_fail("Heap allocator container node not allocated from heap");
+			heap.reset();
+		}
+
+		// Nodes erased from the container are freed through the sized free path of the heap
+		map_t map(heap.get_allocator<value_t>());
+		for (int ivalue = 0; ivalue < 4096; ++ivalue)
+			map[ivalue] = ivalue;
+		for (int ivalue = 0; ivalue < 4096; ivalue += 2)
+			map.erase(ivalue);
+		if (map.size() != 2048)
+			return test_fail("Heap allocator container has wrong size after erase");
+
+		std::vector<cxx_aligned_t, rp::heap_allocator<cxx_aligned_t>> aligned(
+		    33, cxx_aligned_t(), heap.get_allocator<cxx_aligned_t>());
+		if (reinterpret_cast<uintptr_t>(aligned.data()) & (alignof(cxx_aligned_t) - 1))
+			return test_fail("Heap allocator did not align over-aligned type");
+	}
+#endif
+
+	printf("C++ allocator tests passed\n");
+	return 0;
+}
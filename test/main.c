@@ -18,6 +18,7 @@
 #endif
 
 #include <rpmalloc.h>
+#include <rpmalloc_inline.h>
 #include <thread.h>
 #include <test.h>
 
@@ -32,6 +33,9 @@
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
 
 #define pointer_offset(ptr, ofs) (void*)((char*)(ptr) + (ptrdiff_t)(ofs))
 #define pointer_diff(first, second) (ptrdiff_t)((const char*)(first) - (const char*)(second))
@@ -455,6 +459,56 @@ test_superalign(void) {
 	return 0;
 }
 
+static int
+test_zero_block(const void* block, size_t size) {
+	const unsigned char* data = block;
+	for (size_t ibyte = 0; ibyte < size; ++ibyte) {
+		if (data[ibyte])
+			return -1;
+	}
+	return 0;
+}
+
+static int
+test_aligned_class(void) {
+	rpmalloc_initialize(0);
+
+	// Aligned allocations are served from size classes where blocks are naturally aligned, the block is the
+	// start of a block in the size class and the usable size is the block size, a multiple of the alignment
+	static void* block[1024];
+	size_t alignment[] = {32, 64, 128, 256, 1024, 4096, 16384, 65536};
+	size_t sizes[] = {0, 1, 24, 64, 100, 1000, 1500, 4096, 5000, 33000, 70000, 200000};
+	for (size_t ialign = 0; ialign < sizeof(alignment) / sizeof(alignment[0]); ++ialign) {
+		for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+			for (size_t iblock = 0; iblock < 1024; ++iblock) {
+				block[iblock] = rpaligned_alloc(alignment[ialign], sizes[isize]);
+				if (!block[iblock] || ((uintptr_t)block[iblock] & (alignment[ialign] - 1)))
+					return test_fail("Aligned allocation failed");
+				size_t usable_size = rpmalloc_usable_size(block[iblock]);
+				if ((usable_size < sizes[isize]) || (usable_size & (alignment[ialign] - 1)))
+					return test_fail("Aligned allocation not served from naturally aligned size class");
+				if (usable_size > ((sizes[isize] > alignment[ialign]) ? sizes[isize] : alignment[ialign]) * 2)
+					return test_fail("Aligned allocation wasting memory");
+				memset(block[iblock], (int)iblock, usable_size);
+			}
+			// Free in the order allocated through the fast free path, half to the page free list first
+			for (size_t iblock = 0; iblock < 1024; iblock += 2)
+				rpfree(block[iblock]);
+			for (size_t iblock = 1; iblock < 1024; iblock += 2)
+				rpfree(block[iblock]);
+		}
+	}
+	void* zero_block = rpaligned_calloc(64, 16, 100);
+	if (test_zero_block(zero_block, 1600))
+		return test_fail("Aligned zero allocation not zero initialized");
+	rpfree(zero_block);
+
+	rpmalloc_finalize();
+
+	printf("Aligned size class tests passed\n");
+	return 0;
+}
+
 typedef struct allocator_thread_arg_t {
 	unsigned int loops;
 	unsigned int passes;  // max 4096
@@ -884,261 +938,2188 @@ test_thread_implementation(void) {
 	return 0;
 }
 
-static int
-test_threaded(void) {
-	rpmalloc_config_t config = {0};
-	//config.unmap_on_finalize = 1;
-	rpmalloc_initialize_config(0, &config);
-
-	int ret = test_thread_implementation();
-
-	rpmalloc_finalize();
-
-	if (ret == 0)
-		printf("Memory threaded tests passed\n");
+typedef struct collect_thread_arg_t {
+	void* block[64];
+	size_t block_count;
+	int initialized[3];
+} collect_thread_arg_t;
 
-	return ret;
+static void
+collect_free_thread(void* argp) {
+	collect_thread_arg_t* arg = argp;
+	arg->initialized[0] = rpmalloc_is_thread_initialized();
+	for (size_t iblock = 0; iblock < arg->block_count; ++iblock)
+		rpfree(arg->block[iblock]);
+	rpmalloc_thread_initialize();
+	arg->initialized[1] = rpmalloc_is_thread_initialized();
+	rpmalloc_thread_finalize();
+	arg->initialized[2] = rpmalloc_is_thread_initialized();
+	thread_exit(0);
 }
 
 static int
-test_crossthread(void) {
-	uintptr_t thread[32];
-	allocator_thread_arg_t arg[32];
-	thread_arg targ[32];
-
-	rpmalloc_config_t config = {0};
-	//config.unmap_on_finalize = 1;
-	rpmalloc_initialize_config(0, &config);
+test_thread_collect(void) {
+	rpmalloc_initialize(0);
 
-	size_t num_alloc_threads = hardware_threads;
-	if (num_alloc_threads < 2)
-		num_alloc_threads = 2;
-	if (num_alloc_threads > 16)
-		num_alloc_threads = 16;
+	collect_thread_arg_t arg;
+	arg.block_count = 64;
+	const size_t block_size = 200 * 1024;
 
-	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
-		unsigned int iadd = (ithread * (16 + ithread) + ithread) % 128;
-#if defined(__LLP64__) || defined(__LP64__) || defined(_WIN64)
-		arg[ithread].loops = 50;
-		arg[ithread].passes = 1024;
-#else
-		arg[ithread].loops = 20;
-		arg[ithread].passes = 200;
-#endif
-		arg[ithread].pointers = rpmalloc(sizeof(void*) * arg[ithread].loops * arg[ithread].passes);
-		memset(arg[ithread].pointers, 0, sizeof(void*) * arg[ithread].loops * arg[ithread].passes);
-		arg[ithread].datasize[0] = 19 + iadd;
-		arg[ithread].datasize[1] = 249 + iadd;
-		arg[ithread].datasize[2] = 797 + iadd;
-		arg[ithread].datasize[3] = 3 + iadd;
-		arg[ithread].datasize[4] = 7923 + iadd;
-		arg[ithread].datasize[5] = 344 + iadd;
-		arg[ithread].datasize[6] = 3892 + iadd;
-		arg[ithread].datasize[7] = 19 + iadd;
-		arg[ithread].datasize[8] = 154 + iadd;
-		arg[ithread].datasize[9] = 9723 + iadd;
-		arg[ithread].datasize[10] = 15543 + iadd;
-		arg[ithread].datasize[11] = 32493 + iadd;
-		arg[ithread].datasize[12] = 34 + iadd;
-		arg[ithread].datasize[13] = 1894 + iadd;
-		arg[ithread].datasize[14] = 193 + iadd;
-		arg[ithread].datasize[15] = 2893 + iadd;
-		arg[ithread].num_datasize = 16;
+	for (int ipass = 0; ipass < 2; ++ipass) {
+		// Fill medium pages and free all blocks from another thread, the pages are only released
+		// to the heap free list once the deferred thread frees are processed
+		for (size_t iblock = 0; iblock < arg.block_count; ++iblock) {
+			arg.block[iblock] = rpmalloc(block_size);
+			memset(arg.block[iblock], (int)iblock, block_size);
+		}
 
-		targ[ithread].fn = crossallocator_thread;
-		targ[ithread].arg = &arg[ithread];
+		thread_arg targ;
+		targ.fn = collect_free_thread;
+		targ.arg = &arg;
+		thread_join(thread_run(&targ));
+		if (arg.initialized[0] || !arg.initialized[1] || arg.initialized[2])
+			return test_fail("Thread initialized state not tracked");
+
+		size_t decommit_size = ipass ? rpmalloc_thread_collect_budget(0, 1) : rpmalloc_thread_collect_budget(0, 0);
+		if (!rpmalloc_config()->disable_decommit && !decommit_size)
+			return test_fail("Thread collect did not decommit free pages");
+		if (!ipass && rpmalloc_thread_collect_budget(0, 0))
+			return test_fail("Thread collect decommitted already decommitted pages");
 	}
 
-	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
-		arg[ithread].crossthread_pointers = arg[(ithread + 1) % num_alloc_threads].pointers;
-	}
+	rpmalloc_thread_collect();
+	rpmalloc_finalize();
 
-	for (int iloop = 0; iloop < 32; ++iloop) {
-		for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
-			thread[ithread] = thread_run(&targ[ithread]);
+	printf("Thread collect test passed\n");
+	return 0;
+}
 
-		thread_sleep(100);
+typedef struct commit_walk_t {
+	void* block[2];
+	size_t committed[2];
+	size_t page_size[2];
+	size_t block_end[2];
+} commit_walk_t;
 
-		for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
-			if (thread_join(thread[ithread]) != 0)
-				return -1;
+static int
+test_commit_visit(const rpmalloc_page_info_t* page, void* context) {
+	commit_walk_t* walk = context;
+	for (int iblock = 0; iblock < 2; ++iblock) {
+		char* block = walk->block[iblock];
+		if ((block >= (char*)page->address) && (block < (char*)page->address + page->page_size)) {
+			walk->committed[iblock] = page->committed;
+			walk->page_size[iblock] = page->page_size;
 		}
 	}
+	return 0;
+}
 
-	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
-		rpfree(arg[ithread].pointers);
+static int
+test_commit(void) {
+	rpmalloc_initialize(0);
+	// Free pages of heaps released by earlier tests are still committed
+	rpmalloc_purge(0);
+
+	// Medium pages are committed in chunks as blocks are initialized, one page for each size class
+	static void* block[16];
+	commit_walk_t walk;
+	memset(&walk, 0, sizeof(walk));
+	block[0] = rpmalloc(100000);
+	block[1] = rpmalloc(200000);
+	walk.block[0] = block[0];
+	walk.block[1] = block[1];
+	rpmalloc_walk(test_commit_visit, &walk);
+	for (int iblock = 0; iblock < 2; ++iblock) {
+		if (!walk.committed[iblock] || (walk.committed[iblock] >= walk.page_size[iblock]))
+			return test_fail("Medium page fully committed for a single block");
+	}
+	size_t initial_committed = walk.committed[0];
 
-	printf("Memory cross thread free tests passed\n");
+	for (int iblock = 2; iblock < 16; ++iblock) {
+		block[iblock] = rpmalloc(100000);
+		memset(block[iblock], iblock, 100000);
+	}
+	walk.committed[0] = 0;
+	rpmalloc_walk(test_commit_visit, &walk);
+	if (walk.committed[0] <= initial_committed)
+		return test_fail("Medium page commit did not grow with initialized blocks");
+	for (int iblock = 2; iblock < 16; ++iblock) {
+		size_t block_end = (size_t)((char*)block[iblock] - (char*)block[0]) + 100000;
+		if (block_end > walk.committed[0])
+			return test_fail("Medium page block not committed");
+	}
+	if (walk.committed[0] >= walk.page_size[0])
+		return test_fail("Medium page fully committed");
+
+	for (int iblock = 0; iblock < 16; ++iblock)
+		rpfree(block[iblock]);
+
+	// Collecting with a budget smaller than the two pages must decommit both pages, and the released bytes
+	// must match the committed memory of the pages beyond the first memory page
+	if (!rpmalloc_config()->disable_decommit) {
+		size_t page_size = rpmalloc_config()->page_size;
+		size_t decommit_expect = (walk.committed[0] - page_size) + (walk.committed[1] - page_size);
+		rpmalloc_global_statistics_t stats;
+		rpmalloc_global_statistics(&stats);
+		size_t committed_before = stats.committed;
+		size_t decommit_size = rpmalloc_thread_collect_budget(0, decommit_expect - page_size);
+		rpmalloc_global_statistics(&stats);
+		if (decommit_size != decommit_expect)
+			return test_fail("Thread collect did not report the decommitted bytes");
+		if (committed_before - stats.committed != decommit_size)
+			return test_fail("Thread collect decommit size does not match committed memory");
+		if (rpmalloc_thread_collect_budget(0, 0))
+			return test_fail("Thread collect decommitted already decommitted pages");
+	}
 
 	rpmalloc_finalize();
 
+	printf("Commit tests passed\n");
 	return 0;
 }
 
+#if ENABLE_STATISTICS
+static size_t
+test_statistics_alloc_current(void) {
+	rpmalloc_thread_statistics_t stats;
+	rpmalloc_thread_statistics(&stats);
+	size_t alloc_current = 0;
+	for (size_t iclass = 0; iclass < sizeof(stats.size_use) / sizeof(stats.size_use[0]); ++iclass)
+		alloc_current += stats.size_use[iclass].alloc_current;
+	return alloc_current;
+}
+#endif
+
 static int
-test_threadspam(void) {
-	uintptr_t thread[64];
-	uintptr_t threadres[64];
-	unsigned int i, j;
-	size_t num_passes, num_alloc_threads;
-	allocator_thread_arg_t arg;
+test_statistics(void) {
+#if ENABLE_STATISTICS
+	rpmalloc_initialize(0);
+
+	void* block[512];
+	size_t alloc_current = test_statistics_alloc_current();
+	for (size_t iblock = 0; iblock < 512; ++iblock)
+		block[iblock] = rpmalloc(16 + ((iblock * 97) % 32000));
+	if (test_statistics_alloc_current() != alloc_current + 512)
+		return test_fail("Thread statistics allocation count mismatch");
+	for (size_t iblock = 0; iblock < 512; ++iblock)
+		rpfree(block[iblock]);
+	if (test_statistics_alloc_current() != alloc_current)
+		return test_fail("Thread statistics free count mismatch");
+
+	rpmalloc_global_statistics_t global_stats;
+	rpmalloc_global_statistics(&global_stats);
+	size_t huge_alloc = global_stats.huge_alloc;
+	if (!global_stats.mapped || (global_stats.mapped > global_stats.mapped_peak))
+		return test_fail("Global statistics mapped memory mismatch");
+
+	const size_t huge_size = 32 * 1024 * 1024;
+	void* huge_block = rpmalloc(huge_size);
+	rpmalloc_global_statistics(&global_stats);
+	if ((global_stats.huge_alloc < huge_alloc + huge_size) || (global_stats.huge_alloc_peak < global_stats.huge_alloc))
+		return test_fail("Global statistics huge allocation mismatch");
+	rpfree(huge_block);
+	rpmalloc_global_statistics(&global_stats);
+	if (global_stats.huge_alloc != huge_alloc)
+		return test_fail("Global statistics huge free mismatch");
+
+	rpmalloc_finalize();
+
+	printf("Statistics tests passed\n");
+#endif
+	return 0;
+}
 
+static int
+test_huge_cache(void) {
 	rpmalloc_config_t config = {0};
-	//config.unmap_on_finalize = 1;
+	config.huge_cache_max_age = 50;
 	rpmalloc_initialize_config(0, &config);
 
-	num_passes = 100;
-	num_alloc_threads = hardware_threads;
-	if (num_alloc_threads < 2)
-		num_alloc_threads = 2;
-#if defined(__LLP64__) || defined(__LP64__) || defined(_WIN64)
-	if (num_alloc_threads > 32)
-		num_alloc_threads = 32;
-#else
-	if (num_alloc_threads > 16)
-		num_alloc_threads = 16;
+	// Freed huge block should be reused for a slightly smaller huge allocation
+	const size_t huge_size = 32 * 1024 * 1024;
+	void* block = rpmalloc(huge_size);
+	memset(block, 1, huge_size);
+	rpfree(block);
+	void* reuse_block = rpmalloc(huge_size - (1024 * 1024));
+	if (!rpmalloc_config()->disable_huge_cache && (reuse_block != block))
+		return test_fail("Huge block was not reused from huge cache");
+	if (rpmalloc_usable_size(reuse_block) < huge_size - (1024 * 1024))
+		return test_fail("Bad usable size of huge block from huge cache");
+	memset(reuse_block, 2, huge_size - (1024 * 1024));
+	rpfree(reuse_block);
+
+	// Much smaller huge allocation should not reuse the cached huge block
+	block = rpmalloc(huge_size / 2);
+	if (block == reuse_block)
+		return test_fail("Huge block reused for too small huge allocation");
+	rpfree(block);
+
+#if ENABLE_STATISTICS
+	rpmalloc_global_statistics_t stats;
+	rpmalloc_global_statistics(&stats);
+	size_t cached = stats.cached;
+	thread_sleep(100);
+	rpmalloc_thread_collect();
+	rpmalloc_global_statistics(&stats);
+	if (!rpmalloc_config()->disable_huge_cache && (stats.cached > cached - huge_size))
+		return test_fail("Huge cache did not release aged huge spans");
 #endif
 
-	arg.loops = 500;
-	arg.passes = 10;
-	arg.datasize[0] = 19;
-	arg.datasize[1] = 249;
-	arg.datasize[2] = 797;
-	arg.datasize[3] = 3;
-	arg.datasize[4] = 79;
-	arg.datasize[5] = 34;
-	arg.datasize[6] = 389;
-	arg.num_datasize = 7;
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	// Huge blocks freed individually must not be released again in free all
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	block = rpmalloc_heap_alloc(heap, huge_size);
+	void* other_block = rpmalloc_heap_alloc(heap, huge_size * 2);
+	rpmalloc_heap_free(heap, block);
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+	(void)sizeof(other_block);
+	block = rpmalloc(huge_size);
+	memset(block, 3, huge_size);
+	rpfree(block);
+#endif
 
-	thread_arg targ;
-	targ.fn = initfini_thread;
-	targ.arg = &arg;
-	for (i = 0; i < num_alloc_threads; ++i)
-		thread[i] = thread_run(&targ);
+	rpmalloc_finalize();
 
-	for (j = 0; j < num_passes; ++j) {
-		thread_sleep(100);
+	printf("Huge cache tests passed\n");
+	return 0;
+}
 
-		for (i = 0; i < num_alloc_threads; ++i) {
-			threadres[i] = thread_join(thread[i]);
-			if (threadres[i])
-				return -1;
-			thread[i] = thread_run(&targ);
+static int
+test_huge_realloc(void) {
+	rpmalloc_initialize(0);
+
+	// Grow a huge block through the mapping padding, in place extension and moving remap
+	size_t size = 64 * 1024 * 1024;
+	uint32_t* block = rpmalloc(size);
+	for (size_t iword = 0; iword < size / sizeof(uint32_t); iword += 1024)
+		block[iword] = (uint32_t)iword;
+	static const size_t grow_size[] = {200 * 1024 * 1024, 600 * 1024 * 1024, 1200 * 1024 * 1024};
+	for (size_t igrow = 0; igrow < sizeof(grow_size) / sizeof(grow_size[0]); ++igrow) {
+		block = rprealloc(block, grow_size[igrow]);
+		if (!block)
+			return test_fail("Failed to grow huge block");
+		if (((uintptr_t)block & ((256 * 1024 * 1024) - 1)) != 128)
+			return test_fail("Bad alignment of reallocated huge block");
+		if (rpmalloc_usable_size(block) < grow_size[igrow])
+			return test_fail("Bad usable size of reallocated huge block");
+		for (size_t iword = 0; iword < size / sizeof(uint32_t); iword += 1024) {
+			if (block[iword] != (uint32_t)iword)
+				return test_fail("Data not preserved in reallocated huge block");
 		}
+		block[(grow_size[igrow] / sizeof(uint32_t)) - 1] = 0xDEADBEEF;
 	}
 
-	thread_sleep(1000);
+	// Growing in place must either keep the block or fail and leave it untouched
+	size_t usable = rpmalloc_usable_size(block);
+	void* grown = rpaligned_realloc(block, 16, usable + (512 * 1024 * 1024), usable, RPMALLOC_GROW_OR_FAIL);
+	if (grown && (grown != block))
+		return test_fail("Huge block moved when growing in place");
+	if (grown && (rpmalloc_usable_size(grown) < usable + (512 * 1024 * 1024)))
+		return test_fail("Bad usable size of huge block grown in place");
+	if (block[1024] != 1024)
+		return test_fail("Data not preserved in huge block grown in place");
+
+	// Shrinking to less than half should stay in place and release the tail
+	usable = rpmalloc_usable_size(block);
+	void* shrunk = rprealloc(block, size);
+	if (shrunk != block)
+		return test_fail("Huge block moved when shrinking");
+	if (rpmalloc_usable_size(shrunk) >= usable)
+		return test_fail("Huge block not shrunk");
+	for (size_t iword = 0; iword < size / sizeof(uint32_t); iword += 1024) {
+		if (block[iword] != (uint32_t)iword)
+			return test_fail("Data not preserved in shrunk huge block");
+	}
+	rpfree(block);
 
-	for (i = 0; i < num_alloc_threads; ++i)
-		threadres[i] = thread_join(thread[i]);
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	// Moved huge blocks must still be tracked by the first class heap
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	void* heap_block = rpmalloc_heap_alloc(heap, size);
+	void* other_block = rpmalloc_heap_alloc(heap, size);
+	heap_block = rpmalloc_heap_realloc(heap, heap_block, 1200 * 1024 * 1024, 0);
+	other_block = rpmalloc_heap_realloc(heap, other_block, 1200 * 1024 * 1024, 0);
+	if (!heap_block || !other_block)
+		return test_fail("Failed to grow huge block in first class heap");
+	rpmalloc_heap_free(heap, heap_block);
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+#endif
 
 	rpmalloc_finalize();
 
-	for (i = 0; i < num_alloc_threads; ++i) {
-		if (threadres[i])
-			return -1;
-	}
-
-	printf("Memory thread spam tests passed\n");
-
+	printf("Huge realloc tests passed\n");
 	return 0;
 }
 
 static int
-test_first_class_heaps(void) {
-#if RPMALLOC_FIRST_CLASS_HEAPS
-	uintptr_t thread[32];
-	uintptr_t threadres[32];
-	unsigned int i;
-	size_t num_alloc_threads;
-	allocator_thread_arg_t arg[32];
-
+test_numa(void) {
 	rpmalloc_config_t config = {0};
-	//config.unmap_on_finalize = 1;
+	config.enable_numa = 1;
 	rpmalloc_initialize_config(0, &config);
 
-	num_alloc_threads = hardware_threads * 2;
-	if (num_alloc_threads < 2)
-		num_alloc_threads = 2;
-	if (num_alloc_threads > 16)
-		num_alloc_threads = 16;
-
-	for (i = 0; i < num_alloc_threads; ++i) {
-		arg[i].datasize[0] = 19;
-		arg[i].datasize[1] = 249;
-		arg[i].datasize[2] = 797;
-		arg[i].datasize[3] = 3058;
-		arg[i].datasize[4] = 47892;
-		arg[i].datasize[5] = 173932;
-		arg[i].datasize[6] = 389;
-		arg[i].datasize[7] = 19;
-		arg[i].datasize[8] = 2493;
-		arg[i].datasize[9] = 7979;
-		arg[i].datasize[10] = 3;
-		arg[i].datasize[11] = 79374;
-		arg[i].datasize[12] = 3432;
-		arg[i].datasize[13] = 548;
-		arg[i].datasize[14] = 38934;
-		arg[i].datasize[15] = 234;
-		arg[i].num_datasize = 16;
-#if defined(__LLP64__) || defined(__LP64__) || defined(_WIN64)
-		arg[i].loops = 100;
-		arg[i].passes = 4000;
-#else
-		arg[i].loops = 50;
-		arg[i].passes = 1000;
-#endif
-		arg[i].init_fini_each_loop = 1;
-
-		thread_arg targ;
-		targ.fn = heap_allocator_thread;
-		if ((i % 2) != 0)
-			targ.fn = allocator_thread;
-		targ.arg = &arg[i];
-
-		thread[i] = thread_run(&targ);
+	// NUMA awareness is reset if the system has a single node, the thread heap is always on a valid node
+	int numa_enabled = rpmalloc_config()->enable_numa;
+	if (!numa_enabled && (rpmalloc_thread_numa_node() != 0))
+		return test_fail("Bad thread heap NUMA node with NUMA disabled");
+	if (rpmalloc_thread_set_numa_node(1024) == 0)
+		return test_fail("Invalid NUMA node accepted for thread heap");
+	if ((rpmalloc_thread_set_numa_node(0) == 0) != (numa_enabled != 0))
+		return test_fail("Bad result setting thread heap NUMA node");
+	if (rpmalloc_thread_numa_node() != 0)
+		return test_fail("Bad thread heap NUMA node");
+
+	void* block[256];
+	for (size_t iblock = 0; iblock < sizeof(block) / sizeof(block[0]); ++iblock) {
+		block[iblock] = rpmalloc(16 + (iblock * 1024));
+		memset(block[iblock], (int)iblock, 16 + (iblock * 1024));
 	}
+	for (size_t iblock = 0; iblock < sizeof(block) / sizeof(block[0]); ++iblock)
+		rpfree(block[iblock]);
 
-	thread_sleep(1000);
-
-	for (i = 0; i < num_alloc_threads; ++i)
-		threadres[i] = thread_join(thread[i]);
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	if (rpmalloc_heap_set_numa_node(heap, 1024) == 0)
+		return test_fail("Invalid NUMA node accepted for first class heap");
+	if ((rpmalloc_heap_set_numa_node(heap, 0) == 0) != (numa_enabled != 0))
+		return test_fail("Bad result setting first class heap NUMA node");
+	if (rpmalloc_heap_numa_node(heap) != 0)
+		return test_fail("Bad first class heap NUMA node");
+	void* heap_block = rpmalloc_heap_alloc(heap, 4096);
+	memset(heap_block, 1, 4096);
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+#endif
 
 	rpmalloc_finalize();
 
-	for (i = 0; i < num_alloc_threads; ++i) {
-		if (threadres[i])
-			return -1;
-	}
-
-	printf("First class heap tests passed\n");
-#endif
+	printf("NUMA tests passed\n");
 	return 0;
 }
 
 static int
-test_large_pages(void) {
-	int ret = 0;
-
+test_reserve(void) {
 	rpmalloc_config_t config = {0};
-	config.page_size = 16 * 1024 * 1024;
-
+	config.reserve_size = 1024 * 1024 * 1024;
 	rpmalloc_initialize_config(0, &config);
 
-	ret = test_thread_implementation();
+	// Huge blocks covering whole spans are carved from the reservation in order
+	size_t span_size = 256 * 1024 * 1024;
+	size_t block_size = span_size - 4096;
+	void* block[3];
+	for (size_t iblock = 0; iblock < 3; ++iblock) {
+		block[iblock] = rpmalloc(block_size);
+		if (!block[iblock])
+			return test_fail("Failed to allocate huge block from reservation");
+		memset(block[iblock], (int)iblock, 4096);
+		memset(pointer_offset(block[iblock], block_size - 4096), (int)iblock, 4096);
+	}
+	if (rpmalloc_config()->reserve_size) {
+		if ((pointer_diff(block[1], block[0]) != (ptrdiff_t)span_size) ||
+		    (pointer_diff(block[2], block[1]) != (ptrdiff_t)span_size))
+			return test_fail("Huge blocks not carved from reservation");
+	}
 
-	rpmalloc_finalize();
+	// Once the reservation is exhausted spans are mapped individually
+	rpfree(block[1]);
+	void* extra = rpmalloc(block_size * 2);
+	if (!extra)
+		return test_fail("Failed to allocate huge block after reservation exhausted");
+	memset(extra, 1, block_size * 2);
+	rpfree(extra);
+	rpfree(block[0]);
+	rpfree(block[2]);
 
-	if (ret == 0)
-		printf("Large page config test passed\n");
+	rpmalloc_finalize();
 
-	return ret;
+	printf("Reserve tests passed\n");
+	return 0;
 }
 
+//! Allocate small and medium blocks, returns non-zero if any memory was mapped
 static int
-test_named_pages(void) {
-	rpmalloc_config_t config = {0};
-	char page_name[64] = {0};
+prewarm_allocate(void) {
+	void* block[1024];
+	rpmalloc_global_statistics_t stats;
+	rpmalloc_global_statistics(&stats);
+	size_t mapped = stats.mapped;
+	for (size_t iblock = 0; iblock < 1024; ++iblock) {
+		size_t size = (iblock & 255) ? (16 + (iblock & 7) * 16) : 200000;
+		block[iblock] = rpmalloc(size);
+		memset(block[iblock], 0x5A, size);
+	}
+	rpmalloc_global_statistics(&stats);
+	for (size_t iblock = 0; iblock < 1024; ++iblock)
+		rpfree(block[iblock]);
+	return (stats.mapped != mapped);
+}
+
+static void
+prewarm_thread(void* arg) {
+	(void)sizeof(arg);
+	rpmalloc_thread_initialize();
+	int result = prewarm_allocate();
+	rpmalloc_thread_finalize();
+	thread_exit((uintptr_t)result);
+}
+
+typedef struct prewarm_walk_t {
+	void* block;
+	unsigned int heap_id;
+	size_t free_committed;
+} prewarm_walk_t;
+
+//! Find the heap owning the block, then sum the committed bytes of the free pages of the heap in a second walk
+static int
+test_prewarm_visit(const rpmalloc_page_info_t* page, void* context) {
+	prewarm_walk_t* walk = context;
+	char* block = walk->block;
+	if (!walk->heap_id) {
+		if ((block >= (char*)page->address) && (block < (char*)page->address + page->page_size))
+			walk->heap_id = page->heap_id;
+	} else if (page->is_free && (page->heap_id == walk->heap_id)) {
+		walk->free_committed += page->committed;
+	}
+	return 0;
+}
+
+static int
+test_prewarm(void) {
+	rpmalloc_config_t config = {0};
+	config.prewarm_heap_count = 2;
+	config.prewarm_size = 4 * 1024 * 1024;
+	config.prewarm_lock = 1;
+	rpmalloc_initialize_config(0, &config);
+	if (!config.disable_decommit)
+		return test_fail("Decommit not disabled with locked prewarmed pages");
+
+	// The calling thread and the next thread adopt prewarmed heaps and allocate without mapping memory
+	if (prewarm_allocate())
+		return test_fail("Memory mapped in prewarmed heap");
+	thread_arg targ;
+	targ.fn = prewarm_thread;
+	targ.arg = 0;
+	if (thread_join(thread_run(&targ)))
+		return test_fail("Memory mapped in prewarmed heap of thread");
+
+	rpmalloc_finalize();
+
+	// Unlocked prewarmed pages are kept committed when collecting and purging free pages
+	memset(&config, 0, sizeof(config));
+	config.prewarm_heap_count = 1;
+	config.prewarm_size = 4 * 1024 * 1024;
+	rpmalloc_initialize_config(0, &config);
+	prewarm_walk_t walk;
+	memset(&walk, 0, sizeof(walk));
+	walk.block = rpmalloc(16);
+	rpmalloc_thread_collect();
+	rpmalloc_thread_collect_budget(0, 0);
+	rpmalloc_purge(0);
+	rpmalloc_walk(test_prewarm_visit, &walk);
+	rpmalloc_walk(test_prewarm_visit, &walk);
+	rpfree(walk.block);
+	if (walk.free_committed < 3 * 1024 * 1024)
+		return test_fail("Prewarmed pages decommitted");
+	rpmalloc_finalize();
+
+	// Reset the configuration for the following tests
+	memset(&config, 0, sizeof(config));
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_finalize();
+
+	printf("Prewarm tests passed\n");
+	return 0;
+}
+
+static void
+purge_thread(void* argp) {
+	(void)sizeof(argp);
+	rpmalloc_thread_initialize();
+	void* block[64];
+	for (size_t iblock = 0; iblock < 64; ++iblock) {
+		block[iblock] = rpmalloc(200 * 1024);
+		memset(block[iblock], (int)iblock, 200 * 1024);
+	}
+	for (size_t iblock = 0; iblock < 64; ++iblock)
+		rpfree(block[iblock]);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static void* purge_producer_block[64];
+
+static void
+purge_producer_thread(void* argp) {
+	(void)sizeof(argp);
+	rpmalloc_thread_initialize();
+	for (size_t iblock = 0; iblock < 64; ++iblock) {
+		purge_producer_block[iblock] = rpmalloc(200 * 1024);
+		memset(purge_producer_block[iblock], (int)iblock, 200 * 1024);
+	}
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+test_purge(void) {
+	rpmalloc_config_t config = {0};
+	config.decay_time = 100;
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_purge(0);
+
+	// Free pages donated by an exited thread are decommitted from the pool once older than the decay time
+	thread_arg targ;
+	targ.fn = purge_thread;
+	targ.arg = 0;
+	thread_join(thread_run(&targ));
+	if (rpmalloc_purge(0) != 0)
+		return test_fail("Free pages decommitted before decay time");
+	thread_sleep(150);
+	if (rpmalloc_purge(0) == 0)
+		return test_fail("Free pages not decommitted after decay time");
+	if (rpmalloc_purge(0) != 0)
+		return test_fail("Free pages decommitted twice");
+
+	// Pages of an exited thread emptied by frees from another thread are collected and decommitted by the purge
+	targ.fn = purge_producer_thread;
+	thread_join(thread_run(&targ));
+	for (size_t iblock = 0; iblock < 64; ++iblock)
+		rpfree(purge_producer_block[iblock]);
+	if (rpmalloc_purge(0) != 0)
+		return test_fail("Pages emptied by other threads decommitted before decay time");
+	thread_sleep(150);
+	if (rpmalloc_purge(0) == 0)
+		return test_fail("Pages emptied by other threads not decommitted after decay time");
+	targ.fn = purge_thread;
+
+	rpmalloc_finalize();
+
+	// The purge thread decommits the pooled pages without any explicit call
+	config.decay_time = 20;
+	config.enable_purge_thread = 1;
+	rpmalloc_initialize_config(0, &config);
+	thread_join(thread_run(&targ));
+	thread_sleep(200);
+	if (rpmalloc_purge(0) != 0)
+		return test_fail("Purge thread did not decommit free pages");
+
+	rpmalloc_finalize();
+
+	printf("Purge tests passed\n");
+	return 0;
+}
+
+static void* soft_limit_cache[4];
+static size_t soft_limit_callback_count;
+
+static void
+soft_limit_pressure_callback(size_t committed_size, size_t soft_limit) {
+	(void)sizeof(committed_size);
+	(void)sizeof(soft_limit);
+	++soft_limit_callback_count;
+	for (size_t iblock = 0; iblock < sizeof(soft_limit_cache) / sizeof(soft_limit_cache[0]); ++iblock) {
+		rpfree(soft_limit_cache[iblock]);
+		soft_limit_cache[iblock] = 0;
+	}
+}
+
+#if !ENABLE_PER_CPU_HEAPS
+static void* soft_limit_producer_block[320];
+
+static void
+soft_limit_producer_thread(void* argp) {
+	(void)sizeof(argp);
+	rpmalloc_thread_initialize();
+	for (size_t iblock = 0; iblock < 320; ++iblock) {
+		soft_limit_producer_block[iblock] = rpmalloc(200 * 1024);
+		memset(soft_limit_producer_block[iblock], 0x42, 200 * 1024);
+	}
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+#endif
+
+static int
+test_soft_limit(void) {
+	// Memory kept by heaps from previous tests is still committed, set the limit relative to it
+	rpmalloc_global_statistics_t stats;
+	rpmalloc_global_statistics(&stats);
+	size_t committed_base = stats.committed;
+	size_t soft_limit = committed_base + (256 * 1024 * 1024);
+
+	rpmalloc_interface_t memory_interface = {0};
+	memory_interface.memory_pressure_callback = soft_limit_pressure_callback;
+	rpmalloc_config_t config = {0};
+	config.soft_limit = soft_limit;
+	rpmalloc_initialize_config(&memory_interface, &config);
+
+	// Huge blocks held by the application cache and freed huge blocks in the huge span cache
+	for (size_t iblock = 0; iblock < 4; ++iblock)
+		soft_limit_cache[iblock] = rpmalloc(30 * 1024 * 1024);
+	void* block[4];
+	for (size_t iblock = 0; iblock < 4; ++iblock)
+		block[iblock] = rpmalloc(30 * 1024 * 1024);
+	for (size_t iblock = 0; iblock < 4; ++iblock)
+		rpfree(block[iblock]);
+	rpmalloc_global_statistics(&stats);
+	if (stats.committed < committed_base + (240 * 1024 * 1024))
+		return test_fail("Committed memory not tracked");
+	if (soft_limit_callback_count)
+		return test_fail("Memory pressure callback called below soft limit");
+
+	// Crossing the limit releases the application cache, flushes the huge span cache
+	void* huge = rpmalloc(48 * 1024 * 1024);
+	if (soft_limit_callback_count != 1)
+		return test_fail("Memory pressure callback not called on exceeding soft limit");
+	if (soft_limit_cache[0])
+		return test_fail("Memory pressure callback did not run");
+	rpmalloc_global_statistics(&stats);
+	if (stats.committed > committed_base + (64 * 1024 * 1024))
+		return test_fail("Memory not released on exceeding soft limit");
+	rpfree(huge);
+
+	// Free pages are decommitted when crossing the limit
+	static void* medium[128];
+	for (size_t iblock = 0; iblock < 128; ++iblock) {
+		medium[iblock] = rpmalloc(1024 * 1024);
+		memset(medium[iblock], 0x42, 1024 * 1024);
+	}
+	for (size_t iblock = 0; iblock < 128; ++iblock)
+		rpfree(medium[iblock]);
+	rpmalloc_global_statistics(&stats);
+	size_t committed_free = stats.committed;
+	huge = rpmalloc(soft_limit);
+	rpmalloc_global_statistics(&stats);
+	if (soft_limit_callback_count != 2)
+		return test_fail("Memory pressure callback not called on exceeding soft limit");
+	if (stats.committed - soft_limit >= committed_free)
+		return test_fail("Free pages not decommitted on exceeding soft limit");
+	rpfree(huge);
+
+	// Committing memory in already mapped spans, reusing the decommitted free pages, also checks the limit
+	rpmalloc_global_statistics(&stats);
+	huge = rpmalloc(soft_limit - stats.committed - (4 * 1024 * 1024));
+	if (soft_limit_callback_count != 2)
+		return test_fail("Memory pressure callback called below soft limit");
+	for (size_t iblock = 0; iblock < 8; ++iblock) {
+		medium[iblock] = rpmalloc(1024 * 1024);
+		memset(medium[iblock], 0x42, 1024 * 1024);
+	}
+	if (soft_limit_callback_count < 3)
+		return test_fail("Memory pressure callback not called on exceeding soft limit in page commit");
+	for (size_t iblock = 0; iblock < 8; ++iblock)
+		rpfree(medium[iblock]);
+	rpfree(huge);
+
+	// Live data above the limit holds off releases on further commits until live data is freed. Freed blocks in
+	// the huge span cache keep the committed memory up, wait out a hold left by the releases above
+	thread_sleep(1100);
+	size_t callback_count = soft_limit_callback_count;
+	huge = rpmalloc(soft_limit);
+	if (soft_limit_callback_count != callback_count + 1)
+		return test_fail("Memory pressure callback not called on exceeding soft limit");
+	for (size_t iblock = 0; iblock < 128; ++iblock) {
+		medium[iblock] = rpmalloc(1024 * 1024);
+		memset(medium[iblock], 0x42, 1024 * 1024);
+	}
+	for (size_t iblock = 0; iblock < 128; ++iblock)
+		rpfree(medium[iblock]);
+	if (soft_limit_callback_count != callback_count + 1)
+		return test_fail("Memory pressure released on every commit with live data above soft limit");
+	rpfree(huge);
+	rpmalloc_global_statistics(&stats);
+	huge = rpmalloc(soft_limit - stats.committed + (4 * 1024 * 1024));
+	if (soft_limit_callback_count != callback_count + 2)
+		return test_fail("Memory pressure releases not resumed after freeing live data");
+	rpfree(huge);
+
+#if !ENABLE_PER_CPU_HEAPS
+	// Pages of an exited thread emptied by frees from another thread are decommitted when crossing the limit,
+	// before the release decides whether the live data exceeds it
+	thread_sleep(1100);
+	rpmalloc_purge(0);
+	thread_arg targ;
+	targ.fn = soft_limit_producer_thread;
+	targ.arg = 0;
+	thread_join(thread_run(&targ));
+	for (size_t iblock = 0; iblock < 320; ++iblock)
+		rpfree(soft_limit_producer_block[iblock]);
+	rpmalloc_global_statistics(&stats);
+	size_t committed_emptied = stats.committed;
+	huge = rpmalloc(soft_limit);
+	rpmalloc_global_statistics(&stats);
+	if (stats.committed - soft_limit >= committed_emptied - (48 * 1024 * 1024))
+		return test_fail("Pages emptied by other threads not decommitted on exceeding soft limit");
+	rpfree(huge);
+#endif
+
+	rpmalloc_finalize();
+
+	printf("Soft limit tests passed\n");
+	return 0;
+}
+
+static int
+test_size_class(void) {
+	// Heaps kept from previous tests are abandoned when the size classes change
+	rpmalloc_config_t config = {0};
+	static const unsigned int size_class_table[] = {1088, 2048, 4096, 4208, 8192, 65536, 262144, 1048576, 8388608};
+	config.size_class_table = size_class_table;
+	config.size_class_count = sizeof(size_class_table) / sizeof(size_class_table[0]);
+	rpmalloc_initialize_config(0, &config);
+	if (config.size_class_table != size_class_table)
+		return test_fail("Valid size class table rejected");
+
+	static const size_t alloc_size[] = {72, 1024, 1025, 1088, 1089, 3000, 4200, 5000, 300000, 2000000};
+	static const size_t usable_size[] = {80, 1024, 1088, 1088, 2048, 4096, 4208, 8192, 1048576, 8388608};
+	for (size_t isize = 0; isize < sizeof(alloc_size) / sizeof(alloc_size[0]); ++isize) {
+		void* block[64];
+		for (size_t iblock = 0; iblock < 64; ++iblock) {
+			block[iblock] = rpmalloc(alloc_size[isize]);
+			if (rpmalloc_usable_size(block[iblock]) != usable_size[isize])
+				return test_fail("Block not allocated from configured size class");
+			memset(block[iblock], 0x5A, alloc_size[isize]);
+		}
+		for (size_t iblock = 0; iblock < 64; ++iblock)
+			rpfree_sized(block[iblock], alloc_size[isize]);
+	}
+	// Blocks larger than the largest size class are huge blocks
+	void* huge = rpmalloc(8388608 + 1);
+	if (rpmalloc_usable_size(huge) < 8388608 + 1)
+		return test_fail("Bad usable size for huge block");
+	rpfree(huge);
+	rpmalloc_finalize();
+
+	// Block sizes must be ascending multiples of the granularity
+	static const unsigned int invalid_table[] = {2048, 1088};
+	config.size_class_table = invalid_table;
+	config.size_class_count = sizeof(invalid_table) / sizeof(invalid_table[0]);
+	rpmalloc_initialize_config(0, &config);
+	if (config.size_class_table)
+		return test_fail("Invalid size class table accepted");
+	void* block = rpmalloc(1025);
+	if (rpmalloc_usable_size(block) != 1280)
+		return test_fail("Default size classes not restored");
+	rpfree(block);
+	rpmalloc_finalize();
+
+	printf("Size class tests passed\n");
+	return 0;
+}
+
+static int
+test_zero(void) {
+	rpmalloc_initialize(0);
+
+	// Zero allocations from both newly initialized and reused blocks, in heap and page free lists
+	static void* block[4096];
+	static const size_t block_size[] = {16, 48, 880, 3000, 20000, 300000};
+	for (size_t isize = 0; isize < sizeof(block_size) / sizeof(block_size[0]); ++isize) {
+		size_t size = block_size[isize];
+		size_t count = (size < 65536) ? 4096 : 64;
+		for (int ipass = 0; ipass < 3; ++ipass) {
+			for (size_t iblock = 0; iblock < count; ++iblock) {
+				block[iblock] = (iblock & 1) ? rpzalloc(size) : rpcalloc(1, size);
+				if (test_zero_block(block[iblock], size))
+					return test_fail("Zero allocated block not zero initialized");
+				memset(block[iblock], 0xFF, rpmalloc_usable_size(block[iblock]));
+			}
+			for (size_t iblock = 0; iblock < count; iblock += 2)
+				rpfree(block[iblock]);
+			for (size_t iblock = 1; iblock < count; iblock += 2)
+				rpfree(block[iblock]);
+		}
+	}
+
+	// Huge blocks reused from the huge span cache
+	size_t huge_size = 32 * 1024 * 1024;
+	for (int ipass = 0; ipass < 3; ++ipass) {
+		void* huge = rpzalloc(huge_size - (size_t)ipass * 4096);
+		if (test_zero_block(huge, huge_size - (size_t)ipass * 4096))
+			return test_fail("Zero allocated huge block not zero initialized");
+		memset(huge, 0xFF, rpmalloc_usable_size(huge));
+		rpfree(huge);
+	}
+
+	rpmalloc_finalize();
+
+	printf("Zero tests passed\n");
+	return 0;
+}
+
+static int
+test_thp(void) {
+#if defined(__linux__)
+	rpmalloc_config_t config = {0};
+	config.enable_thp = 1;
+	config.decay_time = 10;
+	rpmalloc_initialize_config(0, &config);
+
+	// Recommitted pages and reused huge spans must read back as zero even if parts of the decommitted
+	// memory were kept resident to avoid splitting transparent huge pages
+	static void* block[256];
+	static const size_t block_size[] = {3000, 200000, 6 * 1024 * 1024, 48 * 1024 * 1024};
+	for (size_t isize = 0; isize < sizeof(block_size) / sizeof(block_size[0]); ++isize) {
+		size_t size = block_size[isize];
+		size_t count = (size < 65536) ? 256 : ((size < (1024 * 1024)) ? 64 : 4);
+		for (int ipass = 0; ipass < 3; ++ipass) {
+			for (size_t iblock = 0; iblock < count; ++iblock) {
+				block[iblock] = rpcalloc(1, size);
+				if (test_zero_block(block[iblock], size))
+					return test_fail("Zero allocated block not zero initialized in transparent huge page mode");
+				memset(block[iblock], 0xFF, rpmalloc_usable_size(block[iblock]));
+			}
+			for (size_t iblock = 0; iblock < count; ++iblock)
+				rpfree(block[iblock]);
+			thread_sleep(20);
+			rpmalloc_purge(0);
+		}
+	}
+
+	rpmalloc_global_statistics_t stats;
+	rpmalloc_global_statistics(&stats);
+	if (!rpmalloc_config()->enable_thp && stats.thp_backed)
+		return test_fail("Transparent huge page statistics reported without transparent huge page mode");
+
+	rpmalloc_finalize();
+
+	printf("Transparent huge page tests passed (%s)\n", rpmalloc_config()->enable_thp ? "enabled" : "unsupported");
+#endif
+	return 0;
+}
+
+#if ENABLE_SAMPLING
+
+//! Output collected from a sample dump
+typedef struct test_sample_output_t {
+	char buffer[16 * 1024];
+	size_t size;
+	size_t total;
+} test_sample_output_t;
+
+static void
+test_sample_write(void* context, const char* buffer, size_t size) {
+	test_sample_output_t* output = context;
+	size_t count = sizeof(output->buffer) - 1 - output->size;
+	if (count > size)
+		count = size;
+	memcpy(output->buffer + output->size, buffer, count);
+	output->size += count;
+	output->buffer[output->size] = 0;
+	output->total += size;
+}
+
+static int
+test_sample_count(void) {
+	static test_sample_output_t output;
+	output.size = 0;
+	output.total = 0;
+	return rpmalloc_sample_dump(RPMALLOC_SAMPLE_FORMAT_FOLDED, test_sample_write, &output);
+}
+
+#endif
+
+static int
+test_sampling(void) {
+#if ENABLE_SAMPLING
+	rpmalloc_config_t config = {0};
+	config.sample_interval = 4096;
+	rpmalloc_initialize_config(0, &config);
+	if (config.sample_interval != 4096)
+		return test_fail("Sample interval not configured");
+
+	int baseline = test_sample_count();
+	if (baseline < 0)
+		return test_fail("Sample dump failed");
+
+	// About one sample for each 4KiB allocated, including blocks from the aligned size classes
+	static void* block[8192];
+	for (size_t iblock = 0; iblock < 8192; ++iblock) {
+		block[iblock] = (iblock & 3) ? rpmalloc(16 + (iblock % 512)) : rpaligned_alloc(64, 64 + (iblock % 256));
+		memset(block[iblock], 0x5A, 16);
+	}
+	void* huge = rpmalloc(32 * 1024 * 1024);
+	int sampled = test_sample_count() - baseline;
+	if ((sampled < 64) || (sampled > 4096))
+		return test_fail("Unexpected number of sampled allocations");
+
+	static test_sample_output_t output;
+	output.size = 0;
+	output.total = 0;
+	if (rpmalloc_sample_dump(RPMALLOC_SAMPLE_FORMAT_PPROF, test_sample_write, &output) != baseline + sampled)
+		return test_fail("Sample dump count mismatch");
+	if (strncmp(output.buffer, "heap profile: ", 14) || !strstr(output.buffer, " @ heap_v2/4096\n"))
+		return test_fail("Invalid pprof sample dump header");
+
+	rpmalloc_global_statistics_t global_stats;
+	rpmalloc_global_statistics(&global_stats);
+	if ((global_stats.sampled_alloc_total < 32 * 1024 * 1024) || !global_stats.sampled_alloc_count)
+		return test_fail("Sampled allocation statistics not updated");
+
+	// Frees in any order and through realloc must unlink the samples
+	huge = rprealloc(huge, 64 * 1024 * 1024);
+	for (size_t iblock = 0; iblock < 8192; iblock += 2)
+		rpfree(block[iblock]);
+	for (size_t iblock = 1; iblock < 8192; iblock += 2)
+		block[iblock] = rprealloc(block[iblock], 8000);
+	for (size_t iblock = 1; iblock < 8192; iblock += 2)
+		rpfree_sized(block[iblock], 8000);
+	rpfree(huge);
+	if (test_sample_count() != baseline)
+		return test_fail("Freed sampled allocations still reported");
+
+	// Each block of a batch counts against the sample interval
+	if (rpmalloc_alloc_batch(64, 8192, block) != 8192)
+		return test_fail("Batch allocation failed");
+	sampled = test_sample_count() - baseline;
+	if ((sampled < 32) || (sampled > 512))
+		return test_fail("Unexpected number of sampled batch allocations");
+	rpfree_batch(block, 8192);
+	if (test_sample_count() != baseline)
+		return test_fail("Freed sampled batch allocations still reported");
+
+	// Samples from a first class heap are dropped when the heap is freed
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	for (size_t iblock = 0; iblock < 4096; ++iblock)
+		rpmalloc_heap_alloc(heap, 256);
+	rpmalloc_heap_alloc(heap, 16 * 1024 * 1024);
+	if (test_sample_count() <= baseline)
+		return test_fail("First class heap allocations not sampled");
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+	if (test_sample_count() != baseline)
+		return test_fail("Samples of freed first class heap still reported");
+#endif
+
+	rpmalloc_finalize();
+
+	printf("Sampling tests passed\n");
+#endif
+	return 0;
+}
+
+static int
+test_free_sized(void) {
+	rpmalloc_initialize(0);
+
+	static void* block[8192];
+	static const size_t block_size[] = {0, 8, 17, 1024, 1025, 4000, 70000, 300000, 5000000, 40000000};
+	for (size_t isize = 0; isize < sizeof(block_size) / sizeof(block_size[0]); ++isize) {
+		size_t size = block_size[isize];
+		size_t count = (size < 65536) ? 8192 : 16;
+		for (size_t iblock = 0; iblock < count; ++iblock) {
+			block[iblock] = rpmalloc(size);
+			memset(block[iblock], 0xCD, size);
+		}
+		// Free with both requested and usable size, including blocks in full pages
+		for (size_t iblock = 0; iblock < count; ++iblock) {
+			if (iblock & 1)
+				rpfree_sized(block[iblock], rpmalloc_usable_size(block[iblock]));
+			else
+				rpfree_sized(block[iblock], size);
+		}
+		// Blocks must be reused after sized free
+		void* reuse = rpmalloc(size);
+		memset(reuse, 0xEF, size);
+		rpfree_sized(reuse, size);
+	}
+	rpfree_sized(0, 16);
+
+	// Sizes smaller than the allocated size and aligned blocks are freed as by rpfree
+	static const size_t mismatch_size[][2] = {{5000, 16},     {100, 64},         {1000, 16}, {70000, 1000},
+	                                          {300000, 4000}, {5000000, 300000}, {16, 8}};
+	for (size_t imismatch = 0; imismatch < sizeof(mismatch_size) / sizeof(mismatch_size[0]); ++imismatch) {
+		for (size_t iblock = 0; iblock < 16; ++iblock) {
+			block[iblock] = rpmalloc(mismatch_size[imismatch][0]);
+			memset(block[iblock], 0xCD, mismatch_size[imismatch][0]);
+		}
+		for (size_t iblock = 0; iblock < 16; ++iblock)
+			rpfree_sized(block[iblock], mismatch_size[imismatch][1]);
+	}
+	for (size_t iblock = 0; iblock < 16; ++iblock)
+		block[iblock] = rpaligned_alloc(256, 100);
+	for (size_t iblock = 0; iblock < 16; ++iblock)
+		rpfree_sized(block[iblock], 100);
+	for (size_t isize = 0; isize < sizeof(block_size) / sizeof(block_size[0]); ++isize) {
+		size_t size = block_size[isize];
+		for (size_t iblock = 0; iblock < 64; ++iblock) {
+			block[iblock] = rpmalloc(size);
+			if (rpmalloc_usable_size(block[iblock]) < size)
+				return test_fail("Bad usable size after smaller sized free");
+			memset(block[iblock], (int)iblock, size);
+		}
+		for (size_t iblock = 0; iblock < 64; ++iblock) {
+			if (size && (*(unsigned char*)block[iblock] != (unsigned char)iblock))
+				return test_fail("Blocks overlap after smaller sized free");
+		}
+		for (size_t iblock = 0; iblock < 64; ++iblock)
+			rpfree_sized(block[iblock], size);
+	}
+
+	rpmalloc_finalize();
+
+	printf("Sized free tests passed\n");
+	return 0;
+}
+
+//! Allocate blocks of a compile time constant size, mixing the inline functions with the exported functions, and
+//  free them in a different order than allocated
+#define TEST_INLINE_SIZE(size)                                                                         \
+	do {                                                                                               \
+		for (size_t iblock = 0; iblock < 4096; ++iblock) {                                             \
+			block[iblock] = (iblock & 3) ? rpmalloc_inline(size) : rpmalloc(size);                     \
+			if (!block[iblock] || (rpmalloc_usable_size(block[iblock]) < (size)))                      \
+				return test_fail("Inline allocation failed");                                          \
+			memset(block[iblock], (int)(iblock & 0xFF), size);                                         \
+		}                                                                                              \
+		for (size_t ipass = 0; ipass < 2; ++ipass) {                                                   \
+			for (size_t iblock = ipass; iblock < 4096; iblock += 2) {                                  \
+				unsigned char* data = block[iblock];                                                   \
+				if ((data[0] != (unsigned char)iblock) || (data[(size) - 1] != (unsigned char)iblock)) \
+					return test_fail("Inline allocated block data corrupted");                         \
+				if (iblock & 2)                                                                        \
+					rpfree_sized_inline(block[iblock], size);                                          \
+				else                                                                                   \
+					rpfree(block[iblock]);                                                             \
+			}                                                                                          \
+		}                                                                                              \
+	} while (0)
+
+static int
+test_inline(void) {
+	rpmalloc_initialize(0);
+
+	static void* block[4096];
+	for (int iloop = 0; iloop < 4; ++iloop) {
+		TEST_INLINE_SIZE(1);
+		TEST_INLINE_SIZE(16);
+		TEST_INLINE_SIZE(100);
+		TEST_INLINE_SIZE(1024);
+		// Beyond the inline size limit
+		TEST_INLINE_SIZE(1025);
+		TEST_INLINE_SIZE(70000);
+	}
+	void* zero = rpmalloc_inline(0);
+	if (!zero)
+		return test_fail("Inline allocation of zero size failed");
+	rpfree_sized_inline(zero, 0);
+	rpfree_sized_inline(0, 16);
+	// A mismatching size is detected and the block freed through the exported functions
+	for (size_t iblock = 0; iblock < 64; ++iblock)
+		block[iblock] = rpmalloc((iblock & 1) ? 5000 : 100);
+	for (size_t iblock = 0; iblock < 64; ++iblock)
+		rpfree_sized_inline(block[iblock], 16);
+
+#if RPMALLOC_INLINE_FAST_PATH
+	// The fast path pops the head of the local free list of the size class in the thread heap, and pushes a freed
+	// block to the local free list of its page
+	void* first = rpmalloc(64);
+	void* head = rpmalloc_thread_heap->local_free[64 / RPMALLOC_INLINE_GRANULARITY];
+	if (!head)
+		return test_fail("Thread heap local free list empty");
+	void* next = *(void**)head;
+	void* inlined = rpmalloc_inline(64);
+	if ((inlined != head) || (rpmalloc_thread_heap->local_free[64 / RPMALLOC_INLINE_GRANULARITY] != next))
+		return test_fail("Inline allocation did not pop the thread heap local free list");
+	rpmalloc_inline_page_t* page =
+	    (rpmalloc_inline_page_t*)((uintptr_t)inlined & ~((uintptr_t)RPMALLOC_INLINE_PAGE_SIZE - 1));
+	if (page->heap != rpmalloc_thread_heap)
+		return test_fail("Inline allocated block not in page of thread heap");
+	uint32_t local_free_count = page->local_free_count;
+	rpfree_sized_inline(inlined, 64);
+	if ((page->local_free != inlined) || (page->local_free_count != local_free_count + 1))
+		return test_fail("Inline free did not push to the page local free list");
+	rpfree(first);
+#endif
+
+	rpmalloc_finalize();
+
+	printf("Inline tests passed\n");
+	return 0;
+}
+
+static int
+test_free_bitmap(void) {
+	rpmalloc_initialize(0);
+
+	// Free blocks of medium and large pages are tracked out of line, the block memory must be left untouched
+	// by free and the lowest address free block reused first
+	static const size_t block_size[] = {5000, 20000, 300000, 2000000};
+	for (size_t isize = 0; isize < sizeof(block_size) / sizeof(block_size[0]); ++isize) {
+		size_t size = block_size[isize];
+		unsigned char* block[8];
+		for (size_t iblock = 0; iblock < 8; ++iblock) {
+			block[iblock] = rpmalloc(size);
+			memset(block[iblock], (int)(iblock + 1), size);
+		}
+		for (size_t iblock = 1; iblock < 8; ++iblock) {
+			if (block[iblock] != block[0] + (rpmalloc_usable_size(block[0]) * iblock))
+				return test_fail("Blocks not allocated in order from page");
+		}
+		static const size_t free_order[] = {5, 3, 7};
+		for (size_t ifree = 0; ifree < 3; ++ifree)
+			rpfree(block[free_order[ifree]]);
+		for (size_t ifree = 0; ifree < 3; ++ifree) {
+			unsigned char* freed = block[free_order[ifree]];
+			for (size_t ibyte = 0; ibyte < size; ibyte += 64) {
+				if (freed[ibyte] != (unsigned char)(free_order[ifree] + 1))
+					return test_fail("Free block memory modified");
+			}
+		}
+		static const size_t reuse_order[] = {3, 5, 7};
+		for (size_t ireuse = 0; ireuse < 3; ++ireuse) {
+			void* reuse = rpmalloc(size);
+			if (reuse != block[reuse_order[ireuse]])
+				return test_fail("Lowest address free block not reused first");
+		}
+		for (size_t iblock = 0; iblock < 8; ++iblock)
+			rpfree(block[iblock]);
+	}
+
+	rpmalloc_finalize();
+
+	printf("Free bitmap tests passed\n");
+	return 0;
+}
+
+typedef struct walk_context_t {
+	void* block[3];
+	size_t found[3];
+	size_t page_count;
+	size_t block_used;
+} walk_context_t;
+
+static int
+test_walk_visit(const rpmalloc_page_info_t* page, void* context) {
+	walk_context_t* walk = context;
+	++walk->page_count;
+	if ((page->block_used > page->block_count) || (page->block_initialized > page->block_count) ||
+	    (page->committed > page->page_size))
+		walk->block_used = (size_t)-1;
+	if (walk->block_used != (size_t)-1)
+		walk->block_used += page->block_used;
+	for (int iblock = 0; iblock < 3; ++iblock) {
+		if (((char*)walk->block[iblock] >= (char*)page->address) &&
+		    ((char*)walk->block[iblock] < (char*)page->address + page->page_size))
+			walk->found[iblock] += page->is_free ? 1000 : 1;
+	}
+	return 0;
+}
+
+static int
+test_walk_stop(const rpmalloc_page_info_t* page, void* context) {
+	(void)sizeof(page);
+	++*(size_t*)context;
+	return 1;
+}
+
+static int
+test_walk(void) {
+	rpmalloc_initialize(0);
+
+	static void* block[1024];
+	static const size_t block_size[] = {48, 20000, 300000};
+	walk_context_t walk;
+	memset(&walk, 0, sizeof(walk));
+	for (size_t iblock = 0; iblock < 1024; ++iblock)
+		block[iblock] = rpmalloc(block_size[iblock % 3]);
+	for (int iblock = 0; iblock < 3; ++iblock)
+		walk.block[iblock] = block[iblock];
+
+	if (rpmalloc_walk(test_walk_visit, &walk))
+		return test_fail("Walk stopped without visitor request");
+	if (walk.block_used == (size_t)-1)
+		return test_fail("Walk reported invalid page state");
+	if (walk.block_used < 1024)
+		return test_fail("Walk did not report all blocks in use");
+	for (int iblock = 0; iblock < 3; ++iblock) {
+		if (walk.found[iblock] != 1)
+			return test_fail("Walk did not report page of block in use exactly once");
+	}
+
+	size_t visited = 0;
+	if (!rpmalloc_walk(test_walk_stop, &visited) || (visited != 1))
+		return test_fail("Walk not stopped by visitor");
+
+	rpmalloc_walk_summary_t summary;
+	rpmalloc_walk_summary(&summary);
+	if (summary.page_count != walk.page_count)
+		return test_fail("Walk summary page count mismatch");
+	size_t used = 0;
+	for (size_t iblock = 0; iblock < 1024; ++iblock)
+		used += rpmalloc_usable_size(block[iblock]);
+	if ((summary.used < used) || (summary.committed < summary.used) ||
+	    (summary.total_committed < summary.committed))
+		return test_fail("Walk summary memory use mismatch");
+	size_t block_used = 0;
+	for (int iclass = 0; iclass < 128; ++iclass) {
+		block_used += summary.size_class[iclass].block_used;
+		if (summary.size_class[iclass].fragmented > summary.size_class[iclass].committed)
+			return test_fail("Walk summary fragmentation larger than committed memory");
+		if (summary.size_class[iclass].fragmented_share > 10000)
+			return test_fail("Walk summary fragmentation share out of range");
+	}
+	if (block_used < 1024)
+		return test_fail("Walk summary did not count all blocks in use");
+
+	for (size_t iblock = 0; iblock < 1024; ++iblock)
+		rpfree(block[iblock]);
+
+	// The walk reads the heap local free lists in place, blocks keep being handed out in order after a walk
+	char* first = rpmalloc(208);
+	char* second = rpmalloc(208);
+	size_t stride = (size_t)(second - first);
+	if (rpmalloc_walk(test_walk_visit, &walk))
+		return test_fail("Walk stopped without visitor request");
+	char* third = rpmalloc(208);
+	if ((stride == rpmalloc_usable_size(first)) && (third != second + stride))
+		return test_fail("Walk modified the heap local free list");
+	rpfree(first);
+	rpfree(second);
+	rpfree(third);
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	for (size_t iblock = 0; iblock < 1024; ++iblock)
+		block[iblock] = rpmalloc_heap_alloc(heap, block_size[iblock % 3]);
+	rpmalloc_heap_free(heap, block[3]);
+	void* huge = rpmalloc_heap_alloc(heap, 16 * 1024 * 1024);
+	memset(&walk, 0, sizeof(walk));
+	walk.block[0] = block[0];
+	walk.block[1] = block[1];
+	walk.block[2] = huge;
+	if (rpmalloc_heap_walk(heap, test_walk_visit, &walk))
+		return test_fail("Heap walk stopped without visitor request");
+	if (walk.block_used != 1023 + 1)
+		return test_fail("Heap walk block count mismatch");
+	for (int iblock = 0; iblock < 3; ++iblock) {
+		if (walk.found[iblock] != 1)
+			return test_fail("Heap walk did not report page of block in use exactly once");
+	}
+	rpmalloc_heap_walk_summary(heap, &summary);
+	if ((summary.page_count != walk.page_count) || (summary.size_class[0].page_count != 0))
+		return test_fail("Heap walk summary page count mismatch");
+	block_used = 0;
+	for (int iclass = 0; iclass < 128; ++iclass)
+		block_used += summary.size_class[iclass].block_used;
+	if (block_used != 1023)
+		return test_fail("Heap walk summary block count mismatch");
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+#endif
+
+	rpmalloc_finalize();
+
+	printf("Walk tests passed\n");
+	return 0;
+}
+
+static void
+trace_thread(void* argp) {
+	void** block = argp;
+	rpmalloc_thread_initialize();
+	void* local = rpmalloc(12345);
+	rpfree(local);
+	rpfree(*block);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+//! Read the header and up to the given number of records of the trace file, returns the number of records read
+static size_t
+test_trace_read(const char* path, rpmalloc_trace_header_t* header, rpmalloc_trace_record_t* record, size_t count) {
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return 0;
+	size_t read = 0;
+	if (fread(header, sizeof(rpmalloc_trace_header_t), 1, file) == 1)
+		read = fread(record, sizeof(rpmalloc_trace_record_t), count, file);
+	fclose(file);
+	return read;
+}
+
+//! Find the first record of the given operation on the given block at or after the given index
+static size_t
+test_trace_find(const rpmalloc_trace_record_t* record, size_t count, size_t index, unsigned int op, void* block) {
+	for (; index < count; ++index) {
+		if (((record[index].info >> 56) == op) && (record[index].block == (unsigned long long)(uintptr_t)block))
+			return index;
+	}
+	return count;
+}
+
+static int
+test_trace(void) {
+	static const char trace_path[] = "rpmalloc-test-trace";
+	rpmalloc_config_t config = {0};
+	config.trace_path = trace_path;
+	rpmalloc_initialize_config(0, &config);
+	if (!rpmalloc_config()->trace_path) {
+		rpmalloc_finalize();
+		printf("Trace tests passed (not enabled)\n");
+		return 0;
+	}
+
+	void* block = rpmalloc(100);
+	void* zero = rpcalloc(10, 20);
+	void* aligned = rpaligned_alloc(256, 300);
+	void* moved = rprealloc(block, 5000);
+	void* batch[4];
+	size_t batch_count = rpmalloc_alloc_batch(48, 4, batch);
+	rpfree(zero);
+	rpfree(aligned);
+	rpfree_batch(batch, batch_count);
+	void* shared = rpmalloc(777);
+
+	thread_arg targ;
+	targ.fn = trace_thread;
+	targ.arg = &shared;
+	uintptr_t thread = thread_run(&targ);
+	thread_join(thread);
+	rpfree(moved);
+
+	rpmalloc_finalize();
+
+	// Trace files are named <trace path>.<process id>.<thread index>, tracing is only supported on POSIX systems
+	int process_id = 0;
+#ifndef _MSC_VER
+	process_id = (int)getpid();
+#endif
+	static rpmalloc_trace_record_t record[1024];
+	rpmalloc_trace_header_t header;
+	char path[64];
+	snprintf(path, sizeof(path), "%s.%d.0", trace_path, process_id);
+	size_t count = test_trace_read(path, &header, record, 1024);
+	if ((header.magic != RPMALLOC_TRACE_MAGIC) || (header.version != RPMALLOC_TRACE_VERSION) ||
+	    (header.process_id != (unsigned int)process_id) ||
+	    (header.record_size != sizeof(rpmalloc_trace_record_t)) || (header.thread_index != 0))
+		return test_fail("Invalid trace file header");
+	if (batch_count != 4)
+		return test_fail("Failed to allocate batch of blocks");
+
+	const struct {
+		unsigned int op;
+		void* block;
+		void* previous;
+		unsigned long long size;
+		unsigned int alignment_shift;
+	} expected[] = {{RPMALLOC_TRACE_ALLOC, block, 0, 100, 0},
+	                {RPMALLOC_TRACE_ZALLOC, zero, 0, 200, 0},
+	                {RPMALLOC_TRACE_ALLOC, aligned, 0, 300, 8},
+	                {RPMALLOC_TRACE_REALLOC, moved, block, 5000, 0},
+	                {RPMALLOC_TRACE_ALLOC, batch[0], 0, 48, 0},
+	                {RPMALLOC_TRACE_ALLOC, batch[1], 0, 48, 0},
+	                {RPMALLOC_TRACE_ALLOC, batch[2], 0, 48, 0},
+	                {RPMALLOC_TRACE_ALLOC, batch[3], 0, 48, 0},
+	                {RPMALLOC_TRACE_FREE, zero, 0, 0, 0},
+	                {RPMALLOC_TRACE_FREE, aligned, 0, 0, 0},
+	                {RPMALLOC_TRACE_FREE, batch[0], 0, 0, 0},
+	                {RPMALLOC_TRACE_FREE, batch[1], 0, 0, 0},
+	                {RPMALLOC_TRACE_FREE, batch[2], 0, 0, 0},
+	                {RPMALLOC_TRACE_FREE, batch[3], 0, 0, 0},
+	                {RPMALLOC_TRACE_ALLOC, shared, 0, 777, 0}};
+	size_t expected_count = sizeof(expected) / sizeof(expected[0]);
+	if (count <= expected_count)
+		return test_fail("Trace file missing records");
+	for (size_t irecord = 0; irecord < expected_count; ++irecord) {
+		if (((record[irecord].info >> 56) != expected[irecord].op) ||
+		    (((record[irecord].info >> 48) & 0xFF) != expected[irecord].alignment_shift) ||
+		    ((record[irecord].info & 0xFFFFFFFFFFFFULL) != expected[irecord].size) ||
+		    (record[irecord].block != (unsigned long long)(uintptr_t)expected[irecord].block) ||
+		    (record[irecord].previous != (unsigned long long)(uintptr_t)expected[irecord].previous))
+			return test_fail("Trace record mismatch");
+		if ((irecord && (record[irecord].timestamp < record[irecord - 1].timestamp)) ||
+		    (record[irecord].timestamp < header.timestamp))
+			return test_fail("Trace record timestamps not monotonic");
+	}
+	// Creating the thread can allocate memory before the final free
+	if (test_trace_find(record, count, expected_count, RPMALLOC_TRACE_FREE, moved) == count)
+		return test_fail("Trace missing free of reallocated block");
+
+	snprintf(path, sizeof(path), "%s.%d.1", trace_path, process_id);
+	count = test_trace_read(path, &header, record, 1024);
+	if ((header.magic != RPMALLOC_TRACE_MAGIC) || (header.thread_index != 1))
+		return test_fail("Invalid trace file header of thread");
+	size_t ialloc = 0;
+	while ((ialloc < count) && (((record[ialloc].info >> 56) != RPMALLOC_TRACE_ALLOC) ||
+	                            ((record[ialloc].info & 0xFFFFFFFFFFFFULL) != 12345)))
+		++ialloc;
+	if (ialloc == count)
+		return test_fail("Trace of thread missing allocation");
+	if (test_trace_find(record, count, ialloc + 1, RPMALLOC_TRACE_FREE, (void*)(uintptr_t)record[ialloc].block) ==
+	    count)
+		return test_fail("Trace of thread missing free");
+	if (test_trace_find(record, count, ialloc + 1, RPMALLOC_TRACE_FREE, shared) == count)
+		return test_fail("Trace of thread missing free of block allocated by other thread");
+
+	rpmalloc_initialize(0);
+	if (rpmalloc_config()->trace_path)
+		return test_fail("Tracing not stopped by finalize");
+	rpmalloc_finalize();
+
+	remove(path);
+	snprintf(path, sizeof(path), "%s.%d.0", trace_path, process_id);
+	remove(path);
+
+	printf("Trace tests passed\n");
+	return 0;
+}
+
+#ifndef _WIN32
+
+//! Blocks allocated by the thread alive in the parent process during the fork
+static void* fork_block[256];
+//! State of the thread, 1 when done allocating and 2 when allowed to free and exit
+static volatile int fork_thread_state;
+//! ID of the heap of the thread alive in the parent process, found by the walk in the child
+static unsigned int fork_heap_id;
+//! Blocks allocated by a thread in the child process
+static void* fork_child_block[64];
+
+static void
+fork_thread(void* argp) {
+	(void)sizeof(argp);
+	rpmalloc_thread_initialize();
+	for (size_t iblock = 0; iblock < 256; ++iblock)
+		fork_block[iblock] = rpmalloc((iblock & 1) ? 3000 : 100000);
+	// Leave free pages in the heap of the thread
+	for (size_t iblock = 128; iblock < 256; ++iblock) {
+		rpfree(fork_block[iblock]);
+		fork_block[iblock] = 0;
+	}
+	fork_thread_state = 1;
+	while (fork_thread_state != 2)
+		thread_sleep(1);
+	for (size_t iblock = 0; iblock < 128; ++iblock)
+		rpfree(fork_block[iblock]);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+//! Get the number of threads of the process without allocating memory, zero if unknown
+static int
+fork_process_thread_count(void) {
+	int count = 0;
+#ifdef __linux__
+	char status[4096];
+	int fd = open("/proc/self/status", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ssize_t size = read(fd, status, sizeof(status) - 1);
+	close(fd);
+	if (size <= 0)
+		return 0;
+	status[size] = 0;
+	const char* threads = strstr(status, "Threads:");
+	if (threads)
+		count = atoi(threads + 8);
+#endif
+	return count;
+}
+
+#if !ENABLE_PER_CPU_HEAPS
+//! Count the blocks of the thread in the child process contained in pages of the orphaned heap
+static int
+fork_child_walk_visit(const rpmalloc_page_info_t* page, void* context) {
+	size_t* found = context;
+	if (page->heap_id != fork_heap_id)
+		return 0;
+	for (size_t iblock = 0; iblock < 64; ++iblock) {
+		if (((char*)fork_child_block[iblock] >= (char*)page->address) &&
+		    ((char*)fork_child_block[iblock] < (char*)page->address + page->page_size))
+			++(*found);
+	}
+	return 0;
+}
+#endif
+
+static void
+fork_child_thread(void* argp) {
+	(void)sizeof(argp);
+	rpmalloc_thread_initialize();
+	size_t found = 0;
+	for (int iloop = 0; iloop < 16; ++iloop) {
+		for (size_t iblock = 0; iblock < 64; ++iblock)
+			fork_child_block[iblock] = rpmalloc(16 + (iblock * 997) % 70000);
+#if !ENABLE_PER_CPU_HEAPS
+		// The heap of the thread in the parent can have been in the middle of an update and is never reused
+		rpmalloc_walk(fork_child_walk_visit, &found);
+#endif
+		for (size_t iblock = 0; iblock < 64; ++iblock)
+			rpfree(fork_child_block[iblock]);
+	}
+	rpmalloc_thread_finalize();
+	thread_exit(found ? 1 : 0);
+}
+
+//! Count the blocks of the thread in the parent process contained in the walked pages
+static int
+fork_walk_visit(const rpmalloc_page_info_t* page, void* context) {
+	size_t* found = context;
+	for (size_t iblock = 0; iblock < 128; ++iblock) {
+		if (((char*)fork_block[iblock] >= (char*)page->address) &&
+		    ((char*)fork_block[iblock] < (char*)page->address + page->page_size)) {
+			fork_heap_id = page->heap_id;
+			++(*found);
+		}
+	}
+	return 0;
+}
+
+//! Run in the forked child process, only the forking thread exists and the heap of the other thread is orphaned
+static int
+fork_child_run(int fd) {
+	// Free pages were decommitted before the fork, so the committed memory cannot exceed the committed memory of the
+	// parent after the fork
+	rpmalloc_global_statistics_t stats;
+	rpmalloc_global_statistics(&stats);
+	int thread_count = fork_process_thread_count();
+	if (thread_count > 1)
+		return test_fail("Purge thread started in fork handler");
+	size_t committed_parent = 0;
+	if (read(fd, &committed_parent, sizeof(committed_parent)) != (ssize_t)sizeof(committed_parent))
+		return test_fail("Unable to read committed memory of parent");
+	if (stats.committed > committed_parent)
+		return test_fail("Committed memory increased in child");
+
+	// The heap of the thread in the parent is orphaned in the child and reached by the walk as an abandoned heap
+	size_t found = 0;
+	rpmalloc_walk(fork_walk_visit, &found);
+	if (found != 128)
+		return test_fail("Heap of thread in parent not orphaned in child");
+
+	// Blocks of the orphaned heap can be freed, the purge thread is restarted by the allocations
+	for (size_t iblock = 0; iblock < 128; ++iblock) {
+		if (*(uint32_t*)fork_block[iblock] != (uint32_t)iblock)
+			return test_fail("Block data not inherited by child");
+		rpfree(fork_block[iblock]);
+	}
+	void* huge = rpmalloc(32 * 1024 * 1024);
+	rpfree(huge);
+	huge = rpmalloc(32 * 1024 * 1024);
+	rpfree(huge);
+	if (thread_count && rpmalloc_config()->enable_purge_thread && (fork_process_thread_count() != 2))
+		return test_fail("Purge thread not restarted in child");
+
+	thread_arg targ;
+	targ.fn = fork_child_thread;
+	targ.arg = 0;
+	for (int ithread = 0; ithread < 4; ++ithread) {
+		uintptr_t thread = thread_run(&targ);
+		if (thread_join(thread))
+			return test_fail("Thread in forked child failed");
+	}
+	return 0;
+}
+
+static int
+test_fork(void) {
+	rpmalloc_config_t config = {0};
+	config.decommit_on_fork = 1;
+	config.enable_purge_thread = 1;
+	rpmalloc_initialize_config(0, &config);
+
+	fork_thread_state = 0;
+	thread_arg targ;
+	targ.fn = fork_thread;
+	targ.arg = 0;
+	uintptr_t thread = thread_run(&targ);
+	while (fork_thread_state != 1)
+		thread_sleep(1);
+	for (size_t iblock = 0; iblock < 128; ++iblock)
+		*(uint32_t*)fork_block[iblock] = (uint32_t)iblock;
+
+	// Leave free pages in the heap of the forking thread
+	void* block[256];
+	for (size_t iblock = 0; iblock < 256; ++iblock)
+		block[iblock] = rpmalloc(3000);
+	for (size_t iblock = 0; iblock < 256; ++iblock)
+		rpfree(block[iblock]);
+
+	rpmalloc_global_statistics_t stats;
+	rpmalloc_global_statistics(&stats);
+	size_t committed_before = stats.committed;
+
+	int fd[2];
+	if (pipe(fd))
+		return test_fail("Unable to create pipe");
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+		return test_fail("Unable to fork");
+	if (pid == 0) {
+		int ret = fork_child_run(fd[0]);
+		fflush(stdout);
+		_exit(ret ? 1 : 0);
+	}
+	rpmalloc_global_statistics(&stats);
+	size_t committed_after = stats.committed;
+	ssize_t written = write(fd[1], &committed_after, sizeof(committed_after));
+	int status = 0;
+	pid_t waited = waitpid(pid, &status, 0);
+	close(fd[0]);
+	close(fd[1]);
+	if ((written != (ssize_t)sizeof(committed_after)) || (waited != pid) || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		return test_fail("Forked child failed");
+	if (committed_after >= committed_before)
+		return test_fail("Free pages not decommitted before fork");
+
+	fork_thread_state = 2;
+	thread_join(thread);
+
+	rpmalloc_finalize();
+
+	printf("Fork tests passed\n");
+	return 0;
+}
+
+#endif
+
+typedef struct batch_thread_arg_t {
+	void** block;
+	size_t block_count;
+} batch_thread_arg_t;
+
+static void
+batch_free_thread(void* argp) {
+	batch_thread_arg_t* arg = argp;
+	rpmalloc_thread_initialize();
+	rpfree_batch(arg->block, arg->block_count);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+test_batch(void) {
+	rpmalloc_initialize(0);
+
+	static void* block[4096];
+	static const size_t block_size[] = {16, 48, 1000, 9000, 100000, 3 * 1024 * 1024};
+	for (size_t isize = 0; isize < sizeof(block_size) / sizeof(block_size[0]); ++isize) {
+		size_t size = block_size[isize];
+		size_t count = (size < 65536) ? 4096 : 8;
+		if (rpmalloc_alloc_batch(size, count, block) != count)
+			return test_fail("Failed to allocate batch of blocks");
+		for (size_t iblock = 0; iblock < count; ++iblock) {
+			if (rpmalloc_usable_size(block[iblock]) < size)
+				return test_fail("Bad usable size of batch allocated block");
+			memset(block[iblock], (int)iblock, size);
+		}
+		for (size_t iblock = 0; iblock < count; ++iblock) {
+			if (*(unsigned char*)block[iblock] != (unsigned char)iblock)
+				return test_fail("Batch allocated blocks overlap");
+		}
+		// Free half individually and the rest as a batch with holes
+		for (size_t iblock = 0; iblock < count; iblock += 2) {
+			rpfree(block[iblock]);
+			block[iblock] = 0;
+		}
+		rpfree_batch(block, count);
+	}
+
+	// Mix batch and single allocations of the same size
+	void* single = rpmalloc(48);
+	if (rpmalloc_alloc_batch(48, 1000, block) != 1000)
+		return test_fail("Failed to allocate batch of blocks");
+	for (size_t iblock = 0; iblock < 1000; ++iblock) {
+		if (block[iblock] == single)
+			return test_fail("Batch allocated block aliases single block");
+	}
+	rpfree(single);
+	rpfree_batch(block, 1000);
+
+	// Free a batch from another thread as one list per page
+	if (rpmalloc_alloc_batch(64, 4096, block) != 4096)
+		return test_fail("Failed to allocate batch of blocks");
+	batch_thread_arg_t arg;
+	arg.block = block;
+	arg.block_count = 4096;
+	thread_arg targ;
+	targ.fn = batch_free_thread;
+	targ.arg = &arg;
+	thread_join(thread_run(&targ));
+	if (rpmalloc_alloc_batch(64, 4096, block) != 4096)
+		return test_fail("Failed to allocate batch of blocks after cross thread free");
+	for (size_t iblock = 0; iblock < 4096; ++iblock)
+		memset(block[iblock], 0xAB, 64);
+	rpfree_batch(block, 4096);
+
+	rpmalloc_finalize();
+
+	printf("Batch tests passed\n");
+	return 0;
+}
+
+static int
+test_threaded(void) {
+	rpmalloc_config_t config = {0};
+	//config.unmap_on_finalize = 1;
+	rpmalloc_initialize_config(0, &config);
+
+	int ret = test_thread_implementation();
+
+	rpmalloc_finalize();
+
+	if (ret == 0)
+		printf("Memory threaded tests passed\n");
+
+	return ret;
+}
+
+static int
+test_crossthread_batch(unsigned int remote_free_batch) {
+	uintptr_t thread[32];
+	allocator_thread_arg_t arg[32];
+	thread_arg targ[32];
+
+	rpmalloc_config_t config = {0};
+	//config.unmap_on_finalize = 1;
+	config.remote_free_batch = remote_free_batch;
+	rpmalloc_initialize_config(0, &config);
+	clock_t start_time = clock();
+
+	size_t num_alloc_threads = hardware_threads;
+	if (num_alloc_threads < 2)
+		num_alloc_threads = 2;
+	if (num_alloc_threads > 16)
+		num_alloc_threads = 16;
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
+		unsigned int iadd = (ithread * (16 + ithread) + ithread) % 128;
+#if defined(__LLP64__) || defined(__LP64__) || defined(_WIN64)
+		arg[ithread].loops = 50;
+		arg[ithread].passes = 1024;
+#else
+		arg[ithread].loops = 20;
+		arg[ithread].passes = 200;
+#endif
+		arg[ithread].pointers = rpmalloc(sizeof(void*) * arg[ithread].loops * arg[ithread].passes);
+		memset(arg[ithread].pointers, 0, sizeof(void*) * arg[ithread].loops * arg[ithread].passes);
+		arg[ithread].datasize[0] = 19 + iadd;
+		arg[ithread].datasize[1] = 249 + iadd;
+		arg[ithread].datasize[2] = 797 + iadd;
+		arg[ithread].datasize[3] = 3 + iadd;
+		arg[ithread].datasize[4] = 7923 + iadd;
+		arg[ithread].datasize[5] = 344 + iadd;
+		arg[ithread].datasize[6] = 3892 + iadd;
+		arg[ithread].datasize[7] = 19 + iadd;
+		arg[ithread].datasize[8] = 154 + iadd;
+		arg[ithread].datasize[9] = 9723 + iadd;
+		arg[ithread].datasize[10] = 15543 + iadd;
+		arg[ithread].datasize[11] = 32493 + iadd;
+		arg[ithread].datasize[12] = 34 + iadd;
+		arg[ithread].datasize[13] = 1894 + iadd;
+		arg[ithread].datasize[14] = 193 + iadd;
+		arg[ithread].datasize[15] = 2893 + iadd;
+		arg[ithread].num_datasize = 16;
+
+		targ[ithread].fn = crossallocator_thread;
+		targ[ithread].arg = &arg[ithread];
+	}
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
+		arg[ithread].crossthread_pointers = arg[(ithread + 1) % num_alloc_threads].pointers;
+	}
+
+	for (int iloop = 0; iloop < 32; ++iloop) {
+		for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
+			thread[ithread] = thread_run(&targ[ithread]);
+
+		thread_sleep(100);
+
+		for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
+			if (thread_join(thread[ithread]) != 0)
+				return -1;
+		}
+	}
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
+		rpfree(arg[ithread].pointers);
+
+	printf("Memory cross thread free tests passed (remote free batch %u, %.0fms processor time)\n",
+	       remote_free_batch, 1000.0 * (double)(clock() - start_time) / (double)CLOCKS_PER_SEC);
+
+	rpmalloc_finalize();
+
+	return 0;
+}
+
+static int
+test_crossthread(void) {
+	if (test_crossthread_batch(0))
+		return -1;
+	return test_crossthread_batch(32);
+}
+
+static int
+test_threadspam(void) {
+	uintptr_t thread[64];
+	uintptr_t threadres[64];
+	unsigned int i, j;
+	size_t num_passes, num_alloc_threads;
+	allocator_thread_arg_t arg;
+
+	rpmalloc_config_t config = {0};
+	//config.unmap_on_finalize = 1;
+	rpmalloc_initialize_config(0, &config);
+
+	num_passes = 100;
+	num_alloc_threads = hardware_threads;
+	if (num_alloc_threads < 2)
+		num_alloc_threads = 2;
+#if defined(__LLP64__) || defined(__LP64__) || defined(_WIN64)
+	if (num_alloc_threads > 32)
+		num_alloc_threads = 32;
+#else
+	if (num_alloc_threads > 16)
+		num_alloc_threads = 16;
+#endif
+
+	arg.loops = 500;
+	arg.passes = 10;
+	arg.datasize[0] = 19;
+	arg.datasize[1] = 249;
+	arg.datasize[2] = 797;
+	arg.datasize[3] = 3;
+	arg.datasize[4] = 79;
+	arg.datasize[5] = 34;
+	arg.datasize[6] = 389;
+	arg.num_datasize = 7;
+
+	thread_arg targ;
+	targ.fn = initfini_thread;
+	targ.arg = &arg;
+	for (i = 0; i < num_alloc_threads; ++i)
+		thread[i] = thread_run(&targ);
+
+	for (j = 0; j < num_passes; ++j) {
+		thread_sleep(100);
+
+		for (i = 0; i < num_alloc_threads; ++i) {
+			threadres[i] = thread_join(thread[i]);
+			if (threadres[i])
+				return -1;
+			thread[i] = thread_run(&targ);
+		}
+	}
+
+	thread_sleep(1000);
+
+	for (i = 0; i < num_alloc_threads; ++i)
+		threadres[i] = thread_join(thread[i]);
+
+	rpmalloc_finalize();
+
+	for (i = 0; i < num_alloc_threads; ++i) {
+		if (threadres[i])
+			return -1;
+	}
+
+	printf("Memory thread spam tests passed\n");
+
+	return 0;
+}
+
+static int
+test_first_class_heaps(void) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	uintptr_t thread[32];
+	uintptr_t threadres[32];
+	unsigned int i;
+	size_t num_alloc_threads;
+	allocator_thread_arg_t arg[32];
+
+	rpmalloc_config_t config = {0};
+	//config.unmap_on_finalize = 1;
+	rpmalloc_initialize_config(0, &config);
+
+	num_alloc_threads = hardware_threads * 2;
+	if (num_alloc_threads < 2)
+		num_alloc_threads = 2;
+	if (num_alloc_threads > 16)
+		num_alloc_threads = 16;
+
+	for (i = 0; i < num_alloc_threads; ++i) {
+		arg[i].datasize[0] = 19;
+		arg[i].datasize[1] = 249;
+		arg[i].datasize[2] = 797;
+		arg[i].datasize[3] = 3058;
+		arg[i].datasize[4] = 47892;
+		arg[i].datasize[5] = 173932;
+		arg[i].datasize[6] = 389;
+		arg[i].datasize[7] = 19;
+		arg[i].datasize[8] = 2493;
+		arg[i].datasize[9] = 7979;
+		arg[i].datasize[10] = 3;
+		arg[i].datasize[11] = 79374;
+		arg[i].datasize[12] = 3432;
+		arg[i].datasize[13] = 548;
+		arg[i].datasize[14] = 38934;
+		arg[i].datasize[15] = 234;
+		arg[i].num_datasize = 16;
+#if defined(__LLP64__) || defined(__LP64__) || defined(_WIN64)
+		arg[i].loops = 100;
+		arg[i].passes = 4000;
+#else
+		arg[i].loops = 50;
+		arg[i].passes = 1000;
+#endif
+		arg[i].init_fini_each_loop = 1;
+
+		thread_arg targ;
+		targ.fn = heap_allocator_thread;
+		if ((i % 2) != 0)
+			targ.fn = allocator_thread;
+		targ.arg = &arg[i];
+
+		thread[i] = thread_run(&targ);
+	}
+
+	thread_sleep(1000);
+
+	for (i = 0; i < num_alloc_threads; ++i)
+		threadres[i] = thread_join(thread[i]);
+
+	rpmalloc_finalize();
+
+	for (i = 0; i < num_alloc_threads; ++i) {
+		if (threadres[i])
+			return -1;
+	}
+
+	printf("First class heap tests passed\n");
+#endif
+	return 0;
+}
+
+static int
+test_heap_reset(void) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_initialize(0);
+
+	static void* block[4096];
+	static const size_t block_size[] = {32, 400, 3000, 40000, 600000};
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	rpmalloc_global_statistics_t global_stats;
+	size_t committed[3] = {0};
+	for (int ipass = 0; ipass < 3; ++ipass) {
+		// Allocate the same request pattern each pass, the memory of the first pass must be reused
+		for (size_t iblock = 0; iblock < 4096; ++iblock) {
+			size_t size = block_size[iblock % 5] + (iblock & 15);
+			block[iblock] = rpmalloc_heap_alloc(heap, size);
+			memset(block[iblock], (int)(iblock & 0xFF), size);
+		}
+		void* huge = rpmalloc_heap_alloc(heap, 16 * 1024 * 1024);
+		memset(huge, 0x7F, 16 * 1024 * 1024);
+		for (size_t iblock = 0; iblock < 4096; ++iblock) {
+			const unsigned char* data = block[iblock];
+			if ((data[0] != (unsigned char)(iblock & 0xFF)) || (data[block_size[iblock % 5] - 1] != data[0]))
+				return test_fail("Data corrupted in heap allocation after reset");
+		}
+		rpmalloc_global_statistics(&global_stats);
+		committed[ipass] = global_stats.committed;
+		rpmalloc_heap_reset(heap, SIZE_MAX);
+	}
+	// Reused pages can get other size classes and commit more of the page, but must not grow once warm
+	if ((committed[1] > committed[0] + (committed[0] >> 3)) || (committed[2] > committed[1]))
+		return test_fail("Heap reset did not reuse committed memory");
+
+	// A zero retain size decommits all free pages but keeps the heap usable
+	rpmalloc_global_statistics(&global_stats);
+	size_t committed_before = global_stats.committed;
+	rpmalloc_heap_reset(heap, 0);
+	rpmalloc_global_statistics(&global_stats);
+	if (global_stats.committed >= committed_before)
+		return test_fail("Heap reset did not decommit free pages");
+	for (size_t iblock = 0; iblock < 4096; ++iblock) {
+		block[iblock] = rpmalloc_heap_calloc(heap, 1, block_size[iblock % 5]);
+		if (test_zero_block(block[iblock], block_size[iblock % 5]))
+			return test_fail("Zero allocation not zero initialized after heap reset");
+	}
+	for (size_t iblock = 0; iblock < 4096; iblock += 2)
+		rpmalloc_heap_free(heap, block[iblock]);
+
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+
+	rpmalloc_finalize();
+
+	printf("Heap reset tests passed\n");
+#endif
+	return 0;
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+#define SHARED_HEAP_THREAD_COUNT 4
+#define SHARED_HEAP_BLOCK_COUNT 8192
+
+typedef struct shared_heap_arg_t {
+	rpmalloc_heap_t* heap;
+	void** block;
+	void** free_block;
+	unsigned int index;
+} shared_heap_arg_t;
+
+static void
+shared_heap_thread(void* argp) {
+	shared_heap_arg_t* arg = argp;
+	for (size_t iblock = 0; iblock < SHARED_HEAP_BLOCK_COUNT; ++iblock) {
+		// Free blocks allocated by another thread while allocating from the same shared heap
+		if (arg->free_block)
+			rpmalloc_heap_free(arg->heap, arg->free_block[iblock]);
+		size_t size = 16 + ((iblock * 37 + arg->index * 11) % 8000);
+		void* block = (iblock & 7) ? rpmalloc_heap_alloc(arg->heap, size) :
+		                             rpmalloc_heap_aligned_alloc(arg->heap, 128, size);
+		if (!block || (rpmalloc_get_heap_for_ptr(block) != arg->heap))
+			thread_exit(1);
+		memset(block, (int)arg->index + 1, 16);
+		arg->block[iblock] = block;
+	}
+	thread_exit(0);
+}
+
+#if !ENABLE_PER_CPU_HEAPS
+
+#define SHARED_HEAP_OTHER_THREAD_COUNT 4
+
+//! Allocate in a chain of concurrently live threads to take released heaps from the queue
+static void
+shared_heap_other_thread(void* argp) {
+	rpmalloc_heap_t** heap = argp;
+	void* block = rpmalloc(64);
+	*heap = rpmalloc_get_heap_for_ptr(block);
+	uintptr_t result = 0;
+	if (heap[1] == 0) {
+		thread_arg targ = {shared_heap_other_thread, heap + 1};
+		result = thread_join(thread_run(&targ));
+	}
+	rpfree(block);
+	thread_exit(result);
+}
+
+static void
+shared_heap_current_thread(void* argp) {
+	(void)sizeof(argp);
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire_shared();
+	rpmalloc_heap_thread_set_current(heap);
+	void* block = rpmalloc(100);
+	if (rpmalloc_get_heap_for_ptr(block) != heap)
+		thread_exit(1);
+	// The heap of this thread is detached and kept as the current heap, it must not be reused by another thread
+	rpmalloc_heap_release(heap);
+	rpmalloc_heap_t* thread_heap = rpmalloc_get_heap_for_ptr(block);
+	if (thread_heap == heap)
+		thread_exit(1);
+	// The last entry is a terminator for the chain of threads
+	rpmalloc_heap_t* other_heap[SHARED_HEAP_OTHER_THREAD_COUNT + 1] = {0};
+	other_heap[SHARED_HEAP_OTHER_THREAD_COUNT] = heap;
+	thread_arg targ = {shared_heap_other_thread, other_heap};
+	if (thread_join(thread_run(&targ)))
+		thread_exit(1);
+	for (size_t iheap = 0; iheap < SHARED_HEAP_OTHER_THREAD_COUNT; ++iheap) {
+		if (other_heap[iheap] == thread_heap)
+			thread_exit(1);
+	}
+	void* next_block = rpmalloc(100);
+	if (rpmalloc_get_heap_for_ptr(next_block) != thread_heap)
+		thread_exit(1);
+	rpfree(block);
+	rpfree(next_block);
+	thread_exit(0);
+}
+
+#endif
+
+#endif
+
+static int
+test_shared_heap(void) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_initialize(0);
+
+	static void* block[2][SHARED_HEAP_THREAD_COUNT][SHARED_HEAP_BLOCK_COUNT];
+	shared_heap_arg_t arg[SHARED_HEAP_THREAD_COUNT];
+	thread_arg targ[SHARED_HEAP_THREAD_COUNT];
+	uintptr_t thread[SHARED_HEAP_THREAD_COUNT];
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire_shared();
+	for (int ipass = 0; ipass < 2; ++ipass) {
+		for (unsigned int ithread = 0; ithread < SHARED_HEAP_THREAD_COUNT; ++ithread) {
+			arg[ithread].heap = heap;
+			arg[ithread].block = block[ipass][ithread];
+			arg[ithread].free_block = ipass ? block[0][(ithread + 1) % SHARED_HEAP_THREAD_COUNT] : 0;
+			arg[ithread].index = ithread;
+			targ[ithread].fn = shared_heap_thread;
+			targ[ithread].arg = &arg[ithread];
+			thread[ithread] = thread_run(&targ[ithread]);
+		}
+		int failed = 0;
+		for (unsigned int ithread = 0; ithread < SHARED_HEAP_THREAD_COUNT; ++ithread)
+			failed |= (thread_join(thread[ithread]) != 0);
+		if (failed)
+			return test_fail("Shared heap allocation failed");
+		for (unsigned int ithread = 0; ithread < SHARED_HEAP_THREAD_COUNT; ++ithread) {
+			for (size_t iblock = 0; iblock < SHARED_HEAP_BLOCK_COUNT; ++iblock) {
+				const unsigned char* data = block[ipass][ithread][iblock];
+				for (size_t ibyte = 0; ibyte < 16; ++ibyte) {
+					if (data[ibyte] != (unsigned char)(ithread + 1))
+						return test_fail("Data corrupted in shared heap allocation");
+				}
+			}
+		}
+	}
+
+	// The current thread gets its own heap for the shared heap as well
+	void* local = rpmalloc_heap_alloc(heap, 500);
+	if (rpmalloc_get_heap_for_ptr(local) != heap)
+		return test_fail("Shared heap block not owned by shared heap");
+	rpmalloc_heap_free(heap, block[1][0][0]);
+
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+
+#if !ENABLE_PER_CPU_HEAPS
+	// Releasing a shared heap set as the current heap of a thread keeps the heap of that thread in use. With per
+	// CPU heaps the current heap of the thread is not used by the public interface
+	targ[0].fn = shared_heap_current_thread;
+	targ[0].arg = 0;
+	if (thread_join(thread_run(&targ[0])))
+		return test_fail("Shared heap set as current heap not kept by the thread when released");
+#endif
+
+	rpmalloc_finalize();
+
+	printf("Shared heap tests passed\n");
+#endif
+	return 0;
+}
+
+static int
+test_large_pages(void) {
+	int ret = 0;
+
+	rpmalloc_config_t config = {0};
+	config.page_size = 16 * 1024 * 1024;
+
+	rpmalloc_initialize_config(0, &config);
+
+	ret = test_thread_implementation();
+
+	rpmalloc_finalize();
+
+	if (ret == 0)
+		printf("Large page config test passed\n");
+
+	return ret;
+}
+
+static int
+test_named_pages(void) {
+	rpmalloc_config_t config = {0};
+	char page_name[64] = {0};
 	snprintf(page_name, sizeof(page_name), "rpmalloc ::%s::", __func__);
 	config.page_name = page_name;
 	//config.unmap_on_finalize = 1;
@@ -1170,6 +3151,78 @@ test_named_pages(void) {
 	return 0;
 }
 
+typedef struct pool_thread_arg_t {
+	void* block[64];
+	size_t block_count;
+	size_t block_size;
+	int keep_blocks;
+} pool_thread_arg_t;
+
+static void
+pool_donor_thread(void* argp) {
+	pool_thread_arg_t* arg = argp;
+	rpmalloc_thread_initialize();
+	for (size_t iblock = 0; iblock < arg->block_count; ++iblock)
+		arg->block[iblock] = rpmalloc(arg->block_size);
+	for (size_t iblock = 0; !arg->keep_blocks && (iblock < arg->block_count); ++iblock)
+		rpfree(arg->block[iblock]);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+test_page_pool(void) {
+	// Must run before other tests, the main thread heap should have no free medium pages of its own
+	rpmalloc_initialize(0);
+
+	pool_thread_arg_t arg;
+	arg.block_count = 64;
+	arg.block_size = 200 * 1024;
+	arg.keep_blocks = 0;
+
+	thread_arg targ;
+	targ.fn = pool_donor_thread;
+	targ.arg = &arg;
+	thread_join(thread_run(&targ));
+
+	// Free pages of the exited thread should be reused before any new memory is mapped
+	const uintptr_t page_mask = ~(uintptr_t)(4 * 1024 * 1024 - 1);
+	void* block = rpmalloc(arg.block_size);
+	int found = 0;
+	for (size_t iblock = 0; iblock < arg.block_count; ++iblock) {
+		if (((uintptr_t)arg.block[iblock] & page_mask) == ((uintptr_t)block & page_mask))
+			found = 1;
+	}
+	rpfree(block);
+
+	rpmalloc_finalize();
+
+	if (!found)
+		return test_fail("Free page of released heap was not reused");
+
+	// Pages of the exited thread emptied by frees from another thread should also be reused
+	rpmalloc_initialize(0);
+	arg.keep_blocks = 1;
+	thread_join(thread_run(&targ));
+	for (size_t iblock = 0; iblock < arg.block_count; ++iblock)
+		rpfree(arg.block[iblock]);
+	block = rpmalloc(arg.block_size);
+	found = 0;
+	for (size_t iblock = 0; iblock < arg.block_count; ++iblock) {
+		if (((uintptr_t)arg.block[iblock] & page_mask) == ((uintptr_t)block & page_mask))
+			found = 1;
+	}
+	rpfree(block);
+
+	rpmalloc_finalize();
+
+	if (!found)
+		return test_fail("Page of released heap emptied by another thread was not reused");
+
+	printf("Page pool test passed\n");
+	return 0;
+}
+
 extern int
 test_malloc(int print_log);
 
@@ -1179,19 +3232,70 @@ test_free(int print_log);
 extern int
 test_malloc_thread(void);
 
+extern int
+test_cxx_allocator(void);
+
 int
 test_run(int argc, char** argv) {
 	(void)sizeof(argc);
 	(void)sizeof(argv);
 	test_initialize();
+	if (test_page_pool())
+		return -1;
 	if (test_alloc())
 		return -1;
 	if (test_realloc())
 		return -1;
 	if (test_superalign())
 		return -1;
+	if (test_aligned_class())
+		return -1;
 	if (test_crossthread())
 		return -1;
+	if (test_thread_collect())
+		return -1;
+	if (test_commit())
+		return -1;
+	if (test_statistics())
+		return -1;
+	if (test_huge_cache())
+		return -1;
+	if (test_huge_realloc())
+		return -1;
+	if (test_numa())
+		return -1;
+	if (test_reserve())
+		return -1;
+	if (test_prewarm())
+		return -1;
+	if (test_purge())
+		return -1;
+	if (test_soft_limit())
+		return -1;
+	if (test_size_class())
+		return -1;
+	if (test_zero())
+		return -1;
+	if (test_thp())
+		return -1;
+	if (test_sampling())
+		return -1;
+	if (test_batch())
+		return -1;
+	if (test_free_sized())
+		return -1;
+	if (test_inline())
+		return -1;
+	if (test_free_bitmap())
+		return -1;
+	if (test_walk())
+		return -1;
+	if (test_trace())
+		return -1;
+#ifndef _WIN32
+	if (test_fork())
+		return -1;
+#endif
 	if (test_threaded())
 		return -1;
 	if (test_malloc(1))
@@ -1200,12 +3304,18 @@ test_run(int argc, char** argv) {
 		return -1;
 	if (test_malloc_thread())
 		return -1;
+	if (test_cxx_allocator())
+		return -1;
 	if (test_threadspam())
 		return -1;
 	if (test_large_pages())
 		return -1;
 	if (test_first_class_heaps())
 		return -1;
+	if (test_heap_reset())
+		return -1;
+	if (test_shared_heap())
+		return -1;
 	if (test_named_pages())
 		return -1;
 	printf("All tests passed\n");
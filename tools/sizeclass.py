@@ -0,0 +1,157 @@
+#!/usr/bin/env python
+
+"""Size class table generator for rpmalloc
+
+Reads a histogram of allocation sizes and proposes a size class table for the
+size_class_table field in rpmalloc_config_t, minimizing the bytes wasted by
+rounding allocations up to the block size of the size class.
+
+The histogram is read from a file (or stdin) with one "<size> <count>" pair per
+line, for example recorded by the application or exported from the size_use
+statistics of rpmalloc_thread_statistics as the block size and allocation count
+of each size class. Lines starting with # are ignored.
+"""
+
+import argparse
+import sys
+
+GRANULARITY = 16
+TINY_LIMIT = 1024
+
+# Page types with the largest block size and the maximum number of size classes
+PAGE_TYPES = [
+  ('small', 4 * 1024, 8),
+  ('medium', 256 * 1024, 24),
+  ('large', 8 * 1024 * 1024, 20)
+]
+
+def default_table():
+  """Block sizes of the default size classes above the tiny size classes"""
+  table = []
+  for idx in range(sum(count for _, _, count in PAGE_TYPES)):
+    table += [((5 + (idx & 3)) << ((idx >> 2) + 4)) * GRANULARITY]
+  return table
+
+def round_size(size):
+  return (size + GRANULARITY - 1) // GRANULARITY * GRANULARITY
+
+def read_histogram(lines):
+  histogram = {}
+  for line in lines:
+    line = line.strip()
+    if not line or line.startswith('#'):
+      continue
+    fields = line.split()
+    size = int(fields[0])
+    count = int(fields[1]) if len(fields) > 1 else 1
+    if size > TINY_LIMIT and size <= PAGE_TYPES[-1][1]:
+      histogram[size] = histogram.get(size, 0) + count
+  return histogram
+
+def waste(histogram, table):
+  """Total number of bytes wasted by the given table for the sizes in the histogram"""
+  total = 0
+  for size, count in histogram.items():
+    block_size = next(block for block in table if block >= size)
+    total += (block_size - size) * count
+  return total
+
+def optimize_page_type(samples, limit, class_count):
+  """Select at most class_count block sizes among the sample sizes, always including the limit, minimizing
+  the sum of weight * (block size - size) with dynamic programming over the sorted candidate block sizes"""
+  sizes = sorted(samples.keys())
+  weight = [samples[size] for size in sizes]
+  candidates = sorted(set(round_size(size) for size in sizes) | set([limit]))
+  # Prefix sums of weight and weight * size over samples up to each candidate
+  prefix_weight = [0.0]
+  prefix_bytes = [0.0]
+  isample = 0
+  for candidate in candidates:
+    sum_weight = prefix_weight[-1]
+    sum_bytes = prefix_bytes[-1]
+    while isample < len(sizes) and sizes[isample] <= candidate:
+      sum_weight += weight[isample]
+      sum_bytes += weight[isample] * sizes[isample]
+      isample += 1
+    prefix_weight += [sum_weight]
+    prefix_bytes += [sum_bytes]
+
+  def cost(first, last):
+    # Cost of a size class of the last candidate block size covering samples above the first candidate
+    sum_weight = prefix_weight[last + 1] - prefix_weight[first + 1]
+    sum_bytes = prefix_bytes[last + 1] - prefix_bytes[first + 1]
+    return sum_weight * candidates[last] - sum_bytes
+
+  count = len(candidates)
+  infinity = float('inf')
+  best = [[infinity] * count for _ in range(class_count + 1)]
+  choice = [[-1] * count for _ in range(class_count + 1)]
+  for last in range(count):
+    best[1][last] = cost(-1, last)
+  for classes in range(2, class_count + 1):
+    for last in range(count):
+      for first in range(last):
+        value = best[classes - 1][first] + cost(first, last)
+        if value < best[classes][last]:
+          best[classes][last] = value
+          choice[classes][last] = first
+  classes = min(range(1, class_count + 1), key = lambda classes: best[classes][count - 1])
+  table = []
+  last = count - 1
+  while last >= 0 and classes > 0:
+    table = [candidates[last]] + table
+    last = choice[classes][last]
+    classes -= 1
+  return table
+
+def propose_table(histogram, prior):
+  """Propose a table for the histogram. The default block sizes are added as samples with a weight of the
+  given fraction of the total count, to keep reasonable size classes for sizes not in the histogram"""
+  total_count = sum(histogram.values())
+  defaults = default_table()
+  prior_weight = max(total_count * prior / len(defaults), 1e-9)
+  table = []
+  lower = TINY_LIMIT
+  for _, limit, class_count in PAGE_TYPES:
+    samples = {}
+    for size, count in histogram.items():
+      if size > lower and size <= limit:
+        samples[size] = samples.get(size, 0) + count
+    for size in defaults:
+      if size > lower and size <= limit:
+        samples[size] = samples.get(size, 0) + prior_weight
+    table += optimize_page_type(samples, limit, class_count)
+    lower = limit
+  return table
+
+def main():
+  parser = argparse.ArgumentParser(description = 'rpmalloc size class table generator')
+  parser.add_argument('histogram', nargs = '?', help = 'Histogram file with "<size> <count>" lines, default stdin')
+  parser.add_argument('--prior', type = float, default = 0.01,
+                      help = 'Weight of the default size classes as a fraction of the total count (default 0.01)')
+  parser.add_argument('--name', default = 'size_class_table', help = 'Name of the generated table variable')
+  options = parser.parse_args()
+
+  if options.histogram:
+    with open(options.histogram) as histogram_file:
+      histogram = read_histogram(histogram_file)
+  else:
+    histogram = read_histogram(sys.stdin)
+  if not histogram:
+    sys.stderr.write('No allocation sizes above ' + str(TINY_LIMIT) + ' bytes in histogram\n')
+    return 1
+
+  table = propose_table(histogram, options.prior)
+  default_waste = waste(histogram, default_table())
+  table_waste = waste(histogram, table)
+
+  print('// Generated by tools/sizeclass.py from ' + str(sum(histogram.values())) + ' allocations')
+  print('// Wasted bytes: ' + str(table_waste) + ' (default size classes: ' + str(default_waste) + ')')
+  print('static const unsigned int ' + options.name + '[] = {')
+  for index in range(0, len(table), 8):
+    print('    ' + ', '.join(str(size) for size in table[index:index + 8]) + ',')
+  print('};')
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())